@@ -0,0 +1,126 @@
+/**
+ * Per-file cost of Media type detection for files without a known extension.
+ *
+ * Compares the previous behavior (load the embedded database for every file),
+ * a persistent libmagic handle, and the signature sniffer in front of the handle.
+ * Also checks that the sniffer agrees with libmagic.
+ *
+ *   python3 scripts/magic_static.py > src/magic_generated.c
+ *   gcc -O2 -I. -Isrc -Ithird-party/libscan -Ithird-party/libscan/libscan -I<vcpkg include dir> \
+ *       scripts/magic_bench.c -o magic_bench -lmagic
+ *   find /some/dir -type f | head -n 2000 | xargs ./magic_bench
+ */
+#include "src/parsing/magic_util.c"
+#include "libscan/magic_sniff/magic_sniff.c"
+
+#include <stdarg.h>
+#include <time.h>
+
+#define MAGIC_BUF_SIZE (4096 * 6)
+
+void sist_logf(const char *filepath, int level, char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    if (level == LOG_SIST_FATAL) {
+        exit(-1);
+    }
+}
+
+static char *magic_buffer_reload(void *buffer, size_t buffer_size) {
+    magic_t magic = magic_open(MAGIC_MIME_TYPE);
+
+    const char *magic_buffers[1] = {magic_database_buffer,};
+    size_t sizes[1] = {sizeof(magic_database_buffer),};
+    magic_load_buffers(magic, (void **) &magic_buffers, sizes, 1);
+
+    const char *magic_mime_str = magic_buffer(magic, buffer, buffer_size);
+    char *return_value = magic_mime_str != NULL ? strdup(magic_mime_str) : NULL;
+
+    magic_close(magic);
+    return return_value;
+}
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1000000 + (double) ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv) {
+    int file_count = 0;
+    char **buffers = malloc(sizeof(char *) * argc);
+    size_t *sizes = malloc(sizeof(size_t) * argc);
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            continue;
+        }
+        buffers[file_count] = malloc(MAGIC_BUF_SIZE);
+        sizes[file_count] = fread(buffers[file_count], 1, MAGIC_BUF_SIZE, file);
+        fclose(file);
+        file_count += 1;
+    }
+
+    if (file_count == 0) {
+        fprintf(stderr, "usage: %s FILE...\n", argv[0]);
+        return 1;
+    }
+
+    // Before: the database is loaded for every file. Slow enough to only time a sample
+    int reload_count = MIN(file_count, 200);
+    double start = now_us();
+    for (int i = 0; i < reload_count; i++) {
+        free(magic_buffer_reload(buffers[i], sizes[i]));
+    }
+    double reload_time = (now_us() - start) / reload_count;
+
+    start = now_us();
+    magic_init();
+    double init_time = now_us() - start;
+
+    start = now_us();
+    for (int i = 0; i < file_count; i++) {
+        free(magic_buffer_embedded(buffers[i], sizes[i]));
+    }
+    double handle_time = (now_us() - start) / file_count;
+
+    int sniffed_count = 0;
+    start = now_us();
+    for (int i = 0; i < file_count; i++) {
+        if (magic_sniff(buffers[i], sizes[i]) != NULL) {
+            sniffed_count += 1;
+        } else {
+            free(magic_buffer_embedded(buffers[i], sizes[i]));
+        }
+    }
+    double sniff_time = (now_us() - start) / file_count;
+
+    int mismatch_count = 0;
+    for (int i = 0; i < file_count; i++) {
+        const char *sniffed = magic_sniff(buffers[i], sizes[i]);
+        if (sniffed == NULL) {
+            continue;
+        }
+        char *expected = magic_buffer_embedded(buffers[i], sizes[i]);
+        if (expected == NULL || strcmp(sniffed, expected) != 0) {
+            fprintf(stderr, "Mismatch: sniffer=%s libmagic=%s\n", sniffed, expected);
+            mismatch_count += 1;
+        }
+        free(expected);
+    }
+
+    magic_cleanup();
+
+    printf("files:                   %d\n", file_count);
+    printf("reload per file:         %10.1f us/file\n", reload_time);
+    printf("handle init (once):      %10.1f us\n", init_time);
+    printf("persistent handle:       %10.1f us/file\n", handle_time);
+    printf("sniffer + handle:        %10.1f us/file (%d/%d sniffed)\n", sniff_time, sniffed_count, file_count);
+    printf("sniffer mismatches:      %d\n", mismatch_count);
+
+    return mismatch_count != 0;
+}
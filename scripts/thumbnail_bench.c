@@ -0,0 +1,140 @@
+/**
+ * Thumbnails per second for each image format (file extension), with images decoded
+ * at full resolution and with the reduced-size decode (JPEG DCT scaling, EXIF thumbnails).
+ *
+ *   cmake --build <build dir> --target scan
+ *   gcc -O2 -I. -Ithird-party/libscan -Ithird-party/libscan/libscan -I<vcpkg include dir> \
+ *       scripts/thumbnail_bench.c -o thumbnail_bench <build dir>/third-party/libscan/libscan.a \
+ *       -L<vcpkg lib dir> <libraries of the scan target>
+ *   find /some/dir -type f -iname "*.jpg" -o -iname "*.png" | head -n 500 | xargs ./thumbnail_bench
+ */
+#include "libscan/media/media.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define TN_SIZE 552
+#define TN_QSCALE 2
+#define MAX_FORMATS 32
+
+typedef struct {
+    char name[16];
+    int file_count;
+    int thumbnail_count[2];
+    double time_us[2];
+} format_stats_t;
+
+static void bench_logf(const char *filepath, int level, char *format, ...) {
+    // noop
+}
+
+static void bench_log(const char *filepath, int level, char *str) {
+    // noop
+}
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1000000 + (double) ts.tv_nsec / 1000;
+}
+
+static format_stats_t *get_format(format_stats_t *formats, int *format_count, const char *filepath) {
+    const char *ext = strrchr(filepath, '.');
+    char name[16] = "(none)";
+
+    if (ext != NULL && strchr(ext, '/') == NULL && strlen(ext + 1) < sizeof(name)) {
+        for (int i = 0; ext[i] != '\0'; i++) {
+            name[i] = (char) tolower(ext[i + 1]);
+        }
+    }
+
+    for (int i = 0; i < *format_count; i++) {
+        if (strcmp(formats[i].name, name) == 0) {
+            return &formats[i];
+        }
+    }
+    if (*format_count == MAX_FORMATS) {
+        return NULL;
+    }
+
+    format_stats_t *format = &formats[(*format_count)++];
+    memset(format, 0, sizeof(format_stats_t));
+    strcpy(format->name, name);
+    return format;
+}
+
+/**
+ * @return the number of thumbnails
+ */
+static int generate_thumbnails(scan_media_ctx_t *ctx, const char *filepath) {
+    document_t doc;
+    memset(&doc, 0, sizeof(doc));
+    strcpy(doc.filepath, filepath);
+
+    parse_media_filename(ctx, filepath, &doc);
+
+    meta_line_t *meta = doc.meta_head;
+    while (meta != NULL) {
+        meta_line_t *next = meta->next;
+        free(meta);
+        meta = next;
+    }
+    return doc.thumbnail_count;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s FILE...\n", argv[0]);
+        return 1;
+    }
+
+    init_media();
+
+    scan_media_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.log = bench_log;
+    ctx.logf = bench_logf;
+    ctx.tn_size = TN_SIZE;
+    ctx.tn_qscale = TN_QSCALE;
+    ctx.tn_count = 1;
+    ctx.max_media_buffer = (long) 2000 * 1024 * 1024;
+
+    format_stats_t formats[MAX_FORMATS];
+    int format_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        format_stats_t *format = get_format(formats, &format_count, argv[i]);
+        if (format == NULL) {
+            continue;
+        }
+        format->file_count += 1;
+
+        // Once to load the file in the page cache
+        ctx.full_image_decode = TRUE;
+        generate_thumbnails(&ctx, argv[i]);
+
+        for (int reduced = 0; reduced <= 1; reduced++) {
+            ctx.full_image_decode = !reduced;
+
+            double start = now_us();
+            format->thumbnail_count[reduced] += generate_thumbnails(&ctx, argv[i]);
+            format->time_us[reduced] += now_us() - start;
+        }
+    }
+
+    cleanup_media();
+
+    printf("%-10s %8s %16s %16s %8s\n", "format", "files", "full (tn/s)", "reduced (tn/s)", "speedup");
+    for (int i = 0; i < format_count; i++) {
+        format_stats_t *format = &formats[i];
+
+        double full_rate = format->thumbnail_count[0] / (format->time_us[0] / 1000000);
+        double reduced_rate = format->thumbnail_count[1] / (format->time_us[1] / 1000000);
+
+        printf("%-10s %8d %16.1f %16.1f %7.2fx\n", format->name, format->file_count,
+               full_rate, reduced_rate, format->time_us[0] / format->time_us[1]);
+    }
+
+    return 0;
+}
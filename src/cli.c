@@ -1,5 +1,8 @@
 #include "cli.h"
 #include "ctx.h"
+#include "src/index/index_stream.h"
+#include "src/io/inode_dedup.h"
+#include "src/parsing/checksum.h"
 #include <tesseract/capi.h>
 
 #define DEFAULT_OUTPUT "index.sist2"
@@ -13,6 +16,7 @@
 #define DEFAULT_ES_URL "http://localhost:9200"
 #define DEFAULT_ES_INDEX "sist2"
 #define DEFAULT_BATCH_SIZE 70
+#define DEFAULT_METRICS_INTERVAL 10
 #define DEFAULT_TAGLINE "Lightning-fast file system indexer and search tool"
 #define DEFAULT_LANG "en"
 
@@ -273,6 +277,107 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
         args->max_memory_buffer_mib = DEFAULT_MAX_MEM_BUFFER;
     }
 
+    if (args->mem_budget_mib == OPTION_VALUE_UNSPECIFIED) {
+        args->mem_budget_mib = 0;
+    } else if (args->mem_budget_mib < 0) {
+        fprintf(stderr, "Invalid value for --mem-budget argument: %d. Must be a positive number.\n",
+                args->mem_budget_mib);
+        return 1;
+    }
+
+    if (args->min_threads == OPTION_VALUE_UNSPECIFIED) {
+        args->min_threads = args->threads;
+    } else if (args->min_threads < 1 || args->min_threads > args->threads) {
+        fprintf(stderr, "Invalid value for --min-threads argument: %d. Must be within [1, %d].\n",
+                args->min_threads, args->threads);
+        return 1;
+    }
+
+    if (args->walk_threads == OPTION_VALUE_UNSPECIFIED) {
+        args->walk_threads = 1;
+    } else if (args->walk_threads < 1 || args->walk_threads > MAX_THREADS) {
+        fprintf(stderr, "Invalid value for --walk-threads argument: %d. Must be within [1, %d].\n",
+                args->walk_threads, MAX_THREADS);
+        return 1;
+    }
+
+    if (args->schedule == OPTION_VALUE_UNSPECIFIED || strcmp(args->schedule, "fifo") == 0) {
+        args->schedule_policy = SCHEDULE_FIFO;
+    } else if (strcmp(args->schedule, "largest") == 0) {
+        args->schedule_policy = SCHEDULE_LARGEST_FIRST;
+    } else if (strcmp(args->schedule, "mime-cost") == 0) {
+        args->schedule_policy = SCHEDULE_MIME_COST;
+    } else if (strcmp(args->schedule, "newest") == 0) {
+        args->schedule_policy = SCHEDULE_NEWEST_FIRST;
+    } else {
+        fprintf(stderr, "Schedule must be one of (fifo, largest, mime-cost, newest), got '%s'\n", args->schedule);
+        return 1;
+    }
+
+    if (args->inode_dedup == OPTION_VALUE_UNSPECIFIED || strcmp(args->inode_dedup, "off") == 0) {
+        args->inode_dedup_mode = INODE_DEDUP_OFF;
+    } else if (strcmp(args->inode_dedup, "link") == 0) {
+        args->inode_dedup_mode = INODE_DEDUP_LINK;
+    } else if (strcmp(args->inode_dedup, "copy") == 0) {
+        args->inode_dedup_mode = INODE_DEDUP_COPY;
+    } else {
+        fprintf(stderr, "Inode dedup mode must be one of (link, copy, off), got '%s'\n", args->inode_dedup);
+        return 1;
+    }
+
+    if (args->checksum_algorithm_name == OPTION_VALUE_UNSPECIFIED) {
+        args->checksum_algorithm = CHECKSUM_SHA1;
+    } else {
+        args->checksum_algorithm = checksum_get_algorithm(args->checksum_algorithm_name);
+        if (args->checksum_algorithm == -1) {
+            fprintf(stderr, "Checksum algorithm must be one of (sha1, xxh3, blake3) and be available in this build,"
+                            " got '%s'\n", args->checksum_algorithm_name);
+            return 1;
+        }
+    }
+
+    if (args->index_to == OPTION_VALUE_UNSPECIFIED) {
+        args->index_target = INDEX_TO_NONE;
+    } else if (strcmp(args->index_to, "es") == 0) {
+        args->index_target = INDEX_TO_ES;
+    } else if (strcmp(args->index_to, "sqlite") == 0) {
+        args->index_target = INDEX_TO_SQLITE;
+    } else {
+        fprintf(stderr, "Index target must be one of (es, sqlite), got '%s'\n", args->index_to);
+        return 1;
+    }
+
+    if (args->index_target == INDEX_TO_SQLITE && args->search_index_path == NULL) {
+        fprintf(stderr, "You must specify --search-index <PATH> to use --index-to sqlite\n");
+        return 1;
+    }
+
+    if (args->es_url == NULL) {
+        args->es_url = DEFAULT_ES_URL;
+    }
+
+    if (args->es_index == NULL) {
+        args->es_index = DEFAULT_ES_INDEX;
+    }
+
+    if (args->batch_size == 0) {
+        args->batch_size = DEFAULT_BATCH_SIZE;
+    }
+
+    if (args->ebook_split_pages < 0) {
+        fprintf(stderr, "Invalid value for --ebook-split-pages argument: %d. Must be a positive number.\n",
+                args->ebook_split_pages);
+        return 1;
+    }
+
+    if (args->metrics_interval == OPTION_VALUE_UNSPECIFIED) {
+        args->metrics_interval = DEFAULT_METRICS_INTERVAL;
+    } else if (args->metrics_interval < 0) {
+        fprintf(stderr, "Invalid value for --metrics-interval argument: %d. Must be a positive number.\n",
+                args->metrics_interval);
+        return 1;
+    }
+
     if (args->list_path != OPTION_VALUE_UNSPECIFIED) {
         if (strcmp(args->list_path, "-") == 0) {
             args->list_file = stdin;
@@ -299,14 +404,29 @@ int scan_args_validate(scan_args_t *args, int argc, const char **argv) {
     LOG_DEBUGF("cli.c", "arg path=%s", args->path);
     LOG_DEBUGF("cli.c", "arg archive=%s", args->archive);
     LOG_DEBUGF("cli.c", "arg archive_passphrase=%s", args->archive_passphrase);
+    LOG_DEBUGF("cli.c", "arg archive_fan_out=%d", args->archive_fan_out);
     LOG_DEBUGF("cli.c", "arg tesseract_lang=%s", args->tesseract_lang);
     LOG_DEBUGF("cli.c", "arg tesseract_path=%s", args->tesseract_path);
     LOG_DEBUGF("cli.c", "arg exclude=%s", args->exclude_regex);
     LOG_DEBUGF("cli.c", "arg fast=%d", args->fast);
     LOG_DEBUGF("cli.c", "arg fast_epub=%d", args->fast_epub);
+    LOG_DEBUGF("cli.c", "arg fast_thumbnails=%d", args->fast_thumbnails);
     LOG_DEBUGF("cli.c", "arg treemap_threshold=%f", args->treemap_threshold);
     LOG_DEBUGF("cli.c", "arg max_memory_buffer_mib=%d", args->max_memory_buffer_mib);
+    LOG_DEBUGF("cli.c", "arg mem_budget_mib=%d", args->mem_budget_mib);
     LOG_DEBUGF("cli.c", "arg list_path=%s", args->list_path);
+    LOG_DEBUGF("cli.c", "arg walk_threads=%d", args->walk_threads);
+    LOG_DEBUGF("cli.c", "arg min_threads=%d", args->min_threads);
+    LOG_DEBUGF("cli.c", "arg io_uring=%d", args->io_uring);
+    LOG_DEBUGF("cli.c", "arg inode_dedup=%s", args->inode_dedup);
+    LOG_DEBUGF("cli.c", "arg parse_cache=%d", args->parse_cache);
+    LOG_DEBUGF("cli.c", "arg checksum_algorithm=%s", args->checksum_algorithm_name);
+    LOG_DEBUGF("cli.c", "arg ebook_split_pages=%d", args->ebook_split_pages);
+    LOG_DEBUGF("cli.c", "arg schedule=%s", args->schedule);
+    LOG_DEBUGF("cli.c", "arg index_to=%s", args->index_to);
+    LOG_DEBUGF("cli.c", "arg metrics_path=%s", args->metrics_path);
+    LOG_DEBUGF("cli.c", "arg metrics_listen=%s", args->metrics_listen);
+    LOG_DEBUGF("cli.c", "arg metrics_interval=%d", args->metrics_interval);
 
     return 0;
 }
@@ -392,6 +512,14 @@ int index_args_validate(index_args_t *args, int argc, const char **argv) {
         args->batch_size = DEFAULT_BATCH_SIZE;
     }
 
+    if (args->metrics_interval == OPTION_VALUE_UNSPECIFIED) {
+        args->metrics_interval = DEFAULT_METRICS_INTERVAL;
+    } else if (args->metrics_interval < 0) {
+        fprintf(stderr, "Invalid value for --metrics-interval argument: %d. Must be a positive number.\n",
+                args->metrics_interval);
+        return 1;
+    }
+
     LOG_DEBUGF("cli.c", "arg es_url=%s", args->es_url);
     LOG_DEBUGF("cli.c", "arg es_index=%s", args->es_index);
     LOG_DEBUGF("cli.c", "arg es_insecure_ssl=%d", args->es_insecure_ssl);
@@ -414,6 +542,9 @@ int index_args_validate(index_args_t *args, int argc, const char **argv) {
     LOG_DEBUGF("cli.c", "arg es_settings=%s", args->es_settings);
     LOG_DEBUGF("cli.c", "arg batch_size=%d", args->batch_size);
     LOG_DEBUGF("cli.c", "arg force_reset=%d", args->force_reset);
+    LOG_DEBUGF("cli.c", "arg metrics_path=%s", args->metrics_path);
+    LOG_DEBUGF("cli.c", "arg metrics_listen=%s", args->metrics_listen);
+    LOG_DEBUGF("cli.c", "arg metrics_interval=%d", args->metrics_interval);
 
     return 0;
 }
@@ -23,6 +23,7 @@ typedef struct scan_args {
     char *archive;
     archive_mode_t archive_mode;
     char *archive_passphrase;
+    int archive_fan_out;
     char *tesseract_lang;
     const char *tesseract_path;
     int ocr_images;
@@ -32,13 +33,36 @@ typedef struct scan_args {
     const char* treemap_threshold_str;
     double treemap_threshold;
     int max_memory_buffer_mib;
+    int mem_budget_mib;
     int read_subtitles;
     /** Number of thumbnails to generate */
     int tn_count;
     int fast_epub;
+    int fast_thumbnails;
     int calculate_checksums;
+    char *checksum_algorithm_name;
+    int checksum_algorithm;
     char *list_path;
     FILE *list_file;
+    int walk_threads;
+    int min_threads;
+    int io_uring;
+    char *inode_dedup;
+    int inode_dedup_mode;
+    int parse_cache;
+    int ebook_split_pages;
+    char *schedule;
+    int schedule_policy;
+    char *index_to;
+    int index_target;
+    char *es_url;
+    char *es_index;
+    int es_insecure_ssl;
+    int batch_size;
+    char *search_index_path;
+    char *metrics_path;
+    char *metrics_listen;
+    int metrics_interval;
 } scan_args_t;
 
 scan_args_t *scan_args_create();
@@ -64,6 +88,9 @@ typedef struct index_args {
     int force_reset;
     int threads;
     int incremental;
+    char *metrics_path;
+    char *metrics_listen;
+    int metrics_interval;
 } index_args_t;
 
 typedef struct {
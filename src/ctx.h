@@ -26,14 +26,28 @@ typedef struct {
     struct index_t index;
 
     tpool_t *pool;
+    database_writer_t *index_writer;
 
     int threads;
     int depth;
     int calculate_checksums;
+    /** checksum_algorithm_t */
+    int checksum_algorithm;
 
     pcre *exclude;
     pcre_extra *exclude_extra;
     int fast;
+    /** Batch stat and read syscalls with io_uring when available */
+    int io_uring;
+    /** inode_dedup_mode_t, hard links and bind mounts are parsed once */
+    int inode_dedup;
+    /** Reuse the documents of files with the same content hash instead of parsing them */
+    int parse_cache;
+
+    /**
+     * Documents of the original index, NULL if this is not an incremental scan
+     */
+    incremental_map_t *incremental_map;
 
     scan_arc_ctx_t arc_ctx;
     scan_comic_ctx_t comic_ctx;
@@ -97,8 +111,6 @@ typedef struct {
 
 typedef struct {
     int thread_id;
-    database_t *ipc_db;
-    database_t *index_db;
 } ProcData_t;
 
 extern ScanCtx_t ScanCtx;
@@ -100,23 +100,20 @@ void random_func(sqlite3_context *ctx, int argc, UNUSED(sqlite3_value **argv)) {
 }
 
 
-void save_current_job_info(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
-#ifdef SIST_DEBUG
-    if (argc != 1 || sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
-        sqlite3_result_error(ctx, "Invalid parameters", -1);
-    }
-#endif
-
-    database_ipc_ctx_t *ipc_ctx = sqlite3_user_data(ctx);
-
-    const char *current_job = (const char *) sqlite3_value_text(argv[0]);
-
-    char buf[PATH_MAX];
-    strcpy(buf, current_job);
-
-    strcpy(ipc_ctx->current_job[ProcData.thread_id], current_job);
+/**
+ * Readers and the scan writer don't block each other in WAL mode. The mode is
+ * persistent, this converts databases that were created with a rollback journal.
+ */
+static void database_enable_wal(database_t *db) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, "PRAGMA journal_mode = WAL;", -1, &stmt, NULL));
 
-    sqlite3_result_text(ctx, "ok", -1, SQLITE_STATIC);
+    int ret = sqlite3_step(stmt);
+    if (ret != SQLITE_ROW || strcmp((const char *) sqlite3_column_text(stmt, 0), "wal") != 0) {
+        // Another process holds a lock, we'll try again on the next open
+        LOG_WARNINGF("database.c", "Could not enable WAL mode for %s (%s)", db->filename, sqlite3_errmsg(db->db));
+    }
+    sqlite3_finalize(stmt);
 }
 
 void database_initialize(database_t *db) {
@@ -125,20 +122,27 @@ void database_initialize(database_t *db) {
     LOG_DEBUGF("database.c", "Initializing database %s", db->filename);
     if (db->type == INDEX_DATABASE) {
         CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IndexDatabaseSchema, NULL, NULL, NULL));
-    } else if (db->type == IPC_CONSUMER_DATABASE || db->type == IPC_PRODUCER_DATABASE) {
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, IpcDatabaseSchema, NULL, NULL, NULL));
     } else if (db->type == FTS_DATABASE) {
         CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, FtsDatabaseSchema, NULL, NULL, NULL));
     }
 
+    database_enable_wal(db);
+
     sqlite3_close(db->db);
 }
 
-void database_open(database_t *db) {
+static void database_open_connection(database_t *db, int reader) {
     LOG_DEBUGF("database.c", "Opening database %s (%d)", db->filename, db->type);
 
     CRASH_IF_NOT_SQLITE_OK(sqlite3_open(db->filename, &db->db));
-    sqlite3_busy_timeout(db->db, 1000);
+
+    if (reader) {
+        sqlite3_busy_timeout(db->db, DATABASE_READER_BUSY_TIMEOUT);
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "PRAGMA mmap_size = " DATABASE_READER_MMAP_SIZE ";", NULL, NULL, NULL));
+    } else {
+        sqlite3_busy_timeout(db->db, 1000);
+        database_enable_wal(db);
+    }
 
     // TODO: Optional argument?
 //    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "PRAGMA cache_size = -200000;", NULL, NULL, NULL));
@@ -156,10 +160,33 @@ void database_open(database_t *db) {
 
     if (db->type == INDEX_DATABASE) {
         // Prepare statements;
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+        if (!reader) {
+            // Indexes created by older versions don't have these tables
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+                    db->db,
+                    "CREATE TABLE IF NOT EXISTS duplicate ("
+                    "   id INTEGER PRIMARY KEY REFERENCES document(id),"
+                    "   original INTEGER NOT NULL REFERENCES document(id)"
+                    ");"
+                    "CREATE TABLE IF NOT EXISTS parse_cache ("
+                    "   id INTEGER PRIMARY KEY REFERENCES document(id),"
+                    "   hash TEXT NOT NULL"
+                    ");"
+                    "CREATE INDEX IF NOT EXISTS parse_cache_hash_idx ON parse_cache(hash);",
+                    NULL, NULL, NULL));
+        }
+
+        // The thumbnails of a linked duplicate are the ones of its original
+        if (sqlite3_prepare_v2(
                 db->db,
-                "SELECT data FROM thumbnail WHERE id=? AND num=? LIMIT 1;", -1,
-                &db->select_thumbnail_stmt, NULL));
+                "SELECT data FROM thumbnail WHERE id=coalesce((SELECT original FROM duplicate WHERE id=?1), ?1)"
+                " AND num=?2 LIMIT 1;", -1,
+                &db->select_thumbnail_stmt, NULL) != SQLITE_OK) {
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "SELECT data FROM thumbnail WHERE id=? AND num=? LIMIT 1;", -1,
+                    &db->select_thumbnail_stmt, NULL));
+        }
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
                 db->db,
                 "UPDATE marked SET marked=1 WHERE id=(SELECT ROWID FROM document WHERE path=?) AND mtime=? RETURNING id",
@@ -179,6 +206,74 @@ void database_open(database_t *db) {
                 -1,
                 &db->write_thumbnail_stmt, NULL));
 
+        if (!reader) {
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "SELECT coalesce((SELECT original FROM duplicate WHERE id=document.id), id) FROM document"
+                    " WHERE path=? AND json_data IS NOT NULL;",
+                    -1,
+                    &db->find_original_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "SELECT 1 FROM document WHERE path >= ?1 || '#/' AND path < ?1 || '#0' LIMIT 1;",
+                    -1,
+                    &db->find_archive_entry_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "INSERT INTO document (path, parent, mime, mtime, size, thumbnail_count, json_data, version) "
+                    "SELECT ?, NULL, mime, ?, size, thumbnail_count, json_patch(json_data, ?),"
+                    " (SELECT max(id) FROM version) FROM document WHERE id=? "
+                    "ON CONFLICT (path) DO UPDATE SET mime=excluded.mime, mtime=excluded.mtime, size=excluded.size,"
+                    " thumbnail_count=excluded.thumbnail_count, json_data=excluded.json_data "
+                    "RETURNING id;",
+                    -1,
+                    &db->write_duplicate_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "INSERT INTO duplicate (id, original) VALUES (?,?) ON CONFLICT DO UPDATE SET original=excluded.original;",
+                    -1,
+                    &db->link_duplicate_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "DELETE FROM duplicate WHERE id=?;",
+                    -1,
+                    &db->unlink_duplicate_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "INSERT INTO thumbnail (id, num, data) SELECT ?, num, data FROM thumbnail WHERE id=? "
+                    "ON CONFLICT DO UPDATE SET data=excluded.data;",
+                    -1,
+                    &db->copy_thumbnails_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "DELETE FROM thumbnail WHERE id=?;",
+                    -1,
+                    &db->delete_thumbnails_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "UPDATE marked SET marked=1 WHERE id=?;",
+                    -1,
+                    &db->mark_duplicate_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "SELECT coalesce((SELECT original FROM duplicate WHERE id=c.id), c.id) FROM parse_cache c"
+                    " INNER JOIN document doc ON doc.id = c.id"
+                    " WHERE c.hash=? AND doc.json_data IS NOT NULL LIMIT 1;",
+                    -1,
+                    &db->find_parse_cache_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "INSERT INTO parse_cache (id, hash) SELECT id, ? FROM document WHERE path=? "
+                    "ON CONFLICT DO UPDATE SET hash=excluded.hash;",
+                    -1,
+                    &db->write_parse_cache_stmt, NULL));
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+                    db->db,
+                    "DELETE FROM parse_cache WHERE id=?;",
+                    -1,
+                    &db->delete_parse_cache_stmt, NULL));
+        }
+
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
                 db->db, "SELECT json_set(json_data, "
                         "'$._id', CAST (doc.id AS TEXT),"
@@ -224,46 +319,6 @@ void database_open(database_t *db) {
                 NULL,
                 NULL
         );
-    } else if (db->type == IPC_CONSUMER_DATABASE) {
-
-        sqlite3_create_function(
-                db->db,
-                "save_current_job_info",
-                1,
-                SQLITE_UTF8,
-                db->ipc_ctx,
-                save_current_job_info,
-                NULL,
-                NULL
-        );
-
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                db->db,
-                "DELETE FROM parse_job WHERE id = (SELECT MIN(id) FROM parse_job)"
-                " RETURNING filepath,mtime,st_size,save_current_job_info(filepath);",
-                -1, &db->pop_parse_job_stmt, NULL
-        ));
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                db->db,
-                "DELETE FROM index_job WHERE id = (SELECT MIN(id) FROM index_job)"
-                " RETURNING sid,type,line;",
-                -1, &db->pop_index_job_stmt, NULL
-        ));
-
-    } else if (db->type == IPC_PRODUCER_DATABASE) {
-        char sql[40];
-        int max_size_mb = 10; // TODO: read from args.
-
-        snprintf(sql, sizeof(sql), "PRAGMA max_page_count=%d", (max_size_mb * 1024 * 1024) / 4096);
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, sql, NULL, NULL, NULL));
-
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                db->db, "INSERT INTO parse_job (filepath,mtime,st_size) VALUES (?,?,?);", -1,
-                &db->insert_parse_job_stmt, NULL));
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
-                db->db, "INSERT INTO index_job (sid,type,line) VALUES (?,?,?);", -1,
-                &db->insert_index_job_stmt, NULL));
-
     } else if (db->type == FTS_DATABASE) {
 
         CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
@@ -372,6 +427,32 @@ void database_open(database_t *db) {
     }
 }
 
+void database_open(database_t *db) {
+    database_open_connection(db, FALSE);
+}
+
+void database_open_reader(database_t *db) {
+    database_open_connection(db, TRUE);
+}
+
+void database_checkpoint(database_t *db) {
+    int wal_frames;
+    int checkpointed_frames;
+
+    // TRUNCATE waits for the readers that are still on an older snapshot, give up after the busy timeout
+    int ret = sqlite3_wal_checkpoint_v2(db->db, NULL, SQLITE_CHECKPOINT_TRUNCATE, &wal_frames, &checkpointed_frames);
+    if (ret == SQLITE_BUSY) {
+        ret = sqlite3_wal_checkpoint_v2(db->db, NULL, SQLITE_CHECKPOINT_PASSIVE, &wal_frames, &checkpointed_frames);
+    }
+
+    if (ret != SQLITE_OK) {
+        LOG_WARNINGF("database.c", "Could not checkpoint %s: (%d) %s", db->filename, ret, sqlite3_errmsg(db->db));
+        return;
+    }
+
+    LOG_DEBUGF("database.c", "Checkpointed %s (%d/%d WAL frames)", db->filename, checkpointed_frames, wal_frames);
+}
+
 void database_close(database_t *db, int optimize) {
     LOG_DEBUGF("database.c", "Closing database %s (%p)", db->filename, db->db);
 
@@ -379,16 +460,13 @@ void database_close(database_t *db, int optimize) {
         LOG_DEBUG("database.c", "Optimizing database");
         CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "VACUUM;", NULL, NULL, NULL));
         CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "PRAGMA optimize;", NULL, NULL, NULL));
+        database_checkpoint(db);
     }
 
     if (db->db) {
         sqlite3_close(db->db);
     }
 
-    if (db->type == IPC_PRODUCER_DATABASE) {
-        remove(db->filename);
-    }
-
     free(db);
     db = NULL;
 }
@@ -509,39 +587,76 @@ int database_delete_list_iter(database_iterator_t *iter) {
     return 0;
 }
 
+#define DOCUMENT_JSON_QUERY(where) \
+    "WITH doc (id, j) AS (" \
+    "SELECT" \
+    " document.id," \
+    " json_set(document.json_data," \
+    "  '$._id', document.id," \
+    "  '$.index', (SELECT id FROM descriptor)," \
+    "  '$.size', document.size," \
+    "  '$.mtime', document.mtime," \
+    "  '$.mime', mim.name," \
+    "  '$.thumbnail', document.thumbnail_count," \
+    "  '$.tag', json_group_array(t.tag))" \
+    " FROM document" \
+    "  LEFT JOIN mime mim ON mim.id = document.mime" \
+    "  LEFT JOIN tag t ON t.id = document.id" \
+    where \
+    " GROUP BY document.id)" \
+    "SELECT CASE" \
+    " WHEN emb.embedding IS NULL THEN j" \
+    " ELSE json_set(j," \
+    "  '$.emb', json_group_object(m.path, json(emb_to_json(emb.embedding)))," \
+    "  '$.embedding', 1" \
+    "     ) END" \
+    " FROM doc" \
+    " LEFT JOIN embedding emb ON doc.id = emb.id" \
+    " LEFT JOIN model m ON emb.model_id = m.id" \
+    " GROUP BY doc.id"
+
 database_iterator_t *database_create_document_iterator(database_t *db) {
 
     sqlite3_stmt *stmt;
 
-    CRASH_IF_NOT_SQLITE_OK(
-            sqlite3_prepare_v2(
-                    db->db,
-                    "WITH doc (id, j) AS ("
-                    "SELECT"
-                    " document.id,"
-                    " json_set(document.json_data,"
-                    "  '$._id', document.id,"
-                    "  '$.index', (SELECT id FROM descriptor),"
-                    "  '$.size', document.size,"
-                    "  '$.mtime', document.mtime,"
-                    "  '$.mime', mim.name,"
-                    "  '$.thumbnail', document.thumbnail_count,"
-                    "  '$.tag', json_group_array(t.tag))"
-                    " FROM document"
-                    "  LEFT JOIN mime mim ON mim.id = document.mime"
-                    "  LEFT JOIN tag t ON t.id = document.id"
-                    " GROUP BY document.id)"
-                    "SELECT CASE"
-                    " WHEN emb.embedding IS NULL THEN j"
-                    " ELSE json_set(j,"
-                    "  '$.emb', json_group_object(m.path, json(emb_to_json(emb.embedding))),"
-                    "  '$.embedding', 1"
-                    "     ) END"
-                    " FROM doc"
-                    " LEFT JOIN embedding emb ON doc.id = emb.id"
-                    " LEFT JOIN model m ON emb.model_id = m.id"
-                    " GROUP BY doc.id",
-                    -1, &stmt, NULL));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, DOCUMENT_JSON_QUERY(""), -1, &stmt, NULL));
+
+    database_iterator_t *iter = malloc(sizeof(database_iterator_t));
+
+    iter->stmt = stmt;
+    iter->db = db;
+
+    return iter;
+}
+
+char *database_ids_to_json(const int *ids, int count) {
+    char *json = malloc(count * 12 + 3);
+    char *ptr = json;
+
+    *ptr++ = '[';
+    for (int i = 0; i < count; i++) {
+        ptr += sprintf(ptr, i == 0 ? "%d" : ",%d", ids[i]);
+    }
+    *ptr++ = ']';
+    *ptr = '\0';
+
+    return json;
+}
+
+database_iterator_t *database_create_document_iterator_for_ids(database_t *db, const int *doc_ids, int count) {
+
+    sqlite3_stmt *stmt;
+
+    // Archives are written a first time without json_data, before their children
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db,
+            DOCUMENT_JSON_QUERY(" WHERE document.id IN (SELECT value FROM json_each(?))"
+                                " AND document.json_data IS NOT NULL"),
+            -1, &stmt, NULL));
+
+    char *ids_json = database_ids_to_json(doc_ids, count);
+    sqlite3_bind_text(stmt, 1, ids_json, -1, SQLITE_TRANSIENT);
+    free(ids_json);
 
     database_iterator_t *iter = malloc(sizeof(database_iterator_t));
 
@@ -590,21 +705,156 @@ cJSON *database_document_iter(database_iterator_t *iter) {
     return NULL;
 }
 
-cJSON *database_incremental_scan_begin(database_t *db) {
+/**
+ * 64-bit FNV-1a, collisions are also checked against mtime before skipping a file
+ */
+static unsigned long incremental_path_hash(const char *path) {
+    unsigned long hash = 0xcbf29ce484222325UL;
+
+    for (const unsigned char *c = (const unsigned char *) path; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
+}
+
+static int incremental_map_entry_cmp(const void *a, const void *b) {
+    unsigned long hash_a = ((incremental_map_entry_t *) a)->path_hash;
+    unsigned long hash_b = ((incremental_map_entry_t *) b)->path_hash;
+
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+incremental_map_t *database_incremental_scan_begin(database_t *db) {
     LOG_DEBUG("database.c", "Preparing database for incremental scan");
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "DELETE FROM marked;", NULL, NULL, NULL));
     LOG_DEBUG("database.c", "Preparing database for incremental scan (create marked table)");
     CRASH_IF_NOT_SQLITE_OK(
             sqlite3_exec(db->db, "INSERT INTO marked SELECT id, 0, mtime FROM document;", NULL, NULL, NULL));
+
+    incremental_map_t *map = malloc(sizeof(incremental_map_t));
+    map->count = 0;
+
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, "SELECT count(*) FROM document", -1, &stmt, NULL));
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    int capacity = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    map->entries = malloc(sizeof(incremental_map_entry_t) * MAX(capacity, 1));
+    map->marked = calloc(MAX(capacity, 1), sizeof(char));
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, "SELECT id, path, mtime FROM document", -1, &stmt, NULL));
+
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW && map->count < capacity) {
+        incremental_map_entry_t *entry = &map->entries[map->count++];
+        entry->id = sqlite3_column_int(stmt, 0);
+        entry->path_hash = incremental_path_hash((const char *) sqlite3_column_text(stmt, 1));
+        entry->mtime = sqlite3_column_int(stmt, 2);
+    }
+    CRASH_IF_STMT_FAIL(ret);
+    sqlite3_finalize(stmt);
+
+    qsort(map->entries, map->count, sizeof(incremental_map_entry_t), incremental_map_entry_cmp);
+
+    LOG_DEBUGF("database.c", "Loaded %d documents for incremental scan (%zu KiB)", map->count,
+               (sizeof(incremental_map_entry_t) + 1) * map->count / 1024);
+
+    return map;
+}
+
+int incremental_map_mark(incremental_map_t *map, const char *path, int mtime) {
+    incremental_map_entry_t key = {.path_hash = incremental_path_hash(path)};
+
+    incremental_map_entry_t *entry = bsearch(&key, map->entries, map->count,
+                                             sizeof(incremental_map_entry_t), incremental_map_entry_cmp);
+    if (entry == NULL) {
+        return FALSE;
+    }
+
+    // bsearch() can land anywhere in a run of colliding hashes
+    while (entry > map->entries && (entry - 1)->path_hash == key.path_hash) {
+        entry -= 1;
+    }
+
+    for (; entry < map->entries + map->count && entry->path_hash == key.path_hash; entry++) {
+        if (entry->mtime == mtime) {
+            // Can be called from several walker threads, but never twice for the same file
+            map->marked[entry - map->entries] = TRUE;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
 }
 
-cJSON *database_incremental_scan_end(database_t *db) {
+/**
+ * Write the marks of the documents that were skipped by the walker in a single transaction
+ */
+static void database_apply_incremental_marks(database_t *db, incremental_map_t *map) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, "UPDATE marked SET marked=1 WHERE id=?", -1, &stmt, NULL));
+
+    int marked_count = 0;
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "BEGIN", NULL, NULL, NULL));
+    for (int i = 0; i < map->count; i++) {
+        if (!map->marked[i]) {
+            continue;
+        }
+        marked_count += 1;
+
+        sqlite3_bind_int(stmt, 1, map->entries[i].id);
+        CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(stmt));
+    }
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "COMMIT", NULL, NULL, NULL));
+
+    sqlite3_finalize(stmt);
+
+    LOG_INFOF("database.c", "Skipped %d unchanged documents", marked_count);
+}
+
+void database_incremental_scan_end(database_t *db, incremental_map_t *map) {
+    if (map != NULL) {
+        database_apply_incremental_marks(db, map);
+
+        free(map->entries);
+        free(map->marked);
+        free(map);
+    }
+
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
             "DELETE FROM delete_list WHERE id IN (SELECT id FROM marked WHERE marked = 1);",
             NULL, NULL, NULL
     ));
 
+    // Linked duplicates of a deleted document keep its thumbnails
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "INSERT INTO thumbnail (id, num, data) "
+            "SELECT d.id, t.num, t.data FROM duplicate d"
+            " INNER JOIN marked m ON m.id = d.original"
+            " INNER JOIN thumbnail t ON t.id = d.original"
+            " WHERE m.marked=0 ON CONFLICT DO NOTHING;",
+            NULL, NULL, NULL
+    ));
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "DELETE FROM duplicate WHERE id IN (SELECT id FROM marked WHERE marked=0)"
+            " OR original IN (SELECT id FROM marked WHERE marked=0);",
+            NULL, NULL, NULL
+    ));
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "DELETE FROM parse_cache WHERE id IN (SELECT id FROM marked WHERE marked=0);",
+            NULL, NULL, NULL
+    ));
+
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
             "DELETE FROM thumbnail WHERE EXISTS ("
@@ -637,25 +887,27 @@ int database_mark_document(database_t *db, const char *path, int mtime) {
     sqlite3_bind_text(db->mark_document_stmt, 1, path, -1, SQLITE_STATIC);
     sqlite3_bind_int(db->mark_document_stmt, 2, mtime);
 
-    pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
     int ret = sqlite3_step(db->mark_document_stmt);
 
     if (ret == SQLITE_ROW) {
         CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->mark_document_stmt));
-        pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
         return TRUE;
     }
 
     if (ret == SQLITE_DONE) {
         CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->mark_document_stmt));
-        pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
         return FALSE;
     }
-    pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
 
     CRASH_IF_STMT_FAIL(ret);
 }
 
+static void database_delete_parse_cache(database_t *db, int doc_id) {
+    sqlite3_bind_int(db->delete_parse_cache_stmt, 1, doc_id);
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->delete_parse_cache_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->delete_parse_cache_stmt));
+}
+
 int database_write_document(database_t *db, document_t *doc, const char *json_data) {
 
     const char *rel_path = doc->filepath + ScanCtx.index.desc.root_len;
@@ -676,170 +928,137 @@ int database_write_document(database_t *db, document_t *doc, const char *json_da
         sqlite3_bind_null(db->write_document_stmt, 7);
     }
 
-    pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
     CRASH_IF_STMT_FAIL(sqlite3_step(db->write_document_stmt));
     int id = sqlite3_column_int(db->write_document_stmt, 0);
     CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_document_stmt));
-    pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
 
-    return id;
-}
+    // The path was a linked duplicate in a previous scan, it has its own thumbnails now
+    sqlite3_bind_int(db->unlink_duplicate_stmt, 1, id);
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->unlink_duplicate_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->unlink_duplicate_stmt));
 
+    // The content of the file changed, its hash is written again after this if the cache is enabled
+    database_delete_parse_cache(db, id);
 
-void database_write_thumbnail(database_t *db, int doc_id, int num, void *data, size_t data_size) {
-    sqlite3_bind_int(db->write_thumbnail_stmt, 1, doc_id);
-    sqlite3_bind_int(db->write_thumbnail_stmt, 2, num);
-    sqlite3_bind_blob(db->write_thumbnail_stmt, 3, data, (int) data_size, SQLITE_STATIC);
-
-    pthread_mutex_lock(&db->ipc_ctx->index_db_mutex);
-    CRASH_IF_STMT_FAIL(sqlite3_step(db->write_thumbnail_stmt));
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_thumbnail_stmt));
-    pthread_mutex_unlock(&db->ipc_ctx->index_db_mutex);
+    return id;
 }
 
+/**
+ * @return the id of the first column of the statement's row, or -1
+ */
+static int database_find_original(database_t *db, sqlite3_stmt *stmt, const char *key) {
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
 
-job_t *database_get_work(database_t *db, job_type_t job_type) {
-    job_t *job;
-
-    pthread_mutex_lock(&db->ipc_ctx->mutex);
-    while (db->ipc_ctx->job_count == 0 && !db->ipc_ctx->no_more_jobs) {
-        pthread_cond_timedwait_ms(&db->ipc_ctx->has_work_cond, &db->ipc_ctx->mutex, 10);
+    int ret = sqlite3_step(stmt);
+    if (ret == SQLITE_DONE) {
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(stmt));
+        return -1;
     }
-    pthread_mutex_unlock(&db->ipc_ctx->mutex);
-
-    pthread_mutex_lock(&db->ipc_ctx->db_mutex);
-
-    if (job_type == JOB_PARSE_JOB) {
-        int ret = sqlite3_step(db->pop_parse_job_stmt);
-        if (ret == SQLITE_DONE) {
-            CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->pop_parse_job_stmt));
-            pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
-            return NULL;
-        } else {
-            CRASH_IF_STMT_FAIL(ret);
-        }
-
-        job = malloc(sizeof(*job));
+    CRASH_IF_STMT_FAIL(ret);
+    int original_id = sqlite3_column_int(stmt, 0);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(stmt));
 
-        job->parse_job = create_parse_job(
-                (const char *) sqlite3_column_text(db->pop_parse_job_stmt, 0),
-                sqlite3_column_int(db->pop_parse_job_stmt, 1),
-                sqlite3_column_int64(db->pop_parse_job_stmt, 2));
+    return original_id;
+}
 
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->pop_parse_job_stmt));
+/**
+ * Copy the row of the original document to path
+ */
+static int database_write_copy(database_t *db, int original_id, const char *path, int mtime,
+                               const char *json_data, int link) {
+    sqlite3_bind_text(db->write_duplicate_stmt, 1, path + ScanCtx.index.desc.root_len, -1, SQLITE_STATIC);
+    sqlite3_bind_int(db->write_duplicate_stmt, 2, mtime);
+    sqlite3_bind_text(db->write_duplicate_stmt, 3, json_data, -1, SQLITE_STATIC);
+    sqlite3_bind_int(db->write_duplicate_stmt, 4, original_id);
+
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->write_duplicate_stmt));
+    int id = sqlite3_column_int(db->write_duplicate_stmt, 0);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_duplicate_stmt));
+
+    // The mode can change between two scans of the same index
+    if (link) {
+        sqlite3_bind_int(db->delete_thumbnails_stmt, 1, id);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->delete_thumbnails_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->delete_thumbnails_stmt));
+
+        sqlite3_bind_int(db->link_duplicate_stmt, 1, id);
+        sqlite3_bind_int(db->link_duplicate_stmt, 2, original_id);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->link_duplicate_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->link_duplicate_stmt));
     } else {
+        sqlite3_bind_int(db->unlink_duplicate_stmt, 1, id);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->unlink_duplicate_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->unlink_duplicate_stmt));
+
+        sqlite3_bind_int(db->copy_thumbnails_stmt, 1, id);
+        sqlite3_bind_int(db->copy_thumbnails_stmt, 2, original_id);
+        CRASH_IF_STMT_FAIL(sqlite3_step(db->copy_thumbnails_stmt));
+        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->copy_thumbnails_stmt));
+    }
 
-        int ret = sqlite3_step(db->pop_index_job_stmt);
-
-        if (ret == SQLITE_DONE) {
-            CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->pop_index_job_stmt));
-            pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
-            return NULL;
-        }
+    // Keep the row at the end of an incremental scan
+    sqlite3_bind_int(db->mark_duplicate_stmt, 1, id);
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->mark_duplicate_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->mark_duplicate_stmt));
 
-        CRASH_IF_STMT_FAIL(ret);
+    database_delete_parse_cache(db, id);
 
-        job = malloc(sizeof(*job));
+    return id;
+}
 
-        const char *line = (const char *) sqlite3_column_text(db->pop_index_job_stmt, 2);
-        if (line != NULL) {
-            job->bulk_line = malloc(sizeof(es_bulk_line_t) + strlen(line) + 1);
-            strcpy(job->bulk_line->line, line);
-        } else {
-            job->bulk_line = malloc(sizeof(es_bulk_line_t));
-        }
-        strcpy(job->bulk_line->sid, (const char *) sqlite3_column_text(db->pop_index_job_stmt, 0));
-        job->bulk_line->type = sqlite3_column_int(db->pop_index_job_stmt, 1);
-        job->bulk_line->next = NULL;
+int database_write_duplicate(database_t *db, const char *path, const char *original_path, int mtime,
+                             const char *json_data, int link) {
+    int original_id = database_find_original(db, db->find_original_stmt,
+                                             original_path + ScanCtx.index.desc.root_len);
+    if (original_id == -1) {
+        return -1;
+    }
 
-        CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->pop_index_job_stmt));
+    // Only the row of an archive would be copied, not the rows of its entries
+    sqlite3_bind_text(db->find_archive_entry_stmt, 1, original_path + ScanCtx.index.desc.root_len, -1,
+                      SQLITE_STATIC);
+    int ret = sqlite3_step(db->find_archive_entry_stmt);
+    CRASH_IF_STMT_FAIL(ret);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->find_archive_entry_stmt));
+    if (ret == SQLITE_ROW) {
+        return -2;
     }
 
-    pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
+    return database_write_copy(db, original_id, path, mtime, json_data, link);
+}
+
+int database_write_cached_document(database_t *db, const char *path, const char *hash, int mtime,
+                                   const char *json_data) {
+    int original_id = database_find_original(db, db->find_parse_cache_stmt, hash);
+    if (original_id == -1) {
+        return -1;
+    }
 
-    pthread_mutex_lock(&db->ipc_ctx->mutex);
-    db->ipc_ctx->job_count -= 1;
-    pthread_mutex_unlock(&db->ipc_ctx->mutex);
+    // The copy stays in the cache if the original is deleted
+    int id = database_write_copy(db, original_id, path, mtime, json_data, FALSE);
+    database_write_parse_cache(db, path, hash);
 
-    job->type = job_type;
-    return job;
+    return id;
 }
 
-void database_add_work(database_t *db, job_t *job) {
-    int ret;
+void database_write_parse_cache(database_t *db, const char *path, const char *hash) {
+    sqlite3_bind_text(db->write_parse_cache_stmt, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_text(db->write_parse_cache_stmt, 2, path + ScanCtx.index.desc.root_len, -1, SQLITE_STATIC);
 
-    pthread_mutex_lock(&db->ipc_ctx->db_mutex);
-
-    if (job->type == JOB_PARSE_JOB) {
-        do {
-            sqlite3_bind_text(db->insert_parse_job_stmt, 1, job->parse_job->filepath, -1, SQLITE_STATIC);
-            sqlite3_bind_int(db->insert_parse_job_stmt, 2, job->parse_job->vfile.mtime);
-            sqlite3_bind_int64(db->insert_parse_job_stmt, 3, (long) job->parse_job->vfile.st_size);
-
-            ret = sqlite3_step(db->insert_parse_job_stmt);
-
-            if (ret == SQLITE_FULL) {
-                sqlite3_reset(db->insert_parse_job_stmt);
-                pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
-                usleep(1000000);
-                pthread_mutex_lock(&db->ipc_ctx->db_mutex);
-                continue;
-            } else {
-                CRASH_IF_STMT_FAIL(ret);
-            }
-
-            ret = sqlite3_reset(db->insert_parse_job_stmt);
-            if (ret == SQLITE_FULL) {
-                pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
-                usleep(100000);
-                pthread_mutex_lock(&db->ipc_ctx->db_mutex);
-            } else if (ret != SQLITE_OK) {
-                LOG_FATALF("database.c", "sqlite3_reset returned error %d", ret);
-            }
-        } while (ret != SQLITE_DONE && ret != SQLITE_OK);
-    } else if (job->type == JOB_BULK_LINE) {
-        do {
-            sqlite3_bind_text(db->insert_index_job_stmt, 1, job->bulk_line->sid, -1, SQLITE_STATIC);
-            sqlite3_bind_int(db->insert_index_job_stmt, 2, job->bulk_line->type);
-            if (job->bulk_line->type != ES_BULK_LINE_DELETE) {
-                sqlite3_bind_text(db->insert_index_job_stmt, 3, job->bulk_line->line, -1, SQLITE_STATIC);
-            } else {
-                sqlite3_bind_null(db->insert_index_job_stmt, 3);
-            }
-
-            ret = sqlite3_step(db->insert_index_job_stmt);
-
-            if (ret == SQLITE_FULL) {
-                sqlite3_reset(db->insert_index_job_stmt);
-                pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
-                usleep(100000);
-                pthread_mutex_lock(&db->ipc_ctx->db_mutex);
-                continue;
-            } else {
-                CRASH_IF_STMT_FAIL(ret);
-            }
-
-            ret = sqlite3_reset(db->insert_index_job_stmt);
-            if (ret == SQLITE_FULL) {
-                pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
-                usleep(100000);
-                pthread_mutex_lock(&db->ipc_ctx->db_mutex);
-            } else if (ret != SQLITE_OK) {
-                LOG_FATALF("database.c", "sqlite3_reset returned error %d", ret);
-            }
-
-        } while (ret != SQLITE_DONE && ret != SQLITE_OK);
-    } else {
-        LOG_FATAL("database.c", "FIXME: invalid job type");
-    }
-    pthread_mutex_unlock(&db->ipc_ctx->db_mutex);
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->write_parse_cache_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_parse_cache_stmt));
+}
+
+void database_write_thumbnail(database_t *db, int doc_id, int num, void *data, size_t data_size) {
+    sqlite3_bind_int(db->write_thumbnail_stmt, 1, doc_id);
+    sqlite3_bind_int(db->write_thumbnail_stmt, 2, num);
+    sqlite3_bind_blob(db->write_thumbnail_stmt, 3, data, (int) data_size, SQLITE_STATIC);
 
-    pthread_mutex_lock(&db->ipc_ctx->mutex);
-    db->ipc_ctx->job_count += 1;
-    pthread_cond_signal(&db->ipc_ctx->has_work_cond);
-    pthread_mutex_unlock(&db->ipc_ctx->mutex);
+    CRASH_IF_STMT_FAIL(sqlite3_step(db->write_thumbnail_stmt));
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_reset(db->write_thumbnail_stmt));
 }
 
+
 void database_write_tag(database_t *db, long sid, char *tag) {
     sqlite3_bind_int64(db->write_tag_stmt, 1, sid);
     sqlite3_bind_int(db->write_tag_stmt, 2, (int) (sid >> 32));
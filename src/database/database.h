@@ -8,14 +8,21 @@
 
 typedef struct index_descriptor index_descriptor_t;
 
-extern const char *IpcDatabaseSchema;
 extern const char *IndexDatabaseSchema;
 extern const char *FtsDatabaseSchema;
 
+/**
+ * Web reads are mostly thumbnails and documents, let them come from the page cache
+ */
+#define DATABASE_READER_MMAP_SIZE "268435456"
+
+/**
+ * Tag writes from the web server can wait for a commit of the scan writer (ms)
+ */
+#define DATABASE_READER_BUSY_TIMEOUT 5000
+
 typedef enum {
     INDEX_DATABASE,
-    IPC_CONSUMER_DATABASE,
-    IPC_PRODUCER_DATABASE,
     FTS_DATABASE
 } database_type_t;
 
@@ -30,7 +37,8 @@ typedef enum {
 typedef enum {
     JOB_UNDEFINED,
     JOB_BULK_LINE,
-    JOB_PARSE_JOB
+    JOB_PARSE_JOB,
+    JOB_TYPE_COUNT
 } job_type_t;
 
 typedef enum {
@@ -53,15 +61,13 @@ typedef struct {
 } job_t;
 
 typedef struct {
-    int job_count;
-    int no_more_jobs;
     int completed_job_count;
+    int claimed_job_count;
 
     pthread_mutex_t mutex;
-    pthread_mutex_t db_mutex;
-    pthread_mutex_t index_db_mutex;
-    pthread_cond_t has_work_cond;
-    char current_job[MAX_THREADS][PATH_MAX * 2];
+    /** Indexed by thread_id, from 1 to num_threads */
+    char current_job[MAX_THREADS + 1][PATH_MAX * 2];
+    int current_batch_size[MAX_THREADS + 1];
 } database_ipc_ctx_t;
 
 typedef struct {
@@ -82,6 +88,17 @@ typedef struct database {
     sqlite3_stmt *mark_document_stmt;
     sqlite3_stmt *write_document_stmt;
     sqlite3_stmt *write_thumbnail_stmt;
+    sqlite3_stmt *find_original_stmt;
+    sqlite3_stmt *find_archive_entry_stmt;
+    sqlite3_stmt *write_duplicate_stmt;
+    sqlite3_stmt *link_duplicate_stmt;
+    sqlite3_stmt *unlink_duplicate_stmt;
+    sqlite3_stmt *copy_thumbnails_stmt;
+    sqlite3_stmt *delete_thumbnails_stmt;
+    sqlite3_stmt *mark_duplicate_stmt;
+    sqlite3_stmt *find_parse_cache_stmt;
+    sqlite3_stmt *write_parse_cache_stmt;
+    sqlite3_stmt *delete_parse_cache_stmt;
     sqlite3_stmt *get_document;
     sqlite3_stmt *get_models;
     sqlite3_stmt *get_embedding;
@@ -89,11 +106,6 @@ typedef struct database {
     sqlite3_stmt *delete_tag_stmt;
     sqlite3_stmt *write_tag_stmt;
 
-    sqlite3_stmt *insert_parse_job_stmt;
-    sqlite3_stmt *insert_index_job_stmt;
-    sqlite3_stmt *pop_parse_job_stmt;
-    sqlite3_stmt *pop_index_job_stmt;
-
     sqlite3_stmt *fts_search_paths;
     sqlite3_stmt *fts_search_paths_w_prefix;
     sqlite3_stmt *fts_suggest_paths;
@@ -121,6 +133,32 @@ typedef struct {
     long size;
 } treemap_row_t;
 
+/**
+ * Total parse time (µs) and size of the documents of a mime type
+ */
+typedef struct {
+    unsigned int mime;
+    long count;
+    long size;
+    long time;
+} parse_cost_t;
+
+typedef struct {
+    unsigned long path_hash;
+    int id;
+    int mtime;
+} incremental_map_entry_t;
+
+/**
+ * path -> mtime of the documents of the original index, sorted by path hash.
+ * Lets the walker skip unchanged files without a round trip to the database.
+ */
+typedef struct {
+    incremental_map_entry_t *entries;
+    char *marked;
+    int count;
+} incremental_map_t;
+
 
 database_t *database_create(const char *filename, database_type_t type);
 
@@ -128,6 +166,17 @@ void database_initialize(database_t *db);
 
 void database_open(database_t *db);
 
+/**
+ * Connection for the web server: it reads from a snapshot of the WAL and is never
+ * blocked by a scan writing to the same index. Only user tags are written through it.
+ */
+void database_open_reader(database_t *db);
+
+/**
+ * Copy the WAL back into the database file, and truncate it if no reader is using it
+ */
+void database_checkpoint(database_t *db);
+
 void database_close(database_t *, int optimize);
 
 void database_increment_version(database_t *db);
@@ -142,8 +191,40 @@ index_descriptor_t *database_read_index_descriptor(database_t *db);
 
 int database_write_document(database_t *db, document_t *doc, const char *json_data);
 
+/**
+ * Write the row of a file that was not parsed because it has the same inode as original_path,
+ * with the metadata of the original and the name, path and extension in json_data
+ * @param link read the thumbnails from the original instead of copying them
+ * @return the id of the document, -1 if the original was not written or -2 if it is an archive:
+ *  its entries are not copied, the duplicate must be parsed
+ */
+int database_write_duplicate(database_t *db, const char *path, const char *original_path, int mtime,
+                             const char *json_data, int link);
+
+/**
+ * Same as database_write_duplicate(), from a document with the same content hash
+ * @return the id of the document, or -1 if the hash is not in the parse cache
+ */
+int database_write_cached_document(database_t *db, const char *path, const char *hash, int mtime,
+                                   const char *json_data);
+
+/**
+ * Add a document that was written at path to the parse cache
+ */
+void database_write_parse_cache(database_t *db, const char *path, const char *hash);
+
 database_iterator_t *database_create_document_iterator(database_t *db);
 
+/**
+ * Same as database_create_document_iterator(), for a set of documents that have their json_data
+ */
+database_iterator_t *database_create_document_iterator_for_ids(database_t *db, const int *doc_ids, int count);
+
+/**
+ * @return A JSON array of the ids, to be used with json_each() in a query
+ */
+char *database_ids_to_json(const int *ids, int count);
+
 void emb_to_json_func(sqlite3_context *ctx, int argc, sqlite3_value **argv);
 
 cJSON *database_document_iter(database_iterator_t *);
@@ -159,12 +240,79 @@ int database_delete_list_iter(database_iterator_t *iter);
     for (int (element) = database_delete_list_iter(iter); (element) != 0; (element) = database_delete_list_iter(iter))
 
 
-cJSON *database_incremental_scan_begin(database_t *db);
+incremental_map_t *database_incremental_scan_begin(database_t *db);
 
-cJSON *database_incremental_scan_end(database_t *db);
+void database_incremental_scan_end(database_t *db, incremental_map_t *map);
+
+/**
+ * @return TRUE if the document is unchanged since the last scan. It is marked
+ * in the map and the marks are written to the database at database_incremental_scan_end()
+ */
+int incremental_map_mark(incremental_map_t *map, const char *path, int mtime);
 
 int database_mark_document(database_t *db, const char *id, int mtime);
 
+/**
+ * Single connection to the index database, owned by a thread of the main process.
+ * Workers send it documents and thumbnails through shared memory and it
+ * commits them in large transactions.
+ */
+typedef struct database_writer database_writer_t;
+
+/**
+ * Must be called before the worker processes are forked
+ */
+database_writer_t *database_writer_create(const char *filename);
+
+/**
+ * Called by the writer thread after each commit, with the ids of the documents written in the transaction
+ */
+typedef void (*database_writer_commit_callback_t)(void *data, const int *doc_ids, int count);
+
+/**
+ * Must be called before the first document is sent
+ */
+void database_writer_set_commit_callback(database_writer_t *writer, database_writer_commit_callback_t callback,
+                                         void *data);
+
+/**
+ * Commit everything that was sent and close the database
+ */
+void database_writer_destroy(database_writer_t *writer);
+
+/**
+ * Called by the main process after a worker process was killed, so that a message it was
+ * in the middle of sending does not block the writer
+ */
+void database_writer_recover(database_writer_t *writer, pid_t pid);
+
+void database_writer_write_document(database_writer_t *writer, document_t *doc, const char *json_data,
+                                    meta_line_t *thumbnails);
+
+/**
+ * Same as database_mark_document(), waits for the writer's answer
+ */
+int database_writer_mark_document(database_writer_t *writer, const char *path, int mtime);
+
+/**
+ * Same as database_write_duplicate(), must be called after the originals were sent. Waits for the writer's answer
+ * @return FALSE if the original was not written or is an archive, the duplicate must then be parsed
+ */
+int database_writer_write_duplicate(database_writer_t *writer, const char *path, const char *original_path,
+                                     int mtime, const char *json_data);
+
+/**
+ * Same as database_write_cached_document(), waits for the writer's answer
+ * @return TRUE if the document was written from the parse cache
+ */
+int database_writer_write_cached_document(database_writer_t *writer, const char *path, const char *hash, int mtime,
+                                          const char *json_data);
+
+/**
+ * Same as database_write_parse_cache(), must be called after the document was sent
+ */
+void database_writer_write_parse_cache(database_writer_t *writer, const char *path, const char *hash);
+
 database_iterator_t *database_create_treemap_iterator(database_t *db, long threshold);
 
 treemap_row_t database_treemap_iter(database_iterator_t *iter);
@@ -177,9 +325,16 @@ void database_generate_stats(database_t *db, double treemap_threshold);
 
 database_stat_type_d database_get_stat_type_by_mnemonic(const char *name);
 
-job_t *database_get_work(database_t *db, job_type_t job_type);
+/**
+ * Parse costs measured during the previous scans of this index
+ * @return NULL if there are none
+ */
+parse_cost_t *database_read_parse_costs(database_t *db, int *count);
 
-void database_add_work(database_t *db, job_t *job);
+/**
+ * Replace the stored parse costs
+ */
+void database_write_parse_costs(database_t *db, parse_cost_t *costs, int count);
 
 cJSON *database_get_stats(database_t *db, database_stat_type_d type);
 
@@ -201,6 +356,17 @@ void database_fts_attach(database_t *db, const char *fts_database_path);
 
 void database_fts_index(database_t *db);
 
+/**
+ * Add or update these documents in the attached search index, full-text search table included
+ */
+void database_fts_index_documents(database_t *db, const int *doc_ids, int count);
+
+/**
+ * Everything database_fts_index() does after adding the documents, except rebuilding
+ * the full-text search table: embeddings, deleted documents and summary tables
+ */
+void database_fts_index_finish(database_t *db);
+
 void database_fts_optimize(database_t *db);
 
 cJSON *database_fts_get_paths(database_t *db, int index_id, int depth_min, int depth_max, const char *prefix,
@@ -35,32 +35,93 @@ int database_fts_get_max_path_depth(database_t *db) {
     return max_depth;
 }
 
+#define FTS_INDEX_DOCUMENTS_QUERY(where) \
+    "WITH docs AS (" \
+    " SELECT " \
+    "  ((SELECT id FROM descriptor) << 32) | document.id as id," \
+    "  (SELECT id FROM descriptor) as index_id," \
+    "  size," \
+    "  document.json_data ->> 'name' as name," \
+    "  document.json_data ->> 'path' as path," \
+    "  mtime," \
+    "  m.name as mime," \
+    "  thumbnail_count," \
+    "  document.json_data" \
+    " FROM document" \
+    " LEFT JOIN mime m ON m.id=document.mime" \
+    where \
+    " )" \
+    " INSERT" \
+    " INTO fts.document_index (id, index_id, size, name, path, mtime, mime, thumbnail_count, json_data)" \
+    " SELECT * FROM docs WHERE true" \
+    " on conflict (id) do update set " \
+    "  size=excluded.size, mtime=excluded.mtime, mime=excluded.mime, json_data=excluded.json_data;"
+
+/**
+ * Run a statement with the ids of the documents in the search index bound to the first parameter
+ */
+static void database_fts_exec_for_ids(database_t *db, const char *sql, const char *ids_json) {
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL));
+
+    sqlite3_bind_text(stmt, 1, ids_json, -1, SQLITE_STATIC);
+
+    CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+    sqlite3_finalize(stmt);
+}
+
+#define FTS_IDS_IN_JSON " id IN (SELECT ((SELECT id FROM descriptor) << 32) | value FROM json_each(?))"
+
+void database_fts_index_documents(database_t *db, const int *doc_ids, int count) {
+    char *ids_json = database_ids_to_json(doc_ids, count);
+
+    // search is an external content table: the old version of a document must
+    // be deleted from it with the values it was indexed with, before they are updated
+    database_fts_exec_for_ids(
+            db,
+            "INSERT INTO fts.search(search, rowid, name, content, title, path)"
+            " SELECT 'delete', id, name, content, title, path FROM fts.document_view"
+            " WHERE" FTS_IDS_IN_JSON,
+            ids_json);
+
+    database_fts_exec_for_ids(
+            db,
+            FTS_INDEX_DOCUMENTS_QUERY(" WHERE document.id IN (SELECT value FROM json_each(?))"
+                                      " AND document.json_data IS NOT NULL"),
+            ids_json);
+
+    database_fts_exec_for_ids(
+            db,
+            "INSERT INTO fts.search(rowid, name, content, title, path)"
+            " SELECT id, name, content, title, path FROM fts.document_view"
+            " WHERE" FTS_IDS_IN_JSON,
+            ids_json);
+
+    free(ids_json);
+}
+
 void database_fts_index(database_t *db) {
 
     LOG_INFO("database_fts.c", "Creating content table");
 
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, FTS_INDEX_DOCUMENTS_QUERY(""), NULL, NULL, NULL));
+
+    database_fts_index_finish(db);
+
+    LOG_DEBUG("database_fts.c", "Generating search index");
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db, "INSERT INTO search(search) VALUES ('delete-all')",
+            NULL, NULL, NULL));
+
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
-            "WITH docs AS ("
-            " SELECT "
-            "  ((SELECT id FROM descriptor) << 32) | document.id as id,"
-            "  (SELECT id FROM descriptor) as index_id,"
-            "  size,"
-            "  document.json_data ->> 'name' as name,"
-            "  document.json_data ->> 'path' as path,"
-            "  mtime,"
-            "  m.name as mime,"
-            "  thumbnail_count,"
-            "  document.json_data"
-            " FROM document"
-            " LEFT JOIN mime m ON m.id=document.mime"
-            " )"
-            " INSERT"
-            " INTO fts.document_index (id, index_id, size, name, path, mtime, mime, thumbnail_count, json_data)"
-            " SELECT * FROM docs WHERE true"
-            " on conflict (id) do update set "
-            "  size=excluded.size, mtime=excluded.mtime, mime=excluded.mime, json_data=excluded.json_data;",
+            "INSERT INTO search(rowid, name, content, title, path) "
+            "SELECT id, name, content, title, path from document_view",
             NULL, NULL, NULL));
+}
+
+void database_fts_index_finish(database_t *db) {
 
     LOG_DEBUG("database_fts.c", "Copying embeddings");
 
@@ -79,6 +140,15 @@ void database_fts_index(database_t *db) {
 
     LOG_DEBUG("database_fts.c", "Deleting old documents");
 
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "INSERT INTO fts.search(search, rowid, name, content, title, path)"
+            " SELECT 'delete', id, name, content, title, path FROM fts.document_view"
+            " WHERE id IN (SELECT id FROM fts.document_index"
+            "  WHERE id IN (SELECT id FROM delete_list)"
+            "  AND index_id = (SELECT id FROM descriptor));",
+            NULL, NULL, NULL));
+
     CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
             db->db,
             "DELETE FROM fts.document_index"
@@ -153,18 +223,6 @@ void database_fts_index(database_t *db) {
             "DELETE FROM path_index;"
             "INSERT INTO path_index (path, index_id, count, depth) SELECT path, index_id, total, depth FROM path_tmp",
             NULL, NULL, NULL));
-
-    LOG_DEBUG("database_fts.c", "Generating search index");
-
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
-            db->db, "INSERT INTO search(search) VALUES ('delete-all')",
-            NULL, NULL, NULL));
-
-    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
-            db->db,
-            "INSERT INTO search(rowid, name, content, title, path) "
-            "SELECT id, name, content, title, path from document_view",
-            NULL, NULL, NULL));
 }
 
 void database_fts_optimize(database_t *db) {
@@ -96,21 +96,6 @@ const char *FtsDatabaseSchema =
         "INSERT INTO search(search, rank) VALUES('rank', 'bm25(8, 3, 8, 5)');"
         "";
 
-const char *IpcDatabaseSchema =
-        "CREATE TABLE parse_job ("
-        "   id INTEGER PRIMARY KEY,"
-        "   filepath TEXT NOT NULL,"
-        "   mtime INTEGER NOT NULL,"
-        "   st_size INTEGER NOT NULL"
-        ")"STRICT";"
-        ""
-        "CREATE TABLE index_job ("
-        "   id INTEGER PRIMARY KEY,"
-        "   sid TEXT NOT NULL,"
-        "   type INTEGER NOT NULL,"
-        "   line TEXT"
-        ")"STRICT";";
-
 const char *IndexDatabaseSchema =
         "CREATE TABLE thumbnail ("
         "   id INTEGER REFERENCES document(id),"
@@ -142,6 +127,17 @@ const char *IndexDatabaseSchema =
         "   json_data TEXT CHECK ( json_data IS NULL OR json_valid(json_data) )"
         ")"STRICT";"
         "CREATE UNIQUE INDEX document_path_idx ON document(path);"
+        "CREATE TABLE duplicate ("
+        "   id INTEGER PRIMARY KEY REFERENCES document(id),"
+        "   original INTEGER NOT NULL REFERENCES document(id)"
+        ")"STRICT";"
+        ""
+        "CREATE TABLE parse_cache ("
+        "   id INTEGER PRIMARY KEY REFERENCES document(id),"
+        "   hash TEXT NOT NULL"
+        ")"STRICT";"
+        "CREATE INDEX parse_cache_hash_idx ON parse_cache(hash);"
+        ""
         "CREATE TABLE marked ("
         "   id INTEGER PRIMARY KEY,"
         "   marked INTEGER NOT NULL,"
@@ -192,6 +188,13 @@ const char *IndexDatabaseSchema =
         "   count INTEGER NOT NULL"
         ")"STRICT";"
         ""
+        "CREATE TABLE parse_cost ("
+        "   mime INTEGER PRIMARY KEY REFERENCES mime(id),"
+        "   count INTEGER NOT NULL,"
+        "   size INTEGER NOT NULL,"
+        "   time INTEGER NOT NULL"
+        ")"STRICT";"
+        ""
         "CREATE TABLE embedding ("
         "   id INTEGER REFERENCES document(id),"
         "   model_id INTEGER NOT NULL references model(id),"
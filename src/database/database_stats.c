@@ -242,4 +242,73 @@ cJSON *database_get_stats(database_t *db, database_stat_type_d type) {
     sqlite3_finalize(stmt);
 
     return json;
-}
\ No newline at end of file
+}
+
+parse_cost_t *database_read_parse_costs(database_t *db, int *count) {
+    *count = 0;
+
+    sqlite3_stmt *stmt;
+
+    // Indices created by older versions don't have the table
+    if (sqlite3_prepare_v2(db->db, "SELECT mime, count, size, time FROM parse_cost",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return NULL;
+    }
+
+    int capacity = 64;
+    parse_cost_t *costs = malloc(sizeof(parse_cost_t) * capacity);
+
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (*count == capacity) {
+            capacity *= 2;
+            costs = realloc(costs, sizeof(parse_cost_t) * capacity);
+        }
+
+        parse_cost_t *cost = &costs[(*count)++];
+        cost->mime = (unsigned int) sqlite3_column_int64(stmt, 0);
+        cost->count = sqlite3_column_int64(stmt, 1);
+        cost->size = sqlite3_column_int64(stmt, 2);
+        cost->time = sqlite3_column_int64(stmt, 3);
+    }
+    CRASH_IF_STMT_FAIL(ret);
+    sqlite3_finalize(stmt);
+
+    if (*count == 0) {
+        free(costs);
+        return NULL;
+    }
+
+    return costs;
+}
+
+void database_write_parse_costs(database_t *db, parse_cost_t *costs, int count) {
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(
+            db->db,
+            "CREATE TABLE IF NOT EXISTS parse_cost ("
+            "   mime INTEGER PRIMARY KEY REFERENCES mime(id),"
+            "   count INTEGER NOT NULL,"
+            "   size INTEGER NOT NULL,"
+            "   time INTEGER NOT NULL"
+            ");"
+            "DELETE FROM parse_cost;",
+            NULL, NULL, NULL));
+
+    sqlite3_stmt *stmt;
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_prepare_v2(
+            db->db, "INSERT INTO parse_cost (mime, count, size, time) VALUES (?,?,?,?)", -1, &stmt, NULL));
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "BEGIN", NULL, NULL, NULL));
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_int64(stmt, 1, costs[i].mime);
+        sqlite3_bind_int64(stmt, 2, costs[i].count);
+        sqlite3_bind_int64(stmt, 3, costs[i].size);
+        sqlite3_bind_int64(stmt, 4, costs[i].time);
+
+        CRASH_IF_STMT_FAIL(sqlite3_step(stmt));
+        sqlite3_reset(stmt);
+    }
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "COMMIT", NULL, NULL, NULL));
+
+    sqlite3_finalize(stmt);
+}
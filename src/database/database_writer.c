@@ -0,0 +1,505 @@
+#include "database.h"
+#include "src/ctx.h"
+#include "src/job_ring.h"
+#include "src/metrics.h"
+#include "src/io/inode_dedup.h"
+
+#include <sys/mman.h>
+
+/**
+ * Messages larger than this are split in several records,
+ * so that a large document never has to fit in the ring at once
+ */
+#define WRITER_CHUNK_SIZE (JOB_RING_SIZE / 16)
+
+/**
+ * Commit after this many documents...
+ */
+#define WRITER_COMMIT_COUNT 2000
+
+/**
+ * ... or when the oldest uncommitted document is this old (µs)
+ */
+#define WRITER_COMMIT_INTERVAL (500 * MILLISECOND)
+
+typedef enum {
+    WRITER_WRITE_DOCUMENT,
+    WRITER_MARK_DOCUMENT,
+    WRITER_WRITE_DUPLICATE,
+    WRITER_WRITE_CACHED_DOCUMENT,
+    WRITER_WRITE_PARSE_CACHE,
+} writer_message_type_t;
+
+typedef struct {
+    int thread_id;
+    size_t offset;
+    size_t total_size;
+    char data[0];
+} writer_chunk_t;
+
+/**
+ * Followed by filepath, parent and json_data (NUL-terminated),
+ * then thumbnail_count x {size_t size; char data[size]}.
+ * Duplicates are followed by filepath, the path of the original and json_data,
+ * parse cache messages by filepath, the content hash and json_data.
+ */
+typedef struct {
+    writer_message_type_t type;
+    int mime;
+    int mtime;
+    long size;
+    int thumbnail_count;
+    int has_json_data;
+    char data[0];
+} writer_message_t;
+
+typedef struct {
+    job_ring_t ring;
+
+    /** Indexed by thread_id, 0 is the main process */
+    _Atomic int reply_ready[MAX_THREADS + 1];
+    int reply_value[MAX_THREADS + 1];
+    /** Incremented to wake up the worker waiting for its answer */
+    _Atomic uint32_t reply_seq[MAX_THREADS + 1];
+} writer_shm_t;
+
+struct database_writer {
+    writer_shm_t *shm;
+    pthread_t thread;
+    database_t *db;
+
+    // Only touched by the writer thread
+    char *buffers[MAX_THREADS + 1];
+    size_t buffer_sizes[MAX_THREADS + 1];
+    document_t *doc;
+    int document_count;
+    int thumbnail_count;
+    int commit_count;
+    int cache_lookup_count;
+    int cache_hit_count;
+
+    database_writer_commit_callback_t commit_callback;
+    void *commit_callback_data;
+    // Documents written in the current transaction, only when there is a commit callback
+    int *doc_ids;
+    int doc_id_count;
+    int doc_id_capacity;
+};
+
+static void writer_send(database_writer_t *writer, void *message, size_t size) {
+    writer_chunk_t *chunk = malloc(sizeof(writer_chunk_t) + MIN(size, WRITER_CHUNK_SIZE));
+    chunk->thread_id = ProcData.thread_id;
+    chunk->total_size = size;
+
+    for (size_t offset = 0; offset < size; offset += WRITER_CHUNK_SIZE) {
+        size_t len = MIN(size - offset, WRITER_CHUNK_SIZE);
+
+        chunk->offset = offset;
+        memcpy(chunk->data, (char *) message + offset, len);
+        job_ring_push_data(&writer->shm->ring, chunk, sizeof(writer_chunk_t) + len);
+    }
+
+    free(chunk);
+}
+
+static int writer_send_and_wait(database_writer_t *writer, void *message, size_t size) {
+    writer_shm_t *shm = writer->shm;
+
+    int thread_id = ProcData.thread_id;
+
+    shm->reply_ready[thread_id] = FALSE;
+    writer_send(writer, message, size);
+
+    while (TRUE) {
+        uint32_t seq = shm->reply_seq[thread_id];
+        if (shm->reply_ready[thread_id]) {
+            break;
+        }
+        futex_wait_ms(&shm->reply_seq[thread_id], seq, 100);
+    }
+
+    return shm->reply_value[thread_id];
+}
+
+static void writer_reply(database_writer_t *writer, int thread_id, int value) {
+    writer_shm_t *shm = writer->shm;
+
+    // A shared condition variable could be left unusable by a worker killed while waiting on it
+    shm->reply_value[thread_id] = value;
+    shm->reply_ready[thread_id] = TRUE;
+    shm->reply_seq[thread_id] += 1;
+    futex_wake(&shm->reply_seq[thread_id], 1);
+}
+
+void database_writer_write_document(database_writer_t *writer, document_t *doc, const char *json_data,
+                                    meta_line_t *thumbnails) {
+    size_t filepath_len = strlen(doc->filepath);
+    size_t parent_len = strlen(doc->parent);
+    size_t json_data_len = json_data != NULL ? strlen(json_data) : 0;
+
+    size_t size = sizeof(writer_message_t) + filepath_len + 1 + parent_len + 1 + json_data_len + 1;
+    int thumbnail_count = 0;
+    for (meta_line_t *meta = thumbnails; meta != NULL; meta = meta->next) {
+        size += sizeof(size_t) + meta->size;
+        thumbnail_count += 1;
+    }
+
+    writer_message_t *message = malloc(size);
+    message->type = WRITER_WRITE_DOCUMENT;
+    message->mime = (int) doc->mime;
+    message->mtime = doc->mtime;
+    message->size = (long) doc->size;
+    message->thumbnail_count = thumbnail_count;
+    message->has_json_data = json_data != NULL;
+
+    char *ptr = message->data;
+    memcpy(ptr, doc->filepath, filepath_len + 1);
+    ptr += filepath_len + 1;
+    memcpy(ptr, doc->parent, parent_len + 1);
+    ptr += parent_len + 1;
+    memcpy(ptr, json_data != NULL ? json_data : "", json_data_len + 1);
+    ptr += json_data_len + 1;
+
+    for (meta_line_t *meta = thumbnails; meta != NULL; meta = meta->next) {
+        size_t thumbnail_size = meta->size;
+        memcpy(ptr, &thumbnail_size, sizeof(size_t));
+        memcpy(ptr + sizeof(size_t), meta->str_val, meta->size);
+        ptr += sizeof(size_t) + meta->size;
+    }
+
+    writer_send(writer, message, size);
+    free(message);
+}
+
+int database_writer_mark_document(database_writer_t *writer, const char *path, int mtime) {
+    size_t path_len = strlen(path);
+    size_t size = sizeof(writer_message_t) + path_len + 1;
+
+    writer_message_t *message = malloc(size);
+    message->type = WRITER_MARK_DOCUMENT;
+    message->mtime = mtime;
+    memcpy(message->data, path, path_len + 1);
+
+    int ret = writer_send_and_wait(writer, message, size);
+    free(message);
+
+    return ret;
+}
+
+/**
+ * Followed by three NUL-terminated strings
+ */
+static writer_message_t *writer_create_message(writer_message_type_t type, int mtime, const char *a,
+                                               const char *b, const char *c, size_t *size) {
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    size_t c_len = strlen(c);
+    *size = sizeof(writer_message_t) + a_len + 1 + b_len + 1 + c_len + 1;
+
+    writer_message_t *message = malloc(*size);
+    message->type = type;
+    message->mtime = mtime;
+
+    char *ptr = message->data;
+    memcpy(ptr, a, a_len + 1);
+    ptr += a_len + 1;
+    memcpy(ptr, b, b_len + 1);
+    ptr += b_len + 1;
+    memcpy(ptr, c, c_len + 1);
+
+    return message;
+}
+
+int database_writer_write_duplicate(database_writer_t *writer, const char *path, const char *original_path,
+                                    int mtime, const char *json_data) {
+    size_t size;
+    writer_message_t *message = writer_create_message(WRITER_WRITE_DUPLICATE, mtime, path, original_path, json_data,
+                                                      &size);
+
+    int ret = writer_send_and_wait(writer, message, size);
+    free(message);
+
+    return ret;
+}
+
+int database_writer_write_cached_document(database_writer_t *writer, const char *path, const char *hash, int mtime,
+                                          const char *json_data) {
+    size_t size;
+    writer_message_t *message = writer_create_message(WRITER_WRITE_CACHED_DOCUMENT, mtime, path, hash, json_data,
+                                                      &size);
+
+    int ret = writer_send_and_wait(writer, message, size);
+    free(message);
+
+    return ret;
+}
+
+void database_writer_write_parse_cache(database_writer_t *writer, const char *path, const char *hash) {
+    size_t size;
+    writer_message_t *message = writer_create_message(WRITER_WRITE_PARSE_CACHE, 0, path, hash, "", &size);
+
+    writer_send(writer, message, size);
+    free(message);
+}
+
+static void writer_add_doc_id(database_writer_t *writer, int doc_id) {
+    if (writer->doc_id_count == writer->doc_id_capacity) {
+        writer->doc_id_capacity = MAX(WRITER_COMMIT_COUNT, writer->doc_id_capacity * 2);
+        writer->doc_ids = realloc(writer->doc_ids, sizeof(int) * writer->doc_id_capacity);
+    }
+    writer->doc_ids[writer->doc_id_count++] = doc_id;
+}
+
+static void writer_handle_duplicate(database_writer_t *writer, int thread_id, writer_message_t *message) {
+    char *path = message->data;
+    char *original_path = path + strlen(path) + 1;
+    char *json_data = original_path + strlen(original_path) + 1;
+
+    int doc_id = database_write_duplicate(writer->db, path, original_path, message->mtime, json_data,
+                                          ScanCtx.inode_dedup == INODE_DEDUP_LINK);
+    if (doc_id == -1) {
+        LOG_WARNINGF("database_writer.c", "Original of %s was not indexed, parsing it instead (%s)", path,
+                     original_path);
+        writer_reply(writer, thread_id, FALSE);
+        return;
+    }
+    if (doc_id == -2) {
+        LOG_DEBUGF("database_writer.c", "Original of %s is an archive, parsing it instead (%s)", path, original_path);
+        writer_reply(writer, thread_id, FALSE);
+        return;
+    }
+    writer_reply(writer, thread_id, TRUE);
+
+    if (writer->commit_callback != NULL) {
+        writer_add_doc_id(writer, doc_id);
+    }
+    writer->document_count += 1;
+}
+
+static void writer_handle_cached_document(database_writer_t *writer, int thread_id, writer_message_t *message) {
+    char *path = message->data;
+    char *hash = path + strlen(path) + 1;
+    char *json_data = hash + strlen(hash) + 1;
+
+    writer->cache_lookup_count += 1;
+
+    int doc_id = database_write_cached_document(writer->db, path, hash, message->mtime, json_data);
+    if (doc_id == -1) {
+        writer_reply(writer, thread_id, FALSE);
+        return;
+    }
+    writer_reply(writer, thread_id, TRUE);
+
+    if (writer->commit_callback != NULL) {
+        writer_add_doc_id(writer, doc_id);
+    }
+    writer->document_count += 1;
+    writer->cache_hit_count += 1;
+}
+
+static void writer_handle_message(database_writer_t *writer, int thread_id, writer_message_t *message) {
+
+    if (message->type == WRITER_MARK_DOCUMENT) {
+        writer_reply(writer, thread_id, database_mark_document(writer->db, message->data, message->mtime));
+        return;
+    }
+
+    if (message->type == WRITER_WRITE_DUPLICATE) {
+        writer_handle_duplicate(writer, thread_id, message);
+        return;
+    }
+
+    if (message->type == WRITER_WRITE_CACHED_DOCUMENT) {
+        writer_handle_cached_document(writer, thread_id, message);
+        return;
+    }
+
+    if (message->type == WRITER_WRITE_PARSE_CACHE) {
+        char *path = message->data;
+        database_write_parse_cache(writer->db, path, path + strlen(path) + 1);
+        return;
+    }
+
+    document_t *doc = writer->doc;
+    char *ptr = message->data;
+
+    strcpy(doc->filepath, ptr);
+    ptr += strlen(ptr) + 1;
+    strcpy(doc->parent, ptr);
+    ptr += strlen(ptr) + 1;
+    char *json_data = message->has_json_data ? ptr : NULL;
+    ptr += strlen(ptr) + 1;
+
+    doc->mime = message->mime;
+    doc->mtime = message->mtime;
+    doc->size = message->size;
+    doc->thumbnail_count = message->thumbnail_count;
+
+    // The parent of a document inside an archive is looked up by path. A worker's messages are
+    // applied in the order they were sent, so the archive is always written before its children.
+    int doc_id = database_write_document(writer->db, doc, json_data);
+
+    if (writer->commit_callback != NULL) {
+        writer_add_doc_id(writer, doc_id);
+    }
+
+    for (int i = 0; i < message->thumbnail_count; i++) {
+        size_t thumbnail_size;
+        memcpy(&thumbnail_size, ptr, sizeof(size_t));
+        database_write_thumbnail(writer->db, doc_id, i, ptr + sizeof(size_t), thumbnail_size);
+        ptr += sizeof(size_t) + thumbnail_size;
+    }
+
+    writer->document_count += 1;
+    writer->thumbnail_count += message->thumbnail_count;
+}
+
+/**
+ * @return the complete message once all its chunks were received, NULL otherwise
+ */
+static writer_message_t *writer_assemble(database_writer_t *writer, writer_chunk_t *chunk, size_t len) {
+    size_t data_len = len - sizeof(writer_chunk_t);
+
+    if (chunk->offset == 0 && data_len == chunk->total_size) {
+        return (writer_message_t *) chunk->data;
+    }
+
+    // A new message discards what is left of a message from a worker that crashed
+    if (chunk->offset == 0) {
+        free(writer->buffers[chunk->thread_id]);
+        writer->buffers[chunk->thread_id] = malloc(chunk->total_size);
+        writer->buffer_sizes[chunk->thread_id] = 0;
+    } else if (writer->buffers[chunk->thread_id] == NULL) {
+        return NULL;
+    }
+
+    memcpy(writer->buffers[chunk->thread_id] + chunk->offset, chunk->data, data_len);
+    writer->buffer_sizes[chunk->thread_id] += data_len;
+
+    if (writer->buffer_sizes[chunk->thread_id] == chunk->total_size) {
+        return (writer_message_t *) writer->buffers[chunk->thread_id];
+    }
+    return NULL;
+}
+
+static void writer_commit(database_writer_t *writer) {
+    database_t *db = writer->db;
+    long start = metrics_time_us();
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "COMMIT", NULL, NULL, NULL));
+    metrics_record_stage(METRICS_STAGE_DB_WRITE, 0, metrics_time_us() - start);
+    writer->commit_count += 1;
+
+    if (writer->commit_callback != NULL && writer->doc_id_count > 0) {
+        writer->commit_callback(writer->commit_callback_data, writer->doc_ids, writer->doc_id_count);
+        writer->doc_id_count = 0;
+    }
+}
+
+static void *writer_thread(void *arg) {
+    database_writer_t *writer = arg;
+    database_t *db = writer->db;
+
+    int in_transaction = FALSE;
+    int uncommitted_count = 0;
+    TIMER_INIT();
+
+    while (TRUE) {
+        void *data;
+        size_t len;
+
+        // Only sleep once everything was committed
+        if (job_ring_pop_data(&writer->shm->ring, &data, &len, !in_transaction) == 0) {
+            if (in_transaction) {
+                writer_commit(writer);
+                in_transaction = FALSE;
+                continue;
+            }
+            break;
+        }
+
+        if (!in_transaction) {
+            CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "BEGIN", NULL, NULL, NULL));
+            in_transaction = TRUE;
+            uncommitted_count = 0;
+            TIMER_START();
+        }
+
+        writer_chunk_t *chunk = data;
+        writer_message_t *message = writer_assemble(writer, chunk, len);
+
+        if (message != NULL) {
+            long start = metrics_time_us();
+            writer_handle_message(writer, chunk->thread_id, message);
+            metrics_record_stage(METRICS_STAGE_DB_WRITE, 1, metrics_time_us() - start);
+            uncommitted_count += 1;
+
+            if ((char *) message == writer->buffers[chunk->thread_id]) {
+                free(writer->buffers[chunk->thread_id]);
+                writer->buffers[chunk->thread_id] = NULL;
+            }
+        }
+        free(data);
+
+        long elapsed;
+        TIMER_END(elapsed);
+        if (uncommitted_count >= WRITER_COMMIT_COUNT || elapsed >= WRITER_COMMIT_INTERVAL) {
+            writer_commit(writer);
+            in_transaction = FALSE;
+        }
+    }
+
+    return NULL;
+}
+
+database_writer_t *database_writer_create(const char *filename) {
+    database_writer_t *writer = calloc(1, sizeof(database_writer_t));
+
+    writer->shm = mmap(NULL, sizeof(writer_shm_t) + JOB_RING_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    job_ring_init(&writer->shm->ring, (char *) writer->shm + sizeof(writer_shm_t), JOB_RING_SIZE);
+
+    writer->db = database_create(filename, INDEX_DATABASE);
+    database_open(writer->db);
+    writer->doc = malloc(sizeof(document_t));
+
+    pthread_create(&writer->thread, NULL, writer_thread, writer);
+
+    return writer;
+}
+
+void database_writer_set_commit_callback(database_writer_t *writer, database_writer_commit_callback_t callback,
+                                         void *data) {
+    writer->commit_callback = callback;
+    writer->commit_callback_data = data;
+}
+
+void database_writer_recover(database_writer_t *writer, pid_t pid) {
+    job_ring_recover(&writer->shm->ring, pid, NULL, 0);
+}
+
+void database_writer_destroy(database_writer_t *writer) {
+    job_ring_close(&writer->shm->ring);
+    pthread_join(writer->thread, NULL);
+
+    LOG_INFOF("database_writer.c", "Wrote %d documents and %d thumbnails in %d transactions",
+              writer->document_count, writer->thumbnail_count, writer->commit_count);
+
+    if (writer->cache_lookup_count > 0) {
+        LOG_INFOF("database_writer.c", "Parse cache: %d hits for %d lookups (%.1f%%)",
+                  writer->cache_hit_count, writer->cache_lookup_count,
+                  100.0 * writer->cache_hit_count / writer->cache_lookup_count);
+    }
+
+    database_close(writer->db, FALSE);
+
+    for (int i = 0; i <= MAX_THREADS; i++) {
+        free(writer->buffers[i]);
+    }
+    free(writer->doc);
+    free(writer->doc_ids);
+
+    job_ring_destroy(&writer->shm->ring);
+    munmap(writer->shm, sizeof(writer_shm_t) + JOB_RING_SIZE);
+
+    free(writer);
+}
@@ -2,6 +2,7 @@
 #include "src/ctx.h"
 
 #include "web.h"
+#include "src/metrics.h"
 
 #include "static_generated.c"
 
@@ -303,6 +304,7 @@ void elastic_flush() {
 }
 
 void elastic_index_line(es_bulk_line_t *line) {
+    long start = metrics_time_us();
 
     if (Indexer == NULL) {
         Indexer = create_indexer(IndexCtx.es_url, IndexCtx.es_index);
@@ -321,6 +323,8 @@ void elastic_index_line(es_bulk_line_t *line) {
     if (Indexer->queued >= IndexCtx.batch_size) {
         elastic_flush();
     }
+
+    metrics_record_stage(METRICS_STAGE_INDEX, 1, metrics_time_us() - start);
 }
 
 es_indexer_t *create_indexer(const char *url, const char *index) {
@@ -0,0 +1,137 @@
+#include "index_stream.h"
+#include "src/ctx.h"
+
+struct index_stream {
+    index_target_t target;
+    int index_id;
+    database_t *db;
+    pthread_t thread;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int *doc_ids;
+    int count;
+    int capacity;
+    int closed;
+
+    long document_count;
+};
+
+static void index_stream_index_es(index_stream_t *stream, const int *doc_ids, int count) {
+    database_iterator_t *iterator = database_create_document_iterator_for_ids(stream->db, doc_ids, count);
+
+    database_document_iter_foreach(json, iterator) {
+        char sid[SIST_SID_LEN];
+        int doc_id = cJSON_GetObjectItem(json, "_id")->valueint;
+        cJSON_DeleteItemFromObject(json, "_id");
+        format_sid(sid, stream->index_id, doc_id);
+
+        index_json(json, sid);
+        cJSON_Delete(json);
+    }
+    free(iterator);
+}
+
+static void index_stream_index_sqlite(index_stream_t *stream, const int *doc_ids, int count) {
+    database_t *db = stream->db;
+
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "BEGIN", NULL, NULL, NULL));
+    database_fts_index_documents(db, doc_ids, count);
+    CRASH_IF_NOT_SQLITE_OK(sqlite3_exec(db->db, "COMMIT", NULL, NULL, NULL));
+}
+
+static void *index_stream_thread(void *arg) {
+    index_stream_t *stream = arg;
+
+    while (TRUE) {
+        pthread_mutex_lock(&stream->mutex);
+        while (stream->count == 0 && !stream->closed) {
+            pthread_cond_wait(&stream->cond, &stream->mutex);
+        }
+        if (stream->count == 0) {
+            pthread_mutex_unlock(&stream->mutex);
+            break;
+        }
+
+        // Take all the pending documents, the writer keeps adding to a new array
+        int *doc_ids = stream->doc_ids;
+        int count = stream->count;
+        stream->doc_ids = NULL;
+        stream->count = 0;
+        stream->capacity = 0;
+        pthread_mutex_unlock(&stream->mutex);
+
+        if (stream->target == INDEX_TO_ES) {
+            index_stream_index_es(stream, doc_ids, count);
+        } else {
+            index_stream_index_sqlite(stream, doc_ids, count);
+        }
+
+        stream->document_count += count;
+        free(doc_ids);
+    }
+
+    return NULL;
+}
+
+index_stream_t *index_stream_create(const char *index_path, index_target_t target, const char *search_index_path,
+                                    int index_id) {
+    index_stream_t *stream = calloc(1, sizeof(index_stream_t));
+
+    stream->target = target;
+    stream->index_id = index_id;
+
+    stream->db = database_create(index_path, INDEX_DATABASE);
+    database_open(stream->db);
+
+    if (target == INDEX_TO_SQLITE) {
+        database_t *search_db = database_create(search_index_path, FTS_DATABASE);
+        database_initialize(search_db);
+        free(search_db);
+
+        database_fts_attach(stream->db, search_index_path);
+    }
+
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+
+    pthread_create(&stream->thread, NULL, index_stream_thread, stream);
+
+    return stream;
+}
+
+void index_stream_push(void *arg, const int *doc_ids, int count) {
+    index_stream_t *stream = arg;
+
+    pthread_mutex_lock(&stream->mutex);
+    if (stream->count + count > stream->capacity) {
+        stream->capacity = MAX(stream->capacity * 2, stream->count + count);
+        stream->doc_ids = realloc(stream->doc_ids, sizeof(int) * stream->capacity);
+    }
+    memcpy(stream->doc_ids + stream->count, doc_ids, sizeof(int) * count);
+    stream->count += count;
+
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+void index_stream_destroy(index_stream_t *stream) {
+    pthread_mutex_lock(&stream->mutex);
+    stream->closed = TRUE;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+
+    pthread_join(stream->thread, NULL);
+
+    LOG_INFOF("index_stream.c", "Indexed %ld documents during the scan", stream->document_count);
+
+    if (stream->target == INDEX_TO_SQLITE) {
+        database_fts_detach(stream->db);
+    }
+    database_close(stream->db, FALSE);
+
+    pthread_mutex_destroy(&stream->mutex);
+    pthread_cond_destroy(&stream->cond);
+    free(stream->doc_ids);
+    free(stream);
+}
@@ -0,0 +1,37 @@
+#ifndef SIST2_INDEX_STREAM_H
+#define SIST2_INDEX_STREAM_H
+
+#include "src/sist.h"
+
+typedef enum {
+    INDEX_TO_NONE,
+    INDEX_TO_ES,
+    INDEX_TO_SQLITE,
+} index_target_t;
+
+/**
+ * Indexes the documents of a scan as soon as the database writer has committed them,
+ * while the scan is still running.
+ *
+ * Elasticsearch documents are sent as bulk line jobs to IndexCtx.pool, documents are added
+ * to the SQLite search index by the thread of the stream.
+ */
+typedef struct index_stream index_stream_t;
+
+/**
+ * @param search_index_path Only for INDEX_TO_SQLITE
+ */
+index_stream_t *index_stream_create(const char *index_path, index_target_t target, const char *search_index_path,
+                                    int index_id);
+
+/**
+ * database_writer_commit_callback_t
+ */
+void index_stream_push(void *stream, const int *doc_ids, int count);
+
+/**
+ * Index the documents that are still pending, must be called after the database writer was destroyed
+ */
+void index_stream_destroy(index_stream_t *stream);
+
+#endif
@@ -0,0 +1,210 @@
+#include "inode_dedup.h"
+#include "serialize.h"
+#include "src/ctx.h"
+
+#include <pthread.h>
+
+#define INODE_TABLE_INITIAL_CAPACITY 1024
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    /** NULL if the slot is empty */
+    char *path;
+} inode_entry_t;
+
+/**
+ * Open addressing, linear probing. Kept at most half full.
+ */
+typedef struct {
+    inode_entry_t *entries;
+    size_t capacity;
+    size_t count;
+} inode_table_t;
+
+typedef struct {
+    char *path;
+    char *original;
+    int mtime;
+    long size;
+} inode_duplicate_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    /** Directories, to find bind mounts */
+    inode_table_t dirs;
+    /** Files with more than one link */
+    inode_table_t files;
+
+    inode_duplicate_t *duplicates;
+    int duplicate_count;
+    int duplicate_capacity;
+} InodeDedup;
+
+static void inode_table_init(inode_table_t *table) {
+    table->capacity = INODE_TABLE_INITIAL_CAPACITY;
+    table->count = 0;
+    table->entries = calloc(table->capacity, sizeof(inode_entry_t));
+}
+
+static void inode_table_destroy(inode_table_t *table) {
+    for (size_t i = 0; i < table->capacity; i++) {
+        free(table->entries[i].path);
+    }
+    free(table->entries);
+    table->entries = NULL;
+}
+
+static size_t inode_hash(dev_t dev, ino_t ino) {
+    unsigned long h = (unsigned long) ino * 0x9E3779B97F4A7C15UL ^ (unsigned long) dev;
+    return (size_t) (h ^ (h >> 29));
+}
+
+static inode_entry_t *inode_table_slot(inode_entry_t *entries, size_t capacity, dev_t dev, ino_t ino) {
+    size_t i = inode_hash(dev, ino) & (capacity - 1);
+
+    while (entries[i].path != NULL && (entries[i].dev != dev || entries[i].ino != ino)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &entries[i];
+}
+
+/**
+ * @return the path that was recorded first for this inode, or NULL if path was recorded
+ */
+static const char *inode_table_put(inode_table_t *table, dev_t dev, ino_t ino, const char *path) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        size_t new_capacity = table->capacity * 2;
+        inode_entry_t *new_entries = calloc(new_capacity, sizeof(inode_entry_t));
+
+        for (size_t i = 0; i < table->capacity; i++) {
+            inode_entry_t *entry = &table->entries[i];
+            if (entry->path != NULL) {
+                *inode_table_slot(new_entries, new_capacity, entry->dev, entry->ino) = *entry;
+            }
+        }
+        free(table->entries);
+        table->entries = new_entries;
+        table->capacity = new_capacity;
+    }
+
+    inode_entry_t *entry = inode_table_slot(table->entries, table->capacity, dev, ino);
+    if (entry->path != NULL) {
+        return entry->path;
+    }
+
+    entry->dev = dev;
+    entry->ino = ino;
+    entry->path = strdup(path);
+    table->count += 1;
+
+    return NULL;
+}
+
+void inode_dedup_init() {
+    pthread_mutex_init(&InodeDedup.mutex, NULL);
+    inode_table_init(&InodeDedup.dirs);
+    inode_table_init(&InodeDedup.files);
+
+    InodeDedup.duplicates = NULL;
+    InodeDedup.duplicate_count = 0;
+    InodeDedup.duplicate_capacity = 0;
+}
+
+char *inode_dedup_dir(const char *path, const struct stat *info) {
+    char *original = NULL;
+
+    pthread_mutex_lock(&InodeDedup.mutex);
+    const char *first_path = inode_table_put(&InodeDedup.dirs, info->st_dev, info->st_ino, path);
+    if (first_path != NULL && strcmp(first_path, path) != 0) {
+        original = strdup(first_path);
+    }
+    pthread_mutex_unlock(&InodeDedup.mutex);
+
+    if (original != NULL) {
+        LOG_DEBUGF("inode_dedup.c", "%s is a bind mount of %s", path, original);
+    }
+
+    return original;
+}
+
+char *inode_dedup_file(const char *filepath, const struct stat *info, const char *alias_dir) {
+
+    if (info->st_nlink > 1) {
+        char *original = NULL;
+
+        pthread_mutex_lock(&InodeDedup.mutex);
+        const char *first_path = inode_table_put(&InodeDedup.files, info->st_dev, info->st_ino, filepath);
+        if (first_path != NULL) {
+            original = strdup(first_path);
+        }
+        pthread_mutex_unlock(&InodeDedup.mutex);
+
+        return original;
+    }
+
+    // The only link of this file is the one in the original directory
+    if (alias_dir != NULL) {
+        const char *name = strrchr(filepath, '/') + 1;
+
+        char *original = malloc(strlen(alias_dir) + 1 + strlen(name) + 1);
+        sprintf(original, "%s/%s", alias_dir, name);
+        return original;
+    }
+
+    return NULL;
+}
+
+void inode_dedup_add_duplicate(const char *filepath, char *original, int mtime, long size) {
+    pthread_mutex_lock(&InodeDedup.mutex);
+
+    if (InodeDedup.duplicate_count == InodeDedup.duplicate_capacity) {
+        InodeDedup.duplicate_capacity = MAX(INODE_TABLE_INITIAL_CAPACITY, InodeDedup.duplicate_capacity * 2);
+        InodeDedup.duplicates = realloc(InodeDedup.duplicates,
+                                        sizeof(inode_duplicate_t) * InodeDedup.duplicate_capacity);
+    }
+
+    inode_duplicate_t *duplicate = &InodeDedup.duplicates[InodeDedup.duplicate_count++];
+    duplicate->path = strdup(filepath);
+    duplicate->original = original;
+    duplicate->mtime = mtime;
+    duplicate->size = size;
+
+    pthread_mutex_unlock(&InodeDedup.mutex);
+}
+
+void inode_dedup_flush(database_writer_t *writer) {
+    int parsed_count = 0;
+
+    for (int i = 0; i < InodeDedup.duplicate_count; i++) {
+        inode_duplicate_t *duplicate = &InodeDedup.duplicates[i];
+
+        char *json_data = serialize_duplicate(duplicate->path);
+        if (!database_writer_write_duplicate(writer, duplicate->path, duplicate->original, duplicate->mtime,
+                                             json_data)) {
+            parse_job_t *job = create_parse_job(duplicate->path, duplicate->mtime, duplicate->size);
+            tpool_add_work(ScanCtx.pool, &(job_t) {
+                    .type = JOB_PARSE_JOB,
+                    .parse_job = job
+            });
+            free(job);
+            parsed_count += 1;
+        }
+        free(json_data);
+
+        free(duplicate->path);
+        free(duplicate->original);
+    }
+
+    LOG_INFOF("inode_dedup.c", "Found %d hard links or files in bind mounts, parsed once (%s), %d parsed again",
+              InodeDedup.duplicate_count, ScanCtx.inode_dedup == INODE_DEDUP_LINK ? "link" : "copy", parsed_count);
+
+    free(InodeDedup.duplicates);
+    InodeDedup.duplicates = NULL;
+    InodeDedup.duplicate_count = 0;
+    InodeDedup.duplicate_capacity = 0;
+
+    inode_table_destroy(&InodeDedup.dirs);
+    inode_table_destroy(&InodeDedup.files);
+    pthread_mutex_destroy(&InodeDedup.mutex);
+}
@@ -0,0 +1,46 @@
+#ifndef SIST2_INODE_DEDUP_H
+#define SIST2_INODE_DEDUP_H
+
+#include "src/sist.h"
+#include "src/database/database.h"
+
+typedef enum {
+    INODE_DEDUP_OFF,
+    /** Duplicates get a copy of the metadata, their thumbnails are read from the original */
+    INODE_DEDUP_LINK,
+    /** Duplicates get a copy of the metadata and of the thumbnails */
+    INODE_DEDUP_COPY,
+} inode_dedup_mode_t;
+
+/**
+ * Must be called before the walk when ScanCtx.inode_dedup is not INODE_DEDUP_OFF
+ */
+void inode_dedup_init();
+
+/**
+ * Called for each directory of the walk, before its files
+ * @return the path of the directory with the same (st_dev, st_ino) that was walked first
+ *  (the directory is a bind mount of it), or NULL. Must be freed.
+ */
+char *inode_dedup_dir(const char *path, const struct stat *info);
+
+/**
+ * @param alias_dir the value returned by inode_dedup_dir() for the parent directory, can be NULL
+ * @return the path of the file with the same inode that will be parsed, or NULL if this file
+ *  must be parsed. Must be freed, or passed to inode_dedup_add_duplicate().
+ */
+char *inode_dedup_file(const char *filepath, const struct stat *info, const char *alias_dir);
+
+/**
+ * Record a file that will not be parsed, takes ownership of original
+ */
+void inode_dedup_add_duplicate(const char *filepath, char *original, int mtime, long size);
+
+/**
+ * Write the document rows of the duplicates, once the originals were sent to the writer.
+ * The duplicates of originals that were not written are queued as parse jobs.
+ * Releases the tables.
+ */
+void inode_dedup_flush(database_writer_t *writer);
+
+#endif
@@ -1,6 +1,7 @@
 #include "src/ctx.h"
 #include "serialize.h"
 #include "src/parsing/mime.h"
+#include "src/metrics.h"
 
 
 char *get_meta_key_text(enum metakey meta_key) {
@@ -74,6 +75,8 @@ char *get_meta_key_text(enum metakey meta_key) {
             return "exif_gps_latitude_dec";
         case MetaChecksum:
             return "checksum";
+        case MetaChecksumAlgorithm:
+            return "checksum_algorithm";
         default:
         LOG_FATALF("serialize.c", "FIXME: Unknown meta key: %d", meta_key);
     }
@@ -85,40 +88,66 @@ typedef struct {
 } linked_list_t;
 
 
-void write_document(document_t *doc) {
-    linked_list_t thumbnails_to_write = {.meta_head = NULL, .meta_tail = NULL};
-
-    cJSON *json = cJSON_CreateObject();
-    int buffer_size_guess = 8192;
-
-    // Ignore root directory in the file path
-    doc->ext = (short) (doc->ext - ScanCtx.index.desc.root_len);
-    doc->base = (short) (doc->base - ScanCtx.index.desc.root_len);
-    char filepath[PATH_MAX * 3];
-    strcpy(filepath, doc->filepath + ScanCtx.index.desc.root_len);
+/**
+ * name, path and extension of a document, relative to the root of the index
+ * @param base offset of the file name in filepath
+ * @param ext offset of the extension in filepath
+ */
+static void serialize_path(cJSON *json, const char *filepath, int base, int ext) {
+    char rel_filepath[PATH_MAX * 3];
+    strcpy(rel_filepath, filepath + ScanCtx.index.desc.root_len);
+    base -= ScanCtx.index.desc.root_len;
+    ext -= ScanCtx.index.desc.root_len;
 
-    cJSON_AddStringToObject(json, "extension", filepath + doc->ext);
+    cJSON_AddStringToObject(json, "extension", rel_filepath + ext);
 
     // Remove extension
-    if (*(filepath + doc->ext - 1) == '.') {
-        *(filepath + doc->ext - 1) = '\0';
+    if (*(rel_filepath + ext - 1) == '.') {
+        *(rel_filepath + ext - 1) = '\0';
     } else {
-        *(filepath + doc->ext) = '\0';
+        *(rel_filepath + ext) = '\0';
     }
 
     char filepath_escaped[PATH_MAX * 3];
-    str_escape(filepath_escaped, filepath + doc->base);
+    str_escape(filepath_escaped, rel_filepath + base);
 
     cJSON_AddStringToObject(json, "name", filepath_escaped);
 
-    if (doc->base > 0) {
-        *(filepath + doc->base - 1) = '\0';
+    if (base > 0) {
+        *(rel_filepath + base - 1) = '\0';
 
-        str_escape(filepath_escaped, filepath);
+        str_escape(filepath_escaped, rel_filepath);
         cJSON_AddStringToObject(json, "path", filepath_escaped);
     } else {
         cJSON_AddStringToObject(json, "path", "");
     }
+}
+
+char *serialize_duplicate(const char *filepath) {
+    cJSON *json = cJSON_CreateObject();
+
+    const char *slash = strrchr(filepath, '/');
+    int base = slash == NULL ? 0 : (int) (slash - filepath + 1);
+
+    const char *dot = strrchr(filepath + base, '.');
+    int ext = dot == NULL ? (int) strlen(filepath) : (int) (dot - filepath + 1);
+
+    serialize_path(json, filepath, base, ext);
+
+    char *json_str = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    return json_str;
+}
+
+void write_document(document_t *doc) {
+    long serialize_start = metrics_time_us();
+    linked_list_t thumbnails_to_write = {.meta_head = NULL, .meta_tail = NULL};
+
+    cJSON *json = cJSON_CreateObject();
+    int buffer_size_guess = 8192;
+
+    serialize_path(json, doc->filepath, doc->base, doc->ext);
 
     // Metadata
     meta_line_t *meta = doc->meta_head;
@@ -161,6 +190,7 @@ void write_document(document_t *doc) {
             case MetaExifGpsLatitudeDec:
             case MetaExifGpsLatitudeRef:
             case MetaChecksum:
+            case MetaChecksumAlgorithm:
             case MetaMediaComment:
             case MetaTitle: {
                 cJSON_AddStringToObject(json, get_meta_key_text(meta->key), meta->str_val);
@@ -183,20 +213,16 @@ void write_document(document_t *doc) {
 
     char *json_str = cJSON_PrintBuffered(json, buffer_size_guess, FALSE);
     cJSON_Delete(json);
+    metrics_record_stage(METRICS_STAGE_SERIALIZE, 1, metrics_time_us() - serialize_start);
 
-    int doc_id = database_write_document(ProcData.index_db, doc, json_str);
+    database_writer_write_document(ScanCtx.index_writer, doc, json_str, thumbnails_to_write.meta_head);
     free(doc);
     free(json_str);
 
-    // Write thumbnails
     meta = thumbnails_to_write.meta_head;
-    int index_num = 0;
     while (meta != NULL) {
-        database_write_thumbnail(ProcData.index_db, doc_id, index_num, meta->str_val, meta->size);
-
         meta_line_t *tmp = meta;
         meta = meta->next;
         free(tmp);
-        index_num += 1;
     }
 }
\ No newline at end of file
@@ -5,4 +5,9 @@
 
 void write_document(document_t *doc);
 
+/**
+ * @return the name, path and extension fields of a file that was not parsed, as JSON. Must be freed.
+ */
+char *serialize_duplicate(const char *filepath);
+
 #endif
@@ -0,0 +1,257 @@
+#include "uring.h"
+#include "src/ctx.h"
+
+#ifdef SIST_IO_URING
+
+#include <liburing.h>
+#include <sys/sysmacros.h>
+
+typedef enum {
+    URING_UNINITIALIZED,
+    URING_READY,
+    URING_UNAVAILABLE,
+} uring_state_t;
+
+__thread struct io_uring uring;
+__thread uring_state_t uring_state = URING_UNINITIALIZED;
+
+static int uring_warning_logged = FALSE;
+
+int uring_available() {
+    if (uring_state == URING_UNINITIALIZED) {
+        int ret = io_uring_queue_init(URING_QUEUE_DEPTH, &uring, 0);
+        if (ret < 0) {
+            uring_state = URING_UNAVAILABLE;
+            if (!uring_warning_logged) {
+                uring_warning_logged = TRUE;
+                LOG_WARNINGF("uring.c", "io_uring is not available (%s), using regular reads", strerror(-ret));
+            }
+        } else {
+            uring_state = URING_READY;
+        }
+    }
+
+    return uring_state == URING_READY;
+}
+
+/**
+ * Give up on io_uring for this worker after an error of the ring itself
+ */
+static void uring_disable(int err) {
+    io_uring_queue_exit(&uring);
+    uring_state = URING_UNAVAILABLE;
+    LOG_WARNINGF("uring.c", "io_uring error (%s), using regular reads", strerror(-err));
+}
+
+/**
+ * Submit the prepared entries and collect their results by user_data.
+ * On error, the completions that are already there are collected and the ring is torn down:
+ * a later batch must not see them with its own user_data.
+ * @return FALSE if some of the entries were not completed, their result is unchanged
+ */
+static int uring_submit_and_wait(int count, int *results) {
+    int ret = io_uring_submit_and_wait(&uring, count);
+
+    int reaped = 0;
+    while (ret >= 0 && reaped < count) {
+        struct io_uring_cqe *cqe;
+        ret = io_uring_wait_cqe(&uring, &cqe);
+        if (ret == -EINTR || ret == -EAGAIN) {
+            ret = 0;
+            continue;
+        }
+        if (ret < 0) {
+            break;
+        }
+        results[cqe->user_data] = cqe->res;
+        io_uring_cqe_seen(&uring, cqe);
+        reaped += 1;
+    }
+
+    if (reaped == count) {
+        return TRUE;
+    }
+
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&uring, &cqe) == 0) {
+        results[cqe->user_data] = cqe->res;
+        io_uring_cqe_seen(&uring, cqe);
+    }
+    uring_disable(ret);
+    return FALSE;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *info) {
+    memset(info, 0, sizeof(struct stat));
+    info->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    info->st_ino = stx->stx_ino;
+    info->st_nlink = stx->stx_nlink;
+    info->st_mode = stx->stx_mode;
+    info->st_size = (off_t) stx->stx_size;
+    info->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    info->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+int uring_fstatat_batch(int dirfd, uring_stat_t **stats, int count) {
+    if (!uring_available()) {
+        return FALSE;
+    }
+
+    struct statx stx[URING_QUEUE_DEPTH];
+    int results[URING_QUEUE_DEPTH];
+
+    for (int start = 0; start < count; start += URING_QUEUE_DEPTH) {
+        int n = MIN(URING_QUEUE_DEPTH, count - start);
+
+        for (int i = 0; i < n; i++) {
+            results[i] = -ECANCELED;
+        }
+
+        // Entries that were not completed are done with fstatat(), also after an error of the ring
+        if (uring_state == URING_READY) {
+            for (int i = 0; i < n; i++) {
+                struct io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+                io_uring_prep_statx(sqe, dirfd, stats[start + i]->name, AT_SYMLINK_NOFOLLOW,
+                                    STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO | STATX_NLINK,
+                                    &stx[i]);
+                sqe->user_data = i;
+            }
+            uring_submit_and_wait(n, results);
+        }
+
+        for (int i = 0; i < n; i++) {
+            uring_stat_t *stat = stats[start + i];
+
+            if (results[i] == -EINVAL || results[i] == -ECANCELED) {
+                // statx is not supported by this kernel's io_uring
+                stat->ret = fstatat(dirfd, stat->name, &stat->info, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : -errno;
+            } else {
+                stat->ret = results[i];
+                if (results[i] == 0) {
+                    statx_to_stat(&stx[i], &stat->info);
+                }
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+static int should_prefetch(job_t *job) {
+    return job->type == JOB_PARSE_JOB
+           && job->parse_job->vfile.is_fs_file
+           && job->parse_job->arc_entry_count == 0
+           && job->parse_job->vfile.fd == -1
+           && job->parse_job->vfile.st_size > 0;
+}
+
+void uring_prefetch_jobs(job_t **jobs, int count) {
+    if (ScanCtx.fast || !uring_available()) {
+        return;
+    }
+
+    vfile_t *files[URING_QUEUE_DEPTH];
+    int results[URING_QUEUE_DEPTH];
+
+    int i = 0;
+    while (i < count) {
+        int n = 0;
+        for (; i < count && n < URING_QUEUE_DEPTH; i++) {
+            if (should_prefetch(jobs[i])) {
+                files[n++] = &jobs[i]->parse_job->vfile;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+
+        // Open all the files...
+        for (int j = 0; j < n; j++) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+            io_uring_prep_openat(sqe, AT_FDCWD, files[j]->filepath, O_RDONLY, 0);
+            sqe->user_data = j;
+            results[j] = -ECANCELED;
+        }
+        if (!uring_submit_and_wait(n, results)) {
+            // Files that are not open yet are opened by fs_read()
+            for (int j = 0; j < n; j++) {
+                if (results[j] >= 0) {
+                    files[j]->fd = results[j];
+                }
+            }
+            return;
+        }
+
+        // ... then read their first block
+        int read_count = 0;
+        for (int j = 0; j < n; j++) {
+            vfile_t *f = files[j];
+            if (results[j] < 0) {
+                // fs_read() will try again and report the error
+                continue;
+            }
+
+            f->fd = results[j];
+
+            size_t size = f->st_size <= URING_PREFETCH_SMALL_FILE_SIZE ? f->st_size : URING_PREFETCH_SIZE;
+            f->head = malloc(size);
+            f->head_size = 0;
+
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&uring);
+            io_uring_prep_read(sqe, f->fd, f->head, size, 0);
+            sqe->user_data = j;
+            results[j] = -ECANCELED;
+            read_count += 1;
+        }
+        if (read_count == 0) {
+            continue;
+        }
+        int read_ok = uring_submit_and_wait(read_count, results);
+
+        for (int j = 0; j < n; j++) {
+            vfile_t *f = files[j];
+            if (f->head == NULL) {
+                continue;
+            }
+
+            if (results[j] == -ECANCELED && !read_ok) {
+                // The read may still be running after the teardown, the buffer is not freed
+                f->head = NULL;
+            } else if (results[j] < 0) {
+                free(f->head);
+                f->head = NULL;
+            } else {
+                f->head_size = results[j];
+            }
+        }
+
+        if (!read_ok) {
+            return;
+        }
+    }
+}
+
+void uring_cleanup() {
+    if (uring_state == URING_READY) {
+        io_uring_queue_exit(&uring);
+    }
+    uring_state = URING_UNINITIALIZED;
+}
+
+#else
+
+int uring_available() {
+    return FALSE;
+}
+
+int uring_fstatat_batch(int dirfd, uring_stat_t **stats, int count) {
+    return FALSE;
+}
+
+void uring_prefetch_jobs(job_t **jobs, int count) {
+}
+
+void uring_cleanup() {
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef SIST2_URING_H
+#define SIST2_URING_H
+
+#include "src/sist.h"
+#include "src/tpool.h"
+
+/**
+ * Files up to this size are read entirely before they are parsed...
+ */
+#define URING_PREFETCH_SMALL_FILE_SIZE (256 * 1024)
+/**
+ * ... of the larger files, only this many bytes (enough for mime detection)
+ */
+#define URING_PREFETCH_SIZE (4096 * 6)
+
+#define URING_QUEUE_DEPTH 64
+
+typedef struct {
+    const char *name;
+    struct stat info;
+    /** 0 or -errno */
+    int ret;
+} uring_stat_t;
+
+/**
+ * @return FALSE if io_uring is not available in this build or on this kernel
+ */
+int uring_available();
+
+/**
+ * Same as fstatat(dirfd, name, info, AT_SYMLINK_NOFOLLOW) for each entry, in batches
+ * @return FALSE if io_uring is not available, the entries were not stat'ed
+ */
+int uring_fstatat_batch(int dirfd, uring_stat_t **stats, int count);
+
+/**
+ * Open the files of the parse jobs and read their first block (the whole file for
+ * small files) in batches, into the head block of their vfile.
+ * Does nothing if io_uring is not available.
+ */
+void uring_prefetch_jobs(job_t **jobs, int count);
+
+/**
+ * Release the io_uring instance of the calling thread
+ */
+void uring_cleanup();
+
+#endif
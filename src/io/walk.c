@@ -1,15 +1,97 @@
 #include "walk.h"
 #include "src/ctx.h"
 #include "src/parsing/fs_util.h"
+#include "uring.h"
+#include "inode_dedup.h"
 
 #include <ftw.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
 
 #define STR_STARTS_WITH(x, y) (strncmp(y, x, strlen(y) - 1) == 0)
 
 
-int sub_strings[30];
-#define EXCLUDED(str) (pcre_exec(ScanCtx.exclude, ScanCtx.exclude_extra, str, strlen(str), 0, 0, sub_strings, sizeof(sub_strings)) >= 0)
+// pcre_exec() writes to the vector, each walker thread needs its own
+__thread int sub_strings[30];
+#define EXCLUDED(str) (pcre_exec(ScanCtx.exclude, ScanCtx.exclude_extra, str, strlen(str), 0, 0, sub_strings, sizeof(sub_strings) / sizeof(int)) >= 0)
+
+static struct {
+    _Atomic long file_count;
+    _Atomic long dir_count;
+} WalkStats;
+
+/**
+ * Unchanged files of an incremental scan are marked here instead of being sent to the workers
+ */
+static int is_unchanged(const char *filepath, const struct stat *info) {
+    if (ScanCtx.incremental_map == NULL) {
+        return FALSE;
+    }
+
+    int mtime = MAX((int) info->st_mtim.tv_sec, 0);
+    return incremental_map_mark(ScanCtx.incremental_map, filepath + ScanCtx.index.desc.root_len, mtime);
+}
+
+/**
+ * @param alias_dir original of the parent directory if it is a bind mount, see inode_dedup_dir()
+ */
+static void add_file(const char *filepath, const struct stat *info, const char *alias_dir) {
+    WalkStats.file_count += 1;
+
+    // The first path of an inode is registered even if it is unchanged, its other paths must not be parsed
+    char *original = NULL;
+    if (ScanCtx.inode_dedup != INODE_DEDUP_OFF) {
+        original = inode_dedup_file(filepath, info, alias_dir);
+    }
+
+    if (is_unchanged(filepath, info)) {
+        free(original);
+        return;
+    }
+
+    if (original != NULL) {
+        inode_dedup_add_duplicate(filepath, original, (int) info->st_mtim.tv_sec, info->st_size);
+        return;
+    }
+
+    parse_job_t *job = create_parse_job(filepath, (int) info->st_mtim.tv_sec, info->st_size);
+
+    tpool_add_work(ScanCtx.pool, &(job_t) {
+            .type = JOB_PARSE_JOB,
+            .parse_job = job
+    });
+    free(job);
+}
+
+/**
+ * nftw() walks depth-first from a single thread: the parent of a file is
+ * the last directory that was entered on the level above it
+ */
+static char **nftw_alias_dirs = NULL;
+static int nftw_alias_dir_count = 0;
+
+static void nftw_set_alias_dir(int level, char *alias_dir) {
+    if (level >= nftw_alias_dir_count) {
+        nftw_alias_dirs = realloc(nftw_alias_dirs, sizeof(char *) * (level + 1));
+        memset(nftw_alias_dirs + nftw_alias_dir_count, 0, sizeof(char *) * (level + 1 - nftw_alias_dir_count));
+        nftw_alias_dir_count = level + 1;
+    }
+
+    free(nftw_alias_dirs[level]);
+    nftw_alias_dirs[level] = alias_dir;
+}
+
+static void nftw_free_alias_dirs() {
+    for (int i = 0; i < nftw_alias_dir_count; i++) {
+        free(nftw_alias_dirs[i]);
+    }
+    free(nftw_alias_dirs);
+    nftw_alias_dirs = NULL;
+    nftw_alias_dir_count = 0;
+}
 
 int handle_entry(const char *filepath, const struct stat *info, int typeflag, struct FTW *ftw) {
 
@@ -32,13 +114,15 @@ int handle_entry(const char *filepath, const struct stat *info, int typeflag, st
     }
 
     if (typeflag == FTW_F && S_ISREG(info->st_mode)) {
-        parse_job_t *job = create_parse_job(filepath, (int) info->st_mtim.tv_sec, info->st_size);
+        const char *alias_dir = ftw->level > 0 && ftw->level <= nftw_alias_dir_count
+                                ? nftw_alias_dirs[ftw->level - 1] : NULL;
+        add_file(filepath, info, alias_dir);
+    } else if (typeflag == FTW_D) {
+        WalkStats.dir_count += 1;
 
-        tpool_add_work(ScanCtx.pool, &(job_t) {
-                .type = JOB_PARSE_JOB,
-                .parse_job = job
-        });
-        free(job);
+        if (ScanCtx.inode_dedup != INODE_DEDUP_OFF) {
+            nftw_set_alias_dir(ftw->level, inode_dedup_dir(filepath, info));
+        }
     }
 
     return FTW_CONTINUE;
@@ -46,8 +130,330 @@ int handle_entry(const char *filepath, const struct stat *info, int typeflag, st
 
 #define MAX_FILE_DESCRIPTORS 64
 
-int walk_directory_tree(const char *dirpath) {
-    return nftw(dirpath, handle_entry, MAX_FILE_DESCRIPTORS, FTW_PHYS | FTW_ACTIONRETVAL);
+typedef struct {
+    char *path;
+    int level;
+} walk_dir_t;
+
+/**
+ * Directories waiting to be read. The owner thread pushes and pops at the bottom
+ * (depth-first, keeps the stack small) and idle threads steal from the top,
+ * which holds the directories closest to the root and thus the largest subtrees.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    walk_dir_t *dirs;
+    int top;
+    int bottom;
+    int capacity;
+} walk_deque_t;
+
+#define WALK_DEQUE_INITIAL_CAPACITY 256
+#define GETDENTS_BUF_SIZE (64 * 1024)
+
+static struct {
+    walk_deque_t *deques;
+    int thread_count;
+    /** Directories that were pushed but not read yet */
+    _Atomic int pending_count;
+    _Atomic int error;
+} WalkCtx;
+
+typedef struct {
+    int type;
+    uring_stat_t stat;
+} walk_entry_t;
+
+#define WALK_MAX_ENTRIES (GETDENTS_BUF_SIZE / 24)
+
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+
+static void walk_deque_push(walk_deque_t *deque, char *path, int level) {
+    WalkCtx.pending_count += 1;
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom == deque->capacity) {
+        if (deque->top > 0) {
+            memmove(deque->dirs, deque->dirs + deque->top, (deque->bottom - deque->top) * sizeof(walk_dir_t));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            deque->capacity *= 2;
+            deque->dirs = realloc(deque->dirs, deque->capacity * sizeof(walk_dir_t));
+        }
+    }
+
+    deque->dirs[deque->bottom].path = path;
+    deque->dirs[deque->bottom].level = level;
+    deque->bottom += 1;
+    pthread_mutex_unlock(&deque->mutex);
+}
+
+static int walk_deque_pop(walk_deque_t *deque, walk_dir_t *dir, int steal) {
+    int ret = FALSE;
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->top != deque->bottom) {
+        if (steal) {
+            *dir = deque->dirs[deque->top];
+            deque->top += 1;
+        } else {
+            deque->bottom -= 1;
+            *dir = deque->dirs[deque->bottom];
+        }
+
+        if (deque->top == deque->bottom) {
+            deque->top = 0;
+            deque->bottom = 0;
+        }
+        ret = TRUE;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return ret;
+}
+
+static int walk_next_dir(int thread_id, walk_dir_t *dir) {
+    if (walk_deque_pop(&WalkCtx.deques[thread_id], dir, FALSE)) {
+        return TRUE;
+    }
+
+    for (int i = 1; i < WalkCtx.thread_count; i++) {
+        if (walk_deque_pop(&WalkCtx.deques[(thread_id + i) % WalkCtx.thread_count], dir, TRUE)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Files (and entries of unknown type) need to be stat'ed, in a single batch with io_uring
+ */
+static void walk_stat_entries(int fd, walk_entry_t *entries, int count) {
+    uring_stat_t *to_stat[WALK_MAX_ENTRIES];
+    int stat_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (entries[i].type == DT_UNKNOWN || entries[i].type == DT_REG) {
+            to_stat[stat_count++] = &entries[i].stat;
+        }
+    }
+
+    if (!ScanCtx.io_uring || !uring_fstatat_batch(fd, to_stat, stat_count)) {
+        for (int i = 0; i < stat_count; i++) {
+            to_stat[i]->ret = fstatat(fd, to_stat[i]->name, &to_stat[i]->info, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : -errno;
+        }
+    }
+}
+
+/**
+ * Same semantics as handle_entry() with FTW_PHYS: symlinks are never followed
+ * and the exclude pattern is matched against the full path of files and directories.
+ */
+static void walk_read_dir(int thread_id, walk_dir_t *dir, char *buf, walk_entry_t *entries) {
+    int fd = openat(AT_FDCWD, dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        if (dir->level == 0) {
+            WalkCtx.error = errno;
+        }
+        LOG_DEBUGF("walk.c", "Could not open directory %s (%s)", dir->path, strerror(errno));
+        return;
+    }
+
+    WalkStats.dir_count += 1;
+
+    char *alias_dir = NULL;
+    struct stat dir_info;
+    if (ScanCtx.inode_dedup != INODE_DEDUP_OFF && fstat(fd, &dir_info) == 0) {
+        alias_dir = inode_dedup_dir(dir->path, &dir_info);
+    }
+
+    char filepath[PATH_MAX];
+    size_t dir_len = strlen(dir->path);
+    memcpy(filepath, dir->path, dir_len);
+    if (filepath[dir_len - 1] != '/') {
+        filepath[dir_len++] = '/';
+    }
+
+    int child_level = dir->level + 1;
+
+    while (TRUE) {
+        long nread = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF_SIZE);
+        if (nread == -1) {
+            LOG_ERRORF("walk.c", "Could not read directory %s (%s)", dir->path, strerror(errno));
+            break;
+        }
+        if (nread == 0) {
+            break;
+        }
+
+        if (child_level > ScanCtx.depth) {
+            continue;
+        }
+
+        int entry_count = 0;
+        for (long offset = 0; offset < nread;) {
+            linux_dirent64_t *entry = (linux_dirent64_t *) (buf + offset);
+            offset += entry->d_reclen;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+
+            entries[entry_count].type = entry->d_type;
+            entries[entry_count].stat.name = entry->d_name;
+            entry_count += 1;
+        }
+
+        walk_stat_entries(fd, entries, entry_count);
+
+        for (int i = 0; i < entry_count; i++) {
+            walk_entry_t *entry = &entries[i];
+
+            size_t name_len = strlen(entry->stat.name);
+            if (dir_len + name_len + 1 > sizeof(filepath)) {
+                LOG_ERRORF("walk.c", "Path is too long: %s%s", dir->path, entry->stat.name);
+                continue;
+            }
+            memcpy(filepath + dir_len, entry->stat.name, name_len + 1);
+
+            struct stat *info = &entry->stat.info;
+            int type = entry->type;
+
+            if (type == DT_UNKNOWN || type == DT_REG) {
+                if (entry->stat.ret != 0) {
+                    LOG_DEBUGF("walk.c", "Could not stat file %s (%s)", filepath, strerror(-entry->stat.ret));
+                    continue;
+                }
+                type = S_ISREG(info->st_mode) ? DT_REG : S_ISDIR(info->st_mode) ? DT_DIR : DT_UNKNOWN;
+            }
+
+            if (type != DT_REG && type != DT_DIR) {
+                continue;
+            }
+
+            if (ScanCtx.exclude != NULL && EXCLUDED(filepath)) {
+                LOG_DEBUGF("walk.c", "Excluded: %s", filepath);
+                continue;
+            }
+
+            if (type == DT_REG) {
+                add_file(filepath, info, alias_dir);
+            } else if (child_level < ScanCtx.depth) {
+                walk_deque_push(&WalkCtx.deques[thread_id], strdup(filepath), child_level);
+            } else {
+                // Its content would be past --depth
+                WalkStats.dir_count += 1;
+            }
+        }
+    }
+
+    close(fd);
+    free(alias_dir);
+}
+
+static void *walk_thread(void *arg) {
+    int thread_id = (int) (long) arg;
+    char *buf = malloc(GETDENTS_BUF_SIZE);
+    walk_entry_t *entries = malloc(sizeof(walk_entry_t) * WALK_MAX_ENTRIES);
+
+    while (TRUE) {
+        walk_dir_t dir;
+
+        if (!walk_next_dir(thread_id, &dir)) {
+            if (WalkCtx.pending_count == 0) {
+                break;
+            }
+            usleep(200);
+            continue;
+        }
+
+        walk_read_dir(thread_id, &dir, buf, entries);
+        free(dir.path);
+
+        WalkCtx.pending_count -= 1;
+    }
+
+    free(buf);
+    free(entries);
+    uring_cleanup();
+    return NULL;
+}
+
+static int walk_directory_tree_parallel(const char *dirpath, int thread_count) {
+    WalkCtx.thread_count = thread_count;
+    WalkCtx.pending_count = 0;
+    WalkCtx.error = 0;
+    WalkCtx.deques = malloc(sizeof(walk_deque_t) * thread_count);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_mutex_init(&WalkCtx.deques[i].mutex, NULL);
+        WalkCtx.deques[i].capacity = WALK_DEQUE_INITIAL_CAPACITY;
+        WalkCtx.deques[i].dirs = malloc(sizeof(walk_dir_t) * WALK_DEQUE_INITIAL_CAPACITY);
+        WalkCtx.deques[i].top = 0;
+        WalkCtx.deques[i].bottom = 0;
+    }
+
+    if (ScanCtx.exclude != NULL && EXCLUDED(dirpath)) {
+        LOG_DEBUGF("walk.c", "Excluded: %s", dirpath);
+    } else {
+        walk_deque_push(&WalkCtx.deques[0], strdup(dirpath), 0);
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, walk_thread, (void *) (long) i);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_mutex_destroy(&WalkCtx.deques[i].mutex);
+        free(WalkCtx.deques[i].dirs);
+    }
+    free(WalkCtx.deques);
+
+    if (WalkCtx.error != 0) {
+        errno = WalkCtx.error;
+        return -1;
+    }
+    return 0;
+}
+
+int walk_directory_tree(const char *dirpath, int thread_count) {
+    WalkStats.file_count = 0;
+    WalkStats.dir_count = 0;
+
+    long walk_time;
+    TIMER_INIT();
+    TIMER_START();
+
+    int ret;
+    // nftw() stats files one by one, the parallel walker can batch them with io_uring
+    if (thread_count > 1 || ScanCtx.io_uring) {
+        ret = walk_directory_tree_parallel(dirpath, thread_count);
+    } else {
+        ret = nftw(dirpath, handle_entry, MAX_FILE_DESCRIPTORS, FTW_PHYS | FTW_ACTIONRETVAL);
+        nftw_free_alias_dirs();
+    }
+
+    TIMER_END(walk_time);
+    double walk_time_s = (double) MAX(walk_time, 1) / 1000000;
+
+    LOG_INFOF("walk.c", "Enumerated %ld files in %ld directories in %.2fs (%.0f files/s, %.0f dirs/s, %d walker threads)",
+              (long) WalkStats.file_count, (long) WalkStats.dir_count, walk_time_s,
+              (double) WalkStats.file_count / walk_time_s, (double) WalkStats.dir_count / walk_time_s,
+              MAX(thread_count, 1));
+
+    return ret;
 }
 
 int iterate_file_list(void *input_file) {
@@ -87,15 +493,9 @@ int iterate_file_list(void *input_file) {
             LOG_FATALF("walk.c", "File is not a children of root folder (%s): %s", ScanCtx.index.desc.root, buf);
         }
 
-        parse_job_t *job = create_parse_job(absolute_path, (int) info.st_mtim.tv_sec, info.st_size);
+        add_file(absolute_path, &info, NULL);
         free(absolute_path);
-
-        tpool_add_work(ScanCtx.pool, &(job_t) {
-                .type = JOB_PARSE_JOB,
-                .parse_job = job
-        });
-        free(job);
     }
 
     return 0;
-}
\ No newline at end of file
+}
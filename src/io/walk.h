@@ -4,7 +4,10 @@
 #undef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 500
 
-int walk_directory_tree(const char *);
+/**
+ * @param thread_count more than 1 uses the parallel walker instead of nftw()
+ */
+int walk_directory_tree(const char *dirpath, int thread_count);
 
 int iterate_file_list(void* input_file);
 
@@ -0,0 +1,614 @@
+#include "job_ring.h"
+#include "util.h"
+
+#include <limits.h>
+#include <sys/syscall.h>
+
+#define RECORD_EMPTY 0
+#define RECORD_WRITTEN 1
+#define RECORD_CONSUMED 2
+#define RECORD_PADDING 3
+
+#define RECORD_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+typedef struct {
+    _Atomic uint32_t state;
+    _Atomic uint32_t size;
+} job_record_header_t;
+
+typedef struct {
+    job_record_header_t header;
+    job_type_t type;
+    int mtime;
+    long st_size;
+    int arc_entry_start;
+    int arc_entry_count;
+    int line_type;
+    char sid[SIST_SID_LEN];
+    char data[0];
+} job_record_t;
+
+typedef struct {
+    job_record_header_t header;
+    size_t len;
+    char data[0];
+} data_record_t;
+
+static job_record_header_t *record_at(job_ring_t *ring, size_t pos) {
+    return (job_record_header_t *) (ring->data + (pos % ring->capacity));
+}
+
+void job_ring_init(job_ring_t *ring, void *data, size_t capacity) {
+    ring->data = data;
+    ring->capacity = capacity & ~((size_t) 7);
+    memset(ring->data, 0, ring->capacity);
+
+    atomic_init(&ring->reserve_pos, 0);
+    atomic_init(&ring->read_pos, 0);
+    atomic_init(&ring->release_pos, 0);
+    atomic_init(&ring->releasing_tid, 0);
+    memset(ring->claims, 0, sizeof(ring->claims));
+    atomic_init(&ring->claim_count, 0);
+    memset(ring->reservations, 0, sizeof(ring->reservations));
+    atomic_init(&ring->reservation_count, 0);
+    atomic_init(&ring->count, 0);
+    atomic_init(&ring->closed, FALSE);
+    atomic_init(&ring->empty_waiters, 0);
+    atomic_init(&ring->full_waiters, 0);
+
+    atomic_init(&ring->not_empty_seq, 0);
+    atomic_init(&ring->not_full_seq, 0);
+}
+
+void job_ring_destroy(job_ring_t *ring) {
+    // The data belongs to the caller, and the futexes don't hold any resources
+    ring->data = NULL;
+}
+
+/**
+ * The consumers are forked processes, their thread id is also the pid seen by waitpid()
+ */
+static pid_t current_tid() {
+    return (pid_t) syscall(SYS_gettid);
+}
+
+/**
+ * Give back the space of consumed records to the producers. Records can be
+ * consumed out of order, so we only advance up to the first record still being copied.
+ */
+static void job_ring_release(job_ring_t *ring) {
+    pid_t tid = current_tid();
+
+    while (TRUE) {
+        pid_t expected = 0;
+        if (!atomic_compare_exchange_strong(&ring->releasing_tid, &expected, tid)) {
+            return;
+        }
+
+        size_t pos = atomic_load(&ring->release_pos);
+        size_t start = pos;
+        size_t read_pos = atomic_load(&ring->read_pos);
+
+        while (pos < read_pos) {
+            job_record_header_t *header = record_at(ring, pos);
+            if (atomic_load(&header->state) != RECORD_CONSUMED) {
+                break;
+            }
+
+            size_t size = atomic_load_explicit(&header->size, memory_order_relaxed);
+            memset(header, 0, size);
+            pos += size;
+        }
+
+        atomic_store(&ring->release_pos, pos);
+        atomic_store(&ring->releasing_tid, 0);
+
+        if (pos != start && atomic_load(&ring->full_waiters) > 0) {
+            futex_wake(&ring->not_full_seq, INT_MAX);
+        }
+
+        // Another process may have marked its record as consumed while we were holding the lock
+        if (pos >= atomic_load(&ring->read_pos) || atomic_load(&record_at(ring, pos)->state) != RECORD_CONSUMED) {
+            return;
+        }
+    }
+}
+
+/**
+ * Slot of the calling thread, NULL if all the slots are taken
+ */
+static job_ring_claim_t *get_slot(job_ring_claim_t *slots, _Atomic int *slot_count, int max_slots) {
+    pid_t tid = current_tid();
+
+    int count = atomic_load(slot_count);
+    for (int i = 0; i < count; i++) {
+        if (atomic_load(&slots[i].tid) == tid) {
+            return &slots[i];
+        }
+    }
+
+    for (int i = 0; i < max_slots; i++) {
+        pid_t expected = 0;
+        if (atomic_compare_exchange_strong(&slots[i].tid, &expected, tid)) {
+            count = atomic_load(slot_count);
+            while (count < i + 1 && !atomic_compare_exchange_weak(slot_count, &count, i + 1));
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+static job_ring_claim_t *get_claim_slot(job_ring_t *ring) {
+    return get_slot(ring->claims, &ring->claim_count, JOB_RING_MAX_CONSUMERS);
+}
+
+static job_ring_claim_t *get_reservation_slot(job_ring_t *ring) {
+    return get_slot(ring->reservations, &ring->reservation_count, JOB_RING_MAX_PRODUCERS);
+}
+
+static void set_claim(job_ring_claim_t *claim, size_t start, size_t end) {
+    if (claim != NULL) {
+        atomic_store(&claim->start, start);
+        atomic_store(&claim->end, end);
+    }
+}
+
+/**
+ * Reserve a record of the given size
+ * @param wait Block while the ring is full, otherwise return NULL
+ */
+static job_record_header_t *job_ring_reserve(job_ring_t *ring, size_t size, int wait,
+                                             job_ring_claim_t *reservation) {
+    if (size > ring->capacity) {
+        LOG_FATALF("job_ring.c", "Job is too large for the job queue (%zu bytes)", size);
+    }
+
+    size_t pos;
+    size_t padding;
+
+    while (TRUE) {
+        pos = atomic_load(&ring->reserve_pos);
+
+        size_t tail = ring->capacity - (pos % ring->capacity);
+        padding = size > tail ? tail : 0;
+
+        if (pos + padding + size - atomic_load(&ring->release_pos) > ring->capacity) {
+            job_ring_release(ring);
+
+            if (!wait) {
+                if (pos + padding + size - atomic_load(&ring->release_pos) > ring->capacity) {
+                    return NULL;
+                }
+                continue;
+            }
+
+            uint32_t seq = atomic_load(&ring->not_full_seq);
+            ring->full_waiters += 1;
+            if (pos + padding + size - atomic_load(&ring->release_pos) > ring->capacity) {
+                futex_wait_ms(&ring->not_full_seq, seq, 10);
+            }
+            ring->full_waiters -= 1;
+            continue;
+        }
+
+        // The span is published before the CAS, a crash right after it would otherwise leave
+        // an empty record that blocks the consumers
+        set_claim(reservation, pos, pos + padding + size);
+        if (atomic_compare_exchange_weak(&ring->reserve_pos, &pos, pos + padding + size)) {
+            break;
+        }
+        set_claim(reservation, 0, 0);
+    }
+
+    if (padding != 0) {
+        job_record_header_t *header = record_at(ring, pos);
+        atomic_store_explicit(&header->size, padding, memory_order_relaxed);
+        atomic_store(&header->state, RECORD_PADDING);
+    }
+
+    return record_at(ring, pos + padding);
+}
+
+static void job_ring_publish(job_ring_t *ring, job_record_header_t *header, size_t size,
+                             job_ring_claim_t *reservation) {
+    atomic_store_explicit(&header->size, size, memory_order_relaxed);
+    atomic_store(&header->state, RECORD_WRITTEN);
+    ring->count += 1;
+    set_claim(reservation, 0, 0);
+
+    if (atomic_load(&ring->empty_waiters) > 0) {
+        futex_wake(&ring->not_empty_seq, 1);
+    }
+}
+
+static int job_ring_push_job(job_ring_t *ring, job_t *job, int wait) {
+    size_t len;
+    if (job->type == JOB_PARSE_JOB) {
+        len = strlen(job->parse_job->filepath);
+    } else if (job->type == JOB_BULK_LINE) {
+        len = job->bulk_line->type == ES_BULK_LINE_DELETE ? 0 : strlen(job->bulk_line->line);
+    } else {
+        LOG_FATAL("job_ring.c", "FIXME: invalid job type");
+    }
+
+    size_t size = RECORD_ALIGN(sizeof(job_record_t) + len + 1);
+    job_ring_claim_t *reservation = get_reservation_slot(ring);
+    job_record_t *record = (job_record_t *) job_ring_reserve(ring, size, wait, reservation);
+    if (record == NULL) {
+        return FALSE;
+    }
+    record->type = job->type;
+
+    if (job->type == JOB_PARSE_JOB) {
+        record->mtime = job->parse_job->vfile.mtime;
+        record->st_size = (long) job->parse_job->vfile.st_size;
+        record->arc_entry_start = job->parse_job->arc_entry_start;
+        record->arc_entry_count = job->parse_job->arc_entry_count;
+        memcpy(record->data, job->parse_job->filepath, len + 1);
+    } else {
+        record->line_type = job->bulk_line->type;
+        strcpy(record->sid, job->bulk_line->sid);
+        memcpy(record->data, job->bulk_line->line, len);
+        record->data[len] = '\0';
+    }
+
+    job_ring_publish(ring, &record->header, size, reservation);
+    return TRUE;
+}
+
+void job_ring_push(job_ring_t *ring, job_t *job) {
+    job_ring_push_job(ring, job, TRUE);
+}
+
+int job_ring_try_push(job_ring_t *ring, job_t *job) {
+    return job_ring_push_job(ring, job, FALSE);
+}
+
+void job_ring_push_data(job_ring_t *ring, const void *data, size_t len) {
+    size_t size = RECORD_ALIGN(sizeof(data_record_t) + len);
+    job_ring_claim_t *reservation = get_reservation_slot(ring);
+    data_record_t *record = (data_record_t *) job_ring_reserve(ring, size, TRUE, reservation);
+
+    record->len = len;
+    memcpy(record->data, data, len);
+
+    job_ring_publish(ring, &record->header, size, reservation);
+}
+
+void job_ring_wait_count_below(job_ring_t *ring, int count) {
+    // The consumers wake up the full waiters when they release records
+    while (atomic_load(&ring->count) >= count) {
+        uint32_t seq = atomic_load(&ring->not_full_seq);
+        ring->full_waiters += 1;
+        if (atomic_load(&ring->count) >= count) {
+            futex_wait_ms(&ring->not_full_seq, seq, 10);
+        }
+        ring->full_waiters -= 1;
+    }
+}
+
+static job_t *job_from_record(job_record_t *record) {
+    job_t *job = malloc(sizeof(job_t));
+    job->type = record->type;
+
+    if (record->type == JOB_PARSE_JOB) {
+        job->parse_job = create_parse_job(record->data, record->mtime, record->st_size);
+        job->parse_job->arc_entry_start = record->arc_entry_start;
+        job->parse_job->arc_entry_count = record->arc_entry_count;
+    } else {
+        size_t len = strlen(record->data);
+        job->bulk_line = malloc(sizeof(es_bulk_line_t) + len + 1);
+        memcpy(job->bulk_line->line, record->data, len + 1);
+        strcpy(job->bulk_line->sid, record->sid);
+        job->bulk_line->type = record->line_type;
+        job->bulk_line->next = NULL;
+    }
+
+    return job;
+}
+
+static void read_job_record(job_record_header_t *header, void *dst, int index) {
+    ((job_t **) dst)[index] = job_from_record((job_record_t *) header);
+}
+
+typedef struct {
+    void **data;
+    size_t *len;
+} data_dst_t;
+
+static void read_data_record(job_record_header_t *header, void *dst, int index) {
+    data_record_t *record = (data_record_t *) header;
+    data_dst_t *data_dst = dst;
+
+    data_dst->data[index] = malloc(record->len);
+    memcpy(data_dst->data[index], record->data, record->len);
+    data_dst->len[index] = record->len;
+}
+
+/**
+ * State of the record at pos. The header is only looked at once the space was
+ * reserved, before that it can still hold a record from the previous lap.
+ */
+static int record_state(job_ring_t *ring, size_t pos) {
+    if (pos >= atomic_load(&ring->reserve_pos)) {
+        return RECORD_EMPTY;
+    }
+    return (int) atomic_load(&record_at(ring, pos)->state);
+}
+
+static int job_ring_pop_records(job_ring_t *ring, int max_records, int wait, job_batch_t *batch,
+                                void (*read_record)(job_record_header_t *, void *, int), void *dst) {
+    job_ring_claim_t *claim = get_claim_slot(ring);
+
+    while (TRUE) {
+        size_t pos = atomic_load(&ring->read_pos);
+        size_t end = pos;
+        size_t batch_size = 0;
+        int n = 0;
+
+        // Look ahead for consecutive records that are ready, they are all claimed with a single CAS
+        while (n < max_records) {
+            int state = record_state(ring, end);
+            if (state != RECORD_WRITTEN && state != RECORD_PADDING) {
+                break;
+            }
+
+            size_t size = atomic_load_explicit(&record_at(ring, end)->size, memory_order_relaxed);
+            if (size == 0) {
+                // Stale read, the record was released under our feet
+                break;
+            }
+
+            if (state == RECORD_WRITTEN) {
+                if (batch != NULL && n > 0 && batch_size + size > batch->capacity) {
+                    break;
+                }
+                batch_size += size;
+                n += 1;
+            }
+            end += size;
+        }
+
+        if (end != pos) {
+            // The span is published before the CAS, a crash right after it would otherwise lose it
+            set_claim(claim, pos, end);
+            if (!atomic_compare_exchange_weak(&ring->read_pos, &pos, end)) {
+                set_claim(claim, 0, 0);
+                continue;
+            }
+
+            ring->count -= n;
+
+            int i = 0;
+            size_t offset = 0;
+            for (size_t p = pos; p < end;) {
+                job_record_header_t *header = record_at(ring, p);
+                size_t size = atomic_load_explicit(&header->size, memory_order_relaxed);
+
+                if (atomic_load(&header->state) == RECORD_WRITTEN) {
+                    read_record(header, dst, i++);
+
+                    if (batch != NULL && offset + size <= batch->capacity) {
+                        memcpy(batch->data + offset, header, size);
+                        offset += size;
+                    }
+                }
+                p += size;
+            }
+            if (batch != NULL) {
+                batch->current = -1;
+                batch->count = offset > 0 ? n : 0;
+            }
+
+            // The records are only marked as consumed once they are all copied: until then,
+            // job_ring_recover() can take them back from a consumer that crashed
+            while (pos < end) {
+                job_record_header_t *header = record_at(ring, pos);
+                size_t size = atomic_load_explicit(&header->size, memory_order_relaxed);
+                atomic_store(&header->state, RECORD_CONSUMED);
+                pos += size;
+            }
+            set_claim(claim, 0, 0);
+
+            job_ring_release(ring);
+
+            if (n > 0) {
+                return n;
+            }
+            continue;
+        }
+
+        if (pos != atomic_load(&ring->read_pos)) {
+            continue;
+        }
+
+        if ((ring->closed && ring->count == 0) || !wait) {
+            return 0;
+        }
+
+        uint32_t seq = atomic_load(&ring->not_empty_seq);
+        ring->empty_waiters += 1;
+        if (pos == atomic_load(&ring->read_pos) && record_state(ring, pos) == RECORD_EMPTY && !ring->closed) {
+            futex_wait_ms(&ring->not_empty_seq, seq, 10);
+        }
+        ring->empty_waiters -= 1;
+    }
+}
+
+int job_ring_pop_batch(job_ring_t *ring, job_t **jobs, int max_jobs) {
+    return job_ring_pop_records(ring, max_jobs, TRUE, NULL, read_job_record, jobs);
+}
+
+int job_ring_try_pop_batch(job_ring_t *ring, job_t **jobs, int max_jobs, job_batch_t *batch) {
+    return job_ring_pop_records(ring, max_jobs, FALSE, batch, read_job_record, jobs);
+}
+
+int job_ring_pop_data(job_ring_t *ring, void **data, size_t *len, int wait) {
+    return job_ring_pop_records(ring, 1, wait, NULL, read_data_record, &(data_dst_t) {data, len});
+}
+
+int job_batch_load(job_batch_t *batch, int first, job_t **jobs) {
+    int n = 0;
+    size_t offset = 0;
+
+    for (int i = 0; i < batch->count; i++) {
+        job_record_t *record = (job_record_t *) (batch->data + offset);
+        if (i >= first) {
+            jobs[n++] = job_from_record(record);
+        }
+        offset += record->header.size;
+    }
+    return n;
+}
+
+job_t *job_ring_pop(job_ring_t *ring) {
+    job_t *job;
+
+    if (job_ring_pop_batch(ring, &job, 1) == 0) {
+        return NULL;
+    }
+    return job;
+}
+
+/**
+ * A span published by a consumer (or producer) is only its own if its CAS on read_pos (reserve_pos)
+ * succeeded. If another one won the race, it took the same range and is still working on it.
+ */
+static int span_is_contested(job_ring_claim_t *slots, int slot_count, job_ring_claim_t *claim,
+                             size_t start, size_t end) {
+    for (int i = 0; i < slot_count; i++) {
+        job_ring_claim_t *other = &slots[i];
+        size_t other_start = atomic_load(&other->start);
+        size_t other_end = atomic_load(&other->end);
+
+        if (other != claim && other_start != other_end && other_start < end && other_end > start) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void mark_padding(job_ring_t *ring, size_t pos, size_t size) {
+    job_record_header_t *header = record_at(ring, pos);
+    atomic_store_explicit(&header->size, size, memory_order_relaxed);
+    atomic_store(&header->state, RECORD_PADDING);
+}
+
+/**
+ * Turn the span that a producer reserved but did not publish into padding. Nothing can
+ * read or release an empty record, so the span is still as the producer left it.
+ */
+static void recover_reservation(job_ring_t *ring, pid_t pid) {
+    job_ring_claim_t *reservation = NULL;
+    int reservation_count = atomic_load(&ring->reservation_count);
+    for (int i = 0; i < reservation_count; i++) {
+        if (atomic_load(&ring->reservations[i].tid) == pid) {
+            reservation = &ring->reservations[i];
+            break;
+        }
+    }
+    if (reservation == NULL) {
+        return;
+    }
+
+    size_t start = atomic_load(&reservation->start);
+    size_t end = atomic_load(&reservation->end);
+
+    // The losing producer of a CAS race clears its span right away, give it some time
+    for (int retry = 0; start != end && retry < 1000
+                        && span_is_contested(ring->reservations, reservation_count, reservation, start, end);
+         retry++) {
+        usleep(1000);
+    }
+
+    // Unless the span was already published and released, or another producer won the race for it
+    if (start != end && start >= atomic_load(&ring->release_pos) && end <= atomic_load(&ring->reserve_pos)
+        && !span_is_contested(ring->reservations, reservation_count, reservation, start, end)) {
+
+        size_t tail = ring->capacity - (start % ring->capacity);
+        size_t padding = end - start > tail ? tail : 0;
+        int state = (int) atomic_load(&record_at(ring, start)->state);
+
+        if (padding == 0 && state == RECORD_EMPTY) {
+            mark_padding(ring, start, end - start);
+        } else if (padding != 0 && (state == RECORD_EMPTY || state == RECORD_PADDING)
+                   && atomic_load(&record_at(ring, start + padding)->state) == RECORD_EMPTY) {
+            mark_padding(ring, start, padding);
+            mark_padding(ring, start + padding, end - start - padding);
+        }
+
+        futex_wake(&ring->not_empty_seq, INT_MAX);
+    }
+
+    set_claim(reservation, 0, 0);
+    atomic_store(&reservation->tid, 0);
+}
+
+int job_ring_recover(job_ring_t *ring, pid_t pid, job_t **jobs, int max_jobs) {
+    pid_t tid = current_tid();
+    pid_t expected = pid;
+    atomic_compare_exchange_strong(&ring->releasing_tid, &expected, 0);
+
+    recover_reservation(ring, pid);
+
+    job_ring_claim_t *claim = NULL;
+    int claim_count = atomic_load(&ring->claim_count);
+    for (int i = 0; i < claim_count; i++) {
+        if (atomic_load(&ring->claims[i].tid) == pid) {
+            claim = &ring->claims[i];
+            break;
+        }
+    }
+    if (claim == NULL) {
+        job_ring_release(ring);
+        return 0;
+    }
+
+    size_t pos = atomic_load(&claim->start);
+    size_t end = atomic_load(&claim->end);
+    int n = 0;
+
+    // The losing consumer of a CAS race clears its span right away, give it some time
+    for (int retry = 0; pos != end && span_is_contested(ring->claims, claim_count, claim, pos, end) && retry < 1000;
+         retry++) {
+        usleep(1000);
+    }
+
+    if (pos != end && end <= atomic_load(&ring->read_pos)
+        && !span_is_contested(ring->claims, claim_count, claim, pos, end)) {
+        // Hold the release lock, so that the consumed records of the span are not zeroed while we walk it
+        expected = 0;
+        while (!atomic_compare_exchange_weak(&ring->releasing_tid, &expected, tid)) {
+            expected = 0;
+            usleep(100);
+        }
+
+        pos = MAX(pos, atomic_load(&ring->release_pos));
+        while (pos < end) {
+            job_record_header_t *header = record_at(ring, pos);
+            size_t size = atomic_load_explicit(&header->size, memory_order_relaxed);
+            if (size == 0) {
+                break;
+            }
+
+            if (atomic_load(&header->state) == RECORD_WRITTEN && n < max_jobs) {
+                jobs[n++] = job_from_record((job_record_t *) header);
+            }
+            atomic_store(&header->state, RECORD_CONSUMED);
+            pos += size;
+        }
+
+        atomic_store(&ring->releasing_tid, 0);
+    }
+
+    set_claim(claim, 0, 0);
+    atomic_store(&claim->tid, 0);
+
+    job_ring_release(ring);
+    return n;
+}
+
+void job_ring_close(job_ring_t *ring) {
+    ring->closed = TRUE;
+    futex_wake(&ring->not_empty_seq, INT_MAX);
+}
@@ -0,0 +1,152 @@
+#ifndef SIST2_JOB_RING_H
+#define SIST2_JOB_RING_H
+
+#include "sist.h"
+#include "src/database/database.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Size of the shared job queue. A single job (file path or bulk line)
+ * cannot be larger than this.
+ */
+#define JOB_RING_SIZE (1024 * 1024 * 16)
+
+/**
+ * Maximum number of processes that take records from the same ring
+ */
+#define JOB_RING_MAX_CONSUMERS MAX_THREADS
+
+/**
+ * Maximum number of threads that push records to the same ring and can be recovered
+ * if they crash: the workers, the walker threads and the main thread
+ */
+#define JOB_RING_MAX_PRODUCERS (MAX_THREADS * 2)
+
+/**
+ * Span of records a consumer is claiming or copying, so that the records of a
+ * consumer that crashed can be given back to the producers. Producers also record
+ * the span they reserved until it is published. start == end when idle.
+ */
+typedef struct {
+    _Atomic pid_t tid;
+    _Atomic size_t start;
+    _Atomic size_t end;
+} job_ring_claim_t;
+
+/**
+ * Copy of the records of the last batch taken by a consumer. If the consumer
+ * crashes, the main process pushes again the jobs it did not get to.
+ */
+typedef struct {
+    /** Number of jobs in the batch, 0 once it is done or if it did not fit */
+    _Atomic int count;
+    /** Index of the job being processed, -1 before the first one */
+    _Atomic int current;
+    size_t capacity;
+    char data[0];
+} job_batch_t;
+
+/**
+ * Bounded multi-producer/multi-consumer queue of variable-length job records.
+ *
+ * The ring lives in memory shared by the main process and the forked workers.
+ * Producers reserve space and consumers claim records with CAS on monotonic
+ * byte positions; the futexes are only used to sleep when the ring is full or empty.
+ */
+typedef struct {
+    char *data;
+    size_t capacity;
+
+    _Atomic size_t reserve_pos;
+    _Atomic size_t read_pos;
+    _Atomic size_t release_pos;
+    /** Thread id of the consumer that is advancing release_pos, 0 if none */
+    _Atomic pid_t releasing_tid;
+
+    job_ring_claim_t claims[JOB_RING_MAX_CONSUMERS];
+    _Atomic int claim_count;
+    job_ring_claim_t reservations[JOB_RING_MAX_PRODUCERS];
+    _Atomic int reservation_count;
+
+    _Atomic int count;
+    _Atomic int closed;
+    _Atomic int empty_waiters;
+    _Atomic int full_waiters;
+
+    /** Incremented to wake up the waiters */
+    _Atomic uint32_t not_empty_seq;
+    _Atomic uint32_t not_full_seq;
+} job_ring_t;
+
+void job_ring_init(job_ring_t *ring, void *data, size_t capacity);
+
+void job_ring_destroy(job_ring_t *ring);
+
+/**
+ * Blocks while the ring is full
+ */
+void job_ring_push(job_ring_t *ring, job_t *job);
+
+/**
+ * @return FALSE if the ring is full
+ */
+int job_ring_try_push(job_ring_t *ring, job_t *job);
+
+/**
+ * Blocks until fewer than count records are in the ring, to keep it short without filling it
+ */
+void job_ring_wait_count_below(job_ring_t *ring, int count);
+
+/**
+ * Blocks until a job is available. Returns NULL once the
+ * ring is closed and empty.
+ */
+job_t *job_ring_pop(job_ring_t *ring);
+
+/**
+ * Claim up to max_jobs consecutive jobs at once. Blocks until at least
+ * one job is available. Returns 0 once the ring is closed and empty.
+ */
+int job_ring_pop_batch(job_ring_t *ring, job_t **jobs, int max_jobs);
+
+/**
+ * Same as job_ring_pop_batch(), but returns 0 right away if the ring is empty.
+ * The records are also copied to batch (can be NULL), the batch is cut short
+ * so that they fit.
+ */
+int job_ring_try_pop_batch(job_ring_t *ring, job_t **jobs, int max_jobs, job_batch_t *batch);
+
+/**
+ * Jobs of a batch copied by job_ring_try_pop_batch(), starting from the first-th one
+ * @return The number of jobs
+ */
+int job_batch_load(job_batch_t *batch, int first, job_t **jobs);
+
+/**
+ * Push an opaque record, for rings that don't carry jobs. Blocks while the ring is full
+ */
+void job_ring_push_data(job_ring_t *ring, const void *data, size_t len);
+
+/**
+ * Pop an opaque record into a malloc'd copy. When wait is FALSE,
+ * returns 0 right away if the ring is empty.
+ */
+int job_ring_pop_data(job_ring_t *ring, void **data, size_t *len, int wait);
+
+/**
+ * Called by the main process after a process was killed: unlock the ring if it held the
+ * release lock, and take back the jobs it was in the middle of claiming. The space it reserved
+ * as a producer but did not publish is turned into padding, so that the consumers skip it.
+ * With max_jobs = 0, the jobs are only dropped (they were already copied to a batch).
+ * @return The number of jobs stored in jobs, to be pushed again
+ */
+int job_ring_recover(job_ring_t *ring, pid_t pid, job_t **jobs, int max_jobs);
+
+/**
+ * Wake up all consumers, no more jobs will be pushed
+ */
+void job_ring_close(job_ring_t *ring);
+
+#endif
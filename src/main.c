@@ -7,10 +7,14 @@
 #include "cli.h"
 #include "tpool.h"
 #include "io/walk.h"
+#include "io/inode_dedup.h"
 #include "index/elastic.h"
+#include "index/index_stream.h"
 #include "web/serve.h"
 #include "parsing/mime.h"
 #include "parsing/parse.h"
+#include "libscan/mem_budget/mem_budget.h"
+#include "metrics.h"
 
 #include <signal.h>
 #include <pthread.h>
@@ -54,7 +58,7 @@ void database_scan_begin(scan_args_t *args) {
         database_write_index_descriptor(db, original_desc);
         free(original_desc);
 
-        database_incremental_scan_begin(db);
+        ScanCtx.incremental_map = database_incremental_scan_begin(db);
 
     } else {
         // Create new descriptor
@@ -121,12 +125,14 @@ void logf_callback(const char *filepath, int level, char *format, ...) {
 void initialize_scan_context(scan_args_t *args) {
 
     ScanCtx.calculate_checksums = args->calculate_checksums;
+    ScanCtx.checksum_algorithm = args->checksum_algorithm;
 
     // Archive
     ScanCtx.arc_ctx.mode = args->archive_mode;
     ScanCtx.arc_ctx.log = log_callback;
     ScanCtx.arc_ctx.logf = logf_callback;
     ScanCtx.arc_ctx.parse = (parse_callback_t) parse;
+    ScanCtx.arc_ctx.fan_out = args->archive_fan_out ? fan_out_archive_entries : NULL;
     if (args->archive_passphrase != NULL) {
         strcpy(ScanCtx.arc_ctx.passphrase, args->archive_passphrase);
     } else {
@@ -154,6 +160,10 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.ebook_ctx.logf = logf_callback;
     ScanCtx.ebook_ctx.fast_epub_parse = args->fast_epub;
     ScanCtx.ebook_ctx.tn_qscale = args->tn_quality;
+    ScanCtx.ebook_ctx.page_split_threshold = args->ebook_split_pages;
+    ScanCtx.ebook_ctx.page_split_threads = args->threads;
+    ScanCtx.ebook_ctx.borrow_threads = borrow_idle_workers;
+    ScanCtx.ebook_ctx.return_threads = return_idle_workers;
 
     // Font
     ScanCtx.font_ctx.enable_tn = args->tn_count > 0;
@@ -164,11 +174,13 @@ void initialize_scan_context(scan_args_t *args) {
     ScanCtx.media_ctx.tn_qscale = args->tn_quality;
     ScanCtx.media_ctx.tn_size = args->tn_size;
     ScanCtx.media_ctx.tn_count = args->tn_count;
+    ScanCtx.media_ctx.fast_thumbnails = args->fast_thumbnails;
     ScanCtx.media_ctx.log = log_callback;
     ScanCtx.media_ctx.logf = logf_callback;
     ScanCtx.media_ctx.max_media_buffer = (long) args->max_memory_buffer_mib * 1024 * 1024;
     ScanCtx.media_ctx.read_subtitles = args->read_subtitles;
     ScanCtx.media_ctx.read_subtitles = args->tn_count;
+    ScanCtx.media_ctx.probe_callback = metrics_record_media_probe;
 
     if (args->ocr_images) {
         ScanCtx.media_ctx.tesseract_lang = args->tesseract_lang;
@@ -210,6 +222,9 @@ void initialize_scan_context(scan_args_t *args) {
     strncpy(ScanCtx.index.desc.rewrite_url, args->rewrite_url, sizeof(ScanCtx.index.desc.rewrite_url));
     ScanCtx.index.desc.root_len = (short) strlen(ScanCtx.index.desc.root);
     ScanCtx.fast = args->fast;
+    ScanCtx.io_uring = args->io_uring;
+    ScanCtx.inode_dedup = args->inode_dedup_mode;
+    ScanCtx.parse_cache = args->parse_cache;
 
     // Raw
     ScanCtx.raw_ctx.tn_qscale = args->tn_quality;
@@ -239,8 +254,54 @@ void sist2_scan(scan_args_t *args) {
 
     LOG_INFOF("main.c", "sist2 v%s", Version);
 
+    ScanCtx.index_writer = database_writer_create(args->output);
+
+    mem_budget_init((size_t) args->mem_budget_mib * 1024 * 1024);
+    if (args->metrics_path != NULL || args->metrics_listen != NULL) {
+        metrics_init();
+    }
+
     ScanCtx.pool = tpool_create(ScanCtx.threads, TRUE);
+
+    // Documents are indexed by the same pool as soon as they are committed, instead of in a separate pass
+    index_stream_t *index_stream = NULL;
+    if (args->index_target != INDEX_TO_NONE) {
+        if (args->index_target == INDEX_TO_ES) {
+            IndexCtx.es_url = args->es_url;
+            IndexCtx.es_index = args->es_index;
+            IndexCtx.es_insecure_ssl = args->es_insecure_ssl;
+            IndexCtx.batch_size = args->batch_size;
+            IndexCtx.needs_es_connection = TRUE;
+            IndexCtx.pool = ScanCtx.pool;
+
+            elastic_init(FALSE, NULL, NULL);
+        }
+
+        index_stream = index_stream_create(args->output, args->index_target, args->search_index_path,
+                                           ScanCtx.index.desc.id);
+        database_writer_set_commit_callback(ScanCtx.index_writer, index_stream_push, index_stream);
+    }
+
+    int parse_cost_count = 0;
+    parse_cost_t *parse_costs = NULL;
+    if (args->incremental) {
+        database_t *db = database_create(args->output, INDEX_DATABASE);
+        database_open(db);
+        parse_costs = database_read_parse_costs(db, &parse_cost_count);
+        database_close(db, FALSE);
+    }
+    tpool_set_schedule(ScanCtx.pool, args->schedule_policy, parse_costs, parse_cost_count);
+    if (args->min_threads < args->threads) {
+        tpool_set_min_threads(ScanCtx.pool, args->min_threads);
+    }
+    free(parse_costs);
+
     tpool_start(ScanCtx.pool);
+    metrics_start(ScanCtx.pool, args->metrics_path, args->metrics_listen, args->metrics_interval);
+
+    if (ScanCtx.inode_dedup != INODE_DEDUP_OFF) {
+        inode_dedup_init();
+    }
 
     if (args->list_path) {
         // Scan using file list
@@ -250,23 +311,76 @@ void sist2_scan(scan_args_t *args) {
         }
     } else {
         // Scan directory recursively
-        int walk_ret = walk_directory_tree(ScanCtx.index.desc.root);
+        int walk_ret = walk_directory_tree(ScanCtx.index.desc.root, args->walk_threads);
         if (walk_ret == -1) {
             LOG_FATALF("main.c", "walk_directory_tree() failed! %s (%d)", strerror(errno), errno);
         }
     }
 
-    tpool_wait(ScanCtx.pool);
-    tpool_destroy(ScanCtx.pool);
+    // Index jobs keep running until the last documents are committed
+    tpool_wait_type(ScanCtx.pool, JOB_PARSE_JOB);
+    if (ScanCtx.inode_dedup != INODE_DEDUP_OFF) {
+        inode_dedup_flush(ScanCtx.index_writer);
+        // Duplicates that could not be copied from their original are parsed
+        tpool_wait_type(ScanCtx.pool, JOB_PARSE_JOB);
+    }
+    parse_costs = tpool_get_parse_costs(ScanCtx.pool, &parse_cost_count);
+
+    database_writer_destroy(ScanCtx.index_writer);
+    ScanCtx.index_writer = NULL;
+
+    if (index_stream != NULL) {
+        index_stream_destroy(index_stream);
+    }
 
     database_t *db = database_create(args->output, INDEX_DATABASE);
     database_open(db);
 
+    database_write_parse_costs(db, parse_costs, parse_cost_count);
+    free(parse_costs);
+
     if (args->incremental != FALSE) {
-        database_incremental_scan_end(db);
+        database_incremental_scan_end(db, ScanCtx.incremental_map);
+        ScanCtx.incremental_map = NULL;
+    }
+
+    if (args->index_target == INDEX_TO_ES) {
+        char sid[SIST_SID_LEN];
+
+        database_iterator_t *del_iter = database_create_delete_list_iterator(db);
+        database_delete_list_iter_foreach(doc_id, del_iter) {
+            format_sid(sid, ScanCtx.index.desc.id, doc_id);
+            delete_document(sid);
+        }
+        free(del_iter);
+    }
+
+    tpool_wait(ScanCtx.pool);
+    metrics_stop();
+    tpool_destroy(ScanCtx.pool);
+
+    mem_budget_stats_t mem_budget_stats = mem_budget_get_stats();
+    if (mem_budget_stats.limit != 0) {
+        LOG_INFOF("main.c", "Peak memory reserved by parsers: %.1f/%.1f MiB (%ld waits, %ld denied)",
+                  (double) mem_budget_stats.peak / (1024 * 1024), (double) mem_budget_stats.limit / (1024 * 1024),
+                  mem_budget_stats.wait_count, mem_budget_stats.denied_count);
+    }
+    mem_budget_destroy();
+
+    if (args->index_target == INDEX_TO_ES) {
+        finish_indexer(ScanCtx.index.desc.id);
     }
 
     database_generate_stats(db, args->treemap_threshold);
+
+    if (args->index_target == INDEX_TO_SQLITE) {
+        database_fts_attach(db, args->search_index_path);
+        database_fts_index_finish(db);
+        database_fts_optimize(db);
+        database_fts_detach(db);
+    }
+
+    database_checkpoint(db);
     database_close(db, args->optimize_database);
 }
 
@@ -292,8 +406,12 @@ void sist2_index(index_args_t *args) {
         LOG_FATALF("main.c", "Version mismatch! Index is %s but executable is %s", desc->version, Version);
     }
 
+    if (args->metrics_path != NULL || args->metrics_listen != NULL) {
+        metrics_init();
+    }
     IndexCtx.pool = tpool_create(args->threads, args->print == FALSE);
     tpool_start(IndexCtx.pool);
+    metrics_start(IndexCtx.pool, args->metrics_path, args->metrics_listen, args->metrics_interval);
 
     int cnt = 0;
 
@@ -331,6 +449,7 @@ void sist2_index(index_args_t *args) {
     database_close(db, FALSE);
 
     tpool_wait(IndexCtx.pool);
+    metrics_stop();
     tpool_destroy(IndexCtx.pool);
 
     if (IndexCtx.needs_es_connection) {
@@ -351,6 +470,8 @@ void sist2_sqlite_index(sqlite_index_args_t *args) {
     database_fts_index(db);
     database_fts_optimize(db);
 
+    // Also checkpoints the attached search database
+    database_checkpoint(db);
     database_close(db, FALSE);
 }
 
@@ -376,7 +497,7 @@ void sist2_web(web_args_t *args) {
 
     if (args->search_backend == SQLITE_SEARCH_BACKEND) {
         WebCtx.search_db = database_create(args->search_index_path, FTS_DATABASE);
-        database_open(WebCtx.search_db);
+        database_open_reader(WebCtx.search_db);
     }
 
     for (int i = 0; i < args->index_count; i++) {
@@ -385,7 +506,7 @@ void sist2_web(web_args_t *args) {
         strcpy(WebCtx.indices[i].path, abs_path);
 
         database_t *db = database_create(abs_path, INDEX_DATABASE);
-        database_open(db);
+        database_open_reader(db);
         if (WebCtx.search_backend == SQLITE_SEARCH_BACKEND) {
             database_fts_attach(db, args->search_index_path);
             database_fts_sync_tags(db);
@@ -445,6 +566,9 @@ int main(int argc, const char *argv[]) {
     int common_threads = 0;
     int common_optimize_database = 0;
     char *common_search_index = NULL;
+    char *common_metrics_path = NULL;
+    char *common_metrics_listen = NULL;
+    int common_metrics_interval = 0;
 
     struct argparse_option options[] = {
             OPT_HELP(),
@@ -482,6 +606,9 @@ int main(int argc, const char *argv[]) {
                                                           "shallow: don't scan archives inside archives. DEFAULT: recurse"),
             OPT_STRING(0, "archive-passphrase", &scan_args->archive_passphrase,
                        "Passphrase for encrypted archive files"),
+            OPT_BOOLEAN(0, "archive-fan-out", &scan_args->archive_fan_out,
+                        "Split the files of large zip, 7z and uncompressed tar archives in several jobs,"
+                        " so that they are parsed by all the threads."),
 
             OPT_STRING(0, "ocr-lang", &scan_args->tesseract_lang,
                        "Tesseract language (use 'tesseract --list-langs' to see "
@@ -495,13 +622,58 @@ int main(int argc, const char *argv[]) {
             OPT_INTEGER(0, "mem-buffer", &scan_args->max_memory_buffer_mib,
                         "Maximum memory buffer size per thread in MiB for files inside archives "
                         "(see USAGE.md). DEFAULT: 2000"),
+            OPT_INTEGER(0, "mem-budget", &scan_args->mem_budget_mib,
+                        "Maximum memory in MiB that all threads combined can use to load whole files "
+                        "(see USAGE.md). DEFAULT: 0 (unlimited)"),
             OPT_BOOLEAN(0, "read-subtitles", &scan_args->read_subtitles, "Read subtitles from media files."),
             OPT_BOOLEAN(0, "fast-epub", &scan_args->fast_epub,
                         "Faster but less accurate EPUB parsing (no thumbnails, metadata)."),
+            OPT_BOOLEAN(0, "fast-thumbnails", &scan_args->fast_thumbnails,
+                        "Faster video thumbnails: only decode keyframes (the thumbnails are taken at the"
+                        " keyframe before each position), and scale thumbnails up to 600px with a bilinear filter."),
             OPT_BOOLEAN(0, "checksums", &scan_args->calculate_checksums, "Calculate file checksums when scanning."),
+            OPT_STRING(0, "checksum-algorithm", &scan_args->checksum_algorithm_name,
+                       "Algorithm of --checksums (sha1|xxh3|blake3). The whole file is read by a separate"
+                       " thread while it is parsed. xxh3 and blake3 require sist2 to be built with libxxhash"
+                       " and libblake3. DEFAULT: sha1"),
             OPT_STRING(0, "list-file", &scan_args->list_path, "Specify a list of newline-delimited paths to be scanned"
                                                               " instead of normal directory traversal. Use '-' to read"
                                                               " from stdin."),
+            OPT_INTEGER(0, "min-threads", &scan_args->min_threads,
+                        "Adjust the number of active threads between this value and --threads during the scan,"
+                        " from the measured throughput, CPU utilization and iowait. DEFAULT: --threads"),
+            OPT_INTEGER(0, "walk-threads", &scan_args->walk_threads,
+                        "Number of threads used to enumerate files. Values above 1 use the parallel walker,"
+                        " which is faster on network filesystems. DEFAULT: 1"),
+            OPT_BOOLEAN(0, "io-uring", &scan_args->io_uring,
+                        "Use io_uring to stat files during the walk and read the start of files (whole files"
+                        " under 256 KiB) before they are parsed. Falls back to regular reads when io_uring is"
+                        " not available."),
+            OPT_STRING(0, "inode-dedup", &scan_args->inode_dedup,
+                       "Parse hard links and files seen through bind mounts once (link|copy|off). The other paths"
+                       " get a copy of the metadata, link: their thumbnails are read from the first path,"
+                       " copy: the thumbnails are copied. DEFAULT: off"),
+            OPT_BOOLEAN(0, "parse-cache", &scan_args->parse_cache,
+                        "Hash the content of new and modified files (up to 512 MiB) and reuse the metadata and"
+                        " thumbnails of a document with the same hash instead of parsing them. The hashes are"
+                        " kept in the index for the next incremental scans."),
+            OPT_STRING(0, "index-to", &scan_args->index_to,
+                       "Index the documents while the scan is running (es|sqlite). es: same as the index command"
+                       " (see Index options), sqlite: same as the sqlite-index command (requires --search-index)."),
+            OPT_STRING(0, "schedule", &scan_args->schedule,
+                       "Order in which files are parsed. fifo: in the order they are found, largest: largest"
+                       " files first, mime-cost: highest expected parse time first (learned from the previous"
+                       " scans of the index), newest: most recently modified files first. DEFAULT: fifo"),
+            OPT_INTEGER(0, "ebook-split-pages", &scan_args->ebook_split_pages,
+                        "Read the text of ebooks with at least this many pages in parallel page ranges,"
+                        " using up to --threads threads per document. 0 to disable. DEFAULT: 0"),
+            OPT_STRING(0, "metrics-file", &common_metrics_path,
+                       "Append metrics (throughput, queue depth, time per stage and per file type, parse"
+                       " latency by mime type) to this file as JSON lines."),
+            OPT_STRING(0, "metrics-bind", &common_metrics_listen,
+                       "Serve metrics in Prometheus text format at http://<address>/metrics."),
+            OPT_INTEGER(0, "metrics-interval", &common_metrics_interval,
+                        "Interval in seconds between two lines of --metrics-file. DEFAULT: 10"),
 
             OPT_GROUP("Index options"),
             OPT_INTEGER('t', "threads", &common_threads, "Number of threads. DEFAULT: 1"),
@@ -518,6 +690,13 @@ int main(int argc, const char *argv[]) {
             OPT_STRING(0, "settings-file", &index_args->es_settings_path, "Path to Elasticsearch settings."),
             OPT_INTEGER(0, "batch-size", &index_args->batch_size, "Index batch size. DEFAULT: 70"),
             OPT_BOOLEAN('f', "force-reset", &index_args->force_reset, "Reset Elasticsearch mappings and settings."),
+            OPT_STRING(0, "metrics-file", &common_metrics_path,
+                       "Append metrics (throughput, queue depth, time per stage and per file type, parse"
+                       " latency by mime type) to this file as JSON lines."),
+            OPT_STRING(0, "metrics-bind", &common_metrics_listen,
+                       "Serve metrics in Prometheus text format at http://<address>/metrics."),
+            OPT_INTEGER(0, "metrics-interval", &common_metrics_interval,
+                        "Interval in seconds between two lines of --metrics-file. DEFAULT: 10"),
 
             OPT_GROUP("sqlite-index options"),
             OPT_STRING(0, "search-index", &common_search_index,
@@ -572,12 +751,25 @@ int main(int argc, const char *argv[]) {
     web_args->es_insecure_ssl = common_es_insecure_ssl;
     index_args->es_insecure_ssl = common_es_insecure_ssl;
 
+    scan_args->es_url = common_es_url;
+    scan_args->es_index = common_es_index;
+    scan_args->es_insecure_ssl = common_es_insecure_ssl;
+    scan_args->batch_size = index_args->batch_size;
+    scan_args->search_index_path = common_search_index;
+
     index_args->script_path = common_script_path;
     index_args->threads = common_threads;
     scan_args->threads = common_threads;
 
     scan_args->optimize_database = common_optimize_database;
 
+    scan_args->metrics_path = common_metrics_path;
+    scan_args->metrics_listen = common_metrics_listen;
+    scan_args->metrics_interval = common_metrics_interval;
+    index_args->metrics_path = common_metrics_path;
+    index_args->metrics_listen = common_metrics_listen;
+    index_args->metrics_interval = common_metrics_interval;
+
     sqlite_index_args->search_index_path = common_search_index;
     web_args->search_index_path = common_search_index;
 
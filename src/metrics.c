@@ -0,0 +1,492 @@
+#include "metrics.h"
+#include "ctx.h"
+#include "parsing/mime.h"
+#include "parsing/parse.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <mongoose.h>
+
+#define METRICS_MIME_TABLE_SIZE 1024
+
+/**
+ * Upper bounds of the parse latency histogram buckets (µs), the last bucket is +Inf
+ */
+static const long metrics_bucket_bounds[] = {
+        100, 1000, 10000, 50000, 100000, 500000, 1000000, 5000000, 30000000
+};
+#define METRICS_BUCKET_COUNT (sizeof(metrics_bucket_bounds) / sizeof(metrics_bucket_bounds[0]) + 1)
+
+static const char *metrics_stage_names[METRICS_STAGE_COUNT] = {
+        "mime", "parse", "serialize", "db_write", "index", "hash"
+};
+
+typedef struct {
+    unsigned int mime;
+    long count;
+    long time;
+    long buckets[METRICS_BUCKET_COUNT];
+} metrics_mime_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+
+    long file_count;
+    long file_bytes;
+
+    long stage_count[METRICS_STAGE_COUNT];
+    long stage_time[METRICS_STAGE_COUNT];
+
+    long file_type_count[FILETYPE_COUNT];
+    long file_type_bytes[FILETYPE_COUNT];
+    long file_type_time[FILETYPE_COUNT];
+
+    long parse_cache_lookups;
+    long parse_cache_hits;
+    long parse_cache_hit_bytes;
+
+    long media_probe_count;
+    long media_probe_escalation_count;
+
+    long worker_jobs[MAX_THREADS + 1];
+    long worker_time[MAX_THREADS + 1];
+
+    metrics_mime_t mimes[METRICS_MIME_TABLE_SIZE];
+} metrics_shm_t;
+
+static metrics_shm_t *metrics = NULL;
+
+static struct {
+    tpool_t *pool;
+    FILE *json_file;
+    struct mg_mgr mgr;
+    int listening;
+    int interval;
+
+    pthread_t thread;
+    volatile int stop;
+
+    long start_time;
+    long last_time;
+    long last_file_count;
+    long last_file_bytes;
+    long last_index_count;
+} Exporter;
+
+long metrics_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void metrics_init() {
+    metrics = mmap(NULL, sizeof(metrics_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(metrics, 0, sizeof(metrics_shm_t));
+
+    pthread_mutexattr_t mutexattr;
+    pthread_mutexattr_init(&mutexattr);
+    pthread_mutexattr_setpshared(&mutexattr, TRUE);
+    pthread_mutex_init(&metrics->mutex, &mutexattr);
+}
+
+void metrics_record_stage(metrics_stage_t stage, int count, long time) {
+    if (metrics == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&metrics->mutex);
+    metrics->stage_count[stage] += count;
+    metrics->stage_time[stage] += time;
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+/**
+ * Must be called with the mutex held
+ */
+static metrics_mime_t *metrics_mime_lookup(unsigned int mime) {
+    unsigned int slot = (mime * 2654435761u) % METRICS_MIME_TABLE_SIZE;
+
+    for (int i = 0; i < METRICS_MIME_TABLE_SIZE; i++) {
+        metrics_mime_t *entry = &metrics->mimes[(slot + i) % METRICS_MIME_TABLE_SIZE];
+
+        if (entry->count == 0) {
+            entry->mime = mime;
+            return entry;
+        }
+        if (entry->mime == mime) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+void metrics_record_parse(unsigned int mime, int file_type, long size, long parse_time, long total_time) {
+    if (metrics == NULL) {
+        return;
+    }
+
+    int bucket = 0;
+    while (bucket < METRICS_BUCKET_COUNT - 1 && total_time > metrics_bucket_bounds[bucket]) {
+        bucket += 1;
+    }
+
+    pthread_mutex_lock(&metrics->mutex);
+    metrics->file_count += 1;
+    metrics->file_bytes += size;
+
+    metrics->stage_count[METRICS_STAGE_PARSE] += 1;
+    metrics->stage_time[METRICS_STAGE_PARSE] += parse_time;
+
+    metrics->file_type_count[file_type] += 1;
+    metrics->file_type_bytes[file_type] += size;
+    metrics->file_type_time[file_type] += parse_time;
+
+    metrics_mime_t *entry = metrics_mime_lookup(mime);
+    if (entry != NULL) {
+        entry->count += 1;
+        entry->time += total_time;
+        entry->buckets[bucket] += 1;
+    }
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+void metrics_record_batch(int thread_id, int job_count, long time) {
+    if (metrics == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&metrics->mutex);
+    metrics->worker_jobs[thread_id] += job_count;
+    metrics->worker_time[thread_id] += time;
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+void metrics_record_parse_cache(int hit, long size) {
+    if (metrics == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&metrics->mutex);
+    metrics->parse_cache_lookups += 1;
+    if (hit) {
+        metrics->parse_cache_hits += 1;
+        metrics->parse_cache_hit_bytes += size;
+    }
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+void metrics_record_media_probe(int escalated) {
+    if (metrics == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&metrics->mutex);
+    metrics->media_probe_count += 1;
+    if (escalated) {
+        metrics->media_probe_escalation_count += 1;
+    }
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+static metrics_shm_t *metrics_snapshot() {
+    metrics_shm_t *snapshot = malloc(sizeof(metrics_shm_t));
+
+    pthread_mutex_lock(&metrics->mutex);
+    memcpy(snapshot, metrics, sizeof(metrics_shm_t));
+    pthread_mutex_unlock(&metrics->mutex);
+
+    return snapshot;
+}
+
+static double us_to_s(long time) {
+    return (double) time / 1000000.0;
+}
+
+static void metrics_write_json_line() {
+    metrics_shm_t *snapshot = metrics_snapshot();
+    tpool_stats_t pool_stats = tpool_get_stats(Exporter.pool);
+
+    long now = metrics_time_us();
+    double elapsed = us_to_s(MAX(1, now - Exporter.last_time));
+    long index_count = snapshot->stage_count[METRICS_STAGE_INDEX];
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "time", (double) time(NULL));
+    cJSON_AddNumberToObject(json, "elapsed", us_to_s(now - Exporter.start_time));
+    cJSON_AddNumberToObject(json, "files", (double) snapshot->file_count);
+    cJSON_AddNumberToObject(json, "bytes", (double) snapshot->file_bytes);
+    cJSON_AddNumberToObject(json, "files_per_second", (double) (snapshot->file_count - Exporter.last_file_count) / elapsed);
+    cJSON_AddNumberToObject(json, "bytes_per_second", (double) (snapshot->file_bytes - Exporter.last_file_bytes) / elapsed);
+    cJSON_AddNumberToObject(json, "indexed_per_second", (double) (index_count - Exporter.last_index_count) / elapsed);
+    cJSON_AddNumberToObject(json, "queue_depth", pool_stats.queue_depth);
+    cJSON_AddNumberToObject(json, "busy_workers", pool_stats.busy_count);
+    cJSON_AddNumberToObject(json, "threads", pool_stats.thread_count);
+    cJSON_AddNumberToObject(json, "active_workers", pool_stats.active_count);
+
+    cJSON *stages = cJSON_AddObjectToObject(json, "stages");
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++) {
+        cJSON *stage = cJSON_AddObjectToObject(stages, metrics_stage_names[i]);
+        cJSON_AddNumberToObject(stage, "count", (double) snapshot->stage_count[i]);
+        cJSON_AddNumberToObject(stage, "seconds", us_to_s(snapshot->stage_time[i]));
+    }
+
+    cJSON *file_types = cJSON_AddObjectToObject(json, "file_types");
+    for (int i = 0; i < FILETYPE_COUNT; i++) {
+        if (snapshot->file_type_count[i] == 0) {
+            continue;
+        }
+        cJSON *file_type = cJSON_AddObjectToObject(file_types, get_file_type_name(i));
+        cJSON_AddNumberToObject(file_type, "count", (double) snapshot->file_type_count[i]);
+        cJSON_AddNumberToObject(file_type, "bytes", (double) snapshot->file_type_bytes[i]);
+        cJSON_AddNumberToObject(file_type, "seconds", us_to_s(snapshot->file_type_time[i]));
+    }
+
+    if (snapshot->parse_cache_lookups > 0) {
+        cJSON *parse_cache = cJSON_AddObjectToObject(json, "parse_cache");
+        cJSON_AddNumberToObject(parse_cache, "lookups", (double) snapshot->parse_cache_lookups);
+        cJSON_AddNumberToObject(parse_cache, "hits", (double) snapshot->parse_cache_hits);
+        cJSON_AddNumberToObject(parse_cache, "hit_bytes", (double) snapshot->parse_cache_hit_bytes);
+        cJSON_AddNumberToObject(parse_cache, "hit_rate",
+                                (double) snapshot->parse_cache_hits / (double) snapshot->parse_cache_lookups);
+    }
+
+    if (snapshot->media_probe_count > 0) {
+        cJSON *media_probe = cJSON_AddObjectToObject(json, "media_probe");
+        cJSON_AddNumberToObject(media_probe, "probes", (double) snapshot->media_probe_count);
+        cJSON_AddNumberToObject(media_probe, "escalations", (double) snapshot->media_probe_escalation_count);
+        cJSON_AddNumberToObject(media_probe, "escalation_rate",
+                                (double) snapshot->media_probe_escalation_count /
+                                (double) snapshot->media_probe_count);
+    }
+
+    cJSON *workers = cJSON_AddArrayToObject(json, "workers");
+    for (int i = 1; i <= pool_stats.thread_count; i++) {
+        cJSON *worker = cJSON_CreateObject();
+        cJSON_AddNumberToObject(worker, "id", i);
+        cJSON_AddNumberToObject(worker, "jobs", (double) snapshot->worker_jobs[i]);
+        cJSON_AddNumberToObject(worker, "busy_seconds", us_to_s(snapshot->worker_time[i]));
+        cJSON_AddItemToArray(workers, worker);
+    }
+
+    // Bucket counts are cumulative, like in the Prometheus histogram
+    cJSON *mimes = cJSON_AddObjectToObject(json, "mimes");
+    for (int i = 0; i < METRICS_MIME_TABLE_SIZE; i++) {
+        metrics_mime_t *entry = &snapshot->mimes[i];
+        if (entry->count == 0) {
+            continue;
+        }
+        const char *mime_text = entry->mime == 0 ? "unknown" : mime_get_mime_text(entry->mime);
+        if (mime_text == NULL) {
+            continue;
+        }
+
+        cJSON *mime = cJSON_AddObjectToObject(mimes, mime_text);
+        cJSON_AddNumberToObject(mime, "count", (double) entry->count);
+        cJSON_AddNumberToObject(mime, "seconds", us_to_s(entry->time));
+
+        cJSON *buckets = cJSON_AddObjectToObject(mime, "buckets");
+        long cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKET_COUNT - 1; b++) {
+            char le[32];
+            snprintf(le, sizeof(le), "%g", us_to_s(metrics_bucket_bounds[b]));
+            cumulative += entry->buckets[b];
+            cJSON_AddNumberToObject(buckets, le, (double) cumulative);
+        }
+    }
+
+    char *json_str = cJSON_PrintUnformatted(json);
+    fprintf(Exporter.json_file, "%s\n", json_str);
+    fflush(Exporter.json_file);
+
+    free(json_str);
+    cJSON_Delete(json);
+
+    Exporter.last_time = now;
+    Exporter.last_file_count = snapshot->file_count;
+    Exporter.last_file_bytes = snapshot->file_bytes;
+    Exporter.last_index_count = index_count;
+    free(snapshot);
+}
+
+/**
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+static char *metrics_prometheus_text() {
+    metrics_shm_t *snapshot = metrics_snapshot();
+    tpool_stats_t pool_stats = tpool_get_stats(Exporter.pool);
+
+    char *text;
+    size_t text_len;
+    FILE *out = open_memstream(&text, &text_len);
+
+    fprintf(out, "# TYPE sist2_files_total counter\nsist2_files_total %ld\n", snapshot->file_count);
+    fprintf(out, "# TYPE sist2_bytes_total counter\nsist2_bytes_total %ld\n", snapshot->file_bytes);
+    fprintf(out, "# TYPE sist2_queue_depth gauge\nsist2_queue_depth %d\n", pool_stats.queue_depth);
+    fprintf(out, "# TYPE sist2_busy_workers gauge\nsist2_busy_workers %d\n", pool_stats.busy_count);
+    fprintf(out, "# TYPE sist2_threads gauge\nsist2_threads %d\n", pool_stats.thread_count);
+    fprintf(out, "# TYPE sist2_active_workers gauge\nsist2_active_workers %d\n", pool_stats.active_count);
+
+    fprintf(out, "# TYPE sist2_stage_total counter\n");
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++) {
+        fprintf(out, "sist2_stage_total{stage=\"%s\"} %ld\n", metrics_stage_names[i], snapshot->stage_count[i]);
+    }
+    fprintf(out, "# TYPE sist2_stage_seconds_total counter\n");
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++) {
+        fprintf(out, "sist2_stage_seconds_total{stage=\"%s\"} %f\n", metrics_stage_names[i],
+                us_to_s(snapshot->stage_time[i]));
+    }
+
+    fprintf(out, "# TYPE sist2_parse_files_total counter\n");
+    for (int i = 0; i < FILETYPE_COUNT; i++) {
+        fprintf(out, "sist2_parse_files_total{file_type=\"%s\"} %ld\n", get_file_type_name(i),
+                snapshot->file_type_count[i]);
+    }
+    fprintf(out, "# TYPE sist2_parse_bytes_total counter\n");
+    for (int i = 0; i < FILETYPE_COUNT; i++) {
+        fprintf(out, "sist2_parse_bytes_total{file_type=\"%s\"} %ld\n", get_file_type_name(i),
+                snapshot->file_type_bytes[i]);
+    }
+    fprintf(out, "# TYPE sist2_parse_seconds_total counter\n");
+    for (int i = 0; i < FILETYPE_COUNT; i++) {
+        fprintf(out, "sist2_parse_seconds_total{file_type=\"%s\"} %f\n", get_file_type_name(i),
+                us_to_s(snapshot->file_type_time[i]));
+    }
+
+    fprintf(out, "# TYPE sist2_parse_cache_lookups_total counter\nsist2_parse_cache_lookups_total %ld\n",
+            snapshot->parse_cache_lookups);
+    fprintf(out, "# TYPE sist2_parse_cache_hits_total counter\nsist2_parse_cache_hits_total %ld\n",
+            snapshot->parse_cache_hits);
+    fprintf(out, "# TYPE sist2_parse_cache_hit_bytes_total counter\nsist2_parse_cache_hit_bytes_total %ld\n",
+            snapshot->parse_cache_hit_bytes);
+
+    fprintf(out, "# TYPE sist2_media_probes_total counter\nsist2_media_probes_total %ld\n",
+            snapshot->media_probe_count);
+    fprintf(out, "# TYPE sist2_media_probe_escalations_total counter\nsist2_media_probe_escalations_total %ld\n",
+            snapshot->media_probe_escalation_count);
+
+    fprintf(out, "# TYPE sist2_worker_jobs_total counter\n");
+    for (int i = 1; i <= pool_stats.thread_count; i++) {
+        fprintf(out, "sist2_worker_jobs_total{worker=\"%d\"} %ld\n", i, snapshot->worker_jobs[i]);
+    }
+    fprintf(out, "# TYPE sist2_worker_busy_seconds_total counter\n");
+    for (int i = 1; i <= pool_stats.thread_count; i++) {
+        fprintf(out, "sist2_worker_busy_seconds_total{worker=\"%d\"} %f\n", i, us_to_s(snapshot->worker_time[i]));
+    }
+
+    fprintf(out, "# TYPE sist2_file_duration_seconds histogram\n");
+    for (int i = 0; i < METRICS_MIME_TABLE_SIZE; i++) {
+        metrics_mime_t *entry = &snapshot->mimes[i];
+        if (entry->count == 0) {
+            continue;
+        }
+        const char *mime_text = entry->mime == 0 ? "unknown" : mime_get_mime_text(entry->mime);
+        if (mime_text == NULL) {
+            continue;
+        }
+
+        long cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKET_COUNT - 1; b++) {
+            cumulative += entry->buckets[b];
+            fprintf(out, "sist2_file_duration_seconds_bucket{mime=\"%s\",le=\"%g\"} %ld\n",
+                    mime_text, us_to_s(metrics_bucket_bounds[b]), cumulative);
+        }
+        fprintf(out, "sist2_file_duration_seconds_bucket{mime=\"%s\",le=\"+Inf\"} %ld\n", mime_text, entry->count);
+        fprintf(out, "sist2_file_duration_seconds_sum{mime=\"%s\"} %f\n", mime_text, us_to_s(entry->time));
+        fprintf(out, "sist2_file_duration_seconds_count{mime=\"%s\"} %ld\n", mime_text, entry->count);
+    }
+
+    fclose(out);
+    free(snapshot);
+
+    return text;
+}
+
+static void metrics_ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
+    if (ev != MG_EV_HTTP_MSG) {
+        return;
+    }
+
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+
+    if (mg_http_match_uri(hm, "/metrics")) {
+        char *text = metrics_prometheus_text();
+        mg_http_reply(nc, 200, "Content-Type: text/plain; version=0.0.4\r\n", "%s", text);
+        free(text);
+    } else {
+        mg_http_reply(nc, 404, "", "Not found");
+    }
+}
+
+static void *metrics_exporter_thread(void *arg) {
+    while (!Exporter.stop) {
+        if (Exporter.listening) {
+            mg_mgr_poll(&Exporter.mgr, 100);
+        } else {
+            usleep(100 * MILLISECOND);
+        }
+
+        if (Exporter.json_file != NULL && metrics_time_us() - Exporter.last_time >= Exporter.interval * 1000000L) {
+            metrics_write_json_line();
+        }
+    }
+
+    return NULL;
+}
+
+void metrics_start(tpool_t *pool, const char *json_path, const char *listen_address, int interval) {
+    if (metrics == NULL || (json_path == NULL && listen_address == NULL)) {
+        return;
+    }
+
+    Exporter.pool = pool;
+    Exporter.interval = interval;
+    Exporter.stop = FALSE;
+    Exporter.start_time = metrics_time_us();
+    Exporter.last_time = Exporter.start_time;
+
+    if (json_path != NULL) {
+        Exporter.json_file = fopen(json_path, "a");
+        if (Exporter.json_file == NULL) {
+            LOG_FATALF("metrics.c", "Could not open metrics file %s: %s", json_path, strerror(errno));
+        }
+    }
+
+    if (listen_address != NULL) {
+        mg_mgr_init(&Exporter.mgr);
+        if (mg_http_listen(&Exporter.mgr, listen_address, metrics_ev_handler, NULL) == NULL) {
+            LOG_FATALF("metrics.c", "Couldn't bind metrics endpoint on address %s", listen_address);
+        }
+        Exporter.listening = TRUE;
+        LOG_INFOF("metrics.c", "Serving metrics @ http://%s/metrics", listen_address);
+    }
+
+    pthread_create(&Exporter.thread, NULL, metrics_exporter_thread, NULL);
+}
+
+void metrics_stop() {
+    if (metrics == NULL) {
+        return;
+    }
+
+    if (Exporter.pool != NULL) {
+        Exporter.stop = TRUE;
+        pthread_join(Exporter.thread, NULL);
+
+        if (Exporter.json_file != NULL) {
+            metrics_write_json_line();
+            fclose(Exporter.json_file);
+            Exporter.json_file = NULL;
+        }
+        if (Exporter.listening) {
+            mg_mgr_free(&Exporter.mgr);
+            Exporter.listening = FALSE;
+        }
+        Exporter.pool = NULL;
+    }
+
+    metrics_shm_t *shm = metrics;
+    metrics = NULL;
+    pthread_mutex_destroy(&shm->mutex);
+    munmap(shm, sizeof(metrics_shm_t));
+}
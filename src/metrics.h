@@ -0,0 +1,62 @@
+#ifndef SIST2_METRICS_H
+#define SIST2_METRICS_H
+
+#include "sist.h"
+#include "tpool.h"
+
+/**
+ * Time spent by the workers in each step of a document
+ */
+typedef enum {
+    METRICS_STAGE_MIME,
+    METRICS_STAGE_PARSE,
+    METRICS_STAGE_SERIALIZE,
+    METRICS_STAGE_DB_WRITE,
+    METRICS_STAGE_INDEX,
+    METRICS_STAGE_HASH,
+    METRICS_STAGE_COUNT,
+} metrics_stage_t;
+
+/**
+ * Counters are kept in shared memory, must be called before the workers are started.
+ * Until then (and after metrics_stop()), recording is a no-op.
+ */
+void metrics_init();
+
+/**
+ * Start exporting the metrics from a thread of the main process
+ * @param json_path Append a JSON line to this file every interval seconds, can be NULL
+ * @param listen_address Serve /metrics in Prometheus text format on this address, can be NULL
+ */
+void metrics_start(tpool_t *pool, const char *json_path, const char *listen_address, int interval);
+
+/**
+ * Write the last JSON line and stop exporting, must be called before tpool_destroy()
+ */
+void metrics_stop();
+
+/**
+ * Monotonic time, in µs
+ */
+long metrics_time_us();
+
+void metrics_record_stage(metrics_stage_t stage, int count, long time);
+
+/**
+ * Called by the workers after each document, time is in µs
+ */
+void metrics_record_parse(unsigned int mime, int file_type, long size, long parse_time, long total_time);
+
+void metrics_record_batch(int thread_id, int job_count, long time);
+
+/**
+ * @param size of the file, counted in the bytes that were not parsed if this is a hit
+ */
+void metrics_record_parse_cache(int hit, long size);
+
+/**
+ * Called by the workers after each media file that was probed with the fast probe first
+ */
+void metrics_record_media_probe(int escalated);
+
+#endif
@@ -0,0 +1,277 @@
+#include "checksum.h"
+#include "src/ctx.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+
+#ifdef SIST_XXHASH
+#include <xxhash.h>
+#endif
+#ifdef SIST_BLAKE3
+#include <blake3.h>
+#endif
+
+static const char *checksum_algorithm_names[] = {"sha1", "xxh3", "blake3"};
+
+typedef struct {
+    checksum_algorithm_t algorithm;
+    EVP_MD_CTX *sha1_ctx;
+#ifdef SIST_XXHASH
+    XXH3_state_t *xxh3_state;
+#endif
+#ifdef SIST_BLAKE3
+    blake3_hasher blake3;
+#endif
+} checksum_ctx_t;
+
+int checksum_get_algorithm(const char *name) {
+    if (strcmp(name, "sha1") == 0) {
+        return CHECKSUM_SHA1;
+    }
+#ifdef SIST_XXHASH
+    if (strcmp(name, "xxh3") == 0) {
+        return CHECKSUM_XXH3;
+    }
+#endif
+#ifdef SIST_BLAKE3
+    if (strcmp(name, "blake3") == 0) {
+        return CHECKSUM_BLAKE3;
+    }
+#endif
+    return -1;
+}
+
+const char *checksum_get_algorithm_name(checksum_algorithm_t algorithm) {
+    return checksum_algorithm_names[algorithm];
+}
+
+static void checksum_ctx_init(checksum_ctx_t *ctx, checksum_algorithm_t algorithm) {
+    ctx->algorithm = algorithm;
+
+    switch (algorithm) {
+#ifdef SIST_XXHASH
+        case CHECKSUM_XXH3:
+            ctx->xxh3_state = XXH3_createState();
+            XXH3_128bits_reset(ctx->xxh3_state);
+            break;
+#endif
+#ifdef SIST_BLAKE3
+        case CHECKSUM_BLAKE3:
+            blake3_hasher_init(&ctx->blake3);
+            break;
+#endif
+        case CHECKSUM_SHA1:
+        default:
+            ctx->sha1_ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(ctx->sha1_ctx, EVP_sha1(), NULL);
+            break;
+    }
+}
+
+static void checksum_ctx_update(checksum_ctx_t *ctx, const void *buf, size_t len) {
+    switch (ctx->algorithm) {
+#ifdef SIST_XXHASH
+        case CHECKSUM_XXH3:
+            XXH3_128bits_update(ctx->xxh3_state, buf, len);
+            break;
+#endif
+#ifdef SIST_BLAKE3
+        case CHECKSUM_BLAKE3:
+            blake3_hasher_update(&ctx->blake3, buf, len);
+            break;
+#endif
+        case CHECKSUM_SHA1:
+        default:
+            EVP_DigestUpdate(ctx->sha1_ctx, buf, len);
+            break;
+    }
+}
+
+/**
+ * @return the length of the digest
+ */
+static int checksum_ctx_final(checksum_ctx_t *ctx, unsigned char *digest) {
+    switch (ctx->algorithm) {
+#ifdef SIST_XXHASH
+        case CHECKSUM_XXH3: {
+            XXH128_canonical_t canonical;
+            XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(ctx->xxh3_state));
+            XXH3_freeState(ctx->xxh3_state);
+            memcpy(digest, canonical.digest, sizeof(canonical.digest));
+            return sizeof(canonical.digest);
+        }
+#endif
+#ifdef SIST_BLAKE3
+        case CHECKSUM_BLAKE3:
+            blake3_hasher_finalize(&ctx->blake3, digest, BLAKE3_OUT_LEN);
+            return BLAKE3_OUT_LEN;
+#endif
+        case CHECKSUM_SHA1:
+        default:
+            EVP_DigestFinal_ex(ctx->sha1_ctx, digest, NULL);
+            EVP_MD_CTX_free(ctx->sha1_ctx);
+            return SHA1_DIGEST_LENGTH;
+    }
+}
+
+/**
+ * @return FALSE if the file could not be read
+ */
+static int checksum_file(const char *filepath, unsigned char *digest, int *digest_len) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd == -1) {
+        return FALSE;
+    }
+
+    // Doubles the readahead window, the parser reads the same pages from the cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    checksum_ctx_t ctx;
+    checksum_ctx_init(&ctx, ScanCtx.checksum_algorithm);
+
+    char *buf = malloc(CHECKSUM_READ_SIZE);
+    int ret = TRUE;
+
+    while (TRUE) {
+        ssize_t len = read(fd, buf, CHECKSUM_READ_SIZE);
+        if (len < 0) {
+            ret = FALSE;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        checksum_ctx_update(&ctx, buf, len);
+    }
+
+    free(buf);
+    close(fd);
+
+    *digest_len = checksum_ctx_final(&ctx, digest);
+    return ret;
+}
+
+typedef struct {
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    int has_request;
+    int done;
+    int stop;
+    char filepath[PATH_MAX];
+
+    int ok;
+    unsigned char digest[CHECKSUM_MAX_DIGEST_LENGTH];
+    int digest_len;
+} checksum_worker_t;
+
+static __thread checksum_worker_t *checksum_worker = NULL;
+
+static void *checksum_thread(void *arg) {
+    checksum_worker_t *worker = arg;
+    char filepath[PATH_MAX];
+
+    while (TRUE) {
+        pthread_mutex_lock(&worker->mutex);
+        while (!worker->has_request && !worker->stop) {
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+        }
+        if (worker->stop) {
+            pthread_mutex_unlock(&worker->mutex);
+            break;
+        }
+        worker->has_request = FALSE;
+        strcpy(filepath, worker->filepath);
+        pthread_mutex_unlock(&worker->mutex);
+
+        unsigned char digest[CHECKSUM_MAX_DIGEST_LENGTH];
+        int digest_len;
+        int ok = checksum_file(filepath, digest, &digest_len);
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->ok = ok;
+        memcpy(worker->digest, digest, digest_len);
+        worker->digest_len = digest_len;
+        worker->done = TRUE;
+        pthread_cond_broadcast(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+
+    return NULL;
+}
+
+void checksum_start(vfile_t *f) {
+    if (checksum_worker == NULL) {
+        checksum_worker = calloc(1, sizeof(checksum_worker_t));
+        pthread_mutex_init(&checksum_worker->mutex, NULL);
+        pthread_cond_init(&checksum_worker->cond, NULL);
+    }
+    checksum_worker_t *worker = checksum_worker;
+
+    // Handing small files to the thread costs more than hashing them
+    if (vfile_head_is_whole_file(f)) {
+        checksum_ctx_t ctx;
+        checksum_ctx_init(&ctx, ScanCtx.checksum_algorithm);
+        checksum_ctx_update(&ctx, f->head, f->head_size);
+        worker->digest_len = checksum_ctx_final(&ctx, worker->digest);
+        worker->ok = TRUE;
+        worker->done = TRUE;
+        return;
+    }
+    if (f->st_size <= CHECKSUM_INLINE_MAX_SIZE) {
+        worker->ok = checksum_file(f->filepath, worker->digest, &worker->digest_len);
+        worker->done = TRUE;
+        return;
+    }
+
+    if (!worker->thread_started) {
+        pthread_create(&worker->thread, NULL, checksum_thread, worker);
+        worker->thread_started = TRUE;
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+    strcpy(worker->filepath, f->filepath);
+    worker->done = FALSE;
+    worker->has_request = TRUE;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+int checksum_finish(char *checksum_str) {
+    checksum_worker_t *worker = checksum_worker;
+
+    pthread_mutex_lock(&worker->mutex);
+    while (!worker->done) {
+        pthread_cond_wait(&worker->cond, &worker->mutex);
+    }
+    int ok = worker->ok;
+    if (ok) {
+        buf2hex(worker->digest, worker->digest_len, checksum_str);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    return ok;
+}
+
+void checksum_cleanup() {
+    checksum_worker_t *worker = checksum_worker;
+    if (worker == NULL) {
+        return;
+    }
+
+    if (worker->thread_started) {
+        pthread_mutex_lock(&worker->mutex);
+        worker->stop = TRUE;
+        pthread_cond_broadcast(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+        pthread_join(worker->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&worker->mutex);
+    pthread_cond_destroy(&worker->cond);
+    free(worker);
+    checksum_worker = NULL;
+}
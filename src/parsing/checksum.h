@@ -0,0 +1,49 @@
+#ifndef SIST2_CHECKSUM_H
+#define SIST2_CHECKSUM_H
+
+#include "src/sist.h"
+
+typedef enum {
+    CHECKSUM_SHA1,
+    /** XXH3 128-bit, requires libxxhash */
+    CHECKSUM_XXH3,
+    /** BLAKE3 256-bit, requires libblake3 */
+    CHECKSUM_BLAKE3,
+} checksum_algorithm_t;
+
+#define CHECKSUM_MAX_DIGEST_LENGTH 32
+#define CHECKSUM_STR_MAX_LENGTH (CHECKSUM_MAX_DIGEST_LENGTH * 2 + 1)
+
+/**
+ * Files up to this size are hashed by the calling thread
+ */
+#define CHECKSUM_INLINE_MAX_SIZE (256 * 1024)
+
+#define CHECKSUM_READ_SIZE (1024 * 1024)
+
+/**
+ * @return -1 if the name is unknown or the algorithm is not available in this build
+ */
+int checksum_get_algorithm(const char *name);
+
+const char *checksum_get_algorithm_name(checksum_algorithm_t algorithm);
+
+/**
+ * Start computing the checksum of the whole file with ScanCtx.checksum_algorithm.
+ * Large files are read by a background thread of the worker while they are parsed.
+ */
+void checksum_start(vfile_t *f);
+
+/**
+ * Wait for the checksum of the file given to checksum_start()
+ * @param checksum_str hex digest, at least CHECKSUM_STR_MAX_LENGTH bytes
+ * @return FALSE if the file could not be read
+ */
+int checksum_finish(char *checksum_str);
+
+/**
+ * Stop the background thread of the calling thread
+ */
+void checksum_cleanup();
+
+#endif
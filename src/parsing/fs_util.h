@@ -3,45 +3,74 @@
 
 #include "src/sist.h"
 #include <openssl/evp.h>
+#include <sys/mman.h>
 
 #define CLOSE_FILE(f) if ((f).close != NULL) {(f).close(&(f));};
 
-static int fs_read(struct vfile *f, void *buf, size_t size) {
+static int fs_open(struct vfile *f) {
+    if (f->fd != -1) {
+        return 0;
+    }
+
+    f->fd = open(f->filepath, O_RDONLY);
     if (f->fd == -1) {
-        f->sha1_ctx = EVP_MD_CTX_new();
-        EVP_DigestInit_ex(f->sha1_ctx, EVP_sha1(), NULL);
+        return -1;
+    }
 
-        f->fd = open(f->filepath, O_RDONLY);
-        if (f->fd == -1) {
-            EVP_MD_CTX_free(f->sha1_ctx);
-            return -1;
-        }
+    return 0;
+}
+
+/**
+ * pread() at the cursor: the offset of the file descriptor is never used, reset() does not need a syscall
+ */
+static int fs_read(struct vfile *f, void *buf, size_t size) {
+    if (fs_open(f) == -1) {
+        return -1;
     }
 
-    int ret = (int) read(f->fd, buf, size);
+    size_t copied = vfile_read_head(f, buf, size);
+    if (copied == size || vfile_head_is_whole_file(f)) {
+        return (int) copied;
+    }
 
-    if (ret != 0 && f->calculate_checksum) {
-        f->has_checksum = TRUE;
-        safe_digest_update(f->sha1_ctx, (unsigned char *) buf, ret);
+    int ret = (int) pread(f->fd, (char *) buf + copied, size - copied, (off_t) f->cursor);
+    if (ret < 0) {
+        return copied > 0 ? (int) copied : ret;
     }
 
-    return ret;
+    vfile_consume(f, (char *) buf + copied, ret);
+    return (int) copied + ret;
 }
 
-static void fs_close(struct vfile *f) {
-    if (f->fd != -1) {
-        EVP_DigestFinal_ex(f->sha1_ctx, f->sha1_digest, NULL);
-        EVP_MD_CTX_free(f->sha1_ctx);
-        f->sha1_ctx = NULL;
-        close(f->fd);
-        f->fd = -1;
+/**
+ * Files that shrank since the walker's stat are read instead: the pages past the end
+ * of the file would raise SIGBUS in the worker.
+ */
+static const void *fs_map(struct vfile *f, size_t *size) {
+    if (fs_open(f) == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(f->fd, &st) != 0 || (size_t) st.st_size < f->st_size) {
+        return NULL;
+    }
+
+    void *data = mmap(NULL, f->st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
     }
+
+    *size = f->st_size;
+    return data;
 }
 
-static void fs_reset(struct vfile *f) {
+static void fs_close(struct vfile *f) {
     if (f->fd != -1) {
-        lseek(f->fd, 0, SEEK_SET);
+        close(f->fd);
+        f->fd = -1;
     }
+    vfile_free_buffers(f);
 }
 
 #endif
@@ -4,22 +4,43 @@
 #include <magic.h>
 #include "src/magic_generated.c"
 
+/**
+ * Loading the embedded database takes much longer than a lookup,
+ * each worker keeps its own handle (libmagic handles are not thread safe)
+ */
+static __thread magic_t Magic = NULL;
+
+void magic_init() {
+    if (Magic != NULL) {
+        return;
+    }
 
-char *magic_buffer_embedded(void *buffer, size_t buffer_size) {
-
-    magic_t magic = magic_open(MAGIC_MIME_TYPE);
+    Magic = magic_open(MAGIC_MIME_TYPE);
 
     const char *magic_buffers[1] = {magic_database_buffer,};
     size_t sizes[1] = {sizeof(magic_database_buffer),};
 
-    // TODO optimisation: check if we can reuse the magic instance
-    int load_ret = magic_load_buffers(magic, (void **) &magic_buffers, sizes, 1);
+    int load_ret = magic_load_buffers(Magic, (void **) &magic_buffers, sizes, 1);
 
     if (load_ret != 0) {
         LOG_FATALF("parse.c", "Could not load libmagic database: (%d)", load_ret);
     }
+}
+
+void magic_cleanup() {
+    if (Magic != NULL) {
+        magic_close(Magic);
+        Magic = NULL;
+    }
+}
+
+
+char *magic_buffer_embedded(void *buffer, size_t buffer_size) {
+
+    // Lazy init for callers outside of the worker processes
+    magic_init();
 
-    const char *magic_mime_str = magic_buffer(magic, buffer, buffer_size);
+    const char *magic_mime_str = magic_buffer(Magic, buffer, buffer_size);
     char *return_value = NULL;
 
     if (magic_mime_str != NULL) {
@@ -27,6 +48,5 @@ char *magic_buffer_embedded(void *buffer, size_t buffer_size) {
         strcpy(return_value, magic_mime_str);
     }
 
-    magic_close(magic);
     return return_value;
-}
\ No newline at end of file
+}
@@ -2,6 +2,14 @@
 #define SIST2_MAGIC_UTIL_H
 
 #include <stdio.h>
+#include "libscan/magic_sniff/magic_sniff.h"
+
+/**
+ * Load the embedded libmagic database for the calling worker
+ */
+void magic_init();
+
+void magic_cleanup();
 
 char *magic_buffer_embedded(void *buffer, size_t buffer_size);
 
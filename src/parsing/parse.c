@@ -6,6 +6,9 @@
 #include "src/io/serialize.h"
 #include "src/parsing/fs_util.h"
 #include "src/parsing/magic_util.h"
+#include "src/parsing/parse_cache.h"
+#include "src/parsing/checksum.h"
+#include "src/metrics.h"
 
 
 #define MIN_VIDEO_SIZE (1024 * 64)
@@ -13,22 +16,14 @@
 
 #define MAGIC_BUF_SIZE (4096 * 6)
 
-typedef enum {
-    FILETYPE_DONT_PARSE,
-    FILETYPE_RAW,
-    FILETYPE_MEDIA,
-    FILETYPE_EBOOK,
-    FILETYPE_MARKUP,
-    FILETYPE_TEXT,
-    FILETYPE_FONT,
-    FILETYPE_ARCHIVE,
-    FILETYPE_OOXML,
-    FILETYPE_COMIC,
-    FILETYPE_MOBI,
-    FILETYPE_MSDOC,
-    FILETYPE_JSON,
-    FILETYPE_NDJSON,
-} file_type_t;
+static const char *file_type_names[FILETYPE_COUNT] = {
+        "none", "raw", "media", "ebook", "markup", "text", "font",
+        "archive", "ooxml", "comic", "mobi", "msdoc", "json", "ndjson",
+};
+
+const char *get_file_type_name(file_type_t type) {
+    return file_type_names[type];
+}
 
 file_type_t get_file_type(unsigned int mime, size_t size, const char *filepath) {
 
@@ -67,6 +62,7 @@ file_type_t get_file_type(unsigned int mime, size_t size, const char *filepath)
     } else if (is_ndjson(&ScanCtx.json_ctx, mime)) {
         return FILETYPE_NDJSON;
     }
+    return FILETYPE_DONT_PARSE;
 }
 
 #define GET_MIME_ERROR_FATAL (-1)
@@ -112,17 +108,23 @@ int get_mime(parse_job_t *job) {
         return GET_MIME_ERROR_FATAL;
     }
 
-    char *magic_mime_str = magic_buffer_embedded(buf, bytes_read);
+    const char *magic_mime_str = magic_sniff(buf, bytes_read);
+    char *libmagic_mime_str = NULL;
+
+    if (magic_mime_str == NULL) {
+        libmagic_mime_str = magic_buffer_embedded(buf, bytes_read);
+        magic_mime_str = libmagic_mime_str;
+    }
 
     if (magic_mime_str != NULL) {
         mime = (int) mime_get_mime_by_string(magic_mime_str);
 
         if (mime == 0) {
             LOG_WARNINGF(job->filepath, "Couldn't find mime %s", magic_mime_str);
-            free(magic_mime_str);
+            free(libmagic_mime_str);
             return 0;
         }
-        free(magic_mime_str);
+        free(libmagic_mime_str);
     }
 
     if (job->vfile.reset != NULL) {
@@ -132,16 +134,49 @@ int get_mime(parse_job_t *job) {
     return mime;
 }
 
+int fan_out_archive_entries(vfile_t *f, int entry_start, int entry_count) {
+    parse_job_t *job = create_parse_job(f->filepath, f->mtime, f->st_size);
+    job->arc_entry_start = entry_start;
+    job->arc_entry_count = entry_count;
+
+    int ret = tpool_try_add_work(ScanCtx.pool, &(job_t) {
+            .type = JOB_PARSE_JOB,
+            .parse_job = job
+    });
+    free(job);
+
+    return ret;
+}
+
+int borrow_idle_workers(int max) {
+    return tpool_borrow_idle_workers(ScanCtx.pool, max);
+}
+
+void return_idle_workers(int count) {
+    tpool_return_idle_workers(ScanCtx.pool, count);
+}
+
 void parse(parse_job_t *job) {
+    TIMER_INIT();
+    TIMER_START();
 
     if (job->vfile.is_fs_file) {
         job->vfile.read = fs_read;
-        job->vfile.read_rewindable = fs_read;
-        job->vfile.reset = fs_reset;
+        job->vfile.read_rewindable = vfile_read_rewindable;
+        job->vfile.reset = vfile_reset;
         job->vfile.close = fs_close;
+        job->vfile.map = fs_map;
         job->vfile.calculate_checksum = ScanCtx.calculate_checksums;
     }
 
+    // The archive itself was already written by the job that split it
+    if (job->arc_entry_count > 0) {
+        parse_archive_range(&ScanCtx.arc_ctx, &job->vfile, ScanCtx.exclude, ScanCtx.exclude_extra,
+                            job->arc_entry_start, job->arc_entry_count);
+        CLOSE_FILE(job->vfile)
+        return;
+    }
+
     document_t *doc = malloc(sizeof(document_t));
 
     strcpy(doc->filepath, job->filepath);
@@ -151,7 +186,9 @@ void parse(parse_job_t *job) {
     doc->meta_tail = NULL;
     doc->size = job->vfile.st_size;
     doc->mtime = MAX(job->vfile.mtime, 0);
+    long mime_start = metrics_time_us();
     doc->mime = get_mime(job);
+    metrics_record_stage(METRICS_STAGE_MIME, 1, metrics_time_us() - mime_start);
     doc->thumbnail_count = 0;
     strcpy(doc->parent, job->parent);
 
@@ -161,13 +198,32 @@ void parse(parse_job_t *job) {
         return;
     }
 
-    if (database_mark_document(ProcData.index_db, doc->filepath + ScanCtx.index.desc.root_len, doc->mtime)) {
+    if (database_writer_mark_document(ScanCtx.index_writer, doc->filepath + ScanCtx.index.desc.root_len, doc->mtime)) {
         CLOSE_FILE(job->vfile)
         free(doc);
         return;
     }
 
-    switch (get_file_type(doc->mime, doc->size, doc->filepath)) {
+    file_type_t file_type = get_file_type(doc->mime, doc->size, doc->filepath);
+
+    char cache_hash[PARSE_CACHE_HASH_STR_LENGTH] = "";
+    if (ScanCtx.parse_cache && parse_cache_should_use(job, file_type)) {
+        if (parse_cache_lookup(job, doc, cache_hash)) {
+            CLOSE_FILE(job->vfile)
+            free(doc);
+            return;
+        }
+    }
+
+    int checksum_started = FALSE;
+    if (ScanCtx.calculate_checksums && job->vfile.is_fs_file) {
+        checksum_start(&job->vfile);
+        checksum_started = TRUE;
+    }
+
+    long parse_start = metrics_time_us();
+
+    switch (file_type) {
         case FILETYPE_RAW:
             parse_raw(&ScanCtx.raw_ctx, &job->vfile, doc);
             break;
@@ -189,7 +245,7 @@ void parse(parse_job_t *job) {
         case FILETYPE_ARCHIVE:
 
             // Insert the document now so that the children documents can link to an existing ID
-            database_write_document(ProcData.index_db, doc, NULL);
+            database_writer_write_document(ScanCtx.index_writer, doc, NULL, NULL);
 
             parse_archive(&ScanCtx.arc_ctx, &job->vfile, doc, ScanCtx.exclude, ScanCtx.exclude_extra);
             break;
@@ -217,12 +273,32 @@ void parse(parse_job_t *job) {
     }
 
     CLOSE_FILE(job->vfile)
-
-    if (job->vfile.has_checksum) {
+    long file_type_time = metrics_time_us() - parse_start;
+
+    if (checksum_started) {
+        long checksum_wait_start = metrics_time_us();
+        char checksum_str[CHECKSUM_STR_MAX_LENGTH];
+        if (checksum_finish(checksum_str)) {
+            APPEND_STR_META(doc, MetaChecksum, (const char *) checksum_str);
+            APPEND_STR_META(doc, MetaChecksumAlgorithm, checksum_get_algorithm_name(ScanCtx.checksum_algorithm));
+        }
+        metrics_record_stage(METRICS_STAGE_HASH, 1, metrics_time_us() - checksum_wait_start);
+    } else if (job->vfile.has_checksum) {
+        // Entries of archives are hashed while they are read
         char sha1_digest_str[SHA1_STR_LENGTH];
         buf2hex((unsigned char *) job->vfile.sha1_digest, SHA1_DIGEST_LENGTH, (char *) sha1_digest_str);
         APPEND_STR_META(doc, MetaChecksum, (const char *) sha1_digest_str);
+        APPEND_STR_META(doc, MetaChecksumAlgorithm, checksum_get_algorithm_name(CHECKSUM_SHA1));
     }
 
+    long parse_time;
+    TIMER_END(parse_time);
+    tpool_record_parse_cost(ScanCtx.pool, doc->mime, (long) doc->size, parse_time);
+    metrics_record_parse(doc->mime, file_type, (long) doc->size, file_type_time, parse_time);
+
     write_document(doc);
+
+    if (cache_hash[0] != '\0') {
+        parse_cache_store(job, cache_hash);
+    }
 }
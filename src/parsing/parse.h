@@ -4,7 +4,38 @@
 #include "../sist.h"
 #include "src/tpool.h"
 
+typedef enum {
+    FILETYPE_DONT_PARSE,
+    FILETYPE_RAW,
+    FILETYPE_MEDIA,
+    FILETYPE_EBOOK,
+    FILETYPE_MARKUP,
+    FILETYPE_TEXT,
+    FILETYPE_FONT,
+    FILETYPE_ARCHIVE,
+    FILETYPE_OOXML,
+    FILETYPE_COMIC,
+    FILETYPE_MOBI,
+    FILETYPE_MSDOC,
+    FILETYPE_JSON,
+    FILETYPE_NDJSON,
+    FILETYPE_COUNT,
+} file_type_t;
+
+const char *get_file_type_name(file_type_t type);
 
 void parse(parse_job_t *arg);
 
+/**
+ * Queue a range of entries of an archive as a separate parse job (scan_arc_ctx_t.fan_out)
+ */
+int fan_out_archive_entries(vfile_t *f, int entry_start, int entry_count);
+
+/**
+ * Lend idle workers of the pool to the page range threads of an ebook (scan_ebook_ctx_t.borrow_threads)
+ */
+int borrow_idle_workers(int max);
+
+void return_idle_workers(int count);
+
 #endif
@@ -0,0 +1,106 @@
+#include "parse_cache.h"
+
+#include "src/ctx.h"
+#include "src/io/serialize.h"
+#include "src/metrics.h"
+#include "fs_util.h"
+
+#define PARSE_CACHE_READ_SIZE (1024 * 1024)
+
+int parse_cache_should_use(parse_job_t *job, file_type_t file_type) {
+    // Archives are written before their children, which are not in the cache
+    return job->vfile.is_fs_file
+           && job->parent[0] == '\0'
+           && file_type != FILETYPE_DONT_PARSE
+           && file_type != FILETYPE_ARCHIVE
+           && job->vfile.st_size > 0
+           && job->vfile.st_size <= PARSE_CACHE_MAX_FILE_SIZE;
+}
+
+/**
+ * Options of the scan that change the documents and thumbnails. They are part of the
+ * hash: the documents of a scan with other options are not reused.
+ */
+static void parse_cache_hash_options(EVP_MD_CTX *ctx) {
+    char options[1024];
+    int len = snprintf(
+            options, sizeof(options),
+            "content_size=%ld;tn=%d,%d,%d,%d;subtitles=%d;ocr=%s,%s;ebook_tn=%d;fast_epub=%d;checksum=%d,%d;",
+            ScanCtx.text_ctx.content_size,
+            ScanCtx.media_ctx.tn_count, ScanCtx.media_ctx.tn_size, ScanCtx.media_ctx.tn_qscale,
+            ScanCtx.media_ctx.fast_thumbnails,
+            ScanCtx.media_ctx.read_subtitles,
+            ScanCtx.media_ctx.tesseract_lang != NULL ? ScanCtx.media_ctx.tesseract_lang : "",
+            ScanCtx.ebook_ctx.tesseract_lang != NULL ? ScanCtx.ebook_ctx.tesseract_lang : "",
+            ScanCtx.ebook_ctx.enable_tn,
+            ScanCtx.ebook_ctx.fast_epub_parse,
+            ScanCtx.calculate_checksums, ScanCtx.checksum_algorithm
+    );
+    EVP_DigestUpdate(ctx, options, MIN(len, (int) sizeof(options) - 1));
+}
+
+/**
+ * BLAKE2b of the content of the file and of the parse options,
+ * read with pread(): the cursor of the vfile does not move
+ */
+static int parse_cache_hash(vfile_t *f, unsigned char *digest) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_blake2b512(), NULL);
+    parse_cache_hash_options(ctx);
+
+    int ret = TRUE;
+
+    if (vfile_head_is_whole_file(f)) {
+        EVP_DigestUpdate(ctx, f->head, f->head_size);
+    } else if (fs_open(f) == -1) {
+        ret = FALSE;
+    } else {
+        char *buf = malloc(PARSE_CACHE_READ_SIZE);
+        off_t offset = 0;
+
+        while (TRUE) {
+            ssize_t len = pread(f->fd, buf, PARSE_CACHE_READ_SIZE, offset);
+            if (len < 0) {
+                ret = FALSE;
+                break;
+            }
+            if (len == 0) {
+                break;
+            }
+            EVP_DigestUpdate(ctx, buf, len);
+            offset += len;
+        }
+        free(buf);
+    }
+
+    unsigned char full_digest[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex(ctx, full_digest, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    memcpy(digest, full_digest, PARSE_CACHE_HASH_LENGTH);
+    return ret;
+}
+
+int parse_cache_lookup(parse_job_t *job, document_t *doc, char *hash) {
+    long start = metrics_time_us();
+
+    unsigned char digest[PARSE_CACHE_HASH_LENGTH];
+    if (!parse_cache_hash(&job->vfile, digest)) {
+        hash[0] = '\0';
+        return FALSE;
+    }
+    buf2hex(digest, PARSE_CACHE_HASH_LENGTH, hash);
+    metrics_record_stage(METRICS_STAGE_HASH, 1, metrics_time_us() - start);
+
+    char *json_data = serialize_duplicate(doc->filepath);
+    int hit = database_writer_write_cached_document(ScanCtx.index_writer, doc->filepath, hash, doc->mtime,
+                                                    json_data);
+    free(json_data);
+
+    metrics_record_parse_cache(hit, (long) doc->size);
+    return hit;
+}
+
+void parse_cache_store(parse_job_t *job, const char *hash) {
+    database_writer_write_parse_cache(ScanCtx.index_writer, job->filepath, hash);
+}
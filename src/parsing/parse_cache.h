@@ -0,0 +1,34 @@
+#ifndef SIST2_PARSE_CACHE_H
+#define SIST2_PARSE_CACHE_H
+
+#include "src/sist.h"
+#include "parse.h"
+
+#define PARSE_CACHE_HASH_LENGTH 32
+#define PARSE_CACHE_HASH_STR_LENGTH (PARSE_CACHE_HASH_LENGTH * 2 + 1)
+
+/**
+ * The whole file is read to compute its hash: the parsers of larger
+ * files (mostly media) usually read a small fraction of them
+ */
+#define PARSE_CACHE_MAX_FILE_SIZE (512L * 1024 * 1024)
+
+/**
+ * @return TRUE if the document can be read from, and written to the parse cache
+ */
+int parse_cache_should_use(parse_job_t *job, file_type_t file_type);
+
+/**
+ * Write the document from the parse cache if a document with the same content was parsed before
+ * @param hash set to the hex hash of the content of the file and of the parse options,
+ *             empty string if it could not be read
+ * @return TRUE if the document was written, it must not be parsed
+ */
+int parse_cache_lookup(parse_job_t *job, document_t *doc, char *hash);
+
+/**
+ * Add the document that was just parsed to the parse cache
+ */
+void parse_cache_store(parse_job_t *job, const char *hash);
+
+#endif
@@ -4,16 +4,72 @@
 #include <pthread.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <limits.h>
 #include "parsing/parse.h"
+#include "job_ring.h"
+#include "parsing/magic_util.h"
+#include "parsing/mime.h"
+#include "libscan/ocr/ocr.h"
+#include "libscan/media/media.h"
+#include "libscan/mem_budget/mem_budget.h"
+#include "metrics.h"
+#include "io/uring.h"
+#include "parsing/checksum.h"
 
 #define BLANK_STR "                                         "
 
+/**
+ * Maximum number of jobs a worker claims at once
+ */
+#define JOB_BATCH_MAX 64
+/**
+ * Target duration of a batch of jobs, in microseconds
+ */
+#define JOB_BATCH_TARGET_TIME (10 * MILLISECOND)
+
+/**
+ * With a schedule other than FIFO, the job queue is only filled up to this many
+ * jobs per worker. The rest waits in the main process, sorted by priority.
+ */
+#define SCHEDULE_QUEUE_DEPTH JOB_BATCH_MAX
+
+#define PARSE_COST_TABLE_SIZE 4096
+
+/**
+ * Time between two decisions of the worker count controller, in µs
+ */
+#define CONTROLLER_INTERVAL (5000 * MILLISECOND)
+
+/**
+ * Relative change of throughput that the controller considers significant
+ */
+#define CONTROLLER_THRESHOLD 0.05
+
+/**
+ * Size of the copy of the current batch of each worker
+ */
+#define JOB_BATCH_COPY_SIZE (1024 * 1024)
+
+/**
+ * One job queue per job type, stored after the shared struct. There is no queue for JOB_UNDEFINED.
+ * The batch copies of the workers come next, indexed by thread_id.
+ */
+#define SHM_SIZE(pool) (sizeof(*(pool)->shm) + (JOB_TYPE_COUNT - 1) * JOB_RING_SIZE \
+                        + ((pool)->num_threads + 1) * JOB_BATCH_COPY_SIZE)
+
 typedef struct {
     int thread_id;
     tpool_t *pool;
 } start_thread_arg_t;
 
 
+typedef struct {
+    double priority;
+    char *filepath;
+    int mtime;
+    long st_size;
+} scheduled_job_t;
+
 typedef struct tpool {
     pthread_t threads[256];
     void *start_thread_args[256];
@@ -21,8 +77,22 @@ typedef struct tpool {
 
     int print_progress;
 
+    // Jobs waiting to be fed to the workers in priority order, only used by the main process
+    schedule_policy_t schedule;
+    pthread_t feeder_thread;
+    pthread_mutex_t schedule_mutex;
+    pthread_cond_t schedule_cond;
+    scheduled_job_t *scheduled_jobs;
+    int scheduled_capacity;
+    int scheduled_closed;
+    int feeder_running;
+
+    // Adaptive worker count, only used by the main process
+    int min_threads;
+    pthread_t controller_thread;
+    int controller_running;
+
     struct {
-        job_type_t job_type;
         int stop;
         int waiting;
         database_ipc_ctx_t ipc_ctx;
@@ -30,10 +100,40 @@ typedef struct tpool {
         pthread_mutex_t data_mutex;
         pthread_cond_t done_working_cond;
         pthread_cond_t workers_initialized_cond;
-        int busy_count;
+        /** Workers that are taking or running jobs */
+        _Atomic int busy_count;
         int initialized_count;
-        int thread_id_to_pid_mapping[MAX_THREADS];
-        char ipc_database_filepath[128];
+        /** Indexed by thread_id, from 1 to num_threads */
+        int thread_id_to_pid_mapping[MAX_THREADS + 1];
+
+        /** Jobs of each type have their own queue, the workers take from them in proportion to their weight */
+        job_ring_t rings[JOB_TYPE_COUNT];
+        int weights[JOB_TYPE_COUNT];
+        int claimed_count[JOB_TYPE_COUNT];
+        job_type_t current_batch_type[MAX_THREADS + 1];
+        /** Workers between taking jobs from a queue and counting them as claimed */
+        _Atomic int taking[MAX_THREADS + 1];
+
+        /** Workers waiting for jobs, waken up through job_available_seq */
+        _Atomic int idle_count;
+        _Atomic uint32_t job_available_seq;
+        /** Idle workers lent to the extra threads of a parser, in total and by each worker */
+        _Atomic int borrowed_count;
+        _Atomic int borrowed[MAX_THREADS + 1];
+
+        /** Workers with a higher thread_id are parked by the controller */
+        int active_count;
+        _Atomic uint32_t unpark_seq;
+
+        int scheduled_count;
+
+        /** Time (µs) at which the n-th worker found no more jobs to do */
+        long out_of_work_time[MAX_THREADS + 1];
+        int out_of_work_count;
+
+        parse_cost_t parse_costs[PARSE_COST_TABLE_SIZE];
+        long parse_cost_total_size;
+        long parse_cost_total_time;
     } *shm;
 } tpool_t;
 
@@ -45,67 +145,593 @@ void job_destroy(job_t *job) {
     free(job);
 }
 
+static job_batch_t *worker_batch(tpool_t *pool, int thread_id) {
+    return (job_batch_t *) ((char *) pool->shm + sizeof(*pool->shm) + (JOB_TYPE_COUNT - 1) * JOB_RING_SIZE
+                            + thread_id * JOB_BATCH_COPY_SIZE);
+}
+
+static long monotonic_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Must be called with data_mutex held
+ */
+static parse_cost_t *parse_cost_lookup(tpool_t *pool, unsigned int mime, int create) {
+    unsigned int slot = (mime * 2654435761u) % PARSE_COST_TABLE_SIZE;
+
+    for (int i = 0; i < PARSE_COST_TABLE_SIZE; i++) {
+        parse_cost_t *cost = &pool->shm->parse_costs[(slot + i) % PARSE_COST_TABLE_SIZE];
+
+        if (cost->count == 0) {
+            if (!create) {
+                return NULL;
+            }
+            cost->mime = mime;
+            return cost;
+        }
+        if (cost->mime == mime) {
+            return cost;
+        }
+    }
+
+    return NULL;
+}
+
+void tpool_record_parse_cost(tpool_t *pool, unsigned int mime, long size, long time) {
+    pthread_mutex_lock(&pool->shm->data_mutex);
+
+    parse_cost_t *cost = parse_cost_lookup(pool, mime, TRUE);
+    if (cost != NULL) {
+        cost->count += 1;
+        cost->size += size;
+        cost->time += time;
+    }
+    pool->shm->parse_cost_total_size += size;
+    pool->shm->parse_cost_total_time += time;
+
+    pthread_mutex_unlock(&pool->shm->data_mutex);
+}
+
+parse_cost_t *tpool_get_parse_costs(tpool_t *pool, int *count) {
+    parse_cost_t *costs = malloc(sizeof(parse_cost_t) * PARSE_COST_TABLE_SIZE);
+    *count = 0;
+
+    pthread_mutex_lock(&pool->shm->data_mutex);
+    for (int i = 0; i < PARSE_COST_TABLE_SIZE; i++) {
+        if (pool->shm->parse_costs[i].count != 0) {
+            costs[(*count)++] = pool->shm->parse_costs[i];
+        }
+    }
+    pthread_mutex_unlock(&pool->shm->data_mutex);
+
+    return costs;
+}
+
+/**
+ * Expected parse time of a file: its size times the time per byte of its
+ * mime type (guessed from the extension), or of all files when it is unknown
+ */
+static double parse_job_expected_cost(tpool_t *pool, parse_job_t *job) {
+    unsigned int mime = 0;
+    if (job->filepath[job->ext] != '\0') {
+        mime = mime_get_mime_by_ext(job->filepath + job->ext);
+    }
+
+    double time_per_byte = 1;
+
+    pthread_mutex_lock(&pool->shm->data_mutex);
+    parse_cost_t *cost = parse_cost_lookup(pool, mime, FALSE);
+    if (cost != NULL && cost->size > 0) {
+        time_per_byte = (double) cost->time / (double) cost->size;
+    } else if (pool->shm->parse_cost_total_size > 0) {
+        time_per_byte = (double) pool->shm->parse_cost_total_time / (double) pool->shm->parse_cost_total_size;
+    }
+    pthread_mutex_unlock(&pool->shm->data_mutex);
+
+    return time_per_byte * (double) job->vfile.st_size;
+}
+
+static double parse_job_priority(tpool_t *pool, parse_job_t *job) {
+    switch (pool->schedule) {
+        case SCHEDULE_LARGEST_FIRST:
+            return (double) job->vfile.st_size;
+        case SCHEDULE_NEWEST_FIRST:
+            return (double) job->vfile.mtime;
+        case SCHEDULE_MIME_COST:
+            return parse_job_expected_cost(pool, job);
+        case SCHEDULE_FIFO:
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Binary max-heap on priority, must be called with schedule_mutex held
+ */
+static void schedule_push(tpool_t *pool, scheduled_job_t job) {
+    if (pool->shm->scheduled_count == pool->scheduled_capacity) {
+        pool->scheduled_capacity = MAX(1024, pool->scheduled_capacity * 2);
+        pool->scheduled_jobs = realloc(pool->scheduled_jobs, sizeof(scheduled_job_t) * pool->scheduled_capacity);
+    }
+
+    scheduled_job_t *heap = pool->scheduled_jobs;
+    int i = pool->shm->scheduled_count++;
+
+    while (i > 0 && heap[(i - 1) / 2].priority < job.priority) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = job;
+}
+
+static scheduled_job_t schedule_pop(tpool_t *pool) {
+    scheduled_job_t *heap = pool->scheduled_jobs;
+    scheduled_job_t top = heap[0];
+    scheduled_job_t last = heap[--pool->shm->scheduled_count];
+    int count = pool->shm->scheduled_count;
+
+    int i = 0;
+    while (TRUE) {
+        int child = i * 2 + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && heap[child + 1].priority > heap[child].priority) {
+            child += 1;
+        }
+        if (heap[child].priority <= last.priority) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (count > 0) {
+        heap[i] = last;
+    }
+
+    return top;
+}
+
+/**
+ * Push a job to the queue of its type and wake up an idle worker
+ * @return FALSE if wait is FALSE and the queue is full
+ */
+static int tpool_push(tpool_t *pool, job_t *job, int wait) {
+    job_ring_t *ring = &pool->shm->rings[job->type];
+
+    if (wait) {
+        job_ring_push(ring, job);
+    } else if (!job_ring_try_push(ring, job)) {
+        return FALSE;
+    }
+
+    if (pool->shm->idle_count > 0) {
+        futex_wake(&pool->shm->job_available_seq, 1);
+    }
+    return TRUE;
+}
+
+/**
+ * Moves the jobs with the highest priority to the job queue, while keeping it short
+ */
+static void *schedule_feeder(void *arg) {
+    tpool_t *pool = arg;
+    int queue_depth = pool->num_threads * SCHEDULE_QUEUE_DEPTH;
+
+    while (TRUE) {
+        job_ring_wait_count_below(&pool->shm->rings[JOB_PARSE_JOB], queue_depth);
+
+        pthread_mutex_lock(&pool->schedule_mutex);
+        while (pool->shm->scheduled_count == 0 && !pool->scheduled_closed) {
+            pthread_cond_wait(&pool->schedule_cond, &pool->schedule_mutex);
+        }
+        if (pool->shm->scheduled_count == 0) {
+            pthread_mutex_unlock(&pool->schedule_mutex);
+            break;
+        }
+        scheduled_job_t scheduled_job = schedule_pop(pool);
+        pthread_mutex_unlock(&pool->schedule_mutex);
+
+        parse_job_t *parse_job = create_parse_job(scheduled_job.filepath, scheduled_job.mtime,
+                                                  scheduled_job.st_size);
+        tpool_push(pool, &(job_t) {
+                .type = JOB_PARSE_JOB,
+                .parse_job = parse_job
+        }, TRUE);
+        free(parse_job);
+        free(scheduled_job.filepath);
+    }
+
+    return NULL;
+}
+
+void tpool_set_schedule(tpool_t *pool, schedule_policy_t policy, parse_cost_t *costs, int cost_count) {
+    pool->schedule = policy;
+
+    for (int i = 0; i < cost_count; i++) {
+        parse_cost_t *cost = parse_cost_lookup(pool, costs[i].mime, TRUE);
+        if (cost != NULL && costs[i].count > 0) {
+            *cost = costs[i];
+            pool->shm->parse_cost_total_size += costs[i].size;
+            pool->shm->parse_cost_total_time += costs[i].time;
+        }
+    }
+}
+
 /**
  * Push work object to thread pool
  */
 int tpool_add_work(tpool_t *pool, job_t *job) {
 
-    if (pool->shm->job_type == JOB_UNDEFINED) {
-        pool->shm->job_type = job->type;
-    } else if (pool->shm->job_type != job->type) {
-        LOG_FATAL("tpool.c", "FIXME: tpool cannot queue jobs with different types!");
+    // Once the schedule is closed, the last jobs are pushed directly
+    if (pool->schedule != SCHEDULE_FIFO && job->type == JOB_PARSE_JOB && !pool->scheduled_closed) {
+        scheduled_job_t scheduled_job = {
+                .priority = parse_job_priority(pool, job->parse_job),
+                .filepath = strdup(job->parse_job->filepath),
+                .mtime = job->parse_job->vfile.mtime,
+                .st_size = (long) job->parse_job->vfile.st_size,
+        };
+
+        pthread_mutex_lock(&pool->schedule_mutex);
+        schedule_push(pool, scheduled_job);
+        pthread_cond_signal(&pool->schedule_cond);
+        pthread_mutex_unlock(&pool->schedule_mutex);
+        return TRUE;
+    }
+
+    return tpool_push(pool, job, TRUE);
+}
+
+int tpool_try_add_work(tpool_t *pool, job_t *job) {
+    return tpool_push(pool, job, FALSE);
+}
+
+void tpool_set_weight(tpool_t *pool, job_type_t type, int weight) {
+    pool->shm->weights[type] = MAX(1, weight);
+}
+
+tpool_stats_t tpool_get_stats(tpool_t *pool) {
+    tpool_stats_t stats = {
+            .thread_count = pool->num_threads,
+            .active_count = pool->shm->active_count,
+            .queue_depth = pool->shm->scheduled_count,
+            .busy_count = 0,
+    };
+
+    for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+        stats.queue_depth += pool->shm->rings[type].count;
+    }
+    for (int i = 1; i <= pool->num_threads; i++) {
+        if (pool->shm->ipc_ctx.current_batch_size[i] > 0) {
+            stats.busy_count += 1;
+        }
+    }
+
+    return stats;
+}
+
+int tpool_borrow_idle_workers(tpool_t *pool, int max) {
+    int borrowed = pool->shm->borrowed_count;
+    int count;
+    do {
+        count = MIN(max, pool->shm->idle_count - borrowed);
+        if (count <= 0) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&pool->shm->borrowed_count, &borrowed, borrowed + count));
+
+    pool->shm->borrowed[ProcData.thread_id] += count;
+    return count;
+}
+
+void tpool_return_idle_workers(tpool_t *pool, int count) {
+    pool->shm->borrowed[ProcData.thread_id] -= count;
+    pool->shm->borrowed_count -= count;
+}
+
+/**
+ * Per-worker state of a job queue
+ */
+typedef struct {
+    /** Stride scheduling: advances by 1/weight for each job taken, the queue with the lowest pass goes next */
+    double pass;
+    int batch_size;
+    long job_time_avg;
+} worker_queue_t;
+
+static int tpool_queues_empty(tpool_t *pool) {
+    for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+        if (pool->shm->rings[type].count > 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int tpool_queues_closed(tpool_t *pool) {
+    for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+        if (!pool->shm->rings[type].closed || pool->shm->rings[type].count > 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+typedef struct {
+    long busy;
+    long iowait;
+    long total;
+} cpu_times_t;
+
+/**
+ * Aggregated CPU times of all the cores, from the first line of /proc/stat
+ */
+static int read_cpu_times(cpu_times_t *times) {
+    FILE *file = fopen("/proc/stat", "r");
+    if (file == NULL) {
+        return FALSE;
     }
 
-    database_add_work(ProcData.ipc_db, job);
+    long user, nice, system, idle, iowait, irq, softirq, steal;
+    int ret = fscanf(file, "cpu %ld %ld %ld %ld %ld %ld %ld %ld",
+                     &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+    fclose(file);
+
+    if (ret != 8) {
+        return FALSE;
+    }
 
+    times->busy = user + nice + system + irq + softirq + steal;
+    times->iowait = iowait;
+    times->total = times->busy + idle + iowait;
     return TRUE;
 }
 
+static void tpool_set_active_count(tpool_t *pool, int active_count) {
+    pool->shm->active_count = active_count;
+    futex_wake(&pool->shm->unpark_seq, INT_MAX);
+}
+
+/**
+ * Hill climbing on the number of completed jobs per second: keep moving the worker count in
+ * the same direction while throughput improves, turn around when it drops. When throughput is flat,
+ * a saturated CPU means fewer workers, a high iowait with idle cores means more workers.
+ */
+static void *worker_count_controller(void *arg) {
+    tpool_t *pool = arg;
+
+    int direction = 1;
+    double last_throughput = -1;
+    long last_completed = pool->shm->ipc_ctx.completed_job_count;
+    cpu_times_t last_cpu = {0, 0, 0};
+    read_cpu_times(&last_cpu);
+
+    while (!pool->shm->stop && !pool->shm->waiting) {
+        long start = monotonic_time_us();
+        while (monotonic_time_us() - start < CONTROLLER_INTERVAL) {
+            if (pool->shm->stop || pool->shm->waiting) {
+                return NULL;
+            }
+            usleep(100 * MILLISECOND);
+        }
+
+        long completed = pool->shm->ipc_ctx.completed_job_count;
+        double throughput = (double) (completed - last_completed) / ((double) CONTROLLER_INTERVAL / 1000000.0);
+        last_completed = completed;
+
+        double cpu_busy = 0;
+        double cpu_iowait = 0;
+        cpu_times_t cpu;
+        if (read_cpu_times(&cpu) && cpu.total > last_cpu.total) {
+            cpu_busy = (double) (cpu.busy - last_cpu.busy) / (double) (cpu.total - last_cpu.total);
+            cpu_iowait = (double) (cpu.iowait - last_cpu.iowait) / (double) (cpu.total - last_cpu.total);
+            last_cpu = cpu;
+        }
+
+        // Nothing to do, the measurement says nothing about the worker count
+        if (throughput == 0 && tpool_queues_empty(pool)) {
+            last_throughput = -1;
+            continue;
+        }
+
+        if (last_throughput >= 0) {
+            if (throughput < last_throughput * (1 - CONTROLLER_THRESHOLD)) {
+                direction = -direction;
+            } else if (throughput <= last_throughput * (1 + CONTROLLER_THRESHOLD)) {
+                if (cpu_busy > 0.9) {
+                    direction = -1;
+                } else if (cpu_iowait > 0.2) {
+                    direction = 1;
+                }
+            }
+        }
+        last_throughput = throughput;
+
+        int active_count = pool->shm->active_count;
+        int step = MAX(1, active_count / 4);
+        int new_active_count = MAX(pool->min_threads, MIN(pool->num_threads, active_count + direction * step));
+
+        if (new_active_count != active_count) {
+            LOG_DEBUGF("tpool.c", "Worker count %d -> %d (%.1f jobs/s, cpu %.0f%%, iowait %.0f%%)",
+                       active_count, new_active_count, throughput, cpu_busy * 100, cpu_iowait * 100);
+            tpool_set_active_count(pool, new_active_count);
+        } else if (new_active_count == pool->min_threads || new_active_count == pool->num_threads) {
+            // Reached a bound, try the other way next time
+            direction = -direction;
+        }
+    }
+
+    return NULL;
+}
+
+void tpool_set_min_threads(tpool_t *pool, int min_threads) {
+    pool->min_threads = MAX(1, MIN(min_threads, pool->num_threads));
+    pool->shm->active_count = pool->min_threads;
+}
+
+/**
+ * Take a batch of jobs of a single type, from the queue that is the most behind its share
+ * @return The number of jobs, 0 if all the queues are empty
+ */
+static int worker_take_jobs(tpool_t *pool, worker_queue_t *queues, double *virtual_time,
+                            job_t **jobs, job_type_t *type) {
+
+    while (TRUE) {
+        job_type_t next_type = JOB_UNDEFINED;
+
+        for (int t = JOB_BULK_LINE; t < JOB_TYPE_COUNT; t++) {
+            if (pool->shm->rings[t].count == 0) {
+                // A queue that was empty doesn't get to catch up on the time it was idle
+                queues[t].pass = MAX(queues[t].pass, *virtual_time);
+                continue;
+            }
+            if (next_type == JOB_UNDEFINED || queues[t].pass < queues[next_type].pass) {
+                next_type = t;
+            }
+        }
+
+        if (next_type == JOB_UNDEFINED) {
+            return 0;
+        }
+
+        // Don't take more than our share of the queue, to keep the other workers busy near the end
+        int max_jobs = pool->shm->rings[next_type].count / pool->num_threads;
+        max_jobs = MAX(1, MIN(queues[next_type].batch_size, max_jobs));
+
+        pool->shm->taking[ProcData.thread_id] = TRUE;
+        int job_count = job_ring_try_pop_batch(&pool->shm->rings[next_type], jobs, max_jobs,
+                                               worker_batch(pool, ProcData.thread_id));
+
+        if (job_count > 0) {
+            pthread_mutex_lock(&(pool->shm->ipc_ctx.mutex));
+            pool->shm->ipc_ctx.claimed_job_count += job_count;
+            pool->shm->claimed_count[next_type] += job_count;
+            pool->shm->ipc_ctx.current_batch_size[ProcData.thread_id] = job_count;
+            pool->shm->current_batch_type[ProcData.thread_id] = next_type;
+            pthread_mutex_unlock(&(pool->shm->ipc_ctx.mutex));
+        }
+        pool->shm->taking[ProcData.thread_id] = FALSE;
+
+        if (job_count > 0) {
+            *virtual_time = queues[next_type].pass;
+            queues[next_type].pass += (double) job_count / pool->shm->weights[next_type];
+            *type = next_type;
+            return job_count;
+        }
+        // Another worker took the last jobs of this queue
+    }
+}
+
+static void worker_wait_for_jobs(tpool_t *pool) {
+    uint32_t seq = pool->shm->job_available_seq;
+    pool->shm->idle_count += 1;
+    if (tpool_queues_empty(pool) && !pool->shm->stop) {
+        futex_wait_ms(&pool->shm->job_available_seq, seq, 10);
+    }
+    pool->shm->idle_count -= 1;
+}
+
+/**
+ * Parked workers keep their process (and crash handler) but don't take jobs
+ */
+static void worker_park(tpool_t *pool) {
+    while (TRUE) {
+        uint32_t seq = pool->shm->unpark_seq;
+        if (ProcData.thread_id <= pool->shm->active_count || pool->shm->stop) {
+            break;
+        }
+        futex_wait_ms(&pool->shm->unpark_seq, seq, 100);
+    }
+}
+
 static void worker_thread_loop(tpool_t *pool) {
+    job_t *jobs[JOB_BATCH_MAX];
+    worker_queue_t queues[JOB_TYPE_COUNT];
+    double virtual_time = 0;
+
+    for (int type = 0; type < JOB_TYPE_COUNT; type++) {
+        queues[type].pass = 0;
+        queues[type].batch_size = 1;
+        queues[type].job_time_avg = 0;
+    }
+
     while (TRUE) {
         if (pool->shm->stop) {
             break;
         }
 
-        if (pool->shm->job_type == JOB_UNDEFINED) {
-            // Wait before first job is queued
-            pthread_mutex_lock(&pool->shm->mutex);
-            pthread_cond_timedwait_ms(&pool->shm->ipc_ctx.has_work_cond, &pool->shm->mutex, 1000);
-            pthread_mutex_unlock(&pool->shm->mutex);
+        if (ProcData.thread_id > pool->shm->active_count) {
+            worker_park(pool);
+            continue;
         }
 
-        job_t *job = database_get_work(ProcData.ipc_db, pool->shm->job_type);
+        // Count the worker as busy before taking a job so that
+        // tpool_wait() never sees an empty queue and an idle pool while a job is in flight
+        pool->shm->busy_count += 1;
 
-        if (job != NULL) {
-            if (pool->shm->stop) {
-                break;
+        job_type_t type;
+        int job_count = worker_take_jobs(pool, queues, &virtual_time, jobs, &type);
+
+        if (job_count > 0) {
+            TIMER_INIT();
+            TIMER_START();
+
+            if (type == JOB_PARSE_JOB && ScanCtx.io_uring) {
+                uring_prefetch_jobs(jobs, job_count);
             }
 
-            pthread_mutex_lock(&(pool->shm->data_mutex));
-            pool->shm->busy_count += 1;
-            pthread_mutex_unlock(&(pool->shm->data_mutex));
+            job_batch_t *batch = worker_batch(pool, ProcData.thread_id);
+
+            for (int i = 0; i < job_count; i++) {
+                job_t *job = jobs[i];
+                batch->current = i;
 
-            if (job->type == JOB_PARSE_JOB) {
-                parse(job->parse_job);
-            } else if (job->type == JOB_BULK_LINE) {
-                elastic_index_line(job->bulk_line);
+                if (job->type == JOB_PARSE_JOB) {
+                    strcpy(pool->shm->ipc_ctx.current_job[ProcData.thread_id], job->parse_job->filepath);
+                    parse(job->parse_job);
+                } else if (job->type == JOB_BULK_LINE) {
+                    elastic_index_line(job->bulk_line);
+                }
+
+                job_destroy(job);
             }
 
-            job_destroy(job);
+            long batch_time;
+            TIMER_END(batch_time);
+            metrics_record_batch(ProcData.thread_id, job_count, batch_time);
 
-            pthread_mutex_lock(&(pool->shm->data_mutex));
-            pool->shm->busy_count -= 1;
-            pthread_mutex_unlock(&(pool->shm->data_mutex));
+            // Size the next batch from the recent per-job latency: cheap jobs are
+            // taken many at a time, slow ones one by one
+            worker_queue_t *queue = &queues[type];
+            long job_time = batch_time / job_count;
+            queue->job_time_avg = queue->job_time_avg == 0 ? job_time : (queue->job_time_avg * 3 + job_time) / 4;
+            queue->batch_size = (int) MIN(JOB_BATCH_MAX, JOB_BATCH_TARGET_TIME / MAX(1, queue->job_time_avg));
+            queue->batch_size = MAX(1, queue->batch_size);
+
+            batch->count = 0;
 
             pthread_mutex_lock(&(pool->shm->ipc_ctx.mutex));
-            pool->shm->ipc_ctx.completed_job_count += 1;
+            pool->shm->ipc_ctx.claimed_job_count -= job_count;
+            pool->shm->claimed_count[type] -= job_count;
+            pool->shm->ipc_ctx.current_batch_size[ProcData.thread_id] = 0;
+            pool->shm->ipc_ctx.completed_job_count += job_count;
             pthread_mutex_unlock(&(pool->shm->ipc_ctx.mutex));
         }
 
-        if (pool->print_progress) {
+        pool->shm->busy_count -= 1;
+
+        if (pool->print_progress && job_count > 0) {
 
             int done = pool->shm->ipc_ctx.completed_job_count;
-            int count = pool->shm->ipc_ctx.completed_job_count + pool->shm->ipc_ctx.job_count;
+            int count = pool->shm->ipc_ctx.completed_job_count
+                        + pool->shm->ipc_ctx.claimed_job_count
+                        + pool->shm->scheduled_count;
+            for (int t = JOB_BULK_LINE; t < JOB_TYPE_COUNT; t++) {
+                count += pool->shm->rings[t].count;
+            }
 
             if (LogCtx.json_logs) {
                 progress_bar_print_json(done,
@@ -118,10 +744,24 @@ static void worker_thread_loop(tpool_t *pool) {
             }
         }
 
-        if (job == NULL) {
+        if (job_count == 0) {
+            // A job still running can queue more (archive fan-out)
+            if (!tpool_queues_closed(pool) || pool->shm->ipc_ctx.claimed_job_count > 0) {
+                worker_wait_for_jobs(pool);
+                continue;
+            }
+
+            // All the queues are closed and empty
+            pthread_mutex_lock(&(pool->shm->data_mutex));
+            if (pool->shm->out_of_work_count < MAX_THREADS) {
+                pool->shm->out_of_work_time[++pool->shm->out_of_work_count] = monotonic_time_us();
+            }
+            pthread_mutex_unlock(&(pool->shm->data_mutex));
+
             pthread_mutex_lock(&pool->shm->mutex);
             pthread_cond_signal(&pool->shm->done_working_cond);
             pthread_mutex_unlock(&pool->shm->mutex);
+            break;
         }
     }
 }
@@ -132,36 +772,51 @@ static void worker_proc_init(tpool_t *pool, int thread_id) {
     pthread_mutex_unlock(&pool->shm->data_mutex);
 
     ProcData.thread_id = thread_id;
+    mem_budget_set_slot(thread_id);
 
-    if (ScanCtx.index.path[0] != '\0') {
-        ProcData.index_db = database_create(ScanCtx.index.path, INDEX_DATABASE);
-        ProcData.index_db->ipc_ctx = &pool->shm->ipc_ctx;
-        database_open(ProcData.index_db);
+    if (ScanCtx.index.path[0] != '\0' && !ScanCtx.fast) {
+        magic_init();
     }
-
-    pthread_mutex_lock(&pool->shm->mutex);
-    ProcData.ipc_db = database_create(pool->shm->ipc_database_filepath, IPC_CONSUMER_DATABASE);
-    ProcData.ipc_db->ipc_ctx = &pool->shm->ipc_ctx;
-    database_open(ProcData.ipc_db);
-    pthread_mutex_unlock(&pool->shm->mutex);
 }
 
 void worker_proc_cleanup(tpool_t *pool) {
-    if (ProcData.index_db != NULL) {
-        database_close(ProcData.index_db, FALSE);
-    }
+    magic_cleanup();
+    cleanup_ocr();
+    cleanup_media();
+    uring_cleanup();
+    checksum_cleanup();
 
     if (IndexCtx.needs_es_connection) {
         elastic_cleanup();
     }
-
-    database_close(ProcData.ipc_db, FALSE);
 }
 
 #ifndef SIST_DEBUG
 #define TPOOL_FORK
 #endif
 
+#ifdef TPOOL_FORK
+/**
+ * Push the jobs of a crashed worker again. They are counted as claimed until then.
+ */
+static void tpool_requeue_jobs(tpool_t *pool, job_t **jobs, int job_count) {
+    for (int i = 0; i < job_count; i++) {
+        job_t *job = jobs[i];
+        tpool_push(pool, job, TRUE);
+
+        pthread_mutex_lock(&(pool->shm->ipc_ctx.mutex));
+        pool->shm->ipc_ctx.claimed_job_count -= 1;
+        pool->shm->claimed_count[job->type] -= 1;
+        pthread_mutex_unlock(&(pool->shm->ipc_ctx.mutex));
+
+        if (job->type == JOB_BULK_LINE) {
+            free(job->bulk_line);
+        }
+        job_destroy(job);
+    }
+}
+#endif
+
 /**
  * Thread worker function
  */
@@ -169,6 +824,11 @@ static void *tpool_worker(void *arg) {
     tpool_t *pool = ((start_thread_arg_t *) arg)->pool;
 
 #ifdef TPOOL_FORK
+    // Jobs that a crashed worker did not get to, pushed again once its replacement is running
+    job_t *requeued_jobs[JOB_BATCH_MAX * JOB_TYPE_COUNT];
+    int requeued_count = 0;
+    int crashed = FALSE;
+
     while (TRUE) {
         int pid = fork();
 
@@ -191,28 +851,77 @@ static void *tpool_worker(void *arg) {
             exit(0);
 
         } else {
+            if (crashed) {
+                tpool_requeue_jobs(pool, requeued_jobs, requeued_count);
+                requeued_count = 0;
+
+                // The crashed worker stayed busy until its jobs were back in the queues
+                pool->shm->busy_count -= 1;
+                crashed = FALSE;
+            }
+
             int status;
             waitpid(pid, &status, 0);
 
             LOG_DEBUGF("tpool.c", "Child process terminated with status code %d", WEXITSTATUS(status));
 
-            pthread_mutex_lock(&(pool->shm->ipc_ctx.mutex));
-            pool->shm->ipc_ctx.completed_job_count += 1;
-            pthread_mutex_unlock(&(pool->shm->ipc_ctx.mutex));
-
             if (WIFSIGNALED(status)) {
-                pthread_mutex_lock(&(pool->shm->data_mutex));
-                pool->shm->busy_count -= 1;
-                pthread_mutex_unlock(&(pool->shm->data_mutex));
+                crashed = TRUE;
 
                 int crashed_thread_id = -1;
-                for (int i = 0; i < MAX_THREADS; i++) {
+                for (int i = 1; i <= pool->num_threads; i++) {
                     if (pool->shm->thread_id_to_pid_mapping[i] == pid) {
                         crashed_thread_id = i;
                         break;
                     }
                 }
 
+                job_batch_t *batch = crashed_thread_id != -1 ? worker_batch(pool, crashed_thread_id) : NULL;
+                int batch_count = batch != NULL ? batch->count : 0;
+
+                // The worker may have been killed while it held a queue, or in the middle of claiming jobs.
+                // Once they are copied to its batch, the jobs are pushed again from there.
+                for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+                    int job_count = job_ring_recover(&pool->shm->rings[type], pid, requeued_jobs + requeued_count,
+                                                     batch_count > 0 ? 0 : JOB_BATCH_MAX);
+                    requeued_count += job_count;
+                }
+                if (ScanCtx.index_writer != NULL) {
+                    database_writer_recover(ScanCtx.index_writer, pid);
+                }
+
+                // The job that crashed is not retried, the ones after it in the batch are
+                int batch_requeued_count = 0;
+                if (batch_count > 0) {
+                    batch_requeued_count = job_batch_load(batch, batch->current + 1, requeued_jobs + requeued_count);
+                    requeued_count += batch_requeued_count;
+                    batch->count = 0;
+                }
+
+                pthread_mutex_lock(&(pool->shm->ipc_ctx.mutex));
+                int batch_size = 0;
+                if (crashed_thread_id != -1 && pool->shm->ipc_ctx.current_batch_size[crashed_thread_id] > 0) {
+                    batch_size = pool->shm->ipc_ctx.current_batch_size[crashed_thread_id];
+                    pool->shm->ipc_ctx.claimed_job_count -= batch_size;
+                    pool->shm->claimed_count[pool->shm->current_batch_type[crashed_thread_id]] -= batch_size;
+                    pool->shm->ipc_ctx.current_batch_size[crashed_thread_id] = 0;
+                }
+                pool->shm->ipc_ctx.completed_job_count += MAX(batch_size, batch_count) - batch_requeued_count;
+
+                // The jobs to push again are counted as claimed until then
+                for (int i = 0; i < requeued_count; i++) {
+                    pool->shm->ipc_ctx.claimed_job_count += 1;
+                    pool->shm->claimed_count[requeued_jobs[i]->type] += 1;
+                }
+                pthread_mutex_unlock(&(pool->shm->ipc_ctx.mutex));
+
+                if (crashed_thread_id != -1) {
+                    pool->shm->taking[crashed_thread_id] = FALSE;
+                    pool->shm->borrowed_count -= pool->shm->borrowed[crashed_thread_id];
+                    pool->shm->borrowed[crashed_thread_id] = 0;
+                    mem_budget_release_slot(crashed_thread_id);
+                }
+
                 const char *job_filepath;
                 if (crashed_thread_id != -1) {
                     job_filepath = pool->shm->ipc_ctx.current_job[crashed_thread_id];
@@ -229,6 +938,9 @@ static void *tpool_worker(void *arg) {
                         strsignal(WTERMSIG(status)),
                         job_filepath
                 );
+                if (requeued_count > 0) {
+                    LOG_INFOF("tpool.c", "Queued %d jobs of the crashed process again", requeued_count);
+                }
                 continue;
             }
             break;
@@ -254,21 +966,83 @@ static void *tpool_worker(void *arg) {
     return NULL;
 }
 
+/**
+ * Time spent at the end of the work with fewer than n busy workers. When that is
+ * a large part of the total, the last jobs were stragglers that could have started earlier.
+ */
+static void tpool_log_tail_time(tpool_t *pool, long end_time) {
+    // The n-th worker to run out of work leaves (num_threads - n) busy workers
+    if (pool->num_threads > 1 && pool->shm->out_of_work_count >= 1) {
+        LOG_INFOF("tpool.c", "Tail: %.2fs with fewer than %d busy workers",
+                  (double) (end_time - pool->shm->out_of_work_time[1]) / 1000000.0, pool->num_threads);
+    }
+    if (pool->num_threads > 2 && pool->shm->out_of_work_count >= pool->num_threads - 1) {
+        LOG_INFOF("tpool.c", "Tail: %.2fs with a single busy worker",
+                  (double) (end_time - pool->shm->out_of_work_time[pool->num_threads - 1]) / 1000000.0);
+    }
+}
+
+/**
+ * Move the last scheduled jobs to the job queue
+ */
+static void tpool_close_schedule(tpool_t *pool) {
+    if (!pool->feeder_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->schedule_mutex);
+    pool->scheduled_closed = TRUE;
+    pthread_cond_broadcast(&pool->schedule_cond);
+    pthread_mutex_unlock(&pool->schedule_mutex);
+
+    pthread_join(pool->feeder_thread, NULL);
+    pool->feeder_running = FALSE;
+}
+
+static int tpool_is_taking(tpool_t *pool) {
+    for (int i = 1; i <= pool->num_threads; i++) {
+        if (pool->shm->taking[i]) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void tpool_wait_type(tpool_t *pool, job_type_t type) {
+    LOG_DEBUGF("tpool.c", "Waiting for jobs of type %d to finish", type);
+
+    if (type == JOB_PARSE_JOB) {
+        tpool_close_schedule(pool);
+    }
+
+    pthread_mutex_lock(&pool->shm->mutex);
+    job_ring_close(&pool->shm->rings[type]);
+
+    while (pool->shm->rings[type].count > 0 || pool->shm->claimed_count[type] > 0
+           || tpool_is_taking(pool)) {
+        pthread_cond_timedwait_ms(&(pool->shm->done_working_cond), &pool->shm->mutex, 10);
+    }
+    pthread_mutex_unlock(&pool->shm->mutex);
+}
+
 void tpool_wait(tpool_t *pool) {
     LOG_DEBUG("tpool.c", "Waiting for worker threads to finish");
+
+    tpool_close_schedule(pool);
+
     pthread_mutex_lock(&pool->shm->mutex);
 
     pool->shm->waiting = TRUE;
-    pool->shm->ipc_ctx.no_more_jobs = TRUE;
+    for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+        job_ring_close(&pool->shm->rings[type]);
+    }
 
     while (TRUE) {
-        if (pool->shm->ipc_ctx.job_count > 0) {
-            pthread_cond_wait(&(pool->shm->done_working_cond), &pool->shm->mutex);
+        if (!tpool_queues_empty(pool) || pool->shm->busy_count > 0) {
+            pthread_cond_timedwait_ms(&(pool->shm->done_working_cond), &pool->shm->mutex, 100);
         } else {
-            if (pool->shm->ipc_ctx.job_count == 0 && pool->shm->busy_count <= 0) {
-                pool->shm->stop = TRUE;
-                break;
-            }
+            pool->shm->stop = TRUE;
+            break;
         }
     }
     if (pool->print_progress && !LogCtx.json_logs) {
@@ -276,17 +1050,21 @@ void tpool_wait(tpool_t *pool) {
     }
     pthread_mutex_unlock(&pool->shm->mutex);
 
+    if (pool->controller_running) {
+        pthread_join(pool->controller_thread, NULL);
+        pool->controller_running = FALSE;
+    }
+
     LOG_INFO("tpool.c", "Worker threads finished");
+    tpool_log_tail_time(pool, monotonic_time_us());
 }
 
 void tpool_destroy(tpool_t *pool) {
     LOG_INFO("tpool.c", "Destroying thread pool");
 
-    database_close(ProcData.ipc_db, FALSE);
-
-    pthread_mutex_lock(&pool->shm->mutex);
-    pthread_cond_broadcast(&pool->shm->ipc_ctx.has_work_cond);
-    pthread_mutex_unlock(&pool->shm->mutex);
+    for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+        job_ring_close(&pool->shm->rings[type]);
+    }
 
     for (size_t i = 0; i < pool->num_threads; i++) {
         pthread_t thread = pool->threads[i];
@@ -300,10 +1078,16 @@ void tpool_destroy(tpool_t *pool) {
 
     pthread_mutex_destroy(&pool->shm->ipc_ctx.mutex);
     pthread_mutex_destroy(&pool->shm->mutex);
-    pthread_cond_destroy(&pool->shm->ipc_ctx.has_work_cond);
     pthread_cond_destroy(&pool->shm->done_working_cond);
+    for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+        job_ring_destroy(&pool->shm->rings[type]);
+    }
+
+    pthread_mutex_destroy(&pool->schedule_mutex);
+    pthread_cond_destroy(&pool->schedule_cond);
+    free(pool->scheduled_jobs);
 
-    munmap(pool->shm, sizeof(*pool->shm));
+    munmap(pool->shm, SHM_SIZE(pool));
 }
 
 /**
@@ -313,19 +1097,25 @@ void tpool_destroy(tpool_t *pool) {
 tpool_t *tpool_create(int thread_cnt, int print_progress) {
 
     tpool_t *pool = malloc(sizeof(tpool_t));
+    pool->num_threads = thread_cnt;
 
-    pool->shm = mmap(NULL, sizeof(*pool->shm), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    // The job queue data is stored right after the shared struct, in the same mapping
+    pool->shm = mmap(NULL, SHM_SIZE(pool), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-    pool->num_threads = thread_cnt;
-    pool->shm->ipc_ctx.job_count = 0;
-    pool->shm->ipc_ctx.no_more_jobs = FALSE;
     pool->shm->stop = FALSE;
     pool->shm->waiting = FALSE;
-    pool->shm->job_type = JOB_UNDEFINED;
     memset(pool->threads, 0, sizeof(pool->threads));
     memset(pool->start_thread_args, 0, sizeof(pool->start_thread_args));
     pool->print_progress = print_progress;
-    sprintf(pool->shm->ipc_database_filepath, "/dev/shm/sist2-ipc-%d.sqlite", getpid());
+
+    pool->schedule = SCHEDULE_FIFO;
+    pool->scheduled_jobs = NULL;
+    pool->scheduled_capacity = 0;
+    pool->scheduled_closed = FALSE;
+    pool->feeder_running = FALSE;
+    pthread_mutex_init(&pool->schedule_mutex, NULL);
+    pthread_cond_init(&pool->schedule_cond, NULL);
 
     pthread_mutexattr_t mutexattr;
     pthread_mutexattr_init(&mutexattr);
@@ -334,20 +1124,26 @@ tpool_t *tpool_create(int thread_cnt, int print_progress) {
     pthread_mutex_init(&(pool->shm->mutex), &mutexattr);
     pthread_mutex_init(&(pool->shm->data_mutex), &mutexattr);
     pthread_mutex_init(&(pool->shm->ipc_ctx.mutex), &mutexattr);
-    pthread_mutex_init(&(pool->shm->ipc_ctx.db_mutex), &mutexattr);
-    pthread_mutex_init(&(pool->shm->ipc_ctx.index_db_mutex), &mutexattr);
 
     pthread_condattr_t condattr;
     pthread_condattr_init(&condattr);
     pthread_condattr_setpshared(&condattr, TRUE);
 
-    pthread_cond_init(&(pool->shm->ipc_ctx.has_work_cond), &condattr);
     pthread_cond_init(&(pool->shm->done_working_cond), &condattr);
     pthread_cond_init(&(pool->shm->workers_initialized_cond), &condattr);
 
-    ProcData.ipc_db = database_create(pool->shm->ipc_database_filepath, IPC_PRODUCER_DATABASE);
-    ProcData.ipc_db->ipc_ctx = &pool->shm->ipc_ctx;
-    database_initialize(ProcData.ipc_db);
+    for (int type = JOB_BULK_LINE; type < JOB_TYPE_COUNT; type++) {
+        char *ring_data = (char *) pool->shm + sizeof(*pool->shm) + (type - JOB_BULK_LINE) * JOB_RING_SIZE;
+        job_ring_init(&pool->shm->rings[type], ring_data, JOB_RING_SIZE);
+        pool->shm->weights[type] = 1;
+    }
+    for (int i = 1; i <= thread_cnt; i++) {
+        worker_batch(pool, i)->capacity = JOB_BATCH_COPY_SIZE - sizeof(job_batch_t);
+    }
+
+    pool->min_threads = thread_cnt;
+    pool->controller_running = FALSE;
+    pool->shm->active_count = thread_cnt;
 
     return pool;
 }
@@ -368,11 +1164,20 @@ void tpool_start(tpool_t *pool) {
         pool->start_thread_args[i] = arg;
     }
 
-    // Only open the database when all workers are done initializing
     while (pool->shm->initialized_count != pool->num_threads) {
         pthread_cond_wait(&pool->shm->workers_initialized_cond, &pool->shm->mutex);
     }
     pthread_mutex_unlock(&pool->shm->mutex);
 
-    database_open(ProcData.ipc_db);
+    if (pool->schedule != SCHEDULE_FIFO) {
+        pthread_create(&pool->feeder_thread, NULL, schedule_feeder, pool);
+        pool->feeder_running = TRUE;
+    }
+
+    if (pool->min_threads < pool->num_threads) {
+        LOG_INFOF("tpool.c", "Adjusting the number of active workers between %d and %d",
+                  pool->min_threads, pool->num_threads);
+        pthread_create(&pool->controller_thread, NULL, worker_count_controller, pool);
+        pool->controller_running = TRUE;
+    }
 }
@@ -9,14 +9,91 @@
 struct tpool;
 typedef struct tpool tpool_t;
 
+/**
+ * Order in which parse jobs are handed to the workers
+ */
+typedef enum {
+    SCHEDULE_FIFO,
+    /** Largest files first, so that they don't end up as the last jobs of the scan */
+    SCHEDULE_LARGEST_FIRST,
+    /** Highest expected parse time first, from the parse time per byte of each mime type */
+    SCHEDULE_MIME_COST,
+    /** Most recently modified files first, so that new content is searchable sooner */
+    SCHEDULE_NEWEST_FIRST,
+} schedule_policy_t;
+
 tpool_t *tpool_create(int num, int print_progress);
 
+/**
+ * Must be called before tpool_start()
+ * @param costs Parse costs of the previous scans for SCHEDULE_MIME_COST, can be NULL
+ */
+void tpool_set_schedule(tpool_t *pool, schedule_policy_t policy, parse_cost_t *costs, int cost_count);
+
+/**
+ * Called by the workers after each document, time is in µs
+ */
+void tpool_record_parse_cost(tpool_t *pool, unsigned int mime, long size, long time);
+
+/**
+ * @return A copy of the costs of the previous scans plus the ones measured during this scan
+ */
+parse_cost_t *tpool_get_parse_costs(tpool_t *pool, int *count);
+
+/**
+ * Jobs of different types have separate queues. When several queues have jobs, the workers
+ * take them in proportion to the weight of their type. The default weight is 1.
+ */
+void tpool_set_weight(tpool_t *pool, job_type_t type, int weight);
+
+/**
+ * Enable the worker count controller, must be called before tpool_start(). The number of active
+ * workers starts at min_threads and is adjusted up to the size of the pool from the measured
+ * throughput, CPU utilization and iowait. The other workers are parked.
+ */
+void tpool_set_min_threads(tpool_t *pool, int min_threads);
+
+typedef struct {
+    int thread_count;
+    /** Workers that are not parked by the controller */
+    int active_count;
+    /** Jobs in the queues and jobs waiting for the scheduling policy */
+    int queue_depth;
+    /** Workers that are running a batch of jobs */
+    int busy_count;
+} tpool_stats_t;
+
+tpool_stats_t tpool_get_stats(tpool_t *pool);
+
+/**
+ * Called by a worker to run a parser in extra threads while other workers are waiting
+ * for jobs. A lent worker is not lent again until it is returned.
+ * @return the number of idle workers lent to the caller, at most max
+ */
+int tpool_borrow_idle_workers(tpool_t *pool, int max);
+
+void tpool_return_idle_workers(tpool_t *pool, int count);
+
 void tpool_start(tpool_t *pool);
 
 void tpool_destroy(tpool_t *pool);
 
 int tpool_add_work(tpool_t *pool, job_t *job);
 
+/**
+ * Can be called by the workers. The job skips the scheduling policy and is
+ * not queued if the queue is full.
+ * @return FALSE if the job was not queued
+ */
+int tpool_try_add_work(tpool_t *pool, job_t *job);
+
+/**
+ * Wait until all the jobs of a type are done, the jobs of the other types keep running.
+ * Workers can still add jobs of this type. Jobs added with tpool_add_work() after that skip the scheduling
+ * policy, call it again to wait for them.
+ */
+void tpool_wait_type(tpool_t *pool, job_type_t type);
+
 void tpool_wait(tpool_t *pool);
 
 void job_destroy(job_t *job);
@@ -2,6 +2,8 @@
 #include "src/ctx.h"
 
 #include <wordexp.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #define PBSTR "========================================"
 #define PBWIDTH 40
@@ -302,3 +304,16 @@ struct timespec timespec_add(struct timespec ts1, long usec) {
     return timespec_normalise(ts1);
 }
 
+void futex_wait_ms(_Atomic uint32_t *seq, uint32_t value, int delay_ms) {
+    struct timespec timeout = timespec_normalise((struct timespec) {
+            .tv_sec = 0,
+            .tv_nsec = (long) delay_ms * 1000000
+    });
+    syscall(SYS_futex, seq, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+void futex_wake(_Atomic uint32_t *seq, int count) {
+    *seq += 1;
+    syscall(SYS_futex, seq, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
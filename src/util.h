@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #include "third-party/utf8.h/utf8.h"
 #include "libscan/scan.h"
@@ -108,6 +110,18 @@ struct timespec timespec_add(struct timespec ts1, long usec);
         pthread_cond_timedwait(cond, mutex, &end_time); \
     } while (0)
 
+/**
+ * Sleep for at most delay_ms, or until futex_wake() is called on seq. Returns right away
+ * if seq is not equal to value anymore. Unlike a shared pthread_cond_t, a futex is not
+ * left in a bad state when a process is killed while waiting on it.
+ */
+void futex_wait_ms(_Atomic uint32_t *seq, uint32_t value, int delay_ms);
+
+/**
+ * Increment seq and wake up at most count waiters
+ */
+void futex_wake(_Atomic uint32_t *seq, int count);
+
 #define array_foreach(arr) \
     for (int i = 0; (arr)[i] != 0; i++)
 
@@ -8,6 +8,9 @@
 
 #define MAX_DECOMPRESSED_SIZE_RATIO 40.0
 
+#define ARC_FAN_OUT_RANGE_SIZE (64 * 1024 * 1024)
+#define ARC_FAN_OUT_MAX_RANGES 1024
+
 int should_parse_filtered_file(const char *filepath) {
 
     if (strstr(filepath, ".tgz")) {
@@ -28,45 +31,20 @@ void arc_close(struct vfile *f) {
         f->sha1_ctx = NULL;
     }
 
-    if (f->rewind_buffer != NULL) {
-        free(f->rewind_buffer);
-        f->rewind_buffer = NULL;
-        f->rewind_buffer_size = 0;
-        f->rewind_buffer_cursor = 0;
-    }
+    vfile_free_buffers(f);
 }
 
 
 int arc_read(struct vfile *f, void *buf, size_t size) {
 
-    int bytes_copied = 0;
-
-    if (f->rewind_buffer_size != 0) {
-        if (size > f->rewind_buffer_size) {
-            memcpy(buf, f->rewind_buffer + f->rewind_buffer_cursor, f->rewind_buffer_size);
-
-            bytes_copied = f->rewind_buffer_size;
-            size -= f->rewind_buffer_size;
-            buf += f->rewind_buffer_size;
-            f->rewind_buffer_size = 0;
-        } else {
-            memcpy(buf, f->rewind_buffer + f->rewind_buffer_cursor, size);
-            f->rewind_buffer_size -= (int) size;
-            f->rewind_buffer_cursor += (int) size;
-
-            return (int) size;
-        }
+    size_t bytes_copied = vfile_read_head(f, buf, size);
+    if (bytes_copied == size) {
+        return (int) size;
     }
 
-    size_t bytes_read = archive_read_data(f->arc, buf, size);
-
-    if (bytes_read != 0 && bytes_read <= size && f->calculate_checksum) {
-        f->has_checksum = TRUE;
+    size_t bytes_read = archive_read_data(f->arc, (char *) buf + bytes_copied, size - bytes_copied);
 
-        safe_digest_update(f->sha1_ctx, (unsigned char *) buf, bytes_read);
-    }
-
-    if (bytes_read != size && archive_errno(f->arc) != 0) {
+    if (bytes_read != size - bytes_copied && archive_errno(f->arc) != 0) {
         const char *error_str = archive_error_string(f->arc);
         if (error_str != NULL) {
             f->logf(f->filepath, LEVEL_ERROR, "Error reading archive file: %s", error_str);
@@ -74,32 +52,11 @@ int arc_read(struct vfile *f, void *buf, size_t size) {
         return -1;
     }
 
-    return (int) bytes_read + bytes_copied;
-}
-
-int arc_read_rewindable(struct vfile *f, void *buf, size_t size) {
-
-    if (f->rewind_buffer != NULL) {
-        fprintf(stderr, "Allocated rewind buffer more than once for %s", f->filepath);
-        exit(-1);
-    }
-
-    size_t bytes_read = archive_read_data(f->arc, buf, size);
-
-    if (bytes_read != size && archive_errno(f->arc) != 0) {
-        const char *error_str = archive_error_string(f->arc);
-        if (error_str != NULL) {
-            f->logf(f->filepath, LEVEL_ERROR, "Error reading archive file: %s", error_str);
-        }
-        return -1;
+    if (bytes_read != 0 && bytes_read <= size - bytes_copied) {
+        vfile_consume(f, (char *) buf + bytes_copied, bytes_read);
     }
 
-    f->rewind_buffer = malloc(size);
-    f->rewind_buffer_size = (int) size;
-    f->rewind_buffer_cursor = 0;
-    memcpy(f->rewind_buffer, buf, size);
-
-    return (int) bytes_read;
+    return (int) (bytes_read + bytes_copied);
 }
 
 int arc_open(scan_arc_ctx_t *ctx, vfile_t *f, struct archive **a, arc_data_t *arc_data, int allow_recurse) {
@@ -124,9 +81,9 @@ int arc_open(scan_arc_ctx_t *ctx, vfile_t *f, struct archive **a, arc_data_t *ar
 
         return archive_read_open(
                 *a, arc_data,
-                vfile_open_callback,
+                NULL,
                 vfile_read_callback,
-                vfile_close_callback
+                NULL
         );
     } else {
         return ARC_SKIPPED;
@@ -136,6 +93,192 @@ int arc_open(scan_arc_ctx_t *ctx, vfile_t *f, struct archive **a, arc_data_t *ar
 static __thread int sub_strings[30];
 #define EXCLUDED(str) (pcre_exec(exclude, exclude_extra, str, strlen(str), 0, 0, sub_strings, sizeof(sub_strings)) >= 0)
 
+/**
+ * Parse the entries [entry_start, entry_end) of an open archive, entry_end -1 to parse all the remaining entries.
+ * Entries are counted from the first header of the archive, directories included.
+ */
+static void parse_archive_entries(scan_arc_ctx_t *ctx, vfile_t *f, struct archive *a, pcre *exclude,
+                                  pcre_extra *exclude_extra, int entry_start, int entry_end) {
+    struct archive_entry *entry = NULL;
+
+    parse_job_t *sub_job = malloc(sizeof(parse_job_t));
+
+    sub_job->vfile.close = arc_close;
+    sub_job->vfile.read = arc_read;
+    sub_job->vfile.read_rewindable = vfile_read_rewindable;
+    sub_job->vfile.reset = vfile_reset;
+    sub_job->vfile.map = NULL;
+    sub_job->vfile.arc = a;
+    sub_job->vfile.is_fs_file = FALSE;
+    vfile_init_buffers(&sub_job->vfile);
+    sub_job->vfile.log = ctx->log;
+    sub_job->vfile.logf = ctx->logf;
+    sub_job->vfile.has_checksum = FALSE;
+    sub_job->vfile.calculate_checksum = f->calculate_checksum;
+    sub_job->arc_entry_start = 0;
+    sub_job->arc_entry_count = 0;
+    strcpy(sub_job->parent, f->filepath);
+
+    for (int i = 0; entry_end == -1 || i < entry_end; i++) {
+        if (archive_read_next_header(a, &entry) != ARCHIVE_OK) {
+            break;
+        }
+
+        // The data of the entries before the range is skipped by libarchive
+        if (i < entry_start) {
+            continue;
+        }
+
+        struct stat entry_stat = *archive_entry_stat(entry);
+        sub_job->vfile.st_size = entry_stat.st_size;
+        sub_job->vfile.mtime = (int) entry_stat.st_mtim.tv_sec;
+
+        if (S_ISREG(entry_stat.st_mode)) {
+
+            const char *utf8_name = archive_entry_pathname_utf8(entry);
+
+            if (utf8_name == NULL) {
+                snprintf(sub_job->filepath, sizeof(sub_job->filepath), "%s#/%s", f->filepath,
+                         archive_entry_pathname(entry));
+                strcpy(sub_job->vfile.filepath, sub_job->filepath);
+            } else {
+                snprintf(sub_job->filepath, sizeof(sub_job->filepath), "%s#/%s", f->filepath, utf8_name);
+                strcpy(sub_job->vfile.filepath, sub_job->filepath);
+            }
+            sub_job->base = (int) (strrchr(sub_job->filepath, '/') - sub_job->filepath) + 1;
+
+            double decompressed_size_ratio = (double) sub_job->vfile.st_size / (double) f->st_size;
+            if (decompressed_size_ratio > MAX_DECOMPRESSED_SIZE_RATIO) {
+                CTX_LOG_ERRORF("arc.c", "Skipped %s, possible zip bomb (decompressed_size_ratio=%f)",
+                               sub_job->filepath,
+                               decompressed_size_ratio);
+                break;
+            }
+
+            if ((archive_entry_is_encrypted(entry) || archive_entry_is_data_encrypted(entry) ||
+                 archive_entry_is_metadata_encrypted(entry)) && ctx->passphrase[0] == 0) {
+                // Is encrypted but no password is specified, skip
+                CTX_LOG_ERRORF("arc.c", "Skipped %s, archive is encrypted but no passphrase is supplied",
+                               f->filepath);
+                break;
+            }
+
+            // Handle excludes
+            if (exclude != NULL && EXCLUDED(sub_job->filepath)) {
+                CTX_LOG_DEBUGF("arc.c", "Excluded: %s", sub_job->filepath);
+                continue;
+            }
+
+            char *p = strrchr(sub_job->filepath, '.');
+            if (p != NULL && (p - sub_job->filepath) > strlen(f->filepath)) {
+                sub_job->ext = (int) (p - sub_job->filepath + 1);
+            } else {
+                sub_job->ext = (int) strlen(sub_job->filepath);
+            }
+
+            sub_job->vfile.sha1_ctx = EVP_MD_CTX_new();
+            EVP_DigestInit(sub_job->vfile.sha1_ctx, EVP_sha1());
+
+            ctx->parse(sub_job);
+
+            sub_job->vfile.close(&sub_job->vfile);
+        }
+    }
+
+    free(sub_job);
+}
+
+/**
+ * Entries of an archive can be parsed by several jobs when each job can reach its
+ * range without decompressing the entries before it: zip and 7z have an index of
+ * their entries, tar entries are skipped with a seek as long as there is no compression filter.
+ */
+static int arc_can_fan_out(struct archive *a) {
+    int format = archive_format(a) & ARCHIVE_FORMAT_BASE_MASK;
+
+    if (format != ARCHIVE_FORMAT_ZIP && format != ARCHIVE_FORMAT_7ZIP && format != ARCHIVE_FORMAT_TAR) {
+        return FALSE;
+    }
+
+    // The "none" filter is always there
+    return archive_filter_count(a) == 1;
+}
+
+/**
+ * Split the entries of an archive in ranges of about ARC_FAN_OUT_RANGE_SIZE bytes
+ * (uncompressed) and queue all of them but the first one with ctx->fan_out
+ * @return The number of entries of the first range, which is left to the caller, -1 if
+ * the archive was not split
+ */
+static int arc_fan_out(scan_arc_ctx_t *ctx, vfile_t *f, pcre *exclude, pcre_extra *exclude_extra) {
+    struct archive *a = NULL;
+    struct archive_entry *entry = NULL;
+
+    arc_data_t arc_data;
+    if (arc_open(ctx, f, &a, &arc_data, FALSE) != ARCHIVE_OK) {
+        archive_read_free(a);
+        return -1;
+    }
+
+    int ranges[ARC_FAN_OUT_MAX_RANGES + 1];
+    int range_count = 0;
+    int entry_count = 0;
+    long range_size = 0;
+
+    ranges[0] = 0;
+
+    // The format is only known once the first header was read
+    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+        if (entry_count == 0 && !arc_can_fan_out(a)) {
+            break;
+        }
+
+        if (range_size >= ARC_FAN_OUT_RANGE_SIZE && range_count + 1 < ARC_FAN_OUT_MAX_RANGES) {
+            ranges[++range_count] = entry_count;
+            range_size = 0;
+        }
+
+        entry_count += 1;
+        range_size += archive_entry_size(entry);
+    }
+    ranges[++range_count] = entry_count;
+
+    archive_read_free(a);
+
+    if (range_count < 2) {
+        return -1;
+    }
+
+    CTX_LOG_DEBUGF(f->filepath, "Splitting %d archive entries in %d jobs", entry_count, range_count);
+
+    for (int i = 1; i < range_count; i++) {
+        if (!ctx->fan_out(f, ranges[i], ranges[i + 1] - ranges[i])) {
+            parse_archive_range(ctx, f, exclude, exclude_extra, ranges[i], ranges[i + 1] - ranges[i]);
+        }
+    }
+
+    return ranges[1];
+}
+
+scan_code_t parse_archive_range(scan_arc_ctx_t *ctx, vfile_t *f, pcre *exclude, pcre_extra *exclude_extra,
+                                int entry_start, int entry_count) {
+    struct archive *a = NULL;
+
+    arc_data_t arc_data;
+    int ret = arc_open(ctx, f, &a, &arc_data, FALSE);
+
+    if (ret != ARCHIVE_OK) {
+        CTX_LOG_ERRORF(f->filepath, "(arc.c) [%d] %s", ret, archive_error_string(a));
+        archive_read_free(a);
+        return SCAN_ERR_READ;
+    }
+
+    parse_archive_entries(ctx, f, a, exclude, exclude_extra, entry_start, entry_start + entry_count);
+
+    archive_read_free(a);
+    return SCAN_OK;
+}
+
 scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre *exclude, pcre_extra *exclude_extra) {
 
     struct archive *a = NULL;
@@ -176,81 +319,13 @@ scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre
         dyn_buffer_destroy(&buf);
 
     } else {
-
-        parse_job_t *sub_job = malloc(sizeof(parse_job_t));
-
-        sub_job->vfile.close = arc_close;
-        sub_job->vfile.read = arc_read;
-        sub_job->vfile.read_rewindable = arc_read_rewindable;
-        sub_job->vfile.reset = NULL;
-        sub_job->vfile.arc = a;
-        sub_job->vfile.is_fs_file = FALSE;
-        sub_job->vfile.rewind_buffer_size = 0;
-        sub_job->vfile.rewind_buffer = NULL;
-        sub_job->vfile.log = ctx->log;
-        sub_job->vfile.logf = ctx->logf;
-        sub_job->vfile.has_checksum = FALSE;
-        sub_job->vfile.calculate_checksum = f->calculate_checksum;
-        strcpy(sub_job->parent, doc->filepath);
-
-        while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-            struct stat entry_stat = *archive_entry_stat(entry);
-            sub_job->vfile.st_size = entry_stat.st_size;
-            sub_job->vfile.mtime = (int) entry_stat.st_mtim.tv_sec;
-
-            if (S_ISREG(entry_stat.st_mode)) {
-
-                const char *utf8_name = archive_entry_pathname_utf8(entry);
-
-                if (utf8_name == NULL) {
-                    snprintf(sub_job->filepath, sizeof(sub_job->filepath), "%s#/%s", f->filepath,
-                             archive_entry_pathname(entry));
-                    strcpy(sub_job->vfile.filepath, sub_job->filepath);
-                } else {
-                    snprintf(sub_job->filepath, sizeof(sub_job->filepath), "%s#/%s", f->filepath, utf8_name);
-                    strcpy(sub_job->vfile.filepath, sub_job->filepath);
-                }
-                sub_job->base = (int) (strrchr(sub_job->filepath, '/') - sub_job->filepath) + 1;
-
-                double decompressed_size_ratio = (double) sub_job->vfile.st_size / (double) f->st_size;
-                if (decompressed_size_ratio > MAX_DECOMPRESSED_SIZE_RATIO) {
-                    CTX_LOG_ERRORF("arc.c", "Skipped %s, possible zip bomb (decompressed_size_ratio=%f)",
-                                   sub_job->filepath,
-                                   decompressed_size_ratio);
-                    break;
-                }
-
-                if ((archive_entry_is_encrypted(entry) || archive_entry_is_data_encrypted(entry) ||
-                     archive_entry_is_metadata_encrypted(entry)) && ctx->passphrase[0] == 0) {
-                    // Is encrypted but no password is specified, skip
-                    CTX_LOG_ERRORF("arc.c", "Skipped %s, archive is encrypted but no passphrase is supplied",
-                                   doc->filepath);
-                    break;
-                }
-
-                // Handle excludes
-                if (exclude != NULL && EXCLUDED(sub_job->filepath)) {
-                    CTX_LOG_DEBUGF("arc.c", "Excluded: %s", sub_job->filepath);
-                    continue;
-                }
-
-                char *p = strrchr(sub_job->filepath, '.');
-                if (p != NULL && (p - sub_job->filepath) > strlen(f->filepath)) {
-                    sub_job->ext = (int) (p - sub_job->filepath + 1);
-                } else {
-                    sub_job->ext = (int) strlen(sub_job->filepath);
-                }
-
-                sub_job->vfile.sha1_ctx = EVP_MD_CTX_new();
-                EVP_DigestInit(sub_job->vfile.sha1_ctx, EVP_sha1());
-
-                ctx->parse(sub_job);
-
-                sub_job->vfile.close(&sub_job->vfile);
-            }
+        // Archives inside archives are always parsed by the job of their parent
+        int entry_end = -1;
+        if (ctx->fan_out != NULL && f->is_fs_file) {
+            entry_end = arc_fan_out(ctx, f, exclude, exclude_extra);
         }
 
-        free(sub_job);
+        parse_archive_entries(ctx, f, a, exclude, exclude_extra, 0, entry_end);
     }
 
     archive_read_free(a);
@@ -14,10 +14,19 @@
 #define ARC_MODE_RECURSE 3
 typedef int archive_mode_t;
 
+/**
+ * Queue entries [entry_start, entry_start + entry_count) of the archive as a separate job,
+ * which is handled with parse_archive_range()
+ * @return FALSE if the job could not be queued, the entries are then parsed right away
+ */
+typedef int (*arc_fan_out_callback_t)(vfile_t *f, int entry_start, int entry_count);
+
 typedef struct {
     archive_mode_t mode;
 
     parse_callback_t parse;
+    /** NULL to parse all the entries of an archive in the same job */
+    arc_fan_out_callback_t fan_out;
     log_callback_t log;
     logf_callback_t logf;
     char passphrase[4096];
@@ -30,41 +39,14 @@ typedef struct {
     char buf[ARC_BUF_SIZE];
 } arc_data_t;
 
-static int vfile_open_callback(struct archive *a, void *user_data) {
-    arc_data_t *data = (arc_data_t *) user_data;
-
-    if (!data->f->is_fs_file) {
-        data->f->sha1_ctx = EVP_MD_CTX_new();
-        EVP_DigestInit(data->f->sha1_ctx, EVP_md5());
-    }
-
-    return ARCHIVE_OK;
-}
-
+/**
+ * Reads an archive inside an archive: the checksum of the outer entry is updated by its read()
+ */
 static long vfile_read_callback(struct archive *a, void *user_data, const void **buf) {
     arc_data_t *data = (arc_data_t *) user_data;
 
     *buf = data->buf;
-    long ret = data->f->read(data->f, data->buf, sizeof(data->buf));
-
-    if (!data->f->is_fs_file && ret > 0) {
-        data->f->has_checksum = TRUE;
-        safe_digest_update(data->f->sha1_ctx, (unsigned char *) data->buf, ret);
-    }
-
-    return ret;
-}
-
-static int vfile_close_callback(struct archive *a, void *user_data) {
-    arc_data_t *data = (arc_data_t *) user_data;
-
-    if (!data->f->is_fs_file) {
-        EVP_DigestFinal_ex(data->f->sha1_ctx, data->f->sha1_digest, NULL);
-        EVP_MD_CTX_free(data->f->sha1_ctx);
-        data->f->sha1_ctx = NULL;
-    }
-
-    return ARCHIVE_OK;
+    return data->f->read(data->f, data->buf, sizeof(data->buf));
 }
 
 int arc_open(scan_arc_ctx_t *ctx, vfile_t *f, struct archive **a, arc_data_t *arc_data, int allow_recurse);
@@ -73,9 +55,11 @@ int should_parse_filtered_file(const char *filepath);
 
 scan_code_t parse_archive(scan_arc_ctx_t *ctx, vfile_t *f, document_t *doc, pcre *exclude, pcre_extra *exclude_extra);
 
+scan_code_t parse_archive_range(scan_arc_ctx_t *ctx, vfile_t *f, pcre *exclude, pcre_extra *exclude_extra,
+                                int entry_start, int entry_count);
+
 int arc_read(struct vfile *f, void *buf, size_t size);
 
-int arc_read_rewindable(struct vfile *f, void *buf, size_t size);
 
 void arc_close(struct vfile *f);
 
@@ -1,6 +1,7 @@
 #include "comic.h"
 #include "../media/media.h"
 #include "../arc/arc.h"
+#include "../mem_budget/mem_budget.h"
 
 #include <stdlib.h>
 #include <archive.h>
@@ -32,6 +33,11 @@ void parse_comic(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc) {
             char *p = strrchr(file_path, '.');
             if (p != NULL && (strcmp(p, ".png") == 0 || strcmp(p, ".jpg") == 0 || strcmp(p, ".jpeg") == 0)) {
                 size_t entry_size = archive_entry_size(entry);
+                if (!mem_budget_reserve(entry_size, TRUE)) {
+                    CTX_LOG_WARNINGF(f->filepath, "Not enough memory budget to load cover (%ldB)", entry_size);
+                    continue;
+                }
+
                 void *buf = malloc(entry_size);
                 size_t read = archive_read_data(a, buf, entry_size);
 
@@ -41,6 +47,7 @@ void parse_comic(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc) {
                         CTX_LOG_ERRORF("comic.c", "Error while reading entry: %s", err_str);
                     }
                     free(buf);
+                    mem_budget_release(entry_size);
                     break;
                 }
 
@@ -58,6 +65,7 @@ void parse_comic(scan_comic_ctx_t *ctx, vfile_t *f, document_t *doc) {
 
                 ret = store_image_thumbnail(&media_ctx, buf, entry_size, doc, file_path);
                 free(buf);
+                mem_budget_release(entry_size);
 
                 if (ret == TRUE) {
                     break;
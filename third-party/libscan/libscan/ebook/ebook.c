@@ -5,9 +5,11 @@
 #include "../media/media.h"
 #include "../arc/arc.h"
 #include "../ocr/ocr.h"
+#include "../mem_budget/mem_budget.h"
 
-#if EBOOK_LOCKS
 #include <pthread.h>
+
+#if EBOOK_LOCKS
 pthread_mutex_t Mutex;
 #endif
 
@@ -248,6 +250,50 @@ int read_stext(text_buffer_t *tex, fz_stext_page *stext) {
     return count;
 }
 
+#define OCR_PIXELS_PER_INCH 72
+
+__thread text_buffer_t *thread_ocr_buffer;
+
+static void ocr_page_cb(const char *text, size_t len) {
+    text_buffer_append_char(thread_ocr_buffer, ' ');
+    text_buffer_append_string(thread_ocr_buffer, text, len);
+}
+
+/**
+ * Render the page and pass it to the worker's tesseract engine, so that
+ * the traineddata is not loaded again for every page
+ */
+static void ocr_page(scan_ebook_ctx_t *ctx, fz_context *fzctx, fz_page *page, text_buffer_t *tex, document_t *doc) {
+    fz_pixmap *pixmap = NULL;
+    int err = 0;
+
+    fz_var(pixmap);
+    fz_var(err);
+    fz_try(fzctx)pixmap = fz_new_pixmap_from_page(fzctx, page, fz_identity, fz_device_gray(fzctx), 0);
+    fz_catch(fzctx)err = fzctx->error.errcode;
+
+    if (err != 0) {
+        CTX_LOG_WARNINGF(doc->filepath, "fz_new_pixmap_from_page() returned error code [%d] %s", err,
+                         fzctx->error.message);
+        return;
+    }
+
+    thread_ocr_buffer = tex;
+    ocr_extract_text(
+            ctx->tesseract_path,
+            ctx->tesseract_lang,
+            pixmap->samples,
+            pixmap->w,
+            pixmap->h,
+            pixmap->n,
+            (int) pixmap->stride,
+            OCR_PIXELS_PER_INCH,
+            ocr_page_cb
+    );
+
+    fz_drop_pixmap(fzctx, pixmap);
+}
+
 int load_page(fz_context *fzctx, fz_document *fzdoc, int current_page, fz_page **page) {
     int err = 0;
 
@@ -273,6 +319,274 @@ fz_device *new_stext_dev(fz_context *fzctx, fz_stext_page *stext) {
     return stext_dev;
 }
 
+typedef struct {
+    scan_ebook_ctx_t *ctx;
+    fz_context *fzctx;
+    void *buf;
+    size_t buf_len;
+    const char *mime_str;
+    document_t *doc;
+
+    int index;
+    int from;
+    int to;
+    /** Text length of each range so far, shared by all ranges */
+    _Atomic long *lengths;
+
+    text_buffer_t tex;
+    int err;
+} page_range_t;
+
+/**
+ * Text of the ranges before this one always comes first: once it fills
+ * content_size with this range's text, the rest of the range is not needed.
+ */
+static int page_range_is_full(page_range_t *range) {
+    long length = 0;
+    for (int i = 0; i <= range->index; i++) {
+        length += range->lengths[i];
+    }
+    return length >= range->ctx->content_size;
+}
+
+/**
+ * Read the text of pages [from, to)
+ * @return 0, or the mupdf error code
+ */
+static int read_pages(scan_ebook_ctx_t *ctx, fz_context *fzctx, fz_document *fzdoc, int from, int to,
+                      text_buffer_t *tex, document_t *doc, page_range_t *range) {
+    int err = 0;
+
+    for (int current_page = from; current_page < to; current_page++) {
+        if (range != NULL && page_range_is_full(range)) {
+            break;
+        }
+
+        fz_page *page = NULL;
+        err = load_page(fzctx, fzdoc, current_page, &page);
+
+        if (err != 0) {
+            CTX_LOG_WARNINGF(doc->filepath,
+                             "fz_load_page() returned error code [%d] %s", err, fzctx->error.message);
+            fz_drop_page(fzctx, page);
+            return err;
+        }
+        fz_rect page_mediabox = fz_bound_page(fzctx, page);
+
+        fz_stext_page *stext = fz_new_stext_page(fzctx, page_mediabox);
+        fz_device *stext_dev = new_stext_dev(fzctx, stext);
+
+        fz_var(err);
+        fz_try(fzctx)fz_run_page(fzctx, page, stext_dev, fz_identity, NULL);
+        fz_always(fzctx) {
+                fz_close_device(fzctx, stext_dev);
+                fz_drop_device(fzctx, stext_dev);
+            } fz_catch(fzctx) err = fzctx->error.errcode;
+
+        if (err != 0) {
+            CTX_LOG_WARNINGF(doc->filepath, "fz_run_page() returned error code [%d] %s", err, fzctx->error.message);
+            fz_drop_page(fzctx, page);
+            fz_drop_stext_page(fzctx, stext);
+            return err;
+        }
+
+        int num_blocks_read = read_stext(tex, stext);
+
+        fz_drop_stext_page(fzctx, stext);
+
+        if (range != NULL) {
+            range->lengths[range->index] = (long) tex->dyn_buffer.cur;
+        }
+
+        if (tex->dyn_buffer.cur >= ctx->content_size) {
+            fz_drop_page(fzctx, page);
+            break;
+        }
+
+        // If OCR is enabled and no text is found on the page
+        if (ctx->tesseract_lang != NULL && num_blocks_read == 0) {
+            ocr_page(ctx, fzctx, page, tex, doc);
+        }
+
+        fz_drop_page(fzctx, page);
+
+        if (range != NULL) {
+            range->lengths[range->index] = (long) tex->dyn_buffer.cur;
+        }
+    }
+
+    return 0;
+}
+
+static void *page_range_thread(void *arg) {
+    page_range_t *range = arg;
+    fz_context *fzctx = range->fzctx;
+    document_t *doc = range->doc;
+    scan_ebook_ctx_t *ctx = range->ctx;
+
+    thread_ctx = *ctx;
+    fzctx->warn.print_user = doc;
+    fzctx->warn.print = fz_warn_callback;
+    fzctx->error.print_user = doc;
+    fzctx->error.print = fz_err_callback;
+
+    // A fz_document can't be shared between threads, each range opens its own
+    int err = 0;
+    fz_document *fzdoc = NULL;
+    fz_stream *stream = NULL;
+    fz_var(fzdoc);
+    fz_var(stream);
+    fz_var(err);
+
+    fz_try(fzctx) {
+                stream = fz_open_memory(fzctx, range->buf, range->buf_len);
+                fzdoc = fz_open_document_with_stream(fzctx, range->mime_str, stream);
+            } fz_catch(fzctx)err = fzctx->error.errcode;
+
+    if (err == 0) {
+        err = read_pages(ctx, fzctx, fzdoc, range->from, range->to, &range->tex, doc, range);
+    } else {
+        CTX_LOG_WARNINGF(doc->filepath, "fz_open_document() returned error code [%d] %s", err,
+                         fzctx->error.message);
+    }
+    range->err = err;
+
+    fz_drop_stream(fzctx, stream);
+    fz_drop_document(fzctx, fzdoc);
+
+    // The OCR engines of this thread would otherwise leak when it exits
+    cleanup_ocr();
+
+    return NULL;
+}
+
+static void page_range_lock(void *user, int lock) {
+    pthread_mutex_lock(&((pthread_mutex_t *) user)[lock]);
+    my_fz_lock(user, lock);
+}
+
+static void page_range_unlock(void *user, int lock) {
+    my_fz_unlock(user, lock);
+    pthread_mutex_unlock(&((pthread_mutex_t *) user)[lock]);
+}
+
+/**
+ * Read the text of the document in contiguous page ranges, each in its own thread
+ * and cloned context. The first range is read by the calling thread.
+ * There is one extra thread for each borrowed thread (ctx->borrow_threads) and, with OCR,
+ * for which the memory of another engine could be reserved.
+ * @return 0, or the mupdf error code of the first range that failed
+ */
+static int read_pages_parallel(scan_ebook_ctx_t *ctx, fz_context *fzctx, fz_document *fzdoc, void *buf,
+                               size_t buf_len, const char *mime_str, int page_count, text_buffer_t *tex,
+                               document_t *doc) {
+
+    int max_threads = MIN(ctx->page_split_threads, page_count) - 1;
+    int borrowed = ctx->borrow_threads != NULL ? ctx->borrow_threads(max_threads) : max_threads;
+
+    // Each range thread loads its own OCR engine
+    size_t ocr_size = ctx->tesseract_lang != NULL
+                      ? ocr_engine_size(ctx->tesseract_path, ctx->tesseract_lang) : 0;
+    int thread_count = 0;
+    while (thread_count < borrowed && (ocr_size == 0 || mem_budget_reserve(ocr_size, FALSE))) {
+        thread_count += 1;
+    }
+
+    if (ctx->return_threads != NULL && borrowed > thread_count) {
+        ctx->return_threads(borrowed - thread_count);
+    }
+
+    if (thread_count == 0) {
+        return read_pages(ctx, fzctx, fzdoc, 0, page_count, tex, doc, NULL);
+    }
+
+    int range_count = thread_count + 1;
+
+    pthread_mutex_t locks[FZ_LOCK_MAX];
+    for (int i = 0; i < FZ_LOCK_MAX; i++) {
+        pthread_mutex_init(&locks[i], NULL);
+    }
+
+    // fz_clone_context() requires the context to have actual locks
+    fz_locks_context old_locks = fzctx->locks;
+    fzctx->locks.user = locks;
+    fzctx->locks.lock = page_range_lock;
+    fzctx->locks.unlock = page_range_unlock;
+
+    page_range_t *ranges = calloc(range_count, sizeof(page_range_t));
+    pthread_t *threads = calloc(range_count, sizeof(pthread_t));
+    _Atomic long *lengths = calloc(range_count, sizeof(_Atomic long));
+
+    for (int i = 0; i < range_count; i++) {
+        ranges[i].ctx = ctx;
+        ranges[i].buf = buf;
+        ranges[i].buf_len = buf_len;
+        ranges[i].mime_str = mime_str;
+        ranges[i].doc = doc;
+        ranges[i].index = i;
+        ranges[i].from = (int) ((long) page_count * i / range_count);
+        ranges[i].to = (int) ((long) page_count * (i + 1) / range_count);
+        ranges[i].lengths = lengths;
+        ranges[i].tex = text_buffer_create(ctx->content_size);
+    }
+
+    int started = 1;
+    for (; started < range_count; started++) {
+        ranges[started].fzctx = fz_clone_context(fzctx);
+        if (ranges[started].fzctx == NULL) {
+            break;
+        }
+        pthread_create(&threads[started], NULL, page_range_thread, &ranges[started]);
+    }
+
+    if (started < range_count) {
+        CTX_LOG_DEBUGF(doc->filepath, "fz_clone_context() failed, reading %d page ranges in the parsing thread",
+                       range_count - started);
+    }
+
+    // The first range and the ranges that could not be started are read by this thread
+    for (int i = 0; i < range_count; i++) {
+        if (i == 0 || i >= started) {
+            ranges[i].err = read_pages(ctx, fzctx, fzdoc, ranges[i].from, ranges[i].to, &ranges[i].tex, doc,
+                                       &ranges[i]);
+        }
+    }
+
+    int err = 0;
+    for (int i = 0; i < range_count; i++) {
+        if (i != 0 && i < started) {
+            pthread_join(threads[i], NULL);
+            fz_drop_context(ranges[i].fzctx);
+        }
+
+        if (err == 0) {
+            err = ranges[i].err;
+            text_buffer_append_string(tex, ranges[i].tex.dyn_buffer.buf, ranges[i].tex.dyn_buffer.cur);
+        }
+        text_buffer_destroy(&ranges[i].tex);
+    }
+
+    CTX_LOG_DEBUGF(doc->filepath, "Read %d pages in %d ranges", page_count, range_count);
+
+    if (ocr_size > 0) {
+        mem_budget_release(ocr_size * thread_count);
+    }
+    if (ctx->return_threads != NULL) {
+        ctx->return_threads(thread_count);
+    }
+
+    fzctx->locks = old_locks;
+    for (int i = 0; i < FZ_LOCK_MAX; i++) {
+        pthread_mutex_destroy(&locks[i]);
+    }
+
+    free(ranges);
+    free(threads);
+    free((void *) lengths);
+
+    return err;
+}
+
 void
 parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mime_str, document_t *doc, int tn_only) {
 
@@ -352,91 +666,19 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
     if (ctx->content_size > 0) {
         text_buffer_t tex = text_buffer_create(ctx->content_size);
 
-        for (int current_page = 0; current_page < page_count; current_page++) {
-            fz_page *page = NULL;
-            err = load_page(fzctx, fzdoc, current_page, &page);
-
-            if (err != 0) {
-                CTX_LOG_WARNINGF(doc->filepath,
-                                 "fz_load_page() returned error code [%d] %s", err, fzctx->error.message);
-                text_buffer_destroy(&tex);
-                fz_drop_page(fzctx, page);
-                fz_drop_stream(fzctx, stream);
-                fz_drop_document(fzctx, fzdoc);
-                fz_drop_context(fzctx);
-                return;
-            }
-            fz_rect page_mediabox = fz_bound_page(fzctx, page);
-
-            fz_stext_page *stext = fz_new_stext_page(fzctx, page_mediabox);
-            fz_device *stext_dev = new_stext_dev(fzctx, stext);
-
-            fz_var(err);
-            fz_try(fzctx)fz_run_page(fzctx, page, stext_dev, fz_identity, NULL);
-            fz_always(fzctx) {
-                    fz_close_device(fzctx, stext_dev);
-                    fz_drop_device(fzctx, stext_dev);
-                } fz_catch(fzctx) err = fzctx->error.errcode;
-
-            if (err != 0) {
-                CTX_LOG_WARNINGF(doc->filepath, "fz_run_page() returned error code [%d] %s", err, fzctx->error.message);
-                text_buffer_destroy(&tex);
-                fz_drop_page(fzctx, page);
-                fz_drop_stext_page(fzctx, stext);
-                fz_drop_stream(fzctx, stream);
-                fz_drop_document(fzctx, fzdoc);
-                fz_drop_context(fzctx);
-                return;
-            }
-
-            int num_blocks_read = read_stext(&tex, stext);
-
-            fz_drop_stext_page(fzctx, stext);
-
-            if (tex.dyn_buffer.cur >= ctx->content_size) {
-                fz_drop_page(fzctx, page);
-                break;
-            }
-
-            // If OCR is enabled and no text is found on the page
-            if (ctx->tesseract_lang != NULL && num_blocks_read == 0) {
-                stext = fz_new_stext_page(fzctx, page_mediabox);
-                stext_dev = new_stext_dev(fzctx, stext);
-
-                fz_device *ocr_dev = fz_new_ocr_device(fzctx, stext_dev, fz_identity,
-                                                       page_mediabox, TRUE,
-                                                       ctx->tesseract_lang,
-                                                       ctx->tesseract_path,
-                                                       NULL, NULL);
-
-                fz_var(err);
-                fz_try(fzctx)fz_run_page(fzctx, page, ocr_dev, fz_identity, NULL);
-                fz_always(fzctx) {
-                        fz_close_device(fzctx, ocr_dev);
-                        fz_drop_device(fzctx, ocr_dev);
-                    } fz_catch(fzctx) err = fzctx->error.errcode;
-
-                if (err != 0) {
-                    CTX_LOG_WARNINGF(doc->filepath, "fz_run_page() returned error code [%d] %s", err, fzctx->error.message);
-                    fz_close_device(fzctx, stext_dev);
-                    fz_drop_device(fzctx, stext_dev);
-                    text_buffer_destroy(&tex);
-                    fz_drop_page(fzctx, page);
-                    fz_drop_stext_page(fzctx, stext);
-                    fz_drop_stream(fzctx, stream);
-                    fz_drop_document(fzctx, fzdoc);
-                    fz_drop_context(fzctx);
-                    return;
-                }
-
-                fz_close_device(fzctx, stext_dev);
-                fz_drop_device(fzctx, stext_dev);
-
-                read_stext(&tex, stext);
-                fz_drop_stext_page(fzctx, stext);
-            }
+        if (ctx->page_split_threshold > 0 && page_count >= ctx->page_split_threshold
+            && ctx->page_split_threads > 1) {
+            err = read_pages_parallel(ctx, fzctx, fzdoc, buf, buf_len, mime_str, page_count, &tex, doc);
+        } else {
+            err = read_pages(ctx, fzctx, fzdoc, 0, page_count, &tex, doc, NULL);
+        }
 
-            fz_drop_page(fzctx, page);
+        if (err != 0) {
+            text_buffer_destroy(&tex);
+            fz_drop_stream(fzctx, stream);
+            fz_drop_document(fzctx, fzdoc);
+            fz_drop_context(fzctx);
+            return;
         }
         text_buffer_terminate_string(&tex);
 
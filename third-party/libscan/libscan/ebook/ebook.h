@@ -3,6 +3,14 @@
 
 #include "../scan.h"
 
+/**
+ * @return how many extra threads (at most max) the caller may start, to be given back
+ *         with the matching ebook_return_threads_callback_t
+ */
+typedef int (*ebook_borrow_threads_callback_t)(int max);
+
+typedef void (*ebook_return_threads_callback_t)(int count);
+
 typedef struct {
     long content_size;
     int tn_size;
@@ -14,6 +22,13 @@ typedef struct {
     logf_callback_t logf;
     int fast_epub_parse;
     int tn_qscale;
+    /** Documents with at least this many pages are read in parallel page ranges, 0 to disable */
+    int page_split_threshold;
+    /** Maximum number of page ranges of a document */
+    int page_split_threads;
+    /** NULL to always start page_split_threads - 1 extra threads */
+    ebook_borrow_threads_callback_t borrow_threads;
+    ebook_return_threads_callback_t return_threads;
 } scan_ebook_ctx_t;
 
 void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, document_t *doc);
@@ -1,5 +1,6 @@
 #include "json.h"
 #include "cjson/cJSON.h"
+#include <ctype.h>
 
 
 #define JSON_MAX_FILE_SIZE (1024 * 1024 * 50)
@@ -38,17 +39,25 @@ scan_code_t parse_json(scan_json_ctx_t *ctx, vfile_t *f, document_t *doc) {
     }
 
     size_t buf_len;
-    char *buf = read_all(f, &buf_len);
+    const char *buf = vfile_map(f, &buf_len);
 
     if (buf == NULL) {
+        CTX_LOG_WARNINGF("json.c", "Could not load file [%s]", f->filepath);
         return SCAN_ERR_READ;
     }
 
-    buf_len += 1;
-    buf = realloc(buf, buf_len);
-    *(buf + buf_len - 1) = '\0';
-
-    cJSON *json = cJSON_ParseWithOpts(buf, NULL, TRUE);
+    // The mapped file is not null-terminated, only whitespace is allowed after the value
+    const char *parse_end = NULL;
+    cJSON *json = cJSON_ParseWithLengthOpts(buf, buf_len, &parse_end, FALSE);
+    if (json != NULL) {
+        while (parse_end < buf + buf_len && isspace((unsigned char) *parse_end)) {
+            parse_end += 1;
+        }
+        if (parse_end != buf + buf_len) {
+            cJSON_Delete(json);
+            json = NULL;
+        }
+    }
     text_buffer_t tex = text_buffer_create(ctx->content_size);
 
     json_extract_text(json, &tex);
@@ -57,7 +66,7 @@ scan_code_t parse_json(scan_json_ctx_t *ctx, vfile_t *f, document_t *doc) {
     APPEND_STR_META(doc, MetaContent, tex.dyn_buffer.buf);
 
     cJSON_Delete(json);
-    free(buf);
+    vfile_unmap(f);
     text_buffer_destroy(&tex);
 
     return SCAN_OK;
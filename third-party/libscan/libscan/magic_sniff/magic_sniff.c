@@ -0,0 +1,47 @@
+#include "magic_sniff.h"
+
+#include <string.h>
+
+typedef struct {
+    size_t offset;
+    const char *signature;
+    size_t signature_len;
+    const char *mime;
+} magic_signature_t;
+
+/**
+ * Formats that libmagic identifies from these bytes alone. Containers
+ * whose Media type depends on their content (zip, OLE2, ISO BMFF...) are left to libmagic.
+ * TIFF is one of them: most camera RAW formats (CR2, NEF, DNG...) are TIFF files.
+ */
+static const magic_signature_t Signatures[] = {
+        {0, "\x89PNG\r\n\x1a\n",            8, "image/png"},
+        {0, "\xff\xd8\xff",                 3, "image/jpeg"},
+        {0, "GIF87a",                       6, "image/gif"},
+        {0, "GIF89a",                       6, "image/gif"},
+        {8, "WEBPVP8",                      7, "image/webp"},
+        {0, "%PDF-",                        5, "application/pdf"},
+        {0, "\x1f\x8b\x08",                 3, "application/gzip"},
+        {0, "\xfd" "7zXZ\0",                6, "application/x-xz"},
+        {0, "7z\xbc\xaf\x27\x1c",           6, "application/x-7z-compressed"},
+};
+
+const char *magic_sniff(const void *buffer, size_t buffer_size) {
+    const char *buf = buffer;
+
+    for (int i = 0; i < sizeof(Signatures) / sizeof(Signatures[0]); i++) {
+        const magic_signature_t *sig = &Signatures[i];
+
+        if (buffer_size >= sig->offset + sig->signature_len
+            && memcmp(buf + sig->offset, sig->signature, sig->signature_len) == 0) {
+
+            // RIFF container, only WebP is identified here
+            if (sig->offset == 8 && memcmp(buf, "RIFF", 4) != 0) {
+                continue;
+            }
+            return sig->mime;
+        }
+    }
+
+    return NULL;
+}
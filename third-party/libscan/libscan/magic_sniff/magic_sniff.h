@@ -0,0 +1,13 @@
+#ifndef MAGIC_SNIFF_H
+#define MAGIC_SNIFF_H
+
+#include <stddef.h>
+
+/**
+ * Cheap first pass for the most common signatures, gives the same Media type as libmagic
+ *
+ * @return the Media type, or NULL if libmagic needs to be consulted
+ */
+const char *magic_sniff(const void *buffer, size_t buffer_size);
+
+#endif
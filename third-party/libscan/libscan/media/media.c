@@ -1,9 +1,16 @@
 #include "media.h"
 #include "../ocr/ocr.h"
+#include "../mem_budget/mem_budget.h"
 #include <ctype.h>
 
 #define MIN_SIZE 32
 #define AVIO_BUF_SIZE 8192
+
+// The first probe only reads the headers of the container, which have the tags, codecs and duration of most files
+#define PROBE_SIZE_FAST (1024 * 1024)
+#define MAX_ANALYZE_DURATION_FAST AV_TIME_BASE
+#define PROBE_SIZE_DEEP 100000000
+#define MAX_ANALYZE_DURATION_DEEP 100000000
 #define IS_VIDEO(fmt) ( \
     (fmt)->iformat->name && strcmp((fmt)->iformat->name, "image2") != 0 \
     && strcmp((fmt)->iformat->name, "jpeg_pipe") != 0 \
@@ -14,6 +21,17 @@
 
 #define STORE_AS_IS ((void*)-1)
 
+// With --fast-thumbnails, thumbnails up to this size are scaled with a bilinear filter
+#define FAST_THUMBNAIL_SWS_MAX_SIZE 600
+#define FAST_THUMBNAIL_SWS_ALGO SWS_BILINEAR
+
+// EXIF thumbnails larger than the thumbnail size up to this factor are stored as-is
+#define EXIF_THUMBNAIL_MAX_SCALE 2
+
+// Scaler and encoder of the worker, kept between thumbnails with the same parameters
+__thread struct SwsContext *thumbnail_sws_ctx = NULL;
+__thread AVCodecContext *thumbnail_encoder = NULL;
+
 // Pointer to document being processed
 __thread document_t *thread_doc;
 
@@ -34,7 +52,7 @@ const char *get_filepath_with_ext(document_t *doc, const char *filepath, const c
 
 
 __always_inline
-void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size) {
+void *scale_frame(scan_media_ctx_t *ctx, const AVCodecContext *decoder, const AVFrame *frame, int size) {
 
     if (frame->pict_type == AV_PICTURE_TYPE_NONE) {
         return NULL;
@@ -43,7 +61,8 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
     int dstW;
     int dstH;
     if (frame->width <= size && frame->height <= size) {
-        if (decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG) {
+        // A frame decoded at a reduced size is not the original image
+        if ((decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG) && decoder->lowres == 0) {
             return STORE_AS_IS;
         }
 
@@ -64,22 +83,30 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
         return NULL;
     }
 
-    AVFrame *scaled_frame = av_frame_alloc();
+    int sws_algo = ctx->fast_thumbnails && MAX(dstW, dstH) <= FAST_THUMBNAIL_SWS_MAX_SIZE
+                   ? FAST_THUMBNAIL_SWS_ALGO
+                   : SIST_SWS_ALGO;
 
-    struct SwsContext *sws_ctx = sws_getContext(
-            decoder->width, decoder->height, decoder->pix_fmt,
+    thumbnail_sws_ctx = sws_getCachedContext(
+            thumbnail_sws_ctx,
+            frame->width, frame->height, decoder->pix_fmt,
             dstW, dstH, AV_PIX_FMT_YUV420P,
-            SIST_SWS_ALGO, 0, 0, 0
+            sws_algo, 0, 0, 0
     );
+    if (thumbnail_sws_ctx == NULL) {
+        return NULL;
+    }
+
+    AVFrame *scaled_frame = av_frame_alloc();
 
     int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, dstW, dstH, 1);
     uint8_t *dst_buf = (uint8_t *) av_malloc(dst_buf_len * 2);
 
     av_image_fill_arrays(scaled_frame->data, scaled_frame->linesize, dst_buf, AV_PIX_FMT_YUV420P, dstW, dstH, 1);
 
-    sws_scale(sws_ctx,
+    sws_scale(thumbnail_sws_ctx,
               (const uint8_t *const *) frame->data, frame->linesize,
-              0, decoder->height,
+              0, frame->height,
               scaled_frame->data, scaled_frame->linesize
     );
 
@@ -87,11 +114,46 @@ void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size)
     scaled_frame->height = dstH;
     scaled_frame->format = AV_PIX_FMT_YUV420P;
 
-    sws_freeContext(sws_ctx);
-
     return scaled_frame;
 }
 
+/**
+ * Encode a scaled frame with the encoder of the worker, which is opened again when the size changes
+ * @return NULL if the encoder could not be opened
+ */
+static AVPacket *encode_thumbnail(scan_media_ctx_t *ctx, const AVFrame *scaled_frame) {
+    if (thumbnail_encoder == NULL || thumbnail_encoder->width != scaled_frame->width
+        || thumbnail_encoder->height != scaled_frame->height
+        || thumbnail_encoder->global_quality != FF_QP2LAMBDA * ctx->tn_qscale) {
+
+        avcodec_free_context(&thumbnail_encoder);
+        thumbnail_encoder = alloc_webp_encoder(scaled_frame->width, scaled_frame->height, ctx->tn_qscale);
+        if (thumbnail_encoder == NULL) {
+            return NULL;
+        }
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    avcodec_send_frame(thumbnail_encoder, scaled_frame);
+
+    if (thumbnail_encoder->codec->capabilities & AV_CODEC_CAP_DELAY) {
+        // The packet is only returned at the end of the stream, the encoder cannot be used again
+        avcodec_send_frame(thumbnail_encoder, NULL);
+        avcodec_receive_packet(thumbnail_encoder, packet);
+        avcodec_free_context(&thumbnail_encoder);
+    } else {
+        avcodec_receive_packet(thumbnail_encoder, packet);
+    }
+
+    return packet;
+}
+
+void cleanup_media() {
+    sws_freeContext(thumbnail_sws_ctx);
+    thumbnail_sws_ctx = NULL;
+    avcodec_free_context(&thumbnail_encoder);
+}
+
 typedef struct {
     AVPacket *packet;
     AVFrame *frame;
@@ -404,6 +466,178 @@ void ocr_image(scan_media_ctx_t *ctx, document_t *doc, const AVCodecContext *dec
     av_frame_free(&rgb_frame);
 }
 
+static int exif_read_u16(const unsigned char *p, int little_endian) {
+    return little_endian ? p[0] | (p[1] << 8) : (p[0] << 8) | p[1];
+}
+
+static unsigned int exif_read_u32(const unsigned char *p, int little_endian) {
+    return little_endian
+           ? p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24)
+           : ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**
+ * Read the size of a JPEG image from its SOF segment
+ * @return FALSE if the SOF segment was not found
+ */
+static int jpeg_get_size(const unsigned char *data, size_t len, int *width, int *height) {
+    if (len < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return FALSE;
+    }
+
+    size_t pos = 2;
+    while (pos + 4 <= len && data[pos] == 0xFF) {
+        int marker = data[pos + 1];
+        size_t segment_len = exif_read_u16(data + pos + 2, FALSE);
+
+        // SOF0-SOF15, except DHT, JPG and DAC
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (pos + 9 > len) {
+                return FALSE;
+            }
+            *height = exif_read_u16(data + pos + 5, FALSE);
+            *width = exif_read_u16(data + pos + 7, FALSE);
+            return TRUE;
+        }
+        if (marker == 0xDA || marker == 0xD9) {
+            return FALSE;
+        }
+        pos += 2 + segment_len;
+    }
+    return FALSE;
+}
+
+int find_exif_thumbnail(const unsigned char *data, size_t len, size_t *tn_offset, size_t *tn_len,
+                        int *tn_width, int *tn_height) {
+    if (len < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return FALSE;
+    }
+
+    // Find the APP1 segment with the EXIF data, it is before the image data
+    size_t tiff = 0;
+    size_t tiff_len = 0;
+    size_t pos = 2;
+    while (pos + 4 <= len && data[pos] == 0xFF) {
+        int marker = data[pos + 1];
+        size_t segment_len = exif_read_u16(data + pos + 2, FALSE);
+
+        if (marker == 0xDA || marker == 0xD9 || segment_len < 2 || pos + 2 + segment_len > len) {
+            return FALSE;
+        }
+        if (marker == 0xE1 && segment_len >= 16 && memcmp(data + pos + 4, "Exif\0\0", 6) == 0) {
+            tiff = pos + 10;
+            tiff_len = segment_len - 8;
+            break;
+        }
+        pos += 2 + segment_len;
+    }
+    if (tiff == 0) {
+        return FALSE;
+    }
+
+    const unsigned char *t = data + tiff;
+    int le;
+    if (t[0] == 'I' && t[1] == 'I') {
+        le = TRUE;
+    } else if (t[0] == 'M' && t[1] == 'M') {
+        le = FALSE;
+    } else {
+        return FALSE;
+    }
+    if (exif_read_u16(t + 2, le) != 42) {
+        return FALSE;
+    }
+
+    // IFD1 (the thumbnail) is after IFD0
+    size_t ifd0 = exif_read_u32(t + 4, le);
+    if (ifd0 + 2 > tiff_len) {
+        return FALSE;
+    }
+    size_t ifd0_entries = exif_read_u16(t + ifd0, le);
+    if (ifd0 + 2 + ifd0_entries * 12 + 4 > tiff_len) {
+        return FALSE;
+    }
+    size_t ifd1 = exif_read_u32(t + ifd0 + 2 + ifd0_entries * 12, le);
+    if (ifd1 == 0 || ifd1 + 2 > tiff_len) {
+        return FALSE;
+    }
+    size_t ifd1_entries = exif_read_u16(t + ifd1, le);
+    if (ifd1 + 2 + ifd1_entries * 12 > tiff_len) {
+        return FALSE;
+    }
+
+    size_t offset = 0;
+    size_t length = 0;
+    for (size_t i = 0; i < ifd1_entries; i++) {
+        const unsigned char *entry = t + ifd1 + 2 + i * 12;
+        int tag = exif_read_u16(entry, le);
+
+        if (tag == 0x0201) {
+            // JPEGInterchangeFormat
+            offset = exif_read_u32(entry + 8, le);
+        } else if (tag == 0x0202) {
+            // JPEGInterchangeFormatLength
+            length = exif_read_u32(entry + 8, le);
+        }
+    }
+
+    if (offset == 0 || length == 0 || offset + length > tiff_len) {
+        return FALSE;
+    }
+    if (!jpeg_get_size(t + offset, length, tn_width, tn_height)) {
+        return FALSE;
+    }
+
+    *tn_offset = tiff + offset;
+    *tn_len = length;
+    return TRUE;
+}
+
+/**
+ * Largest DCT-domain scaling of the JPEG decoder (1/2, 1/4 or 1/8) that still decodes
+ * the image at the thumbnail size or larger. The OCR needs the full resolution.
+ */
+static int get_reduced_decode_lowres(scan_media_ctx_t *ctx, const AVCodec *codec, const AVCodecParameters *par) {
+    if (ctx->full_image_decode || ctx->tesseract_lang != NULL || par->codec_id != AV_CODEC_ID_MJPEG) {
+        return 0;
+    }
+
+    int max_size = MAX(par->width, par->height);
+    int lowres = 0;
+    while (lowres < codec->max_lowres && (max_size >> (lowres + 1)) >= ctx->tn_size) {
+        lowres += 1;
+    }
+    return lowres;
+}
+
+/**
+ * Store the EXIF thumbnail of a JPEG image as-is when it is large enough
+ * @return FALSE if the thumbnail must be generated from the image
+ */
+static int append_exif_thumbnail(scan_media_ctx_t *ctx, const AVCodecContext *decoder, const AVPacket *packet,
+                                 document_t *doc) {
+    if (ctx->full_image_decode || decoder->codec_id != AV_CODEC_ID_MJPEG) {
+        return FALSE;
+    }
+
+    size_t tn_offset;
+    size_t tn_len;
+    int tn_width;
+    int tn_height;
+    if (!find_exif_thumbnail(packet->data, packet->size, &tn_offset, &tn_len, &tn_width, &tn_height)) {
+        return FALSE;
+    }
+
+    int tn_max_size = MAX(tn_width, tn_height);
+    if (tn_max_size < ctx->tn_size || tn_max_size > ctx->tn_size * EXIF_THUMBNAIL_MAX_SCALE) {
+        return FALSE;
+    }
+
+    CTX_LOG_DEBUGF(doc->filepath, "(media.c) Using EXIF thumbnail (%dx%d)", tn_width, tn_height);
+    APPEND_THUMBNAIL(doc, packet->data + tn_offset, tn_len);
+    return TRUE;
+}
+
 #define SAVE_THUMBNAIL_OK 0
 #define SAVE_THUMBNAIL_SKIPPED 1
 #define SAVE_THUMBNAIL_FAILED 2
@@ -418,14 +652,21 @@ int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFor
         double target_timestamp = (double) pFormatCtx->duration * seek_ratio;
         long ts = (long) target_timestamp;
 
-        int seek_ret = avformat_seek_file(
-                // Allow +- 1s
-                pFormatCtx, -1, ts - AV_TIME_BASE, ts, ts + AV_TIME_BASE,
-                0
-        );
+        int seek_ret;
+        if (decoder->skip_frame == AVDISCARD_NONKEY) {
+            // Keyframe at or before the timestamp, which is the next frame out of the decoder
+            seek_ret = avformat_seek_file(pFormatCtx, -1, INT64_MIN, ts, ts, 0);
+        } else {
+            seek_ret = avformat_seek_file(
+                    // Allow +- 1s
+                    pFormatCtx, -1, ts - AV_TIME_BASE, ts, ts + AV_TIME_BASE,
+                    0
+            );
+        }
 
-        if (seek_ret == 0) {
+        if (seek_ret >= 0) {
             seek_ok = TRUE;
+            avcodec_flush_buffers(decoder);
         } else {
             CTX_LOG_DEBUGF(
                     doc->filepath,
@@ -454,8 +695,13 @@ int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFor
         append_video_meta(ctx, pFormatCtx, frame_and_packet->frame, doc, IS_VIDEO(pFormatCtx));
     }
 
+    if (!IS_VIDEO(pFormatCtx) && append_exif_thumbnail(ctx, decoder, frame_and_packet->packet, doc)) {
+        frame_and_packet_free(frame_and_packet);
+        return SAVE_THUMBNAIL_OK;
+    }
+
     // Scale frame
-    AVFrame *scaled_frame = scale_frame(decoder, frame_and_packet->frame, ctx->tn_size);
+    AVFrame *scaled_frame = scale_frame(ctx, decoder, frame_and_packet->frame, ctx->tn_size);
 
     if (scaled_frame == NULL) {
         frame_and_packet_free(frame_and_packet);
@@ -470,16 +716,12 @@ int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFor
         APPEND_THUMBNAIL(doc, frame_and_packet->packet->data, frame_and_packet->packet->size);
     } else {
         // Encode frame
-        AVCodecContext *thumbnail_encoder = alloc_webp_encoder(scaled_frame->width, scaled_frame->height,
-                                                               ctx->tn_qscale);
-        avcodec_send_frame(thumbnail_encoder, scaled_frame);
-        avcodec_send_frame(thumbnail_encoder, NULL); // send EOF
-
-        AVPacket *thumbnail_packet = av_packet_alloc();
-        avcodec_receive_packet(thumbnail_encoder, thumbnail_packet);
+        AVPacket *thumbnail_packet = encode_thumbnail(ctx, scaled_frame);
 
         // Save thumbnail_count
-        if (thumbnail_index == 0) {
+        if (thumbnail_packet == NULL) {
+            return_value = SAVE_THUMBNAIL_FAILED;
+        } else if (thumbnail_index == 0) {
             APPEND_THUMBNAIL(doc, thumbnail_packet->data, thumbnail_packet->size);
             return_value = SAVE_THUMBNAIL_OK;
 
@@ -495,7 +737,6 @@ int decode_frame_and_save_thumbnail(scan_media_ctx_t *ctx, AVFormatContext *pFor
             return_value = SAVE_THUMBNAIL_SKIPPED;
         }
 
-        avcodec_free_context(&thumbnail_encoder);
         av_packet_free(&thumbnail_packet);
         av_free(*scaled_frame->data);
         av_frame_free(&scaled_frame);
@@ -511,8 +752,6 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
     int audio_stream = -1;
     int subtitle_stream = -1;
 
-    avformat_find_stream_info(pFormatCtx, NULL);
-
     for (int i = (int) pFormatCtx->nb_streams - 1; i >= 0; i--) {
         AVStream *stream = pFormatCtx->streams[i];
 
@@ -582,8 +821,13 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
         AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
         decoder->thread_count = 1;
         avcodec_parameters_to_context(decoder, stream->codecpar);
+        decoder->lowres = get_reduced_decode_lowres(ctx, video_codec, stream->codecpar);
         avcodec_open2(decoder, video_codec, NULL);
 
+        if (ctx->fast_thumbnails && IS_VIDEO(pFormatCtx) && stream->codecpar->codec_id != AV_CODEC_ID_GIF) {
+            decoder->skip_frame = AVDISCARD_NONKEY;
+        }
+
         int video_duration_in_seconds = (int) (pFormatCtx->duration / AV_TIME_BASE);
 
         int thumbnails_to_generate = (IS_VIDEO(pFormatCtx) && stream->codecpar->codec_id != AV_CODEC_ID_GIF &&
@@ -624,21 +868,110 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
     avformat_free_context(pFormatCtx);
 }
 
-void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_t *doc) {
+/**
+ * Images do not have a duration
+ */
+static int is_image_format(AVFormatContext *pFormatCtx) {
+    const char *name = pFormatCtx->iformat->name;
+    size_t len = strlen(name);
 
-    AVFormatContext *pFormatCtx = avformat_alloc_context();
-    if (pFormatCtx == NULL) {
-        CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()");
-        return;
+    return strcmp(name, "image2") == 0 || strcmp(name, "gif") == 0
+           || (len > 5 && strcmp(name + len - 5, "_pipe") == 0);
+}
+
+/**
+ * @return NULL if the streams are complete, or why they need to be probed again with the deep probesize
+ */
+static const char *get_incomplete_probe_reason(AVFormatContext *pFormatCtx) {
+    if (pFormatCtx->nb_streams == 0) {
+        return "no streams";
     }
-    pFormatCtx->max_analyze_duration = 100000000;
-    pFormatCtx->probesize = 100000000;
 
-    int res = avformat_open_input(&pFormatCtx, filepath, NULL, NULL);
-    if (res < 0) {
-        CTX_LOG_ERRORF(doc->filepath, "(media.c) avformat_open_input() returned [%d] %s", res, av_err2str(res));
-        avformat_close_input(&pFormatCtx);
-        avformat_free_context(pFormatCtx);
+    for (int i = 0; i < pFormatCtx->nb_streams; i++) {
+        AVCodecParameters *codecpar = pFormatCtx->streams[i]->codecpar;
+
+        if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (codecpar->codec_id == AV_CODEC_ID_NONE) {
+                return "unknown video codec";
+            }
+            if (codecpar->width == 0 || codecpar->height == 0) {
+                return "unknown video dimensions";
+            }
+        } else if (codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (codecpar->codec_id == AV_CODEC_ID_NONE) {
+                return "unknown audio codec";
+            }
+        }
+    }
+
+    if (!is_image_format(pFormatCtx) && pFormatCtx->duration == AV_NOPTS_VALUE) {
+        return "unknown duration";
+    }
+
+    return NULL;
+}
+
+/**
+ * Open the input and find its streams. Seekable inputs are probed with a small probesize
+ * first, then opened again with the deep probesize if the streams are incomplete.
+ * @param io_ctx custom IO, NULL to open the url with the file protocol
+ * @return NULL if the input could not be opened
+ */
+static AVFormatContext *open_media_input(scan_media_ctx_t *ctx, const char *url, AVIOContext *io_ctx,
+                                         document_t *doc) {
+
+    int tiered = io_ctx == NULL || (io_ctx->seekable & AVIO_SEEKABLE_NORMAL);
+    int deep = !tiered;
+
+    while (TRUE) {
+        AVFormatContext *pFormatCtx = avformat_alloc_context();
+        if (pFormatCtx == NULL) {
+            CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()");
+            return NULL;
+        }
+        pFormatCtx->probesize = deep ? PROBE_SIZE_DEEP : PROBE_SIZE_FAST;
+        pFormatCtx->max_analyze_duration = deep ? MAX_ANALYZE_DURATION_DEEP : MAX_ANALYZE_DURATION_FAST;
+        pFormatCtx->pb = io_ctx;
+
+        const char *reason;
+        int res = avformat_open_input(&pFormatCtx, url, NULL, NULL);
+        if (res < 0) {
+            if (deep) {
+                if (io_ctx == NULL || res != -5) {
+                    CTX_LOG_ERRORF(doc->filepath, "(media.c) avformat_open_input() returned [%d] %s",
+                                   res, av_err2str(res));
+                }
+                if (tiered && ctx->probe_callback != NULL) {
+                    ctx->probe_callback(TRUE);
+                }
+                return NULL;
+            }
+            reason = "could not open input";
+        } else {
+            avformat_find_stream_info(pFormatCtx, NULL);
+
+            reason = deep ? NULL : get_incomplete_probe_reason(pFormatCtx);
+            if (reason == NULL) {
+                if (tiered && ctx->probe_callback != NULL) {
+                    ctx->probe_callback(deep);
+                }
+                return pFormatCtx;
+            }
+            avformat_close_input(&pFormatCtx);
+        }
+
+        CTX_LOG_DEBUGF(doc->filepath, "(media.c) Probing again with a larger probesize: %s", reason);
+        if (io_ctx != NULL) {
+            avio_seek(io_ctx, 0, SEEK_SET);
+        }
+        deep = TRUE;
+    }
+}
+
+void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_t *doc) {
+
+    AVFormatContext *pFormatCtx = open_media_input(ctx, filepath, NULL, doc);
+    if (pFormatCtx == NULL) {
         return;
     }
 
@@ -700,14 +1033,6 @@ int memfile_open(vfile_t *f, memfile_t *mem) {
     int ret = f->read(f, mem->buf, mem->size);
     mem->file = fmemopen(mem->buf, mem->size, "rb");
 
-    if (f->calculate_checksum) {
-        safe_digest_update(f->sha1_ctx, mem->buf, mem->size);
-        EVP_DigestFinal_ex(f->sha1_ctx, f->sha1_digest, NULL);
-        EVP_MD_CTX_free(f->sha1_ctx);
-        f->sha1_ctx = NULL;
-        f->has_checksum = TRUE;
-    }
-
     return (ret == mem->size && mem->file != NULL) ? 0 : -1;
 }
 
@@ -729,24 +1054,19 @@ void memfile_close(memfile_t *mem) {
 
 void parse_media_vfile(scan_media_ctx_t *ctx, struct vfile *f, document_t *doc, const char *mime_str) {
 
-    AVFormatContext *pFormatCtx = avformat_alloc_context();
-    if (pFormatCtx == NULL) {
-        CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()");
-        return;
-    }
-    pFormatCtx->max_analyze_duration = 100000000;
-    pFormatCtx->probesize = 100000000;
-
-
     unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
     AVIOContext *io_ctx = NULL;
     memfile_t memfile = {0, 0, 0};
 
     const char *filepath = get_filepath_with_ext(doc, f->filepath, mime_str);
 
+    int reserved = FALSE;
     if (f->st_size <= ctx->max_media_buffer) {
-        int ret = memfile_open(f, &memfile);
-        if (ret == 0) {
+        reserved = mem_budget_reserve(f->st_size, FALSE);
+        if (!reserved) {
+            CTX_LOG_DEBUGF(f->filepath, "Memory budget exhausted, not loading media file in memory (%ldB)",
+                           f->st_size);
+        } else if (memfile_open(f, &memfile) == 0) {
             CTX_LOG_DEBUGF(f->filepath, "Loading media file in memory (%ldB)", f->st_size);
             io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, &memfile, memfile_read, NULL, memfile_seek);
         }
@@ -757,18 +1077,14 @@ void parse_media_vfile(scan_media_ctx_t *ctx, struct vfile *f, document_t *doc,
         io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, f, vfile_read, NULL, NULL);
     }
 
-    pFormatCtx->pb = io_ctx;
-
-    int res = avformat_open_input(&pFormatCtx, filepath, NULL, NULL);
-    if (res < 0) {
-        if (res != -5) {
-            CTX_LOG_ERRORF(doc->filepath, "(media.c) avformat_open_input() returned [%d] %s", res, av_err2str(res));
-        }
+    AVFormatContext *pFormatCtx = open_media_input(ctx, filepath, io_ctx, doc);
+    if (pFormatCtx == NULL) {
         av_free(io_ctx->buffer);
         memfile_close(&memfile);
+        if (reserved) {
+            mem_budget_release(f->st_size);
+        }
         avio_context_free(&io_ctx);
-        avformat_close_input(&pFormatCtx);
-        avformat_free_context(pFormatCtx);
         return;
     }
 
@@ -776,6 +1092,9 @@ void parse_media_vfile(scan_media_ctx_t *ctx, struct vfile *f, document_t *doc,
     av_free(io_ctx->buffer);
     avio_context_free(&io_ctx);
     memfile_close(&memfile);
+    if (reserved) {
+        mem_budget_release(f->st_size);
+    }
 }
 
 void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char *mime_str) {
@@ -835,6 +1154,7 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
     AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
     decoder->thread_count = 1;
     avcodec_parameters_to_context(decoder, stream->codecpar);
+    decoder->lowres = get_reduced_decode_lowres(ctx, video_codec, stream->codecpar);
     avcodec_open2(decoder, video_codec, NULL);
 
     frame_and_packet_t *frame_and_packet = read_frame(ctx, pFormatCtx, decoder, 0, doc);
@@ -848,8 +1168,20 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
         return FALSE;
     }
 
+    if (append_exif_thumbnail(ctx, decoder, frame_and_packet->packet, doc)) {
+        doc->thumbnail_count = 1;
+        frame_and_packet_free(frame_and_packet);
+        avcodec_free_context(&decoder);
+        avformat_close_input(&pFormatCtx);
+        avformat_free_context(pFormatCtx);
+        av_free(io_ctx->buffer);
+        avio_context_free(&io_ctx);
+        fclose(memfile.file);
+        return TRUE;
+    }
+
     // Scale frame
-    AVFrame *scaled_frame = scale_frame(decoder, frame_and_packet->frame, ctx->tn_size);
+    AVFrame *scaled_frame = scale_frame(ctx, decoder, frame_and_packet->frame, ctx->tn_size);
 
     if (scaled_frame == NULL) {
         frame_and_packet_free(frame_and_packet);
@@ -866,21 +1198,15 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
         doc->thumbnail_count = 1;
         APPEND_THUMBNAIL(doc, frame_and_packet->packet->data, frame_and_packet->packet->size);
     } else {
-        // Encode frame to jpeg
-        AVCodecContext *jpeg_encoder = alloc_webp_encoder(scaled_frame->width, scaled_frame->height,
-                                                          ctx->tn_qscale);
-        avcodec_send_frame(jpeg_encoder, scaled_frame);
-        avcodec_send_frame(jpeg_encoder, NULL); // Send EOF
-
-        AVPacket *jpeg_packet = av_packet_alloc();
-        avcodec_receive_packet(jpeg_encoder, jpeg_packet);
+        AVPacket *thumbnail_packet = encode_thumbnail(ctx, scaled_frame);
 
         // Save thumbnail_count
-        doc->thumbnail_count = 1;
-        APPEND_THUMBNAIL(doc, jpeg_packet->data, jpeg_packet->size);
+        if (thumbnail_packet != NULL) {
+            doc->thumbnail_count = 1;
+            APPEND_THUMBNAIL(doc, thumbnail_packet->data, thumbnail_packet->size);
+            av_packet_free(&thumbnail_packet);
+        }
 
-        av_packet_free(&jpeg_packet);
-        avcodec_free_context(&jpeg_encoder);
         av_free(*scaled_frame->data);
         av_frame_free(&scaled_frame);
     }
@@ -10,6 +10,11 @@
 #include "libavcodec/avcodec.h"
 #include "libavutil/imgutils.h"
 
+/**
+ * @param escalated TRUE if the streams were not found by the fast probe
+ */
+typedef void (*media_probe_callback_t)(int escalated);
+
 typedef struct {
     log_callback_t log;
     logf_callback_t logf;
@@ -18,12 +23,19 @@ typedef struct {
     int tn_qscale;
     /** Number of thumbnails to generate for videos */
     int tn_count;
+    /** Decode only the keyframes of videos, and scale small thumbnails with a cheaper filter */
+    int fast_thumbnails;
+    /** Always decode JPEG images at full resolution and ignore their EXIF thumbnail */
+    int full_image_decode;
 
     long max_media_buffer;
     int read_subtitles;
 
     const char *tesseract_lang;
     const char *tesseract_path;
+
+    /** Called once for each file that was probed with the fast probe first, can be NULL */
+    media_probe_callback_t probe_callback;
 } scan_media_ctx_t;
 
 __always_inline
@@ -49,7 +61,11 @@ static AVCodecContext *alloc_jpeg_encoder(int w, int h, int qscale) {
 
 static AVCodecContext *alloc_webp_encoder(int w, int h, int qscale) {
 
-    const AVCodec *webp_codec = avcodec_find_encoder(AV_CODEC_ID_WEBP);
+    // libwebp_anim is found first for AV_CODEC_ID_WEBP, it only returns the packet at the end of the stream
+    const AVCodec *webp_codec = avcodec_find_encoder_by_name("libwebp");
+    if (webp_codec == NULL) {
+        webp_codec = avcodec_find_encoder(AV_CODEC_ID_WEBP);
+    }
     AVCodecContext *webp = avcodec_alloc_context3(webp_codec);
     webp->width = w;
     webp->height = h;
@@ -63,6 +79,7 @@ static AVCodecContext *alloc_webp_encoder(int w, int h, int qscale) {
     int ret = avcodec_open2(webp, webp_codec, NULL);
 
     if (ret != 0) {
+        avcodec_free_context(&webp);
         return NULL;
     }
 
@@ -72,8 +89,23 @@ static AVCodecContext *alloc_webp_encoder(int w, int h, int qscale) {
 
 void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char *mime_str);
 
+void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_t *doc);
+
 void init_media();
 
+/**
+ * Free the scaler and encoder of the calling worker
+ */
+void cleanup_media();
+
 int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url);
 
+/**
+ * Find the JPEG thumbnail in the EXIF data (IFD1) of a JPEG image
+ * @param tn_offset offset of the thumbnail in data
+ * @return FALSE if the image has no valid EXIF thumbnail
+ */
+int find_exif_thumbnail(const unsigned char *data, size_t len, size_t *tn_offset, size_t *tn_len,
+                        int *tn_width, int *tn_height);
+
 #endif
@@ -0,0 +1,187 @@
+#include "mem_budget.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    /** Robust: a worker can be killed while it holds it */
+    pthread_mutex_t mutex;
+    /** Slot of the holder of the lock, -1 if unknown */
+    int owner_slot;
+    /** Incremented when memory is released. A futex rather than a condition variable,
+     * which can be left unusable by a worker killed while waiting on it */
+    _Atomic uint32_t released_seq;
+    size_t limit;
+    size_t reserved;
+    size_t peak;
+    long wait_count;
+    long denied_count;
+    size_t slot_reserved[MEM_BUDGET_MAX_SLOTS];
+} mem_budget_t;
+
+static mem_budget_t *mem_budget = NULL;
+
+__thread int mem_budget_slot = 0;
+__thread size_t mem_budget_held = 0;
+
+void mem_budget_init(size_t limit) {
+    if (limit == 0) {
+        return;
+    }
+
+    mem_budget = mmap(NULL, sizeof(mem_budget_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+    memset(mem_budget, 0, sizeof(mem_budget_t));
+    mem_budget->limit = limit;
+    mem_budget->owner_slot = -1;
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, TRUE);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&mem_budget->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+}
+
+static void mem_budget_lock() {
+    if (pthread_mutex_lock(&mem_budget->mutex) == EOWNERDEAD) {
+        // The worker that held the lock was killed, maybe between two updates
+        if (mem_budget->owner_slot > 0) {
+            mem_budget->slot_reserved[mem_budget->owner_slot] = 0;
+        }
+
+        size_t reserved = 0;
+        for (int i = 0; i < MEM_BUDGET_MAX_SLOTS; i++) {
+            reserved += mem_budget->slot_reserved[i];
+        }
+        mem_budget->reserved = reserved;
+        pthread_mutex_consistent(&mem_budget->mutex);
+    }
+    mem_budget->owner_slot = mem_budget_slot;
+}
+
+static void mem_budget_unlock() {
+    mem_budget->owner_slot = -1;
+    pthread_mutex_unlock(&mem_budget->mutex);
+}
+
+static void mem_budget_notify_released() {
+    mem_budget->released_seq += 1;
+    syscall(SYS_futex, &mem_budget->released_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Must be called with the lock held, which is released while waiting
+ */
+static void mem_budget_wait_released() {
+    uint32_t seq = mem_budget->released_seq;
+    mem_budget_unlock();
+
+    struct timespec timeout = {0, 100 * 1000 * 1000};
+    syscall(SYS_futex, &mem_budget->released_seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+
+    mem_budget_lock();
+}
+
+void mem_budget_destroy() {
+    if (mem_budget == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&mem_budget->mutex);
+    munmap(mem_budget, sizeof(mem_budget_t));
+    mem_budget = NULL;
+}
+
+void mem_budget_set_slot(int slot) {
+    mem_budget_slot = slot;
+    mem_budget_held = 0;
+}
+
+int mem_budget_reserve(size_t size, int wait) {
+    if (mem_budget == NULL) {
+        return TRUE;
+    }
+
+    mem_budget_lock();
+
+    if (size > mem_budget->limit) {
+        mem_budget->denied_count += 1;
+        mem_budget_unlock();
+        return FALSE;
+    }
+
+    if (mem_budget->reserved + size > mem_budget->limit) {
+        // Waiting while holding memory could deadlock two workers waiting for each other
+        if (!wait || mem_budget_held > 0) {
+            mem_budget->denied_count += 1;
+            mem_budget_unlock();
+            return FALSE;
+        }
+
+        mem_budget->wait_count += 1;
+        while (mem_budget->reserved + size > mem_budget->limit) {
+            mem_budget_wait_released();
+        }
+    }
+
+    mem_budget->reserved += size;
+    mem_budget->slot_reserved[mem_budget_slot] += size;
+    if (mem_budget->reserved > mem_budget->peak) {
+        mem_budget->peak = mem_budget->reserved;
+    }
+    mem_budget_held += size;
+
+    mem_budget_unlock();
+    return TRUE;
+}
+
+void mem_budget_release(size_t size) {
+    if (mem_budget == NULL) {
+        return;
+    }
+
+    mem_budget_lock();
+    mem_budget->reserved -= size;
+    mem_budget->slot_reserved[mem_budget_slot] -= size;
+    mem_budget_held -= size;
+    mem_budget_notify_released();
+    mem_budget_unlock();
+}
+
+void mem_budget_release_slot(int slot) {
+    if (mem_budget == NULL) {
+        return;
+    }
+
+    mem_budget_lock();
+    mem_budget->reserved -= mem_budget->slot_reserved[slot];
+    mem_budget->slot_reserved[slot] = 0;
+    mem_budget_notify_released();
+    mem_budget_unlock();
+}
+
+mem_budget_stats_t mem_budget_get_stats() {
+    mem_budget_stats_t stats = {0, 0, 0, 0};
+
+    if (mem_budget == NULL) {
+        return stats;
+    }
+
+    mem_budget_lock();
+    stats.limit = mem_budget->limit;
+    stats.peak = mem_budget->peak;
+    stats.wait_count = mem_budget->wait_count;
+    stats.denied_count = mem_budget->denied_count;
+    mem_budget_unlock();
+
+    return stats;
+}
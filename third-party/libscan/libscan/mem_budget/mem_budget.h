@@ -0,0 +1,53 @@
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include "../macros.h"
+#include <stddef.h>
+
+/**
+ * Slots are the thread ids of the workers, from 1 to MAX_THREADS (256)
+ */
+#define MEM_BUDGET_MAX_SLOTS (256 + 1)
+
+/**
+ * Memory budget shared by all the worker processes, parsers reserve from it
+ * before loading a whole file in memory.
+ *
+ * Must be called before the workers are started. Until then (and with limit=0),
+ * every reservation succeeds.
+ */
+void mem_budget_init(size_t limit);
+
+void mem_budget_destroy();
+
+/**
+ * Reservations of the calling worker are recorded under this slot, so that they can
+ * be released if the worker crashes
+ */
+void mem_budget_set_slot(int slot);
+
+/**
+ * @param wait Block until enough memory is released. A thread that already holds
+ *             a reservation never blocks.
+ * @return FALSE if the memory could not be reserved, the caller must fall back to
+ *         a streaming path or skip the file
+ */
+int mem_budget_reserve(size_t size, int wait);
+
+void mem_budget_release(size_t size);
+
+/**
+ * Release everything that was reserved by a worker that crashed
+ */
+void mem_budget_release_slot(int slot);
+
+typedef struct {
+    size_t limit;
+    size_t peak;
+    long wait_count;
+    long denied_count;
+} mem_budget_stats_t;
+
+mem_budget_stats_t mem_budget_get_stats();
+
+#endif
@@ -4,7 +4,7 @@
 #include <sys/mman.h>
 #include "../../third-party/antiword/src/antiword.h"
 
-void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, void *buf, size_t buf_len) {
+void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, const void *buf, size_t buf_len) {
 
     // Open word doc
     options_type *opts = direct_vGetOptions();
@@ -20,7 +20,6 @@ void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, voi
 
     int doc_word_version = iGuessVersionNumber(file_in, (int) buf_len);
     if (doc_word_version < 0 || doc_word_version == 3) {
-        free(buf);
         return;
     }
     rewind(file_in);
@@ -65,26 +64,27 @@ void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, voi
         text_buffer_destroy(&tex);
     }
 
-    free(buf);
     free(out_buf);
 }
 
 void parse_msdoc(scan_msdoc_ctx_t *ctx, vfile_t *f, document_t *doc) {
 
     size_t buf_len;
-    char *buf = read_all(f, &buf_len);
+    const void *buf = vfile_map(f, &buf_len);
     if (buf == NULL) {
-        CTX_LOG_ERROR(f->filepath, "read_all() failed");
+        CTX_LOG_ERRORF(f->filepath, "vfile_map() failed (%ldB)", f->st_size);
         return;
     }
 
-    FILE *file = fmemopen(buf, buf_len, "rb");
+    // Opened read-only, the mapping is never written to
+    FILE *file = fmemopen((void *) buf, buf_len, "rb");
     if (file == NULL) {
-        free(buf);
+        vfile_unmap(f);
         CTX_LOG_ERRORF(f->filepath, "fmemopen() failed (%d)", errno);
         return;
     }
 
     parse_msdoc_text(ctx, doc, file, buf, buf_len);
     fclose(file);
+    vfile_unmap(f);
 }
@@ -17,6 +17,6 @@ static int is_msdoc(scan_msdoc_ctx_t *ctx, unsigned int mime) {
 
 void parse_msdoc(scan_msdoc_ctx_t *ctx, vfile_t *f, document_t *doc);
 
-void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, void* buf, size_t buf_len);
+void parse_msdoc_text(scan_msdoc_ctx_t *ctx, document_t *doc, FILE *file_in, const void *buf, size_t buf_len);
 
 #endif
@@ -0,0 +1,136 @@
+#include "ocr.h"
+
+#include <unistd.h>
+
+typedef struct ocr_engine {
+    TessBaseAPI *api;
+    char *path;
+    char *lang;
+    size_t size;
+    unsigned long last_used;
+    struct ocr_engine *next;
+} ocr_engine_t;
+
+__thread ocr_engine_t *ocr_engines = NULL;
+__thread size_t ocr_engines_size = 0;
+__thread unsigned long ocr_engines_clock = 0;
+
+static int str_eq(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+static char *str_dup(const char *str) {
+    return str == NULL ? NULL : strdup(str);
+}
+
+/**
+ * Resident set size of the current process, in bytes
+ */
+static size_t get_rss() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    long pages = 0;
+    long resident = 0;
+    if (fscanf(file, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+
+    return (size_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+static void ocr_engine_destroy(ocr_engine_t *engine) {
+    TessBaseAPIEnd(engine->api);
+    TessBaseAPIDelete(engine->api);
+    free(engine->path);
+    free(engine->lang);
+    free(engine);
+}
+
+/**
+ * Drop least recently used engines until there is room for another one
+ */
+static void ocr_engine_evict(size_t size) {
+    while (ocr_engines != NULL && ocr_engines_size + size > OCR_ENGINE_CACHE_SIZE) {
+        ocr_engine_t **lru = &ocr_engines;
+        for (ocr_engine_t **engine = &ocr_engines; *engine != NULL; engine = &(*engine)->next) {
+            if ((*engine)->last_used < (*lru)->last_used) {
+                lru = engine;
+            }
+        }
+
+        ocr_engine_t *victim = *lru;
+        *lru = victim->next;
+        ocr_engines_size -= victim->size;
+        ocr_engine_destroy(victim);
+    }
+}
+
+TessBaseAPI *ocr_engine_get(const char *tesseract_path, const char *tesseract_lang) {
+    for (ocr_engine_t *engine = ocr_engines; engine != NULL; engine = engine->next) {
+        if (str_eq(engine->path, tesseract_path) && str_eq(engine->lang, tesseract_lang)) {
+            engine->last_used = ++ocr_engines_clock;
+            return engine->api;
+        }
+    }
+
+    // The size of an engine is only known once it is loaded, assume it is as large as the last one
+    ocr_engine_evict(ocr_engines != NULL ? ocr_engines->size : 0);
+
+    size_t rss = get_rss();
+
+    TessBaseAPI *api = TessBaseAPICreate();
+    if (TessBaseAPIInit3(api, tesseract_path, tesseract_lang) != 0) {
+        TessBaseAPIDelete(api);
+        return NULL;
+    }
+
+    // https://github.com/simon987/sist2/issues/443
+    if (strstr(tesseract_lang, "chi") != NULL) {
+        TessBaseAPISetVariable(api, "preserve_interword_spaces", "1");
+    }
+
+    // TODO: add this as param?
+//    TessBaseAPISetPageSegMode(api, PSM_AUTO_OSD);
+
+    size_t new_rss = get_rss();
+
+    ocr_engine_t *engine = malloc(sizeof(ocr_engine_t));
+    engine->api = api;
+    engine->path = str_dup(tesseract_path);
+    engine->lang = str_dup(tesseract_lang);
+    engine->size = new_rss > rss ? new_rss - rss : 0;
+    engine->last_used = ++ocr_engines_clock;
+
+    ocr_engine_evict(engine->size);
+
+    engine->next = ocr_engines;
+    ocr_engines = engine;
+    ocr_engines_size += engine->size;
+
+    return api;
+}
+
+size_t ocr_engine_size(const char *tesseract_path, const char *tesseract_lang) {
+    for (ocr_engine_t *engine = ocr_engines; engine != NULL; engine = engine->next) {
+        if (str_eq(engine->path, tesseract_path) && str_eq(engine->lang, tesseract_lang) && engine->size > 0) {
+            return engine->size;
+        }
+    }
+    return OCR_ENGINE_SIZE_ESTIMATE;
+}
+
+void cleanup_ocr() {
+    while (ocr_engines != NULL) {
+        ocr_engine_t *next = ocr_engines->next;
+        ocr_engine_destroy(ocr_engines);
+        ocr_engines = next;
+    }
+    ocr_engines_size = 0;
+}
@@ -12,8 +12,32 @@
   ((d) == 1 || (d) == 2 || (d) == 4 || (d) == 8 || (d) == 16 || (d) == 24 ||   \
    (d) == 32)
 
+/**
+ * Initialized engines are kept for the lifetime of the worker, up to this many bytes
+ */
+#define OCR_ENGINE_CACHE_SIZE (1024L * 1024 * 1024)
+
+/**
+ * Assumed size of an engine that was not loaded yet
+ */
+#define OCR_ENGINE_SIZE_ESTIMATE (128L * 1024 * 1024)
+
 typedef void (*ocr_extract_callback_t)(const char *, size_t);
 
+/**
+ * @return an initialized engine for this (path, lang) pair, reused across calls
+ *         of the current thread. NULL if tesseract could not be initialized
+ */
+TessBaseAPI *ocr_engine_get(const char *tesseract_path, const char *tesseract_lang);
+
+/**
+ * @return the memory used by the engine for this (path, lang) pair, as measured when the
+ *         current thread loaded it, or OCR_ENGINE_SIZE_ESTIMATE
+ */
+size_t ocr_engine_size(const char *tesseract_path, const char *tesseract_lang);
+
+void cleanup_ocr();
+
 __always_inline static void
 ocr_extract_text(const char *tesseract_path, const char *tesseract_lang,
                  const unsigned char *img_buf, const int img_w, const int img_h,
@@ -25,17 +49,11 @@ ocr_extract_text(const char *tesseract_path, const char *tesseract_lang,
         return;
     }
 
-    TessBaseAPI *api = TessBaseAPICreate();
-    TessBaseAPIInit3(api, tesseract_path, tesseract_lang);
-
-    // https://github.com/simon987/sist2/issues/443
-    if (strstr(tesseract_lang, "chi") != NULL) {
-        TessBaseAPISetVariable(api, "preserve_interword_spaces", "1");
+    TessBaseAPI *api = ocr_engine_get(tesseract_path, tesseract_lang);
+    if (api == NULL) {
+        return;
     }
 
-    // TODO: add this as param?
-//    TessBaseAPISetPageSegMode(api, PSM_AUTO_OSD);
-
     TessBaseAPISetImage(api, img_buf, img_w, img_h, img_bpp, img_stride);
     TessBaseAPISetSourceResolution(api, img_xres);
 
@@ -48,8 +66,7 @@ ocr_extract_text(const char *tesseract_path, const char *tesseract_lang,
         TessDeleteText(text);
     }
 
-    TessBaseAPIEnd(api);
-    TessBaseAPIDelete(api);
+    TessBaseAPIClear(api);
 }
 
 #endif
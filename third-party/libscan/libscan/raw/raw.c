@@ -94,6 +94,34 @@ int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, do
     return TRUE;
 }
 
+/**
+ * Unpack the smallest preview that is at least as large as the thumbnail, or the largest one.
+ * Before LibRaw 0.21, only the largest preview can be unpacked.
+ */
+static int unpack_preview(scan_raw_ctx_t *ctx, libraw_data_t *libraw_lib) {
+#if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION(0, 21, 0)
+    libraw_thumbnail_list_t *thumbs = &libraw_lib->thumbs_list;
+
+    int best = -1;
+    int best_size = 0;
+    for (int i = 0; i < thumbs->thumbcount; i++) {
+        int size = MAX(thumbs->thumblist[i].twidth, thumbs->thumblist[i].theight);
+
+        if (best == -1
+            || (size >= ctx->tn_size && (best_size < ctx->tn_size || size < best_size))
+            || (size < ctx->tn_size && best_size < ctx->tn_size && size > best_size)) {
+            best = i;
+            best_size = size;
+        }
+    }
+
+    if (best != -1) {
+        return libraw_unpack_thumb_ex(libraw_lib, best);
+    }
+#endif
+    return libraw_unpack_thumb(libraw_lib);
+}
+
 #define DMS_REF(ref) (((ref) == 'S' || (ref) == 'W') ? -1 : 1)
 
 void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
@@ -104,17 +132,23 @@ void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
         return;
     }
 
-    size_t buf_len = 0;
-    void *buf = read_all(f, &buf_len);
-    if (buf == NULL) {
-        CTX_LOG_ERROR(f->filepath, "read_all() failed");
-        return;
+    int ret;
+    if (f->is_fs_file) {
+        // LibRaw reads the metadata and the preview, not the whole file
+        ret = libraw_open_file(libraw_lib, f->filepath);
+    } else {
+        size_t buf_len = 0;
+        const void *buf = vfile_map(f, &buf_len);
+        if (buf == NULL) {
+            CTX_LOG_ERRORF(f->filepath, "vfile_map() failed (%ldB)", f->st_size);
+            libraw_close(libraw_lib);
+            return;
+        }
+        ret = libraw_open_buffer(libraw_lib, (void *) buf, buf_len);
     }
-
-    int ret = libraw_open_buffer(libraw_lib, buf, buf_len);
     if (ret != 0) {
         CTX_LOG_ERROR(f->filepath, "Could not open raw file");
-        free(buf);
+        vfile_unmap(f);
         libraw_close(libraw_lib);
         return;
     }
@@ -172,48 +206,44 @@ void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
     APPEND_STR_META(doc, MetaMediaVideoCodec, "raw");
 
     if (!ctx->enable_tn) {
-        free(buf);
-        libraw_close(libraw_lib);
-        return;
-    }
-
-    int unpack_ret = libraw_unpack_thumb(libraw_lib);
-    if (unpack_ret != 0) {
-        CTX_LOG_ERRORF(f->filepath, "libraw_unpack_thumb returned error code %d", unpack_ret);
-        free(buf);
+        vfile_unmap(f);
         libraw_close(libraw_lib);
         return;
     }
 
     int tn_ok = 0;
 
-    if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) {
+    int unpack_ret = unpack_preview(ctx, libraw_lib);
+    if (unpack_ret != 0) {
+        CTX_LOG_DEBUGF(f->filepath, "libraw_unpack_thumb returned error code %d", unpack_ret);
+    } else if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) {
         tn_ok = store_thumbnail_jpeg(ctx, libraw_lib->thumbnail, doc);
     } else if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_BITMAP) {
         // TODO: technically this should work but is currently untested
 
         int errc = 0;
         libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(libraw_lib, &errc);
-        if (errc != 0) {
-            free(buf);
-            libraw_dcraw_clear_mem(thumb);
-            libraw_close(libraw_lib);
-            return;
+        if (errc == 0) {
+            tn_ok = store_thumbnail_rgb24(ctx, thumb, doc);
         }
-
-        tn_ok = store_thumbnail_rgb24(ctx, thumb, doc);
+        libraw_dcraw_clear_mem(thumb);
     }
 
     if (tn_ok == TRUE) {
-        free(buf);
+        vfile_unmap(f);
         libraw_close(libraw_lib);
         return;
     }
 
+    // No usable preview: process the raw data. The thumbnail does not need the full resolution
+    if (MAX(libraw_lib->sizes.width, libraw_lib->sizes.height) / 2 >= ctx->tn_size) {
+        libraw_lib->params.half_size = 1;
+    }
+
     ret = libraw_unpack(libraw_lib);
     if (ret != 0) {
         CTX_LOG_ERROR(f->filepath, "Could not unpack raw file");
-        free(buf);
+        vfile_unmap(f);
         libraw_close(libraw_lib);
         return;
     }
@@ -223,7 +253,7 @@ void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
     int errc = 0;
     libraw_processed_image_t *img = libraw_dcraw_make_mem_image(libraw_lib, &errc);
     if (errc != 0) {
-        free(buf);
+        vfile_unmap(f);
         libraw_dcraw_clear_mem(img);
         libraw_close(libraw_lib);
         return;
@@ -234,5 +264,5 @@ void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
     libraw_dcraw_clear_mem(img);
     libraw_close(libraw_lib);
 
-    free(buf);
+    vfile_unmap(f);
 }
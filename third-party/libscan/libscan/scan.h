@@ -78,6 +78,7 @@ enum metakey {
     MetaAuthor,
     MetaModifiedBy,
     MetaChecksum,
+    MetaChecksumAlgorithm,
 
     // Number
     MetaWidth,
@@ -134,6 +135,8 @@ typedef void (*close_func_t)(struct vfile *);
 
 typedef void (*reset_func_t)(struct vfile *);
 
+typedef const void *(*map_func_t)(struct vfile *, size_t *size);
+
 typedef struct vfile {
     union {
         int fd;
@@ -152,14 +155,25 @@ typedef struct vfile {
     EVP_MD_CTX *sha1_ctx;
     unsigned char sha1_digest[SHA1_DIGEST_LENGTH];
 
-    void *rewind_buffer;
-    int rewind_buffer_size;
-    int rewind_buffer_cursor;
+    /** Start of the file, served by read() before the backend (see vfile_read_rewindable()) */
+    void *head;
+    size_t head_size;
+    /** Offset of the next read() */
+    size_t cursor;
+    /** The bytes before this offset were added to sha1_ctx */
+    size_t digest_offset;
+
+    /** Whole content of the file, see vfile_map() */
+    const void *map_data;
+    size_t map_size;
+    int map_is_copy;
 
     read_func_t read;
     read_func_t read_rewindable;
     close_func_t close;
     reset_func_t reset;
+    /** Memory-map the whole file, NULL if the backend does not support it */
+    map_func_t map;
     log_callback_t log;
     logf_callback_t logf;
 } vfile_t;
@@ -167,6 +181,9 @@ typedef struct vfile {
 typedef struct {
     int base;
     int ext;
+    /** When arc_entry_count is not 0, the job is this range of entries of the archive at filepath */
+    int arc_entry_start;
+    int arc_entry_count;
     struct vfile vfile;
     char parent[PATH_MAX * 2 + 1];
     char filepath[PATH_MAX * 2 + 1];
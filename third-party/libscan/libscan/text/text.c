@@ -12,6 +12,7 @@ scan_code_t parse_text(scan_text_ctx_t *ctx, vfile_t *f, document_t *doc) {
         return SCAN_OK;
     }
 
+    // Only the first content_size bytes are used, they are often in the head block already
     char *buf = malloc(to_read);
     int ret = f->read(f, buf, to_read);
     if (ret < 0) {
@@ -19,6 +20,12 @@ scan_code_t parse_text(scan_text_ctx_t *ctx, vfile_t *f, document_t *doc) {
         free(buf);
         return SCAN_ERR_READ;
     }
+    to_read = ret;
+
+    if (to_read <= 2) {
+        free(buf);
+        return SCAN_OK;
+    }
 
     text_buffer_t tex = text_buffer_create(ctx->content_size);
 
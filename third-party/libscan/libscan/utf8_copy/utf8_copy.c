@@ -0,0 +1,289 @@
+#include "utf8_copy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define UTF8_COPY_X86
+#endif
+
+/** Same as SHOULD_KEEP_CHAR() for c <= 127 */
+#define IS_KEPT_ASCII(c) (((c) >= '\'' && (c) <= ';') || ((c) >= 'A' && (c) <= 'z'))
+
+typedef struct {
+    const char *str;
+    size_t len;
+    size_t pos;
+    char *dst;
+    size_t cur;
+    long max_size;
+    int last_char_was_whitespace;
+} utf8_copy_state_t;
+
+static int utf8_copy_kernel = -1;
+
+static inline int utf8_char_len(unsigned char c) {
+    if ((c & 0xf8) == 0xf0) {
+        return 4;
+    }
+    if ((c & 0xf0) == 0xe0) {
+        return 3;
+    }
+    if ((c & 0xe0) == 0xc0) {
+        return 2;
+    }
+    return 1;
+}
+
+static inline int utf8_copy_is_full(const utf8_copy_state_t *s) {
+    return s->max_size > 0 && s->cur > (size_t) s->max_size;
+}
+
+/**
+ * Same condition as UTF8_END_OF_STRING
+ */
+static inline int utf8_copy_at_end(const utf8_copy_state_t *s) {
+    if (s->pos >= s->len || s->str[s->pos] == 0) {
+        return TRUE;
+    }
+    return s->pos + utf8_char_len(s->str[s->pos]) > s->len;
+}
+
+/**
+ * @return TRUE if a block of width bytes can be copied at once: it is in the string,
+ *         and it cannot exceed the max size
+ */
+static inline int utf8_copy_has_room(const utf8_copy_state_t *s, size_t width) {
+    return s->pos + width <= s->len && (s->max_size <= 0 || s->cur + width <= (size_t) s->max_size);
+}
+
+static inline int utf8_copy_whitespace(utf8_copy_state_t *s) {
+    if (!s->last_char_was_whitespace && s->cur != 0) {
+        s->dst[s->cur++] = ' ';
+        s->last_char_was_whitespace = TRUE;
+        return utf8_copy_is_full(s);
+    }
+    return FALSE;
+}
+
+/**
+ * Validate and copy the character at s->pos. Sequences are validated like utf8_validchr2(),
+ * they are copied as-is since they are not overlong.
+ * @return TRUE if the max size was exceeded
+ */
+static int utf8_copy_char(utf8_copy_state_t *s) {
+    const unsigned char *p = (const unsigned char *) s->str + s->pos;
+    int n = utf8_char_len(p[0]);
+    s->pos += n;
+
+    if (n == 1) {
+        if (p[0] >= 0x80) {
+            // Continuation byte or invalid lead byte
+            return FALSE;
+        }
+        if (!IS_KEPT_ASCII(p[0])) {
+            return utf8_copy_whitespace(s);
+        }
+        s->dst[s->cur++] = (char) p[0];
+        s->last_char_was_whitespace = FALSE;
+        return utf8_copy_is_full(s);
+    }
+
+    for (int i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return FALSE;
+        }
+    }
+
+    // Overlong encodings
+    int c;
+    if (n == 2) {
+        if ((p[0] & 0x1e) == 0) {
+            return FALSE;
+        }
+        c = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+    } else if (n == 3) {
+        if ((p[0] & 0x0f) == 0 && (p[1] & 0x20) == 0) {
+            return FALSE;
+        }
+        c = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+    } else {
+        if ((p[0] & 0x07) == 0 && (p[1] & 0x30) == 0) {
+            return FALSE;
+        }
+        c = ((p[0] & 0x07) << 18) | ((p[1] & 0x3f) << 12) | ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+    }
+
+    if (c == 0x00A0 || c == 0xFFFD) {
+        return utf8_copy_whitespace(s);
+    }
+
+    memcpy(s->dst + s->cur, p, n);
+    s->cur += n;
+    s->last_char_was_whitespace = FALSE;
+    return utf8_copy_is_full(s);
+}
+
+/**
+ * Copy a block of ASCII characters that does not contain NUL bytes
+ * @param keep bit i is set if src[i] is kept
+ */
+static inline void utf8_copy_ascii_block(utf8_copy_state_t *s, const char *src, uint64_t keep, int width) {
+    int i = 0;
+
+    while (i < width) {
+        uint64_t rest = keep >> i;
+        int n;
+
+        if (rest & 1) {
+            n = __builtin_ctzll(~rest);
+            memcpy(s->dst + s->cur, src + i, n);
+            s->cur += n;
+            s->last_char_was_whitespace = FALSE;
+        } else {
+            n = rest == 0 ? width - i : __builtin_ctzll(rest);
+            utf8_copy_whitespace(s);
+        }
+        i += n;
+    }
+}
+
+static int utf8_copy_scalar(utf8_copy_state_t *s) {
+    while (!utf8_copy_at_end(s)) {
+        if (utf8_copy_char(s)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+#ifdef UTF8_COPY_X86
+
+static int utf8_copy_sse2(utf8_copy_state_t *s) {
+    const __m128i punct_lo = _mm_set1_epi8('\'' - 1);
+    const __m128i punct_hi = _mm_set1_epi8(';' + 1);
+    const __m128i alpha_lo = _mm_set1_epi8('A' - 1);
+    const __m128i alpha_hi = _mm_set1_epi8('z' + 1);
+
+    while (!utf8_copy_at_end(s)) {
+        if ((unsigned char) s->str[s->pos] < 0x80 && utf8_copy_has_room(s, 16)) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (s->str + s->pos));
+
+            // Multi-byte characters and NUL bytes are handled one at a time
+            int special = _mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+            if (special == 0) {
+                // The bytes are ASCII: signed comparisons are fine
+                __m128i punct = _mm_and_si128(_mm_cmpgt_epi8(v, punct_lo), _mm_cmplt_epi8(v, punct_hi));
+                __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(v, alpha_lo), _mm_cmplt_epi8(v, alpha_hi));
+                uint64_t keep = (uint32_t) _mm_movemask_epi8(_mm_or_si128(punct, alpha));
+
+                utf8_copy_ascii_block(s, s->str + s->pos, keep, 16);
+                s->pos += 16;
+                continue;
+            }
+        }
+
+        if (utf8_copy_char(s)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+__attribute__((target("avx2")))
+static int utf8_copy_avx2(utf8_copy_state_t *s) {
+    const __m256i punct_lo = _mm256_set1_epi8('\'' - 1);
+    const __m256i punct_hi = _mm256_set1_epi8(';' + 1);
+    const __m256i alpha_lo = _mm256_set1_epi8('A' - 1);
+    const __m256i alpha_hi = _mm256_set1_epi8('z' + 1);
+
+    while (!utf8_copy_at_end(s)) {
+        if ((unsigned char) s->str[s->pos] < 0x80 && utf8_copy_has_room(s, 32)) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (s->str + s->pos));
+
+            int special = _mm256_movemask_epi8(v) |
+                          _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+            if (special == 0) {
+                __m256i punct = _mm256_and_si256(_mm256_cmpgt_epi8(v, punct_lo), _mm256_cmpgt_epi8(punct_hi, v));
+                __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(v, alpha_lo), _mm256_cmpgt_epi8(alpha_hi, v));
+                uint64_t keep = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(punct, alpha));
+
+                utf8_copy_ascii_block(s, s->str + s->pos, keep, 32);
+                s->pos += 32;
+                continue;
+            }
+        }
+
+        if (utf8_copy_char(s)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+#endif
+
+int utf8_copy_kernel_supported(utf8_copy_kernel_t kernel) {
+    switch (kernel) {
+        case UTF8_COPY_SCALAR:
+            return TRUE;
+#ifdef UTF8_COPY_X86
+        case UTF8_COPY_SSE2:
+            return TRUE;
+        case UTF8_COPY_AVX2:
+            return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+void utf8_copy_set_kernel(utf8_copy_kernel_t kernel) {
+    utf8_copy_kernel = kernel;
+}
+
+utf8_copy_kernel_t utf8_copy_get_kernel() {
+    if (utf8_copy_kernel == -1) {
+        if (utf8_copy_kernel_supported(UTF8_COPY_AVX2)) {
+            utf8_copy_kernel = UTF8_COPY_AVX2;
+        } else if (utf8_copy_kernel_supported(UTF8_COPY_SSE2)) {
+            utf8_copy_kernel = UTF8_COPY_SSE2;
+        } else {
+            utf8_copy_kernel = UTF8_COPY_SCALAR;
+        }
+    }
+    return utf8_copy_kernel;
+}
+
+int utf8_copy(char *dst, size_t *cur, long max_size, int *last_char_was_whitespace, const char *str, size_t len) {
+    utf8_copy_state_t s = {
+            .str = str,
+            .len = len,
+            .pos = 0,
+            .dst = dst,
+            .cur = *cur,
+            .max_size = max_size,
+            .last_char_was_whitespace = *last_char_was_whitespace,
+    };
+
+    int full;
+    switch (utf8_copy_get_kernel()) {
+#ifdef UTF8_COPY_X86
+        case UTF8_COPY_AVX2:
+            full = utf8_copy_avx2(&s);
+            break;
+        case UTF8_COPY_SSE2:
+            full = utf8_copy_sse2(&s);
+            break;
+#endif
+        case UTF8_COPY_SCALAR:
+        default:
+            full = utf8_copy_scalar(&s);
+            break;
+    }
+
+    *cur = s.cur;
+    *last_char_was_whitespace = s.last_char_was_whitespace;
+    return full;
+}
@@ -0,0 +1,41 @@
+#ifndef UTF8_COPY_H
+#define UTF8_COPY_H
+
+#include "../macros.h"
+#include <stddef.h>
+
+typedef enum {
+    UTF8_COPY_SCALAR,
+    /** x86-64 only */
+    UTF8_COPY_SSE2,
+    /** x86-64 only, selected when the CPU supports it */
+    UTF8_COPY_AVX2,
+} utf8_copy_kernel_t;
+
+/**
+ * Append the valid UTF-8 characters of str to dst, with the rules of text_buffer_append_char():
+ * characters that are not kept (whitespace, control characters, punctuation...) are collapsed
+ * into a single space. Stops at the end of the string, at a NUL byte or at a truncated character.
+ *
+ * dst must have room for MIN(len, MAX(max_size - *cur, 0) + 4) more bytes.
+ *
+ * @param cur offset in dst, updated
+ * @param max_size stop as soon as *cur is larger than this value, 0 for no limit
+ * @param last_char_was_whitespace state of the text_buffer_t, updated
+ * @return TRUE if the max size was exceeded
+ */
+int utf8_copy(char *dst, size_t *cur, long max_size, int *last_char_was_whitespace, const char *str, size_t len);
+
+/**
+ * @return TRUE if the kernel can run on this CPU
+ */
+int utf8_copy_kernel_supported(utf8_copy_kernel_t kernel);
+
+/**
+ * Override the kernel selected from the features of the CPU (for tests and benchmarks)
+ */
+void utf8_copy_set_kernel(utf8_copy_kernel_t kernel);
+
+utf8_copy_kernel_t utf8_copy_get_kernel();
+
+#endif
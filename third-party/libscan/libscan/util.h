@@ -6,7 +6,10 @@
 #include "string.h"
 #include "../third-party/utf8.h/utf8.h"
 #include "macros.h"
+#include "mem_budget/mem_budget.h"
+#include "utf8_copy/utf8_copy.h"
 #include <openssl/evp.h>
+#include <sys/mman.h>
 
 #define STR_STARTS_WITH_CONSTANT(x, y) ((x) != NULL && (y) != NULL && strncmp(y, x, sizeof(y) - 1) == 0)
 
@@ -243,7 +246,6 @@ static int text_buffer_append_string16_be(text_buffer_t *buf, const char *str, s
 static int text_buffer_append_string(text_buffer_t *buf, const char *str, size_t len) {
 
     const char *ptr = str;
-    const char *oldPtr = ptr;
 
     if (str == NULL || UTF8_END_OF_STRING) {
         return 0;
@@ -258,25 +260,18 @@ static int text_buffer_append_string(text_buffer_t *buf, const char *str, size_t
         return 0;
     }
 
-    utf8_int32_t c;
-    char tmp[16] = {0};
-
-    do {
-        ptr = (char *) utf8codepoint(ptr, &c);
-        *(int *) tmp = 0x00000000;
-        memcpy(tmp, oldPtr, ptr - oldPtr);
-        oldPtr = ptr;
-
-        if (!utf8_validchr2(tmp)) {
-            continue;
-        }
-
-        int ret = text_buffer_append_char(buf, c);
+    // The output is never longer than the input, and stops within 4 bytes of max_size
+    size_t reserve = len;
+    if (buf->max_size > 0) {
+        size_t room = buf->dyn_buffer.cur < (size_t) buf->max_size ? buf->max_size - buf->dyn_buffer.cur : 0;
+        reserve = MIN(len, room + 4);
+    }
+    grow_buffer(&buf->dyn_buffer, reserve);
 
-        if (ret != 0) {
-            return ret;
-        }
-    } while (!UTF8_END_OF_STRING);
+    if (utf8_copy(buf->dyn_buffer.buf, &buf->dyn_buffer.cur, buf->max_size, &buf->last_char_was_whitespace,
+                  str, len)) {
+        return TEXT_BUF_FULL;
+    }
 
     return 0;
 }
@@ -359,6 +354,171 @@ static void safe_digest_update(EVP_MD_CTX *ctx, void *buf, size_t size) {
     }
 }
 
+/*
+ * Buffered read layer of vfile_t, shared by the backends (fs_read(), arc_read()).
+ * Backends serve the head block first with vfile_read_head() and report the bytes
+ * they read themselves with vfile_consume(), which is the only place where the
+ * SHA1 digest is updated: bytes that are read again after reset() are not counted twice.
+ */
+
+static void vfile_init_buffers(vfile_t *f) {
+    f->head = NULL;
+    f->head_size = 0;
+    f->cursor = 0;
+    f->digest_offset = 0;
+    f->map_data = NULL;
+    f->map_size = 0;
+    f->map_is_copy = FALSE;
+}
+
+/**
+ * Called by the backends after reading size bytes at the cursor
+ */
+static void vfile_consume(vfile_t *f, const void *buf, size_t size) {
+    size_t end = f->cursor + size;
+
+    if (f->calculate_checksum && f->sha1_ctx != NULL && end > f->digest_offset) {
+        size_t skip = f->cursor < f->digest_offset ? f->digest_offset - f->cursor : 0;
+
+        f->has_checksum = TRUE;
+        safe_digest_update(f->sha1_ctx, (char *) buf + skip, size - skip);
+        f->digest_offset = end;
+    }
+
+    f->cursor = end;
+}
+
+/**
+ * Copy the bytes of the head block that are after the cursor
+ * @return The number of bytes copied to buf
+ */
+static size_t vfile_read_head(vfile_t *f, void *buf, size_t size) {
+    if (f->cursor >= f->head_size) {
+        return 0;
+    }
+
+    size_t len = MIN(size, f->head_size - f->cursor);
+    const char *src = (char *) f->head + f->cursor;
+
+    memcpy(buf, src, len);
+    vfile_consume(f, src, len);
+
+    return len;
+}
+
+/**
+ * @return TRUE if the head block holds the whole file, the backend does not need to be read
+ */
+static int vfile_head_is_whole_file(vfile_t *f) {
+    return f->head != NULL && f->head_size == f->st_size;
+}
+
+/**
+ * read() from the start of the file that keeps the bytes in the head block, so that
+ * the parser can read them again after reset()
+ */
+static int vfile_read_rewindable(vfile_t *f, void *buf, size_t size) {
+    int ret = f->read(f, buf, size);
+
+    if (ret > 0 && (size_t) ret > f->head_size) {
+        f->head = realloc(f->head, ret);
+        memcpy((char *) f->head + f->head_size, (char *) buf + f->head_size, ret - f->head_size);
+        f->head_size = ret;
+    }
+
+    return ret;
+}
+
+/**
+ * Go back to the start of the file. Backends that can't seek (archive entries) rely
+ * on the head block: the cursor must not have gone past it.
+ */
+static void vfile_reset(vfile_t *f) {
+    f->cursor = 0;
+}
+
+/**
+ * Whole content of the file, read-only. It is memory-mapped when the backend supports
+ * it, otherwise it is read in a buffer reserved from the memory budget.
+ * Valid until vfile_unmap() or close(), must be called at the start of the file.
+ * @return NULL on error
+ */
+static const void *vfile_map(vfile_t *f, size_t *size) {
+    if (f->map_data != NULL) {
+        *size = f->map_size;
+        return f->map_data;
+    }
+
+    if (f->st_size == 0) {
+        *size = 0;
+        return "";
+    }
+
+    if (f->map != NULL) {
+        const void *data = f->map(f, size);
+
+        if (data != NULL) {
+            f->map_data = data;
+            f->map_size = *size;
+            f->map_is_copy = FALSE;
+
+            f->cursor = 0;
+            vfile_consume(f, data, *size);
+            return data;
+        }
+    }
+
+    if (!mem_budget_reserve(f->st_size, TRUE)) {
+        return NULL;
+    }
+
+    void *buf = malloc(f->st_size);
+    int ret = f->read(f, buf, f->st_size);
+
+    if (ret <= 0) {
+        free(buf);
+        mem_budget_release(f->st_size);
+        return NULL;
+    }
+
+    // The file was truncated since it was listed
+    if ((size_t) ret < f->st_size) {
+        mem_budget_release(f->st_size - ret);
+    }
+
+    f->map_data = buf;
+    f->map_size = ret;
+    f->map_is_copy = TRUE;
+
+    *size = f->map_size;
+    return buf;
+}
+
+static void vfile_unmap(vfile_t *f) {
+    if (f->map_data == NULL) {
+        return;
+    }
+
+    if (f->map_is_copy) {
+        free((void *) f->map_data);
+        mem_budget_release(f->map_size);
+    } else {
+        munmap((void *) f->map_data, f->map_size);
+    }
+
+    f->map_data = NULL;
+    f->map_size = 0;
+}
+
+/**
+ * Called by the backends on close()
+ */
+static void vfile_free_buffers(vfile_t *f) {
+    vfile_unmap(f);
+    free(f->head);
+    vfile_init_buffers(f);
+}
+
 static parse_job_t *create_parse_job(const char *filepath, int mtime, size_t st_size) {
     parse_job_t *job = (parse_job_t *) malloc(sizeof(parse_job_t));
 
@@ -386,8 +546,10 @@ static parse_job_t *create_parse_job(const char *filepath, int mtime, size_t st_
     job->vfile.fd = -1;
     job->vfile.is_fs_file = TRUE;
     job->vfile.has_checksum = FALSE;
-    job->vfile.rewind_buffer_size = 0;
-    job->vfile.rewind_buffer = NULL;
+    vfile_init_buffers(&job->vfile);
+
+    job->arc_entry_start = 0;
+    job->arc_entry_count = 0;
 
     return job;
 }
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include "test_util.h"
+#include <filesystem>
 
 extern "C" {
 #include "../libscan/arc/arc.h"
@@ -13,6 +14,11 @@ extern "C" {
 #include "../libscan/msdoc/msdoc.h"
 #include "../libscan/wpd/wpd.h"
 #include "../libscan/json/json.h"
+#include "../libscan/mem_budget/mem_budget.h"
+#include "../libscan/utf8_copy/utf8_copy.h"
+#include "../libscan/magic_sniff/magic_sniff.h"
+#include <magic.h>
+#include <sys/wait.h>
 #include <libavutil/avutil.h>
 }
 
@@ -20,6 +26,7 @@ static scan_arc_ctx_t arc_recurse_media_ctx;
 static scan_arc_ctx_t arc_list_ctx;
 static scan_arc_ctx_t arc_recurse_ooxml_ctx;
 static scan_arc_ctx_t arc_recurse_noop_ctx;
+static scan_arc_ctx_t arc_count_ctx;
 
 static scan_text_ctx_t text_500_ctx;
 
@@ -65,6 +72,12 @@ void _parse_noop(parse_job_t *job) {
     while (job->vfile.read(&job->vfile, buf, sizeof(buf)) != 0) {}
 }
 
+static int parse_count = 0;
+
+void _parse_count(parse_job_t *job) {
+    parse_count += 1;
+}
+
 
 /* Text */
 
@@ -170,6 +183,123 @@ TEST(Text, MemNoise) {
     cleanup(&doc, &f);
 }
 
+// Character by character version of text_buffer_append_string()
+static int append_string_reference(text_buffer_t *buf, const char *str, size_t len) {
+    const char *ptr = str;
+    const char *oldPtr = ptr;
+
+    if (UTF8_END_OF_STRING) {
+        return 0;
+    }
+
+    utf8_int32_t c;
+    char tmp[16] = {0};
+
+    do {
+        ptr = (char *) utf8codepoint(ptr, &c);
+        *(int *) tmp = 0x00000000;
+        memcpy(tmp, oldPtr, ptr - oldPtr);
+        oldPtr = ptr;
+
+        if (!utf8_validchr2(tmp)) {
+            continue;
+        }
+
+        int ret = text_buffer_append_char(buf, c);
+        if (ret != 0) {
+            return ret;
+        }
+    } while (!UTF8_END_OF_STRING);
+
+    return 0;
+}
+
+static void random_text(char *buf, size_t len, int random_bytes) {
+    static const char *pieces[] = {
+            "a", "Z", ".", "'", ";", "<", "@", "[", "{", " ", "\t", "\n", "\x01", "\x7f",
+            "é", "最", "😀", "\xc2\xa0", "\xef\xbf\xbd",
+            // Invalid or overlong sequences
+            "\x80", "\xff", "\xc0\x80", "\xe0\x80\x80", "\xf0\x80\x80\x80", "\xc3",
+            // NUL byte
+            "\0",
+            "The quick brown fox jumps over the lazy dog. ",
+    };
+
+    size_t i = 0;
+    while (i < len) {
+        if (random_bytes) {
+            buf[i++] = (char) rand();
+            continue;
+        }
+        const char *piece = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+        size_t piece_len = MIN(MAX(strlen(piece), 1), len - i);
+        memcpy(buf + i, piece, piece_len);
+        i += piece_len;
+    }
+}
+
+TEST(Text, Utf8CopyKernels) {
+    const long max_sizes[] = {0, 1, 7, 16, 17, 33, 100};
+    utf8_copy_kernel_t default_kernel = utf8_copy_get_kernel();
+    char content[512];
+
+    for (int i = 0; i < 5000; i++) {
+        size_t len = 5 + rand() % (sizeof(content) - 5);
+        random_text(content, len, i % 3 == 0);
+        long max_size = max_sizes[i % (sizeof(max_sizes) / sizeof(max_sizes[0]))];
+
+        // Appended twice, to carry the whitespace state over
+        text_buffer_t expected = text_buffer_create(max_size);
+        int expected_ret = 0;
+        for (int j = 0; j < 2 && expected_ret == 0; j++) {
+            expected_ret = append_string_reference(&expected, content, len);
+        }
+
+        for (int kernel = UTF8_COPY_SCALAR; kernel <= UTF8_COPY_AVX2; kernel++) {
+            if (!utf8_copy_kernel_supported((utf8_copy_kernel_t) kernel)) {
+                continue;
+            }
+            utf8_copy_set_kernel((utf8_copy_kernel_t) kernel);
+
+            text_buffer_t buf = text_buffer_create(max_size);
+            int ret = 0;
+            for (int j = 0; j < 2 && ret == 0; j++) {
+                ret = text_buffer_append_string(&buf, content, len);
+            }
+
+            ASSERT_EQ(ret, expected_ret);
+            ASSERT_EQ(buf.dyn_buffer.cur, expected.dyn_buffer.cur);
+            ASSERT_EQ(memcmp(buf.dyn_buffer.buf, expected.dyn_buffer.buf, buf.dyn_buffer.cur), 0);
+            ASSERT_EQ(buf.last_char_was_whitespace, expected.last_char_was_whitespace);
+            text_buffer_destroy(&buf);
+        }
+        text_buffer_destroy(&expected);
+    }
+
+    utf8_copy_set_kernel(default_kernel);
+}
+
+TEST(Text, Utf8CopyWhitespace) {
+    const char *content = "The quick brown fox\t\t jumps over\n\nthe lazy dog, 最後測試 \xc2\xa0 end\xe8\xa9";
+    utf8_copy_kernel_t default_kernel = utf8_copy_get_kernel();
+
+    for (int kernel = UTF8_COPY_SCALAR; kernel <= UTF8_COPY_AVX2; kernel++) {
+        if (!utf8_copy_kernel_supported((utf8_copy_kernel_t) kernel)) {
+            continue;
+        }
+        utf8_copy_set_kernel((utf8_copy_kernel_t) kernel);
+
+        text_buffer_t buf = text_buffer_create(0);
+        text_buffer_append_string0(&buf, content);
+        text_buffer_terminate_string(&buf);
+
+        ASSERT_STREQ(buf.dyn_buffer.buf, "The quick brown fox jumps over the lazy dog, 最後測試 end");
+        text_buffer_destroy(&buf);
+    }
+
+    utf8_copy_set_kernel(default_kernel);
+}
+
 TEST(TextMarkup, Mem1) {
     const char *content = "<<a<aa<<<>test<aaaa><>test test    <>";
     vfile_t f;
@@ -483,6 +613,70 @@ TEST(MediaImage, Mem2AsIs) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaImage, ExifThumbnail) {
+    // 640x480 JPEG thumbnail (SOF segment only) in IFD1
+    unsigned char tn[] = {
+            0xFF, 0xD8, 0xFF, 0xC0, 0x00, 0x11, 0x08, 0x01, 0xE0, 0x02, 0x80, 0x03,
+            0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01, 0xFF, 0xD9
+    };
+    unsigned char tiff[] = {
+            'I', 'I', 42, 0, 8, 0, 0, 0,
+            // IFD0: no entries, IFD1 at 14
+            0, 0, 14, 0, 0, 0,
+            // IFD1: JPEGInterchangeFormat=44, JPEGInterchangeFormatLength
+            2, 0,
+            0x01, 0x02, 4, 0, 1, 0, 0, 0, 44, 0, 0, 0,
+            0x02, 0x02, 4, 0, 1, 0, 0, 0, sizeof(tn), 0, 0, 0,
+            0, 0, 0, 0
+    };
+
+    std::vector<unsigned char> jpeg = {0xFF, 0xD8, 0xFF, 0xE1, 0, 8 + sizeof(tiff) + sizeof(tn)};
+    jpeg.insert(jpeg.end(), {'E', 'x', 'i', 'f', 0, 0});
+    jpeg.insert(jpeg.end(), tiff, tiff + sizeof(tiff));
+    jpeg.insert(jpeg.end(), tn, tn + sizeof(tn));
+    jpeg.insert(jpeg.end(), {0xFF, 0xD9});
+
+    size_t tn_offset;
+    size_t tn_len;
+    int tn_width;
+    int tn_height;
+    ASSERT_TRUE(find_exif_thumbnail(jpeg.data(), jpeg.size(), &tn_offset, &tn_len, &tn_width, &tn_height));
+    ASSERT_EQ(tn_offset, 12 + sizeof(tiff));
+    ASSERT_EQ(tn_len, sizeof(tn));
+    ASSERT_EQ(tn_width, 640);
+    ASSERT_EQ(tn_height, 480);
+
+    // Truncated EXIF segment
+    for (size_t len = 0; len < 12 + sizeof(tiff) + sizeof(tn); len++) {
+        ASSERT_FALSE(find_exif_thumbnail(jpeg.data(), len, &tn_offset, &tn_len, &tn_width, &tn_height));
+    }
+}
+
+TEST(MediaImage, ReducedDecode) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/exiftest1.jpg", &f, &doc);
+
+    media_ctx.full_image_decode = TRUE;
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+    media_ctx.full_image_decode = FALSE;
+
+    long width = get_meta(&doc, MetaWidth)->long_val;
+    long height = get_meta(&doc, MetaHeight)->long_val;
+    ASSERT_EQ(doc.thumbnail_count, 1);
+    cleanup(&doc, &f);
+
+    load_doc_file("libscan-test-files/test_files/media/exiftest1.jpg", &f, &doc);
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+
+    // The size of the image, not the size of the reduced frame
+    ASSERT_EQ(get_meta(&doc, MetaWidth)->long_val, width);
+    ASSERT_EQ(get_meta(&doc, MetaHeight)->long_val, height);
+    ASSERT_EQ(doc.thumbnail_count, 1);
+
+    cleanup(&doc, &f);
+}
+
 TEST(MediaVideo, VidMkvSubDisabled) {
     vfile_t f;
     document_t doc;
@@ -530,6 +724,24 @@ TEST(MediaVideo, Vid3Mp4) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaVideo, Vid3Mp4FastThumbnails) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+
+    size_t size_before = store_size;
+    media_ctx.fast_thumbnails = TRUE;
+    parse_media(&media_ctx, &f, &doc, "video/mp4");
+    media_ctx.fast_thumbnails = FALSE;
+
+    ASSERT_NE(size_before, store_size);
+    ASSERT_EQ(doc.thumbnail_count, 1);
+    ASSERT_STREQ(get_meta(&doc, MetaMediaVideoCodec)->str_val, "h264");
+    ASSERT_EQ(get_meta(&doc, MetaMediaDuration)->long_val, 10);
+
+    cleanup(&doc, &f);
+}
+
 TEST(MediaVideo, Vid3Ogv) {
     vfile_t f;
     document_t doc;
@@ -781,6 +993,25 @@ TEST(Arc, Utf8) {
     cleanup(&doc, &f);
 }
 
+TEST(Arc, Range) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/arc/test1.zip", &f, &doc);
+
+    parse_count = 0;
+    parse_archive(&arc_count_ctx, &f, &doc, nullptr, nullptr);
+    int total = parse_count;
+
+    parse_count = 0;
+    parse_archive_range(&arc_count_ctx, &f, nullptr, nullptr, 0, 1);
+    parse_archive_range(&arc_count_ctx, &f, nullptr, nullptr, 1, 1000);
+
+    ASSERT_GT(total, 0);
+    ASSERT_EQ(parse_count, total);
+
+    cleanup(&doc, &f);
+}
+
 TEST(Arc, EncryptedZip) {
     vfile_t f;
     document_t doc;
@@ -835,6 +1066,25 @@ TEST(RAW, Panasonic) {
     cleanup(&doc, &f);
 }
 
+TEST(RAW, PanasonicBuffer) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/raw/Panasonic.RW2", &f, &doc);
+    // Archive entries are read in memory instead of being opened by LibRaw
+    f.is_fs_file = FALSE;
+
+    size_t size_before = store_size;
+
+    parse_raw(&raw_ctx, &f, &doc);
+
+    ASSERT_STREQ(get_meta(&doc, MetaExifModel)->str_val, "DMC-GX8");
+    ASSERT_EQ(get_meta(&doc, MetaWidth)->long_val, 5200);
+    ASSERT_EQ(get_meta(&doc, MetaHeight)->long_val, 3904);
+    ASSERT_NE(size_before, store_size);
+
+    cleanup(&doc, &f);
+}
+
 TEST(RAW, ExifGps1) {
     vfile_t f;
     document_t doc;
@@ -1060,6 +1310,7 @@ TEST(Msdoc, TestFuzz1) {
         fuzz_buffer(buf_copy, &buf_len_copy, 3, 8, 5);
         FILE *file = fmemopen(buf_copy, buf_len_copy, "rb");
         parse_msdoc_text(&msdoc_text_ctx, &doc, file, buf_copy, buf_len_copy);
+        free(buf_copy);
     }
     free(buf);
     cleanup(&doc, &f);
@@ -1098,6 +1349,156 @@ TEST(Json, NDJson1) {
     cleanup(&doc, &f);
 }
 
+TEST(MemBudget, ReserveRelease) {
+    mem_budget_init(1000);
+
+    ASSERT_TRUE(mem_budget_reserve(600, TRUE));
+    // Already holding memory: must not block
+    ASSERT_FALSE(mem_budget_reserve(600, TRUE));
+    ASSERT_FALSE(mem_budget_reserve(2000, FALSE));
+    ASSERT_TRUE(mem_budget_reserve(400, FALSE));
+
+    mem_budget_release(1000);
+    ASSERT_TRUE(mem_budget_reserve(600, FALSE));
+    mem_budget_release(600);
+
+    mem_budget_stats_t stats = mem_budget_get_stats();
+    ASSERT_EQ(stats.peak, 1000);
+    ASSERT_EQ(stats.denied_count, 2);
+    ASSERT_EQ(stats.wait_count, 0);
+
+    mem_budget_destroy();
+
+    // Without a budget, everything can be reserved
+    ASSERT_TRUE(mem_budget_reserve(2000, TRUE));
+}
+
+TEST(MemBudget, ReleaseSlotOfCrashedWorker) {
+    mem_budget_init(1000);
+
+    // The last worker of a pool with the maximum number of threads
+    pid_t pid = fork();
+    if (pid == 0) {
+        mem_budget_set_slot(MEM_BUDGET_MAX_SLOTS - 1);
+        mem_budget_reserve(600, FALSE);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+
+    ASSERT_FALSE(mem_budget_reserve(600, FALSE));
+    mem_budget_release_slot(MEM_BUDGET_MAX_SLOTS - 1);
+    ASSERT_TRUE(mem_budget_reserve(600, FALSE));
+    mem_budget_release(600);
+
+    mem_budget_destroy();
+}
+
+/* vfile */
+
+// In-memory backend on top of the buffered layer
+static int layered_mem_read(vfile_t *f, void *buf, size_t size) {
+    size_t copied = vfile_read_head(f, buf, size);
+    size_t len = MIN(size - copied, f->st_size - f->cursor);
+
+    memcpy((char *) buf + copied, (char *) f->_test_data + f->cursor, len);
+    vfile_consume(f, (char *) buf + copied, len);
+
+    return (int) (copied + len);
+}
+
+TEST(Vfile, HeadChecksum) {
+    const char *content = "0123456789abcdefghij";
+    vfile_t f;
+    load_mem((void *) content, strlen(content), &f);
+    f.read = layered_mem_read;
+    f.calculate_checksum = TRUE;
+    f.sha1_ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(f.sha1_ctx, EVP_sha1(), nullptr);
+
+    char buf[32];
+    ASSERT_EQ(vfile_read_rewindable(&f, buf, 8), 8);
+    vfile_reset(&f);
+
+    // The head block is read again, then the rest of the file
+    ASSERT_EQ(f.read(&f, buf, 12), 12);
+    ASSERT_EQ(memcmp(buf, content, 12), 0);
+    ASSERT_EQ(f.read(&f, buf, sizeof(buf)), 8);
+    ASSERT_EQ(memcmp(buf, content + 12, 8), 0);
+
+    // Each byte is added to the digest once
+    unsigned char expected[SHA1_DIGEST_LENGTH];
+    EVP_Digest(content, strlen(content), expected, nullptr, EVP_sha1(), nullptr);
+    EVP_DigestFinal_ex(f.sha1_ctx, f.sha1_digest, nullptr);
+    ASSERT_EQ(memcmp(f.sha1_digest, expected, SHA1_DIGEST_LENGTH), 0);
+
+    EVP_MD_CTX_free(f.sha1_ctx);
+    vfile_free_buffers(&f);
+}
+
+TEST(Vfile, MapCopy) {
+    const char *content = "0123456789abcdefghij";
+    vfile_t f;
+    load_mem((void *) content, strlen(content), &f);
+    f.read = layered_mem_read;
+
+    // No map() in the backend: the file is read in a buffer
+    size_t size;
+    const void *data = vfile_map(&f, &size);
+    ASSERT_NE(data, nullptr);
+    ASSERT_EQ(size, strlen(content));
+    ASSERT_EQ(memcmp(data, content, size), 0);
+    ASSERT_TRUE(f.map_is_copy);
+
+    ASSERT_EQ(vfile_map(&f, &size), data);
+
+    vfile_unmap(&f);
+    ASSERT_EQ(f.map_data, nullptr);
+}
+
+TEST(MagicSniff, SameAsLibmagic) {
+    magic_t magic = magic_open(MAGIC_MIME_TYPE);
+    if (magic_load(magic, nullptr) != 0) {
+        magic_close(magic);
+        GTEST_SKIP() << "Could not load the libmagic database";
+    }
+
+    char buf[4096 * 6];
+    int sniffed_count = 0;
+
+    for (const auto &entry: std::filesystem::recursive_directory_iterator("libscan-test-files/test_files")) {
+        if (!entry.is_regular_file()) {
+            continue;
+        }
+
+        FILE *file = fopen(entry.path().c_str(), "rb");
+        ASSERT_NE(file, nullptr);
+        size_t size = fread(buf, 1, sizeof(buf), file);
+        fclose(file);
+
+        const char *sniffed = magic_sniff(buf, size);
+        if (sniffed == nullptr) {
+            continue;
+        }
+
+        const char *expected = magic_buffer(magic, buf, size);
+        ASSERT_NE(expected, nullptr) << entry.path();
+        ASSERT_STREQ(sniffed, expected) << entry.path();
+        sniffed_count += 1;
+    }
+
+    magic_close(magic);
+    ASSERT_GT(sniffed_count, 0);
+}
+
+TEST(MagicSniff, TiffRaw) {
+    // CR2 header: a TIFF file that libmagic identifies as image/x-canon-cr2
+    const char cr2[] = "II*\0\x10\0\0\0CR\x02\0";
+    ASSERT_EQ(magic_sniff(cr2, sizeof(cr2) - 1), nullptr);
+
+    const char tiff[] = "MM\0*\0\0\0\x08";
+    ASSERT_EQ(magic_sniff(tiff, sizeof(tiff) - 1), nullptr);
+}
+
 int main(int argc, char **argv) {
     setlocale(LC_ALL, "");
 
@@ -1119,6 +1520,12 @@ int main(int argc, char **argv) {
     arc_recurse_noop_ctx.mode = ARC_MODE_RECURSE;
     arc_recurse_noop_ctx.parse = _parse_noop;
 
+    arc_count_ctx.log = noop_log;
+    arc_count_ctx.logf = noop_logf;
+    arc_count_ctx.store = counter_store;
+    arc_count_ctx.mode = ARC_MODE_RECURSE;
+    arc_count_ctx.parse = _parse_count;
+
     arc_list_ctx.log = noop_log;
     arc_list_ctx.logf = noop_logf;
     arc_list_ctx.store = counter_store;
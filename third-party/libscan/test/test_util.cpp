@@ -23,7 +23,7 @@ int fs_read(struct vfile *f, void *buf, size_t size) {
 int mem_read(vfile_t *f, void *buf, size_t size) {
     memcpy(buf, f->_test_data, size);
     f->_test_data = (char *) f->_test_data + size;
-    return 0;
+    return (int) size;
 }
 
 void fs_close(vfile_t *f) {
@@ -50,6 +50,8 @@ void cleanup(document_t *doc, vfile_t *f) {
 }
 
 void load_file(const char *filepath, vfile_t *f) {
+    memset(f, 0, sizeof(vfile_t));
+
     struct stat info = {};
     stat(filepath, &info);
 
@@ -71,6 +73,8 @@ void load_file(const char *filepath, vfile_t *f) {
 }
 
 void load_mem(void *mem, size_t size, vfile_t *f) {
+    memset(f, 0, sizeof(vfile_t));
+
     memcpy(f->filepath, "_mem_", strlen("_mem_"));
     f->_test_data = mem;
     f->st_size = size;